@@ -201,6 +201,9 @@ int apt_utimens(struct atrfs *atrfs,const char *path, const struct timespec tv[2
 int apt_utime(struct atrfs *atrfs,const char *path, struct utimbuf *utimbuf);
 #endif
 int apt_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
+int apt_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length);
+int apt_getxattr(struct atrfs *atrfs,const char *path, const char *name, char *value, size_t size);
+int apt_listxattr(struct atrfs *atrfs,const char *path, char *list, size_t size);
 int apt_newfs(struct atrfs *atrfs);
 char *apt_fsinfo(struct atrfs *atrfs);
 
@@ -229,6 +232,9 @@ const struct fs_ops apt_ops = {
    .fs_statfs = apt_statfs,
    // .fs_newfs = apt_newfs, // Not applicable
    .fs_fsinfo = apt_fsinfo,
+   .fs_fallocate = apt_fallocate,
+   .fs_getxattr = apt_getxattr,
+   .fs_listxattr = apt_listxattr,
 };
 
 off_t apt_offset; // Offset in bytes from the start of the overall image (i.e., start of APT partition in MBR)
@@ -412,19 +418,14 @@ void apt_prepare_submounts(struct atrfs *atrfs)
       partitions[i].atrfs.sectorsize = partitions[i].bytes_per_sector;
       partitions[i].atrfs.sectors = partitions[i].sectors;
       partitions[i].atrfs.fstype = ATR_UNKNOWN; // Scan and check
+      partitions[i].atrfs.alloc_hint = 0;
 
-      for (int j=ATR_SPECIAL;j<ATR_APT;++j)
+      int j = detect_fstype(&partitions[i].atrfs,ATR_SPECIAL,ATR_APT-1);
+      if ( j >= 0 )
       {
-         if ( fs_ops[j] && fs_ops[j]->fs_sanity )
-         {
-            if ( (fs_ops[j]->fs_sanity)(&partitions[i].atrfs) == 0 )
-            {
-               partitions[i].atrfs.fstype = j;
-               if ( options.debug ) fprintf(stderr,"DEBUG: %s detected %s image\n",__FUNCTION__,fs_ops[j]->name);
-               partitions[i].submount = 1;
-               break; // Next partition
-            }
-         }
+         partitions[i].atrfs.fstype = j;
+         if ( options.debug ) fprintf(stderr,"DEBUG: %s detected %s image\n",__FUNCTION__,fs_ops[j]->name);
+         partitions[i].submount = 1;
       }
    }
 }
@@ -1074,6 +1075,38 @@ int apt_utime(struct atrfs *atrfs,const char *path, struct utimbuf *utimbuf)
 }
 #endif
 
+int apt_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length)
+{
+   (void)atrfs;
+   int p = apt_path_to_partition(path);
+   if ( p < 0 ) return -EOPNOTSUPP;
+   path = apt_subpath(path,p);
+   int r = (generic_ops.fs_fallocate)(&partitions[p].atrfs,path,mode,offset,length);
+   apt_copyback(p);
+   return r;
+}
+
+// The generic layer strips XATTR_PREFIX from the name; put it back
+int apt_getxattr(struct atrfs *atrfs,const char *path, const char *name, char *value, size_t size)
+{
+   char fullname[64];
+   (void)atrfs;
+   int p = apt_path_to_partition(path);
+   if ( p < 0 ) return -ENODATA;
+   path = apt_subpath(path,p);
+   snprintf(fullname,sizeof(fullname),"%s%s",XATTR_PREFIX,name);
+   return (generic_ops.fs_getxattr)(&partitions[p].atrfs,path,fullname,value,size);
+}
+
+int apt_listxattr(struct atrfs *atrfs,const char *path, char *list, size_t size)
+{
+   (void)atrfs;
+   int p = apt_path_to_partition(path);
+   if ( p < 0 ) return 0;
+   path = apt_subpath(path,p);
+   return (generic_ops.fs_listxattr)(&partitions[p].atrfs,path,list,size);
+}
+
 /*
  * apt_statfs()
  *
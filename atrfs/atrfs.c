@@ -19,6 +19,7 @@
 #include <sys/mman.h>
 #include <sys/param.h>
 #include <unistd.h>
+#include <limits.h>
 #include "atrfs.h"
 
 /*
@@ -278,19 +279,23 @@ int atr_preinit(void)
    }
    if ( master_atrfs.atrmem ) master_atrfs.mem=((char *)master_atrfs.atrmem)+sizeof(struct atr_head);
 
+   // A pack from --pack: open the member image instead
+   if ( pack_member(&master_atrfs) ) return 1;
+   // A compressed image: decompress it into memory
+   if ( zatr_open(&master_atrfs) ) return 1;
+   // A DCM archive: decode it into memory
+   if ( dcm_open(&master_atrfs) ) return 1;
+
    // Special case for disk image files with partition tables
    struct atr_head *head = master_atrfs.atrmem;
    if ( ( head->h0 != 0x96 || head->h1 != 0x02 ) && master_atrfs.atrstat.st_size > 128*720 )
    {
-      for (int i = ATR_APT;i<=ATR_APT;++i) // Currently only APT, but code for other options
-      if ( fs_ops[i] && fs_ops[i]->fs_sanity )
+      int i = detect_fstype(&master_atrfs,ATR_APT,ATR_APT); // Currently only APT, but code for other options
+      if ( i >= 0 )
       {
-         if ( (fs_ops[i]->fs_sanity)(&master_atrfs) == 0 )
-         {
-            master_atrfs.fstype = i;
-            if ( options.debug ) fprintf(stderr,"DEBUG: %s detected %s image\n",__FUNCTION__,fs_ops[i]->name);
-            return 0;
-         }
+         master_atrfs.fstype = i;
+         if ( options.debug ) fprintf(stderr,"DEBUG: %s detected %s image\n",__FUNCTION__,fs_ops[i]->name);
+         return 0;
       }
    }
    
@@ -320,18 +325,19 @@ int atr_preinit(void)
       }
    }
 
+   if ( master_atrfs.sectors < 1 )
+   {
+      fprintf(stderr,"Image has no complete sectors: %s\n",options.filename);
+      return 1;
+   }
+
    // Determine file system type
-   for (int i=0;i<ATR_MAXFSTYPE;++i)
+   int i = detect_fstype(&master_atrfs,0,ATR_MAXFSTYPE-1);
+   if ( i >= 0 )
    {
-      if ( fs_ops[i] && fs_ops[i]->fs_sanity )
-      {
-         if ( (fs_ops[i]->fs_sanity)(&master_atrfs) == 0 )
-         {
-            master_atrfs.fstype = i;
-            if ( options.debug ) fprintf(stderr,"DEBUG: %s detected %s image\n",__FUNCTION__,fs_ops[i]->name);
-            return 0;
-         }
-      }
+      master_atrfs.fstype = i;
+      if ( options.debug ) fprintf(stderr,"DEBUG: %s detected %s image\n",__FUNCTION__,fs_ops[i]->name);
+      return 0;
    }
    fprintf(stderr,"Unable to determine file system type; expose raw non-zero sectors\n");
    master_atrfs.fstype = ATR_UNKNOWN;
@@ -347,10 +353,41 @@ void *atr_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
    (void)conn; // unused parameter
    if ( options.lowcase ) options.upcase = 1;
    cfg->use_ino = 1; // Use sector numbers as inode number
+   if ( master_atrfs.broker )
+   {
+      // sio2linux may change the image at any time, so don't let the kernel cache what we return
+      cfg->entry_timeout = 0;
+      cfg->negative_timeout = 0;
+      cfg->attr_timeout = 0;
+   }
    return NULL;
 }
 #endif
 
+void atr_destroy(void *private_data)
+{
+   (void)private_data;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
+   image_flush(&master_atrfs);
+}
+
+int atr_flush(const char *path, struct fuse_file_info *fi)
+{
+   (void)fi;
+   if ( options.debug > 1 ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
+   return image_flush(&master_atrfs);
+}
+
+int atr_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+   (void)datasync;
+   (void)fi;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
+   if ( master_atrfs.zatr || master_atrfs.dcm ) return image_flush(&master_atrfs);
+   if ( msync(master_atrfs.atrmem,master_atrfs.atrsize,MS_SYNC) ) return -errno;
+   return 0;
+}
+
 int atr_getattr(const char *path, struct stat *stbuf
 #if (FUSE_USE_VERSION >= 30)
                 , struct fuse_file_info *fi
@@ -361,10 +398,26 @@ int atr_getattr(const char *path, struct stat *stbuf
    (void)fi;
 #endif
    upcase_path(path);
-   memset(stbuf,0,sizeof(*stbuf));
 
    if ( options.debug > 1 ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
 
+   atr_stat_defaults(stbuf);
+   int r;
+   broker_lock(&master_atrfs,0);
+   r = (generic_ops.fs_getattr)(&master_atrfs,path, stbuf);
+   broker_unlock(&master_atrfs,0);
+   return r;
+}
+
+/*
+ * atr_stat_defaults()
+ *
+ * Initial stat values for any file; the file system adjusts from here.
+ */
+void atr_stat_defaults(struct stat *stbuf)
+{
+   memset(stbuf,0,sizeof(*stbuf));
+
    // Copy time stamps from image file; adjust if SpartaDOS or other file system supports time stamps
    stbuf->st_atim = master_atrfs.atrstat.st_atim;
    stbuf->st_mtim = master_atrfs.atrstat.st_mtim;
@@ -374,11 +427,32 @@ int atr_getattr(const char *path, struct stat *stbuf
    stbuf->st_blksize = master_atrfs.sectorsize;
    stbuf->st_nlink = 1;
    stbuf->st_mode = MODE_FILE(master_atrfs.atrstat.st_mode & 0777);
+}
+
+/*
+ * dirfill_stat()
+ *
+ * For fs_readdir functions: return non-zero if FUSE wants stat data for
+ * the next entry, with 'stbuf' set to the defaults.  Pass the filled-in
+ * structure with FILLER_STAT(stbuf).  Returns zero if the entry will be
+ * skipped anyway, so no time is spent on it.
+ */
+int dirfill_stat(void *buf,struct stat *stbuf)
+{
+   struct dirfill *d = buf;
 
-   return (generic_ops.fs_getattr)(&master_atrfs,path, stbuf);
+   if ( !d->plus || d->full || d->count+1 <= d->offset ) return 0;
+   atr_stat_defaults(stbuf);
+   return 1;
 }
 
-static fuse_fill_dir_t save_filler;
+/*
+ * atrfs_filler()
+ *
+ * Filler passed to fs_readdir functions.  Number the entries so that FUSE
+ * can resume a large directory at an offset instead of rereading it, and
+ * only pass stat data along if FUSE asked for it.
+ */
 int atrfs_filler(void *buf,const char *name,
                  const struct stat *stbuf, off_t off
 #if (FUSE_USE_VERSION >= 30)
@@ -386,12 +460,24 @@ int atrfs_filler(void *buf,const char *name,
 #endif
    )
 {
+   struct dirfill *d = buf;
+
+   (void)off;
+   if ( d->full ) return 1;
+   ++d->count;
+   if ( d->count <= d->offset ) return 0;
    lowcase_path(name);
-   return save_filler(buf,name,stbuf,off
 #if (FUSE_USE_VERSION >= 30)
-                      ,flags
+   if ( !d->plus || !stbuf )
+   {
+      stbuf = NULL;
+      flags = 0;
+   }
+   d->full = d->filler(d->buf,name,stbuf,d->count,flags);
+#else
+   d->full = d->filler(d->buf,name,stbuf,d->count);
 #endif
-      );
+   return d->full;
 }
 
 int atr_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi
@@ -400,15 +486,16 @@ int atr_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 #endif
    )
 {
+   struct dirfill d;
+
    (void)fi;
+   memset(&d,0,sizeof(d));
+   d.buf = buf;
+   d.filler = filler;
+   d.offset = offset;
 #if (FUSE_USE_VERSION >= 30)
-   (void)flags;
+   d.plus = (flags & FUSE_READDIR_PLUS) != 0;
 #endif
-   if ( options.lowcase )
-   {
-      save_filler = filler;
-      filler = atrfs_filler;
-   }
    upcase_path(path);
 #if 0 // Have FUSE call getattr() for stat information
    // No subdirectories yet
@@ -426,11 +513,15 @@ int atr_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 
    if ( options.debug > 1 ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
    // Standard directories
-   filler(buf, ".", FILLER_NULL);
-   filler(buf, "..", FILLER_NULL);
+   atrfs_filler(&d, ".", FILLER_NULL);
+   atrfs_filler(&d, "..", FILLER_NULL);
 
-   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
-   return (generic_ops.fs_readdir)(&master_atrfs,path, buf, filler,offset);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s offset %ld\n",__FUNCTION__,path,(long)offset);
+   int r;
+   broker_lock(&master_atrfs,0);
+   r = (generic_ops.fs_readdir)(&master_atrfs,path, &d, atrfs_filler, offset);
+   broker_unlock(&master_atrfs,0);
+   return r;
 }
 
 int atr_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
@@ -438,7 +529,11 @@ int atr_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
    (void)fi;
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s %s %ld bytes at %lu\n",__FUNCTION__,path,size,offset);
-   return (generic_ops.fs_read)(&master_atrfs,path,buf,size,offset);
+   int r;
+   broker_lock(&master_atrfs,0);
+   r = (generic_ops.fs_read)(&master_atrfs,path,buf,size,offset);
+   broker_unlock(&master_atrfs,0);
+   return r;
 }
 
 int atr_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
@@ -447,7 +542,11 @@ int atr_write(const char *path, const char *buf, size_t size, off_t offset, stru
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s %s %ld bytes at %lu\n",__FUNCTION__,path,size,offset);
    if ( master_atrfs.readonly ) return -EROFS;
-   return (generic_ops.fs_write)(&master_atrfs,path,buf,size,offset);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_write)(&master_atrfs,path,buf,size,offset);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 
 int atr_mkdir(const char *path,mode_t mode)
@@ -455,7 +554,11 @@ int atr_mkdir(const char *path,mode_t mode)
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( master_atrfs.readonly ) return -EROFS;
-   return (generic_ops.fs_mkdir)(&master_atrfs,path,mode);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_mkdir)(&master_atrfs,path,mode);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 
 int atr_rmdir(const char *path)
@@ -463,7 +566,11 @@ int atr_rmdir(const char *path)
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( master_atrfs.readonly ) return -EROFS;
-   return (generic_ops.fs_rmdir)(&master_atrfs,path);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_rmdir)(&master_atrfs,path);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 
 int atr_unlink(const char *path)
@@ -471,7 +578,11 @@ int atr_unlink(const char *path)
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( master_atrfs.readonly ) return -EROFS;
-   return (generic_ops.fs_unlink)(&master_atrfs,path);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_unlink)(&master_atrfs,path);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 
 int atr_rename(const char *path1, const char *path2
@@ -488,7 +599,11 @@ int atr_rename(const char *path1, const char *path2
    upcase_path(path2);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( master_atrfs.readonly ) return -EROFS;
-   return (generic_ops.fs_rename)(&master_atrfs,path1,path2,flags);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_rename)(&master_atrfs,path1,path2,flags);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 
 int atr_chmod(const char *path, mode_t mode
@@ -503,21 +618,33 @@ int atr_chmod(const char *path, mode_t mode
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( master_atrfs.readonly ) return -EROFS;
-   return (generic_ops.fs_chmod)(&master_atrfs,path,mode);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_chmod)(&master_atrfs,path,mode);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 
 int atr_readlink(const char *path, char *buf, size_t size )
 {
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
-   return (generic_ops.fs_readlink)(&master_atrfs,path,buf,size);
+   int r;
+   broker_lock(&master_atrfs,0);
+   r = (generic_ops.fs_readlink)(&master_atrfs,path,buf,size);
+   broker_unlock(&master_atrfs,0);
+   return r;
 }
 
 int atr_statfs(const char *path, struct statvfs *stfsbuf)
 {
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
-   return (generic_ops.fs_statfs)(&master_atrfs,path,stfsbuf);
+   int r;
+   broker_lock(&master_atrfs,0);
+   r = (generic_ops.fs_statfs)(&master_atrfs,path,stfsbuf);
+   broker_unlock(&master_atrfs,0);
+   return r;
 }
 
 int atr_create(const char *path, mode_t mode, struct fuse_file_info *fi)
@@ -526,7 +653,11 @@ int atr_create(const char *path, mode_t mode, struct fuse_file_info *fi)
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( master_atrfs.readonly ) return -EROFS;
-   return (generic_ops.fs_create)(&master_atrfs,path,mode);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_create)(&master_atrfs,path,mode);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 
 int atr_truncate(const char *path,
@@ -542,7 +673,11 @@ int atr_truncate(const char *path,
    upcase_path(path);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( master_atrfs.readonly ) return -EROFS;
-   return (generic_ops.fs_truncate)(&master_atrfs,path,size);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_truncate)(&master_atrfs,path,size);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 
 #if (FUSE_USE_VERSION >= 30)
@@ -562,7 +697,11 @@ int atr_utimens(const char *path, const struct timespec tv[2], struct fuse_file_
       else if ( tv[1].tv_nsec == UTIME_OMIT ) fprintf(stderr,"OMIT, ");
       else fprintf(stderr,"%lu, ",tv[1].tv_sec);
    }
-   return (generic_ops.fs_utimens)(&master_atrfs,path,tv);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_utimens)(&master_atrfs,path,tv);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 #else
 int atr_utime(const char *path, struct utimbuf *utimbuf)
@@ -571,10 +710,70 @@ int atr_utime(const char *path, struct utimbuf *utimbuf)
    if ( master_atrfs.readonly ) return -EROFS;
    if ( options.debug > 1 ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
 
-   return (generic_ops.fs_utime)(&master_atrfs,path,utimbuf);
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_utime)(&master_atrfs,path,utimbuf);
+   broker_unlock(&master_atrfs,1);
+   return r;
+}
+#endif
+
+#if (FUSE_USE_VERSION >= 30)
+int atr_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+   (void)fi;
+   upcase_path(path);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s mode 0x%x %lu bytes at %lu\n",__FUNCTION__,path,mode,length,offset);
+   if ( master_atrfs.readonly ) return -EROFS;
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_fallocate)(&master_atrfs,path,mode,offset,length);
+   broker_unlock(&master_atrfs,1);
+   return r;
+}
+
+ssize_t atr_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+                            const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+                            size_t size, int flags)
+{
+   (void)fi_in;
+   (void)fi_out;
+   upcase_path(path_in);
+   upcase_path(path_out);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s at %lu to %s at %lu, %lu bytes\n",__FUNCTION__,path_in,offset_in,path_out,offset_out,size);
+   if ( flags ) return -EINVAL; // No flags are defined
+   if ( master_atrfs.readonly ) return -EROFS;
+   if ( size > INT_MAX ) size = INT_MAX; // Return value is an int in the lower layers
+   int r;
+   broker_lock(&master_atrfs,1);
+   r = (generic_ops.fs_copy_file_range)(&master_atrfs,path_in,offset_in,path_out,offset_out,size);
+   broker_unlock(&master_atrfs,1);
+   return r;
 }
 #endif
 
+int atr_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+   upcase_path(path);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s %s\n",__FUNCTION__,path,name);
+   int r;
+   broker_lock(&master_atrfs,0);
+   r = (generic_ops.fs_getxattr)(&master_atrfs,path,name,value,size);
+   broker_unlock(&master_atrfs,0);
+   return r;
+}
+
+int atr_listxattr(const char *path, char *list, size_t size)
+{
+   upcase_path(path);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
+   int r;
+   broker_lock(&master_atrfs,0);
+   r = (generic_ops.fs_listxattr)(&master_atrfs,path,list,size);
+   broker_unlock(&master_atrfs,0);
+   return r;
+}
+
 int atr_chown(const char *path, uid_t uid, gid_t gid
 #if (FUSE_USE_VERSION >= 30)
               , struct fuse_file_info *fi
@@ -595,6 +794,9 @@ static const struct fuse_operations atr_oper = {
 #if (FUSE_USE_VERSION >= 30)
         .init           = atr_init,
 #endif
+        .destroy        = atr_destroy,
+        .flush          = atr_flush,
+        .fsync          = atr_fsync,
 	.getattr	= atr_getattr,
 	.readdir	= atr_readdir,
 	.read		= atr_read,
@@ -614,6 +816,12 @@ static const struct fuse_operations atr_oper = {
 #endif
         .chown          = atr_chown,
         .statfs         = atr_statfs,
+        .getxattr       = atr_getxattr,
+        .listxattr      = atr_listxattr,
+#if (FUSE_USE_VERSION >= 30)
+        .fallocate      = atr_fallocate,
+        .copy_file_range = atr_copy_file_range,
+#endif
 };
 
 /*
@@ -662,6 +870,12 @@ void atrfs_info(void)
       printf("%s",buf);
       free(buf);
    }
+   buf = detect_textdata(&master_atrfs);
+   if ( buf )
+   {
+      printf("\n%s",buf);
+      free(buf);
+   }
 }
 
 /*
@@ -686,6 +900,31 @@ const struct fuse_opt option_spec[] = {
    OPTION("--fs=%s", fstype),
    OPTION("--volname=%s", volname),
    OPTION("--cluster=%u", clustersize),
+   OPTION("--sparse", sparse),
+   OPTION("--sparsify", sparsify),
+   OPTION("--defrag", defrag),
+   OPTION("--convert=%s", convert),
+   OPTION("--skew=%u", skew),
+   OPTION("--batch=%s", batch),
+   OPTION("--jobs=%u", jobs),
+   OPTION("--knowndisks=%s", knowndisks),
+   OPTION("--dups", dups),
+   OPTION("--dupcache=%s", dupcache),
+   OPTION("--diff", diff),
+   OPTION("--patch=%s", patch),
+   OPTION("--apply=%s", apply),
+   OPTION("--check", check),
+   OPTION("--repair", repair),
+   OPTION("--loadtime", loadtime),
+   OPTION("--textview", textview),
+   OPTION("--basicview", basicview),
+   OPTION("--index=%s", index),
+   OPTION("--search=%s", search),
+   OPTION("--pack=%s", pack),
+   OPTION("--member=%s", member),
+   OPTION("--unpack=%s", unpack),
+   OPTION("--compress=%s", compress),
+   OPTION("--decompress=%s", decompress),
    FUSE_OPT_END
 };
 
@@ -703,8 +942,17 @@ int main(int argc,char *argv[])
    options.sectors=720;
 
    // Mangle options for no '--nmae=' option with a mount point
+   // With --batch, --dups, --diff, --apply, --check, --loadtime, --index, --pack, --compress, or --decompress, every non-option argument is an image
    int mp = 0;
-   for ( int i=argc-1;i>0;--i )
+   for ( int i=1;i<argc;++i )
+   {
+      if ( strncmp(argv[i],"--batch=",8) == 0 || strcmp(argv[i],"--dups") == 0 ||
+           strcmp(argv[i],"--diff") == 0 || strncmp(argv[i],"--apply=",8) == 0 ||
+           strcmp(argv[i],"--check") == 0 || strcmp(argv[i],"--loadtime") == 0 || strncmp(argv[i],"--index=",8) == 0 ||
+           strncmp(argv[i],"--pack=",7) == 0 || strncmp(argv[i],"--compress=",11) == 0 ||
+           strncmp(argv[i],"--decompress=",13) == 0 ) mp = 2;
+   }
+   for ( int i=argc-1;i>0 && mp<2;--i )
    {
       if ( argv[i][0] == '-' ) continue;
       if ( !mp )
@@ -722,13 +970,44 @@ int main(int argc,char *argv[])
    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
       return 1;
    
+   if ( options.batch && !options.help ) return batch_info(args.argc-1,args.argv+1);
+   if ( options.dups && !options.help ) return dups_report(args.argc-1,args.argv+1);
+   if ( options.diff && !options.help ) return diff_images(args.argc-1,args.argv+1);
+   if ( options.apply && !options.help ) return diff_apply(args.argc-1,args.argv+1);
+   if ( options.check && !options.help ) return check_report(args.argc-1,args.argv+1);
+   if ( options.loadtime && !options.help ) return loadtime_report(args.argc-1,args.argv+1);
+   if ( options.search && !options.help ) return search_report();
+   if ( options.index && !options.help ) return index_report(args.argc-1,args.argv+1);
+   if ( options.pack && !options.help ) return pack_report(args.argc-1,args.argv+1);
+   if ( (options.compress || options.decompress) && !options.help ) return zatr_convert(args.argc-1,args.argv+1);
+
    if ( !options.filename || options.help )
    {
       printf("usage:\n"
              " %s [options] <mountpoint>\n"
              "   or\n"
              " %s [options] <atrfile> <mountpoint>\n"
-             "\n",argv[0],argv[0]);
+             "   or\n"
+             " %s --batch=<json|csv> [--jobs=<#>] <atrfile|directory>...\n"
+             "   or\n"
+             " %s --dups [--dupcache=<file>] [--jobs=<#>] <atrfile|directory>...\n"
+             "   or\n"
+             " %s --diff [--patch=<file>] <old atrfile> <new atrfile>\n"
+             "   or\n"
+             " %s --apply=<patch file> <atrfile>\n"
+             "   or\n"
+             " %s --check [--repair] [--jobs=<#>] <atrfile|directory>...\n"
+             "   or\n"
+             " %s --loadtime [--jobs=<#>] <atrfile|directory>...\n"
+             "   or\n"
+             " %s --index=<file> [--jobs=<#>] <atrfile|directory>...\n"
+             "   or\n"
+             " %s --index=<file> --search=<string>\n"
+             "   or\n"
+             " %s --pack=<file> [<atrfile|directory>...] [--unpack=<directory> [--member=<name>]]\n"
+             "   or\n"
+             " %s --compress=<new file>|--decompress=<new file> <atrfile>\n"
+             "\n",argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0]);
       printf("fuse options:\n"
              "    -d   (debugging output; implies -f)\n"
              "    -f   (do not fork into background)\n"
@@ -743,7 +1022,35 @@ int main(int argc,char *argv[])
              "    --create      (create new image)\n"
              "    --upcase      (new files are create uppercase; operations are case insensitive)\n"
              "    --lowcase     (present all files as lower-case; implies --upcase)\n"
+             "    --textview    (open <file>.txt to read and write a file with ASCII newlines and tabs)\n"
+             "    --basicview   (open <file>.lst to read a tokenized BASIC program as a listing)\n"
              "    --secsize=<#> (sector size to use if no ATR header is present)\n"
+             "    --sparse      (punch holes in the image file for freed sectors)\n"
+             "    --sparsify    (zero unused sectors and punch holes in the image, then exit)\n"
+             "    --defrag      (move files so each is one contiguous run of sectors, then exit)\n"
+             "    --convert=<type> (rebuild the image as another file system type with the same\n"
+             "                   files laid out contiguously, then exit; see --fs for types)\n"
+             "    --skew=<#>    (sector times the Atari needs between reads; place new sectors\n"
+             "                   where the drive head will be, for faster loading on real drives)\n"
+             "    --batch=<fmt> (report on each image or image in a directory as json or csv, then exit)\n"
+             "    --jobs=<#>    (images to examine in parallel with --batch, --dups, --check, --loadtime,\n"
+             "                   or --index; default one per CPU)\n"
+             "    --dups        (report duplicate files across the images or directories given, then exit)\n"
+             "    --dupcache=<file> (keep --dups results per image; only changed images are read again)\n"
+             "    --diff        (report the files that differ between two images, then exit)\n"
+             "    --patch=<file> (with --diff, write the differing sectors as a patch instead)\n"
+             "    --apply=<file> (write a patch from --diff --patch into the image, then exit)\n"
+             "    --check       (check the file system in each image or directory of images, then exit)\n"
+             "    --repair      (with --check, fix bitmaps, free counts, and sector counts)\n"
+             "    --loadtime    (estimate how long each file takes to load on a real drive, then exit)\n"
+             "    --index=<file> (add the files in each image or directory to a search index, then exit)\n"
+             "    --pack=<file> (add images to a pack that stores shared sectors once; list it if none given)\n"
+             "    --member=<name> (open this image from the pack given as the image file)\n"
+             "    --unpack=<dir> (with --pack, write the pack's images into a directory)\n"
+             "    --compress=<file> (write the image as a compressed image that atrfs and sio2linux can use)\n"
+             "    --decompress=<file> (write a compressed image back out as a plain image)\n"
+             "    --search=<string> (with --index, list files containing the string as text or screen codes; \\xNN for bytes)\n"
+             "    --knowndisks=<file> (more signatures for recognizing known disks; see README.TXT)\n"
              " Options used with --create:\n"
              "    --secsize=<#> (sector size if creating; default 128)\n"
              "    --sectors=<#> (number of sectors in image; default 720)\n"
@@ -775,10 +1082,21 @@ int main(int argc,char *argv[])
       return 0;
    }
 
+   if ( options.sparsify || options.defrag || options.convert )
+   {
+      if ( options.convert ) ret = convert_image(&master_atrfs);
+      else ret = options.sparsify ? sparsify_image(&master_atrfs) : defrag_image(&master_atrfs);
+      if ( !ret && image_flush(&master_atrfs) ) ret = 1;
+      return ret;
+   }
+
    if ( options.info ) atrfs_info();
 
    if ( options.info && args.argc == 1 ) return 0;
 
+   // Let sio2linux use the image while it's mounted
+   if ( broker_open(&master_atrfs) ) return 1;
+
    ret = fuse_main(args.argc, args.argv, &atr_oper
 #if (FUSE_USE_VERSION >= 26)
                    , NULL
@@ -27,8 +27,10 @@
 #define MODE_RO(m)      ((m) & ~000222) // Remove write bits
 #if (FUSE_USE_VERSION >= 30)
 #define FILLER_NULL     NULL,0,0
+#define FILLER_STAT(st) (st),0,FUSE_FILL_DIR_PLUS
 #else
 #define FILLER_NULL     NULL,0
+#define FILLER_STAT(st) (st),0
 #endif
 
 /*
@@ -41,6 +43,16 @@
 #define st_mtim st_mtimespec
 #endif
 
+// fallocate(2) mode flags; only defined on Linux
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+// Extended attributes with file system metadata (getfattr -d -m user.atari)
+#define XATTR_PREFIX    "user.atari."
+#ifndef ENODATA
+#define ENODATA ENOATTR // BSD name for a missing attribute
+#endif
 
 /*
  * Data types
@@ -64,6 +76,14 @@ enum atrfstype {
    ATR_MAXFSTYPE
 };
 
+// What happened while detecting the file system type; reported by --info
+struct detect_stats {
+   int score[ATR_MAXFSTYPE]; // From fs_score; 0 rules the type out
+   int tried[ATR_MAXFSTYPE]; // Order in which fs_sanity ran (1 is first); 0 if not run
+   long ns[ATR_MAXFSTYPE]; // Time spent in fs_sanity
+   long score_ns; // Time spent in all fs_score functions
+};
+
 // One struct for all global information about the file system
 struct atrfs {
    int fd;
@@ -77,6 +97,66 @@ struct atrfs {
    int sectorsize; // 128, 256, or possibly even 512
    int sectors;
    enum atrfstype fstype;
+   int alloc_hint; // If non-zero, first sector (or cluster) for allocators to try
+   unsigned int changes; // Incremented on each modification; expires cached data
+   unsigned int rawchanges; // Incremented when sectors change outside the file system module; expires its indexes
+   struct detect_stats detect;
+   struct zatr *zatr; // Compressed image state, or NULL
+   struct dcm *dcm; // DCM archive state, or NULL
+   struct broker *broker; // Sharing with sio2linux, or NULL
+};
+
+// State for one atr_readdir() call; passed to fs_readdir as the filler 'buf'
+struct dirfill {
+   void *buf; // From FUSE
+   fuse_fill_dir_t filler; // From FUSE
+   off_t offset; // Entries already returned by earlier calls
+   off_t count; // Entries seen so far in this call
+   int plus; // FUSE wants stat data with each entry
+   int full; // FUSE buffer is full; ignore remaining entries
+};
+
+// Sector ownership map: built in one pass by fs_sectormap for .sectormap
+enum sectormap_bitmap {
+   SM_UNMAPPED = 0, // Not covered by the bitmap
+   SM_FREE,
+   SM_USED,
+};
+
+enum sectormap_use {
+   SM_NONE = 0,
+   SM_SYSTEM, // Boot sectors, VTOC, bitmaps
+   SM_DIR, // Directory contents
+   SM_DATA, // File data
+   SM_MAP, // SpartaDOS sector map
+};
+
+struct sectormap_entry {
+   unsigned char bitmap; // enum sectormap_bitmap
+   unsigned char use; // enum sectormap_use from the first claim
+   unsigned short claims; // More than one means cross-linked
+   int owner; // Index into owners[] from the first claim
+   int position; // Position in the owner's chain (or list of map sectors)
+   int other; // Owner from the second claim if cross-linked
+};
+
+struct sectormap {
+   int sectors;
+   struct sectormap_entry *map; // Indexed by sector number
+   int num_owners;
+   char **owners;
+};
+
+// Results from fs_check for --check and --repair
+struct fscheck {
+   int repair; // Fix what can be fixed safely
+   int damaged; // A file chain is broken, so unclaimed sectors may still hold its data
+   int problems;
+   int repaired;
+   char *buf; // One line per problem
+   size_t len;
+   size_t alloc;
+   struct sectormap *sm; // Built before fs_check is called
 };
 
 struct options {
@@ -94,6 +174,31 @@ struct options {
    const char *fstype;
    int clustersize;
    const char *volname;
+   int sparse; // Punch holes in the image file for freed sectors
+   int sparsify; // Zero unused sectors and punch holes, then exit
+   int defrag; // Make each file a contiguous run of sectors, then exit
+   const char *convert; // File system type to rebuild the image as, then exit
+   int skew; // Sector times the Atari needs between reads; allocate for rotation if set
+   const char *batch; // Report format for many images: json or csv
+   int jobs; // Images to examine in parallel with --batch
+   const char *knowndisks; // File of extra known-disk signatures
+   int dups; // Report duplicate files across images, then exit
+   const char *dupcache; // File of per-image results for --dups
+   int diff; // Compare two images, then exit
+   const char *patch; // With --diff, write the differing sectors here
+   const char *apply; // Patch from --diff --patch to write into an image
+   int check; // Check file system consistency of each image, then exit
+   int repair; // With --check, fix what can be fixed safely
+   int loadtime; // Estimate load times on a real drive for each image, then exit
+   int textview; // "<file>.txt" shows the file with ASCII end-of-line and tab characters
+   int basicview; // "<file>.lst" shows a tokenized BASIC program as a listing
+   const char *index; // Content index file for --index and --search
+   const char *search; // String to find with the content index
+   const char *pack; // Pack of deduplicated images to add to, list, or unpack
+   const char *member; // Image in a pack to open
+   const char *unpack; // Directory to write pack members into
+   const char *compress; // Write the image as a compressed image file
+   const char *decompress; // Write the image as a plain image file
 };
 
 struct sector1 {
@@ -119,6 +224,7 @@ struct fs_ops {
    const char *name;
    const char *fstype; // For command-line create image option
    int (*fs_sanity)(struct atrfs *atrfs);
+   int (*fs_score)(struct atrfs *atrfs); // Cheap check before fs_sanity: 0 if it must fail, else higher for more likely
    int (*fs_getattr)(struct atrfs *atrfs,const char *,struct stat *);
    int (*fs_readdir)(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
    int (*fs_read)(struct atrfs *atrfs,const char *,char *,size_t,off_t);
@@ -139,6 +245,14 @@ struct fs_ops {
 #endif
    int (*fs_newfs)(struct atrfs *atrfs); // Used from command-line optoin
    char *(*fs_fsinfo)(struct atrfs *atrfs); // Added text for .fsinfo file
+   int (*fs_fallocate)(struct atrfs *atrfs,const char *,int,off_t,off_t);
+   int (*fs_copy_file_range)(struct atrfs *atrfs,const char *,off_t,const char *,off_t,size_t);
+   int (*fs_unused_sector)(struct atrfs *atrfs,int sector); // Non-zero if not allocated (for --sparsify)
+   int (*fs_getxattr)(struct atrfs *atrfs,const char *,const char *,char *,size_t);
+   int (*fs_listxattr)(struct atrfs *atrfs,const char *,char *,size_t);
+   int (*fs_sectormap)(struct atrfs *atrfs,struct sectormap *sm); // Claim every sector in use for .sectormap
+   int (*fs_defrag)(struct atrfs *atrfs,int *fragmented); // One --defrag pass; returns files moved
+   int (*fs_check)(struct atrfs *atrfs,struct fscheck *ck); // Consistency checks for --check
 };
 
 /*
@@ -147,8 +261,55 @@ struct fs_ops {
 // atrfs.c functions used elsewhere
 int atr_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 char *atr_info(const char *path,int filesize);
+void atr_stat_defaults(struct stat *stbuf);
+int dirfill_stat(void *buf,struct stat *stbuf);
+int atrfs_filler(void *buf,const char *name,const struct stat *stbuf,off_t off
+#if (FUSE_USE_VERSION >= 30)
+                 ,enum fuse_fill_dir_flags flags
+#endif
+   );
+int atr_preinit(void);
 // special.c functions
 char *fsinfo_textdata(struct atrfs *atrfs);
+// info.c functions
+const char *basic_view(struct atrfs *atrfs,const char *path);
+// unknown.c functions
+const char *known_disk_name(struct atrfs *atrfs);
+void known_index_build(void);
+// batch.c functions
+int batch_info(int count,char *names[]);
+int dups_report(int count,char *names[]);
+int check_report(int count,char *names[]);
+int loadtime_report(int count,char *names[]);
+int index_report(int count,char *names[]);
+int search_report(void);
+int batch_files(const char *path,char ***names);
+// diff.c functions
+int diff_images(int count,char *names[]);
+int diff_apply(int count,char *names[]);
+void diff_put(unsigned char *b,unsigned int value,int bytes);
+unsigned int diff_get(const unsigned char *b,int bytes);
+// pack.c functions
+int pack_member(struct atrfs *atrfs);
+int pack_report(int count,char *names[]);
+// zatr.c functions
+int zatr_open(struct atrfs *atrfs);
+int zatr_flush(struct atrfs *atrfs);
+int zatr_convert(int count,char *names[]);
+// dcm.c functions
+int dcm_open(struct atrfs *atrfs);
+int dcm_flush(struct atrfs *atrfs);
+// broker.c functions
+int broker_open(struct atrfs *atrfs);
+void broker_lock(struct atrfs *atrfs,int write);
+void broker_unlock(struct atrfs *atrfs,int write);
+// convert.c functions
+int convert_image(struct atrfs *atrfs);
+// loadtime.c functions
+char *loadtime_image(struct atrfs *atrfs);
+// tar.c functions
+off_t tar_size(struct atrfs *atrfs);
+int tar_read(struct atrfs *atrfs,char *buf,size_t size,off_t offset);
 // common.c functions
 int string_to_sector(const char *path);
 int atrfs_strncmp(const char *s1, const char *s2, size_t n);
@@ -157,6 +318,31 @@ int atrfs_memcmp(const void *s1, const void *s2, size_t n);
 char *strcpy_upcase(char *dst,const char *src);
 char *strcpy_lowcase(char *dst,const char *src);
 char *strcpy_case(char *dst,const char *src);
+int find_free_run(struct atrfs *atrfs,int first,int last,int count,int (*is_free)(struct atrfs *,int));
+void sparse_free(struct atrfs *atrfs,void *mem,size_t len);
+int image_flush(struct atrfs *atrfs);
+int sparsify_image(struct atrfs *atrfs);
+int defrag_image(struct atrfs *atrfs);
+int detect_fstype(struct atrfs *atrfs,int first,int last);
+char *detect_textdata(struct atrfs *atrfs);
+int skew_delay(struct atrfs *atrfs,int from,int to);
+int skew_next_sector(struct atrfs *atrfs,int prev,int (*is_free)(struct atrfs *,int));
+int skew_chain_time(struct atrfs *atrfs,const int *sectors);
+long load_time(struct atrfs *atrfs,const int *sectors,int count,int baud,long *ideal);
+int load_skew(struct atrfs *atrfs,int baud);
+int xattr_value(char *value,size_t size,const void *data,size_t len);
+int xattr_text(char *value,size_t size,const char *fmt,...);
+int xattr_chain(char *value,size_t size,const int *sectors,int count);
+int xattr_names(char *list,size_t size,const char *const names[]);
+struct sectormap *sectormap_build(struct atrfs *atrfs);
+void sectormap_free(struct sectormap *sm);
+int sectormap_owner(struct sectormap *sm,const char *name);
+void sectormap_claim(struct sectormap *sm,int sector,int owner,int use,int position);
+void fscheck_problem(struct fscheck *ck,int repaired,const char *fmt,...);
+void fscheck_note(struct fscheck *ck,const char *fmt,...);
+void fscheck_bitmap(struct fscheck *ck,struct atrfs *atrfs,int unit,int (*set)(struct atrfs *atrfs,int sector,int used));
+int check_image(struct atrfs *atrfs,char **report,int *repaired);
+int tree_walk(struct atrfs *atrfs,int (*found)(void *arg,const char *path,const struct stat *st),void *arg);
 
 /*
  * Global variables
@@ -0,0 +1,1857 @@
+/*
+ * batch.c
+ *
+ * Work on many images at once: --batch reports one record per image as
+ * JSON lines or CSV, --dups finds duplicate files across images,
+ * --check verifies (and with --repair, fixes) each image's file system,
+ * and --index and --search find images containing a string.
+ *
+ * The file system code keeps its state in globals (master_atrfs and
+ * per-module caches), so each image is examined in a forked worker
+ * rather than a thread.  That also keeps a corrupt image that crashes
+ * a detector from taking down the whole run.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#define _GNU_SOURCE // scandir(), alphasort(), memmem()
+#include FUSE_INCLUDE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <ctype.h>
+// MD5 library functions
+#if defined(__APPLE__)
+#  define COMMON_DIGEST_FOR_OPENSSL
+#  include <CommonCrypto/CommonDigest.h>
+#else
+#  include <openssl/md5.h>
+#endif
+#include "atrfs.h"
+
+/*
+ * Macros and defines
+ */
+#define BATCH_RECORD_MAX 8192 // Longest --batch record
+#define INDEX_MAGIC "ATRIDX01"
+#define INDEX_QUERY_MAX 256 // Longest --search string
+#define INDEX_VARIANTS 4
+#define ATASCII_TO_SCREEN(_a) ( ( ((_a)&0x7f) < 0x20 ) ? ((_a)+0x40) : ( ((_a)&0x7f) < 0x60 ) ? (_a) - 0x20 : (_a) ) // From disasm.c
+
+/*
+ * Index file format for --index (all numbers little-endian)
+ *
+ *   "ATRIDX01"
+ *   Image count, file count, trigram count, posting count (4 bytes each)
+ *   Images: size, mtime seconds, mtime nanoseconds, file count (4 bytes
+ *      each), name length (2 bytes), name
+ *   Files, in image order: size (4 bytes), path length (2 bytes), path
+ *   Trigrams in ascending order: trigram, first posting, posting count
+ *      (4 bytes each)
+ *   Postings: file numbers in ascending order (4 bytes each)
+ *
+ * A trigram is three consecutive bytes of a file as one number.  Every
+ * string in a file has all of its trigrams listed for that file, so a
+ * search only has to look at files in the postings of every trigram of
+ * the string.
+ */
+
+/*
+ * Data types
+ */
+struct batch_list {
+   int count;
+   int alloc;
+   char **names;
+};
+
+struct batch_job {
+   pid_t pid; // 0 if the slot is idle
+   int fd; // Read end of the worker's pipe
+   int index; // Image this worker is examining
+   char *buf; // Output from the worker so far
+   size_t len;
+   size_t alloc;
+};
+
+// Called in the parent as each worker finishes; record is NULL on failure
+typedef void (*batch_done_t)(void *arg,int index,char *record);
+
+// State for --batch
+struct batch_info_state {
+   struct batch_list *list;
+   char **records;
+   int printed;
+   int failed;
+};
+
+// One file found by --dups
+struct dups_file {
+   int image; // Index into the image list
+   long size;
+   char md5[33]; // Whole file
+   char tmd5[33]; // Without trailing padding; "-" if nothing is left
+   char *path;
+};
+
+// One image for --dups: file lines from a worker or the cache
+struct dups_image {
+   char *name;
+   off_t size;
+   struct timespec mtime;
+   char *files; // "<size> <md5> <tmd5> <path>" lines
+   int used; // Named on this run
+};
+
+// Worker output for --dups, --index, or --search
+struct dups_walk_state {
+   char *out;
+   size_t len;
+   size_t alloc;
+   void (*found)(struct dups_walk_state *w,const char *path,const char *data,off_t size); // Called for each file
+};
+
+struct dups_state {
+   struct dups_image *image;
+   int count;
+   int alloc;
+   int *pending; // Image index for each worker job
+};
+
+// State for --check
+struct check_state {
+   struct batch_list *list;
+   char **reports;
+   int printed;
+   int unrepaired; // Images with problems left
+};
+
+// State for --loadtime
+struct loadtime_state {
+   struct batch_list *list;
+   char **reports;
+   int printed;
+};
+
+// One file for --index: its distinct trigrams in ascending order
+struct index_file {
+   char *path;
+   long size;
+   int ntri;
+   unsigned int *tri;
+};
+
+// One image for --index, from a worker or the old index
+struct index_image {
+   char *name;
+   off_t size;
+   struct timespec mtime;
+   int nfiles;
+   struct index_file *files;
+   int used; // Named on this run
+   int current; // Files are from this image as it is now
+};
+
+struct index_state {
+   struct index_image *image;
+   int count;
+   int alloc;
+   int *pending; // Image index for each worker job
+};
+
+// An index file mapped for --search or to update
+struct index_map {
+   unsigned char *map;
+   size_t len;
+   unsigned int images;
+   unsigned int files;
+   unsigned int trigrams;
+   unsigned int postings;
+   unsigned char **image; // Start of each image entry
+   unsigned char **file; // Start of each file entry
+   const unsigned char *dir; // Trigram table
+   const unsigned char *post; // Postings
+};
+
+// State for --search
+struct search_state {
+   struct batch_list *list;
+   char **reports;
+   int printed;
+   int matches;
+};
+
+/*
+ * Function prototypes
+ */
+void batch_add(struct batch_list *list,const char *name);
+void batch_expand(struct batch_list *list,const char *path);
+char *batch_quote(char *b,const char *s);
+char *batch_record(const char *name);
+void batch_worker(const char *name,int fd,char *(*examine)(const char *name));
+int batch_run(struct batch_list *list,int jobs,char *(*examine)(const char *name),batch_done_t done,void *arg);
+int batch_jobs(int count);
+void batch_info_done(void *arg,int index,char *record);
+void dups_hex(char *hex,const unsigned char *digest);
+void batch_reserve(struct dups_walk_state *w,size_t more);
+int dups_file(void *arg,const char *path,const struct stat *st);
+void dups_found(struct dups_walk_state *w,const char *path,const char *data,off_t size);
+char *dups_examine(const char *name);
+struct dups_image *dups_image(struct dups_state *st,const char *name);
+void dups_cache_read(struct dups_state *st,const char *filename);
+void dups_cache_write(struct dups_state *st,const char *filename);
+void dups_done(void *arg,int index,char *record);
+int dups_cmp_md5(const void *a,const void *b);
+int dups_cmp_tmd5(const void *a,const void *b);
+void dups_print(struct dups_state *st,struct dups_file *f,int first,int last);
+char *check_examine(const char *name);
+void check_done(void *arg,int index,char *record);
+char *loadtime_examine(const char *name);
+void loadtime_done(void *arg,int index,char *record);
+int index_cmp_uint(const void *a,const void *b);
+int index_cmp_pair(const void *a,const void *b);
+void index_found(struct dups_walk_state *w,const char *path,const char *data,off_t size);
+char *index_examine(const char *name);
+struct index_image *index_image(struct index_state *st,const char *name);
+void index_free_files(struct index_image *im);
+void index_done(void *arg,int index,char *record);
+int index_open(struct index_map *m,const char *filename);
+void index_close(struct index_map *m);
+void index_load(struct index_state *st,const char *filename);
+int index_write(struct index_state *st,const char *filename);
+int index_query(unsigned char variant[INDEX_VARIANTS][INDEX_QUERY_MAX],const char *form[INDEX_VARIANTS],int *len);
+void search_found(struct dups_walk_state *w,const char *path,const char *data,off_t size);
+char *search_examine(const char *name);
+void search_done(void *arg,int index,char *record);
+
+/*
+ * Functions
+ */
+
+/*
+ * batch_add()
+ */
+void batch_add(struct batch_list *list,const char *name)
+{
+   if ( list->count == list->alloc )
+   {
+      list->alloc = list->alloc ? list->alloc * 2 : 64;
+      list->names = realloc(list->names,list->alloc * sizeof(*list->names));
+   }
+   list->names[list->count++] = strdup(name);
+}
+
+/*
+ * batch_expand()
+ *
+ * Add a file, or every file under a directory in sorted order
+ */
+void batch_expand(struct batch_list *list,const char *path)
+{
+   struct stat sb;
+   struct dirent **ents;
+   int n;
+
+   if ( stat(path,&sb) == 0 && S_ISDIR(sb.st_mode) )
+   {
+      n = scandir(path,&ents,NULL,alphasort);
+      if ( n < 0 )
+      {
+         fprintf(stderr,"Unable to read directory %s\n",path);
+         return;
+      }
+      for ( int i=0;i<n;++i )
+      {
+         if ( ents[i]->d_name[0] != '.' )
+         {
+            char *sub = malloc(strlen(path)+strlen(ents[i]->d_name)+2);
+            sprintf(sub,"%s/%s",path,ents[i]->d_name);
+            batch_expand(list,sub);
+            free(sub);
+         }
+         free(ents[i]);
+      }
+      free(ents);
+      return;
+   }
+   batch_add(list,path);
+}
+
+/*
+ * batch_files()
+ *
+ * batch_expand() for other modules: set *names to the image files for a
+ * path; returns the count
+ */
+int batch_files(const char *path,char ***names)
+{
+   struct batch_list list = {0,0,NULL};
+
+   batch_expand(&list,path);
+   *names = list.names;
+   return list.count;
+}
+
+/*
+ * batch_quote()
+ *
+ * Append a quoted string in the selected format; returns the new end
+ * Strings are truncated to keep the record within BATCH_RECORD_MAX.
+ */
+char *batch_quote(char *b,const char *s)
+{
+   int json = strcmp(options.batch,"csv") != 0;
+
+   *b++ = '"';
+   for ( int i=0;s[i] && i<256;++i )
+   {
+      unsigned char c = s[i];
+      if ( json && ( c == '"' || c == '\\' ) ) *b++ = '\\';
+      else if ( !json && c == '"' ) *b++ = '"';
+      if ( json && c < 0x20 ) b+=sprintf(b,"\\u%04x",c);
+      else *b++ = c;
+   }
+   *b++ = '"';
+   *b = 0;
+   return b;
+}
+
+/*
+ * batch_record()
+ *
+ * Examine one image in master_atrfs and return its record
+ */
+char *batch_record(const char *name)
+{
+   char *buf = malloc(BATCH_RECORD_MAX);
+   char *b = buf;
+   int json = strcmp(options.batch,"csv") != 0;
+   int r;
+
+   memset(&master_atrfs,0,sizeof(master_atrfs));
+   options.filename = name;
+   r = atr_preinit();
+
+   if ( json ) b+=sprintf(b,"{\"file\":");
+   b = batch_quote(b,name);
+   if ( r )
+   {
+      if ( json ) b+=sprintf(b,",\"error\":\"not a disk image\"}\n");
+      else b+=sprintf(b,",,,,,,,,,,,,,\"not a disk image\"\n");
+      return buf;
+   }
+
+   struct atrfs *atrfs = &master_atrfs;
+   const struct fs_ops *ops = fs_ops[atrfs->fstype];
+   struct statvfs sv;
+   long free_bytes = -1;
+   memset(&sv,0,sizeof(sv));
+   if ( ops->fs_statfs && (ops->fs_statfs)(atrfs,"/",&sv) == 0 ) free_bytes = (long)sv.f_bfree * sv.f_bsize;
+
+   struct sector1 *sec1 = atrfs->fstype == ATR_APT ? NULL : SECTOR(1);
+   const char *known = atrfs->fstype == ATR_APT ? NULL : known_disk_name(atrfs);
+   long ns = atrfs->detect.score_ns;
+   for ( int i=0;i<ATR_MAXFSTYPE;++i ) ns += atrfs->detect.ns[i];
+
+   if ( json )
+   {
+      b+=sprintf(b,",\"type\":");
+      b = batch_quote(b,ops->name);
+      b+=sprintf(b,",\"fstype\":");
+      b = batch_quote(b,ops->fstype ? ops->fstype : "");
+      b+=sprintf(b,",\"sectors\":%d,\"sector_size\":%d,\"short_sectors\":%d,\"free_bytes\":%ld",
+                 atrfs->sectors,atrfs->sectorsize,atrfs->shortsectors,free_bytes);
+      if ( sec1 ) b+=sprintf(b,",\"boot_sectors\":%d,\"boot_addr\":%d,\"init_addr\":%d,\"exec_addr\":%d",
+                             sec1->boot_sectors,BYTES2(sec1->boot_addr),BYTES2(sec1->dos_ini),BYTES2(sec1->exec_addr));
+      b+=sprintf(b,",\"known_disk\":");
+      if ( known ) b = batch_quote(b,known);
+      else b+=sprintf(b,"null");
+      b+=sprintf(b,",\"detect_us\":%.1f}\n",ns/1000.0);
+      return buf;
+   }
+
+   b+=sprintf(b,",");
+   b = batch_quote(b,ops->name);
+   b+=sprintf(b,",%s,%d,%d,%d,%ld,",ops->fstype ? ops->fstype : "",
+              atrfs->sectors,atrfs->sectorsize,atrfs->shortsectors,free_bytes);
+   if ( sec1 ) b+=sprintf(b,"%d,%d,%d,%d,",sec1->boot_sectors,BYTES2(sec1->boot_addr),BYTES2(sec1->dos_ini),BYTES2(sec1->exec_addr));
+   else b+=sprintf(b,",,,,");
+   if ( known ) b = batch_quote(b,known);
+   b+=sprintf(b,",%.1f,\n",ns/1000.0);
+   return buf;
+}
+
+/*
+ * batch_worker()
+ *
+ * Child process: write the record for one image to the pipe and exit
+ */
+void batch_worker(const char *name,int fd,char *(*examine)(const char *name))
+{
+   // Detection warnings would interleave between records
+   if ( !options.debug )
+   {
+      int null = open("/dev/null",O_WRONLY);
+      if ( null >= 0 ) dup2(null,STDERR_FILENO);
+   }
+   char *rec = examine(name);
+   if ( !rec ) _exit(1);
+   size_t len = strlen(rec);
+   for ( size_t done=0;done<len; )
+   {
+      ssize_t n = write(fd,rec+done,len-done);
+      if ( n <= 0 ) _exit(1);
+      done += n;
+   }
+   _exit(0);
+}
+
+/*
+ * batch_jobs()
+ *
+ * Number of workers to run for 'count' images
+ */
+int batch_jobs(int count)
+{
+   int jobs = options.jobs;
+
+   if ( jobs <= 0 ) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   if ( jobs <= 0 ) jobs = 1;
+   if ( jobs > count ) jobs = count;
+   return jobs;
+}
+
+/*
+ * batch_run()
+ *
+ * Run examine() on each image in a pool of forked workers, passing each
+ * worker's output to done() in the parent as it finishes.  Output is read
+ * as it arrives, so a worker can return any amount of text.
+ * Returns the number of workers that failed.
+ */
+int batch_run(struct batch_list *list,int jobs,char *(*examine)(const char *name),batch_done_t done,void *arg)
+{
+   struct batch_job *job = calloc(jobs,sizeof(*job));
+   struct pollfd *pfd = calloc(jobs,sizeof(*pfd));
+   int next = 0, running = 0, failed = 0;
+
+   while ( next < list->count || running )
+   {
+      // Start workers on idle slots
+      for ( int j=0;j<jobs && next<list->count;++j )
+      {
+         int p[2];
+         if ( job[j].pid ) continue;
+         if ( pipe(p) < 0 )
+         {
+            perror("pipe");
+            exit(1);
+         }
+         fflush(stdout); // Don't let the worker inherit buffered output
+         pid_t pid = fork();
+         if ( pid < 0 )
+         {
+            perror("fork");
+            exit(1);
+         }
+         if ( pid == 0 )
+         {
+            close(p[0]);
+            batch_worker(list->names[next],p[1],examine);
+         }
+         close(p[1]);
+         job[j].pid = pid;
+         job[j].fd = p[0];
+         job[j].index = next++;
+         job[j].len = 0;
+         ++running;
+      }
+
+      // Wait for output from any worker
+      int n = 0;
+      for ( int j=0;j<jobs;++j )
+      {
+         if ( !job[j].pid ) continue;
+         pfd[n].fd = job[j].fd;
+         pfd[n].events = POLLIN;
+         pfd[n].revents = 0;
+         ++n;
+      }
+      if ( poll(pfd,n,-1) < 0 )
+      {
+         if ( errno == EINTR ) continue;
+         perror("poll");
+         exit(1);
+      }
+
+      // Collect it, and finish workers that closed their pipe
+      for ( int j=0;j<jobs;++j )
+      {
+         int k;
+         if ( !job[j].pid ) continue;
+         for ( k=0;k<n && pfd[k].fd != job[j].fd;++k ) ;
+         if ( k == n || !pfd[k].revents ) continue;
+         if ( job[j].alloc - job[j].len < 4096 )
+         {
+            job[j].alloc = job[j].alloc ? job[j].alloc * 2 : 16384;
+            job[j].buf = realloc(job[j].buf,job[j].alloc);
+         }
+         ssize_t r = read(job[j].fd,job[j].buf+job[j].len,job[j].alloc-job[j].len-1);
+         if ( r < 0 && errno == EINTR ) continue;
+         if ( r > 0 )
+         {
+            job[j].len += r;
+            continue;
+         }
+         int status;
+         close(job[j].fd);
+         waitpid(job[j].pid,&status,0);
+         job[j].pid = 0;
+         --running;
+         if ( !WIFEXITED(status) || WEXITSTATUS(status) )
+         {
+            ++failed;
+            done(arg,job[j].index,NULL);
+            continue;
+         }
+         if ( !job[j].buf ) job[j].buf = malloc(1);
+         job[j].buf[job[j].len] = 0;
+         done(arg,job[j].index,job[j].buf);
+         job[j].buf = NULL;
+         job[j].alloc = 0;
+      }
+   }
+   for ( int j=0;j<jobs;++j ) free(job[j].buf);
+   free(job);
+   free(pfd);
+   return failed;
+}
+
+/*
+ * batch_info_done()
+ *
+ * Print records that are ready, in the order the images were given
+ */
+void batch_info_done(void *arg,int index,char *record)
+{
+   struct batch_info_state *st = arg;
+
+   if ( !record )
+   {
+      char *b = record = malloc(BATCH_RECORD_MAX);
+      if ( strcmp(options.batch,"csv") == 0 )
+      {
+         b = batch_quote(b,st->list->names[index]);
+         sprintf(b,",,,,,,,,,,,,,\"examination failed\"\n");
+      }
+      else
+      {
+         b+=sprintf(b,"{\"file\":");
+         b = batch_quote(b,st->list->names[index]);
+         sprintf(b,",\"error\":\"examination failed\"}\n");
+      }
+      ++st->failed;
+   }
+   st->records[index] = record;
+   while ( st->printed < st->list->count && st->records[st->printed] )
+   {
+      fputs(st->records[st->printed],stdout);
+      free(st->records[st->printed]);
+      ++st->printed;
+   }
+   fflush(stdout);
+}
+
+/*
+ * batch_info()
+ *
+ * Entry point for --batch: examine every named image or directory
+ */
+int batch_info(int count,char *names[])
+{
+   struct batch_list list = {0,0,NULL};
+   struct batch_info_state st;
+
+   if ( strcmp(options.batch,"json") != 0 && strcmp(options.batch,"csv") != 0 )
+   {
+      fprintf(stderr,"Unknown --batch format: %s (use json or csv)\n",options.batch);
+      return 1;
+   }
+   for ( int i=0;i<count;++i ) batch_expand(&list,names[i]);
+   if ( !list.count )
+   {
+      fprintf(stderr,"No images specified for --batch\n");
+      return 1;
+   }
+
+   known_index_build(); // Once, rather than in every worker
+   memset(&st,0,sizeof(st));
+   st.list = &list;
+   st.records = calloc(list.count,sizeof(*st.records));
+
+   if ( strcmp(options.batch,"csv") == 0 )
+   {
+      printf("file,type,fstype,sectors,sector_size,short_sectors,free_bytes,boot_sectors,boot_addr,init_addr,exec_addr,known_disk,detect_us,error\n");
+   }
+   batch_run(&list,batch_jobs(list.count),batch_record,batch_info_done,&st);
+
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d images, %d failed\n",__FUNCTION__,list.count,st.failed);
+   for ( int i=0;i<list.count;++i ) free(list.names[i]);
+   free(st.records);
+   free(list.names);
+   return 0;
+}
+
+/*
+ * batch_reserve()
+ *
+ * Make room to append 'more' bytes to a worker's output
+ */
+void batch_reserve(struct dups_walk_state *w,size_t more)
+{
+   if ( w->alloc - w->len < more + 1 )
+   {
+      w->alloc = w->alloc * 2 + more + 1;
+      w->out = realloc(w->out,w->alloc);
+   }
+}
+
+/*
+ * dups_hex()
+ */
+void dups_hex(char *hex,const unsigned char *digest)
+{
+   for ( int i=0;i<16;++i ) sprintf(hex+i*2,"%02x",digest[i]);
+}
+
+/*
+ * dups_file()
+ *
+ * tree_walk() callback: call w->found() with the contents of a file
+ */
+int dups_file(void *arg,const char *path,const struct stat *st)
+{
+   struct dups_walk_state *w = arg;
+
+   if ( S_ISREG(st->st_mode) && st->st_size > 0 )
+   {
+      char *data = malloc(st->st_size);
+      off_t got = 0;
+      while ( data && got < st->st_size )
+      {
+         int r = (generic_ops.fs_read)(&master_atrfs,path,data+got,st->st_size-got,got);
+         if ( r <= 0 ) break;
+         got += r;
+      }
+      if ( data && got == st->st_size ) (w->found)(w,path,data,got);
+      free(data);
+   }
+   return 0;
+}
+
+/*
+ * dups_found()
+ *
+ * Worker: append a line for a file to w->out
+ *
+ * Two checksums are kept per file: one over the whole file, and one with
+ * trailing padding (0x00, 0xff, or 0x1a bytes) removed.  Files that differ
+ * only in the second are reported as near-duplicates.
+ */
+void dups_found(struct dups_walk_state *w,const char *path,const char *data,off_t size)
+{
+   unsigned char digest[16];
+   char md5[33],tmd5[33];
+   off_t trim = size;
+
+   MD5((const unsigned char *)data,size,digest);
+   dups_hex(md5,digest);
+   while ( trim > 0 && ( (unsigned char)data[trim-1] == 0x00 || (unsigned char)data[trim-1] == 0xff || data[trim-1] == 0x1a ) ) --trim;
+   if ( trim )
+   {
+      MD5((const unsigned char *)data,trim,digest);
+      dups_hex(tmd5,digest);
+   }
+   else strcpy(tmd5,"-");
+   batch_reserve(w,strlen(path) + 100);
+   w->len += sprintf(w->out+w->len,"%ld %s %s %s\n",(long)size,md5,tmd5,path);
+}
+
+/*
+ * dups_examine()
+ *
+ * Worker: list every file in one image with its checksums
+ */
+char *dups_examine(const char *name)
+{
+   struct dups_walk_state w;
+
+   memset(&w,0,sizeof(w));
+   w.alloc = 4096;
+   w.out = calloc(1,w.alloc);
+   w.found = dups_found;
+   memset(&master_atrfs,0,sizeof(master_atrfs));
+   options.filename = name;
+   options.nodotfiles = 1;
+   if ( atr_preinit() ) return w.out; // Not an image: no files
+   tree_walk(&master_atrfs,dups_file,&w);
+   return w.out;
+}
+
+/*
+ * dups_image()
+ *
+ * Find or add an image
+ */
+struct dups_image *dups_image(struct dups_state *st,const char *name)
+{
+   for ( int i=st->count-1;i>=0;--i )
+   {
+      if ( strcmp(st->image[i].name,name) == 0 ) return &st->image[i];
+   }
+   if ( st->count == st->alloc )
+   {
+      st->alloc = st->alloc ? st->alloc * 2 : 64;
+      st->image = realloc(st->image,st->alloc * sizeof(*st->image));
+   }
+   struct dups_image *im = &st->image[st->count++];
+   memset(im,0,sizeof(*im));
+   im->name = strdup(name);
+   return im;
+}
+
+/*
+ * dups_cache_read()
+ *
+ * Load per-image results from an earlier run:
+ *    I <size> <mtime seconds> <mtime nanoseconds> <image path>
+ * followed by the image's file lines
+ */
+void dups_cache_read(struct dups_state *st,const char *filename)
+{
+   FILE *f = fopen(filename,"r");
+   char line[4096];
+   struct dups_image *im = NULL;
+   size_t len = 0, alloc = 0;
+
+   if ( !f ) return; // First run
+   while ( fgets(line,sizeof(line),f) )
+   {
+      long long size,sec;
+      long nsec;
+      int n;
+
+      if ( line[0] == '#' ) continue;
+      if ( line[0] == 'I' && sscanf(line,"I %lld %lld %ld %n",&size,&sec,&nsec,&n) == 3 )
+      {
+         line[strcspn(line,"\n")] = 0;
+         im = dups_image(st,line+n);
+         im->size = size;
+         im->mtime.tv_sec = sec;
+         im->mtime.tv_nsec = nsec;
+         free(im->files);
+         im->files = calloc(1,1);
+         len = 0;
+         alloc = 1;
+         continue;
+      }
+      if ( !im ) continue;
+      n = strlen(line);
+      if ( len + n + 1 > alloc )
+      {
+         alloc = (len + n + 1) * 2;
+         im->files = realloc(im->files,alloc);
+      }
+      strcpy(im->files+len,line);
+      len += n;
+   }
+   fclose(f);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d images cached in %s\n",__FUNCTION__,st->count,filename);
+}
+
+/*
+ * dups_cache_write()
+ *
+ * Save per-image results, keeping entries for images not named this run
+ */
+void dups_cache_write(struct dups_state *st,const char *filename)
+{
+   char *tmp = malloc(strlen(filename)+5);
+   FILE *f;
+
+   sprintf(tmp,"%s.tmp",filename);
+   f = fopen(tmp,"w");
+   if ( !f )
+   {
+      fprintf(stderr,"Unable to write duplicate cache %s\n",tmp);
+      free(tmp);
+      return;
+   }
+   fprintf(f,"# atrfs --dups cache\n");
+   for ( int i=0;i<st->count;++i )
+   {
+      if ( !st->image[i].files ) continue; // Failed this run
+      fprintf(f,"I %lld %lld %ld %s\n",(long long)st->image[i].size,(long long)st->image[i].mtime.tv_sec,st->image[i].mtime.tv_nsec,st->image[i].name);
+      fputs(st->image[i].files,f);
+   }
+   if ( fclose(f) == 0 ) rename(tmp,filename);
+   else unlink(tmp);
+   free(tmp);
+}
+
+/*
+ * dups_done()
+ */
+void dups_done(void *arg,int index,char *record)
+{
+   struct dups_state *st = arg;
+   struct dups_image *im = &st->image[st->pending[index]];
+
+   if ( !record ) fprintf(stderr,"Unable to examine %s\n",im->name);
+   free(im->files);
+   im->files = record;
+}
+
+/*
+ * dups_cmp_md5()
+ */
+int dups_cmp_md5(const void *a,const void *b)
+{
+   const struct dups_file *fa = a, *fb = b;
+   int r = strcmp(fa->md5,fb->md5);
+   if ( r ) return r;
+   if ( fa->image != fb->image ) return fa->image - fb->image;
+   return strcmp(fa->path,fb->path);
+}
+
+/*
+ * dups_cmp_tmd5()
+ */
+int dups_cmp_tmd5(const void *a,const void *b)
+{
+   const struct dups_file *fa = a, *fb = b;
+   int r = strcmp(fa->tmd5,fb->tmd5);
+   if ( r ) return r;
+   return dups_cmp_md5(a,b);
+}
+
+/*
+ * dups_print()
+ */
+void dups_print(struct dups_state *st,struct dups_file *f,int first,int last)
+{
+   for ( int i=first;i<=last;++i )
+   {
+      printf("   %s:%s",st->image[f[i].image].name,f[i].path);
+      if ( strcmp(f[i].md5,f[first].md5) || strcmp(f[last].md5,f[first].md5) ) printf("  (%ld bytes, %.8s)",f[i].size,f[i].md5);
+      printf("\n");
+   }
+}
+
+/*
+ * dups_report()
+ *
+ * Entry point for --dups: find duplicate files across images
+ *
+ * Files are compared by their contents as read through the file system,
+ * so copies match even when their sectors are laid out differently.  With
+ * --dupcache=<file>, images whose size and time stamp are unchanged since
+ * the last run are not read again.
+ */
+int dups_report(int count,char *names[])
+{
+   struct batch_list list = {0,0,NULL};
+   struct batch_list work = {0,0,NULL};
+   struct dups_state st;
+   struct dups_file *f = NULL;
+   int nfiles = 0, falloc = 0;
+   int groups = 0, near = 0;
+
+   for ( int i=0;i<count;++i ) batch_expand(&list,names[i]);
+   if ( !list.count )
+   {
+      fprintf(stderr,"No images specified for --dups\n");
+      return 1;
+   }
+   memset(&st,0,sizeof(st));
+   if ( options.dupcache ) dups_cache_read(&st,options.dupcache);
+
+   // Queue images that aren't cached or have changed
+   st.pending = calloc(list.count,sizeof(*st.pending));
+   for ( int i=0;i<list.count;++i )
+   {
+      struct stat sb;
+      struct dups_image *im = dups_image(&st,list.names[i]);
+      if ( im->used ) continue; // Named twice
+      im->used = 1;
+      if ( stat(list.names[i],&sb) ) memset(&sb,0,sizeof(sb));
+      if ( im->files && im->size == sb.st_size && im->mtime.tv_sec == sb.st_mtim.tv_sec && im->mtime.tv_nsec == sb.st_mtim.tv_nsec ) continue;
+      im->size = sb.st_size;
+      im->mtime = sb.st_mtim;
+      free(im->files);
+      im->files = NULL;
+      st.pending[work.count] = im - st.image;
+      batch_add(&work,list.names[i]);
+   }
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d images, %d to examine\n",__FUNCTION__,list.count,work.count);
+   if ( work.count ) batch_run(&work,batch_jobs(work.count),dups_examine,dups_done,&st);
+   if ( options.dupcache ) dups_cache_write(&st,options.dupcache);
+
+   // Gather the files from the images named this run
+   for ( int i=0;i<st.count;++i )
+   {
+      char *line = st.image[i].files;
+      if ( !st.image[i].used || !line ) continue;
+      while ( *line )
+      {
+         char *eol = strchr(line,'\n');
+         int n;
+         if ( !eol ) break;
+         *eol = 0;
+         if ( nfiles == falloc )
+         {
+            falloc = falloc ? falloc * 2 : 1024;
+            f = realloc(f,falloc * sizeof(*f));
+         }
+         if ( sscanf(line,"%ld %32s %32s %n",&f[nfiles].size,f[nfiles].md5,f[nfiles].tmd5,&n) == 3 )
+         {
+            f[nfiles].image = i;
+            f[nfiles].path = line+n;
+            ++nfiles;
+         }
+         line = eol+1;
+      }
+   }
+
+   // Exact duplicates
+   qsort(f,nfiles,sizeof(*f),dups_cmp_md5);
+   for ( int i=0,j;i<nfiles;i=j )
+   {
+      for ( j=i+1;j<nfiles && strcmp(f[i].md5,f[j].md5) == 0;++j ) ;
+      if ( j - i < 2 ) continue;
+      if ( !groups++ ) printf("Duplicate files:\n");
+      printf("%s: %d copies, %ld bytes, md5 %s\n",strrchr(f[i].path,'/')+1,j-i,f[i].size,f[i].md5);
+      dups_print(&st,f,i,j-1);
+   }
+
+   // Near-duplicates: same contents once trailing padding is removed
+   qsort(f,nfiles,sizeof(*f),dups_cmp_tmd5);
+   for ( int i=0,j;i<nfiles;i=j )
+   {
+      for ( j=i+1;j<nfiles && strcmp(f[i].tmd5,f[j].tmd5) == 0;++j ) ;
+      if ( strcmp(f[i].tmd5,"-") == 0 || strcmp(f[i].md5,f[j-1].md5) == 0 ) continue; // Padding only, or all identical
+      if ( !near++ ) printf("%sNear-duplicates (differ only in trailing padding):\n",groups?"\n":"");
+      printf("%s: %d copies\n",strrchr(f[i].path,'/')+1,j-i);
+      dups_print(&st,f,i,j-1);
+   }
+   if ( !groups && !near ) printf("No duplicate files found in %d images\n",list.count);
+
+   free(f);
+   for ( int i=0;i<st.count;++i )
+   {
+      free(st.image[i].name);
+      free(st.image[i].files);
+   }
+   for ( int i=0;i<list.count;++i ) free(list.names[i]);
+   for ( int i=0;i<work.count;++i ) free(work.names[i]);
+   free(list.names);
+   free(work.names);
+   free(st.image);
+   free(st.pending);
+   return 0;
+}
+
+/*
+ * check_examine()
+ *
+ * Worker: check one image.  The first line is the count of problems not
+ * repaired and the summary; the report follows.
+ */
+char *check_examine(const char *name)
+{
+   char *report,*out;
+   int repaired;
+
+   memset(&master_atrfs,0,sizeof(master_atrfs));
+   options.filename = name;
+   if ( atr_preinit() ) return strdup("0\tnot a disk image; skipped\n");
+
+   struct atrfs *atrfs = &master_atrfs;
+   int left = check_image(atrfs,&report,&repaired);
+   const char *fsname = fs_ops[atrfs->fstype] ? fs_ops[atrfs->fstype]->name : "unknown";
+   out = malloc(128 + strlen(fsname) + (report ? strlen(report) : 0));
+   char *b = out + sprintf(out,"%d\t%s: ",left > 0 ? left : 0,fsname);
+   if ( left < 0 ) b += sprintf(b,"no consistency checks for this file system");
+   else if ( left ) b += sprintf(b,"%d problem%s not repaired",left,left==1?"":"s");
+   if ( left > 0 && repaired ) b += sprintf(b,", ");
+   if ( repaired ) b += sprintf(b,"%d problem%s repaired",repaired,repaired==1?"":"s");
+   if ( !left && !repaired ) b += sprintf(b,"clean");
+   sprintf(b,"\n%s",report ? report : "");
+   free(report);
+   return out;
+}
+
+/*
+ * check_done()
+ *
+ * Print reports that are ready, in the order the images were given
+ */
+void check_done(void *arg,int index,char *record)
+{
+   struct check_state *st = arg;
+
+   if ( !record ) record = strdup("1\tcheck failed\n");
+   st->reports[index] = record;
+   while ( st->printed < st->list->count && st->reports[st->printed] )
+   {
+      char *r = st->reports[st->printed];
+      char *line = strchr(r,'\t')+1;
+
+      if ( atoi(r) ) ++st->unrepaired;
+      printf("%s: ",st->list->names[st->printed]);
+      for ( int first=1;*line;first=0 )
+      {
+         char *eol = strchr(line,'\n');
+         if ( !eol ) break;
+         printf("%s%.*s\n",first?"":"   ",(int)(eol-line),line);
+         line = eol+1;
+      }
+      free(r);
+      ++st->printed;
+   }
+   fflush(stdout);
+}
+
+/*
+ * check_report()
+ *
+ * Entry point for --check: check every named image or directory in
+ * parallel.  Exit status is non-zero if any problems were left.
+ */
+int check_report(int count,char *names[])
+{
+   struct batch_list list = {0,0,NULL};
+   struct check_state st;
+
+   for ( int i=0;i<count;++i ) batch_expand(&list,names[i]);
+   if ( !list.count )
+   {
+      fprintf(stderr,"No images specified for --check\n");
+      return 1;
+   }
+   memset(&st,0,sizeof(st));
+   st.list = &list;
+   st.reports = calloc(list.count,sizeof(*st.reports));
+   options.nodotfiles = 1;
+   batch_run(&list,batch_jobs(list.count),check_examine,check_done,&st);
+
+   if ( list.count > 1 ) printf("%d images checked; %d with problems left\n",list.count,st.unrepaired);
+   for ( int i=0;i<list.count;++i ) free(list.names[i]);
+   free(st.reports);
+   free(list.names);
+   return st.unrepaired ? 1 : 0;
+}
+
+/*
+ * loadtime_examine()
+ *
+ * Worker: estimate load times for one image
+ */
+char *loadtime_examine(const char *name)
+{
+   memset(&master_atrfs,0,sizeof(master_atrfs));
+   options.filename = name;
+   if ( atr_preinit() ) return strdup("not a disk image; skipped\n");
+   char *report = loadtime_image(&master_atrfs);
+   if ( !report ) return strdup("no sector map for this file system\n");
+   return report;
+}
+
+/*
+ * loadtime_done()
+ *
+ * Print reports that are ready, in the order the images were given
+ */
+void loadtime_done(void *arg,int index,char *record)
+{
+   struct loadtime_state *st = arg;
+
+   if ( !record ) record = strdup("estimate failed\n");
+   st->reports[index] = record;
+   while ( st->printed < st->list->count && st->reports[st->printed] )
+   {
+      char *line = st->reports[st->printed];
+
+      printf("%s: ",st->list->names[st->printed]);
+      for ( int first=1;*line;first=0 )
+      {
+         char *eol = strchr(line,'\n');
+         if ( !eol ) break;
+         printf("%s%.*s\n",first?"":"   ",(int)(eol-line),line);
+         line = eol+1;
+      }
+      free(st->reports[st->printed]);
+      ++st->printed;
+   }
+   fflush(stdout);
+}
+
+/*
+ * loadtime_report()
+ *
+ * Entry point for --loadtime: estimate how long each file in each image
+ * takes to load on a real drive
+ */
+int loadtime_report(int count,char *names[])
+{
+   struct batch_list list = {0,0,NULL};
+   struct loadtime_state st;
+
+   for ( int i=0;i<count;++i ) batch_expand(&list,names[i]);
+   if ( !list.count )
+   {
+      fprintf(stderr,"No images specified for --loadtime\n");
+      return 1;
+   }
+   memset(&st,0,sizeof(st));
+   st.list = &list;
+   st.reports = calloc(list.count,sizeof(*st.reports));
+   options.nodotfiles = 1;
+   batch_run(&list,batch_jobs(list.count),loadtime_examine,loadtime_done,&st);
+
+   for ( int i=0;i<list.count;++i ) free(list.names[i]);
+   free(st.reports);
+   free(list.names);
+   return 0;
+}
+
+/*
+ * index_cmp_uint()
+ */
+int index_cmp_uint(const void *a,const void *b)
+{
+   unsigned int ua = *(const unsigned int *)a, ub = *(const unsigned int *)b;
+   return ( ua > ub ) - ( ua < ub );
+}
+
+/*
+ * index_cmp_pair()
+ *
+ * Sort trigram and file number pairs
+ */
+int index_cmp_pair(const void *a,const void *b)
+{
+   unsigned long long ua = *(const unsigned long long *)a, ub = *(const unsigned long long *)b;
+   return ( ua > ub ) - ( ua < ub );
+}
+
+/*
+ * index_found()
+ *
+ * Worker: append a file's size and path, then its distinct trigrams in
+ * hex on the next line
+ */
+void index_found(struct dups_walk_state *w,const char *path,const char *data,off_t size)
+{
+   const unsigned char *d = (const unsigned char *)data;
+   unsigned int *tri = NULL;
+   int n = 0;
+
+   if ( size >= 3 )
+   {
+      tri = malloc((size-2) * sizeof(*tri));
+      for ( off_t i=0;i+2<size;++i ) tri[i] = d[i] << 16 | d[i+1] << 8 | d[i+2];
+      qsort(tri,size-2,sizeof(*tri),index_cmp_uint);
+      for ( off_t i=0;i<size-2;++i )
+      {
+         if ( !n || tri[i] != tri[n-1] ) tri[n++] = tri[i];
+      }
+   }
+   batch_reserve(w,strlen(path) + 40 + n * 6);
+   w->len += sprintf(w->out+w->len,"F %ld %d %s\n",(long)size,n,path);
+   for ( int i=0;i<n;++i ) w->len += sprintf(w->out+w->len,"%06x",tri[i]);
+   w->len += sprintf(w->out+w->len,"\n");
+   free(tri);
+}
+
+/*
+ * index_examine()
+ *
+ * Worker: list every file in one image with its trigrams
+ */
+char *index_examine(const char *name)
+{
+   struct dups_walk_state w;
+
+   memset(&w,0,sizeof(w));
+   w.alloc = 4096;
+   w.out = calloc(1,w.alloc);
+   w.found = index_found;
+   memset(&master_atrfs,0,sizeof(master_atrfs));
+   options.filename = name;
+   options.nodotfiles = 1;
+   if ( atr_preinit() ) return w.out; // Not an image: no files
+   tree_walk(&master_atrfs,dups_file,&w);
+   return w.out;
+}
+
+/*
+ * index_image()
+ *
+ * Find or add an image
+ */
+struct index_image *index_image(struct index_state *st,const char *name)
+{
+   for ( int i=st->count-1;i>=0;--i )
+   {
+      if ( strcmp(st->image[i].name,name) == 0 ) return &st->image[i];
+   }
+   if ( st->count == st->alloc )
+   {
+      st->alloc = st->alloc ? st->alloc * 2 : 64;
+      st->image = realloc(st->image,st->alloc * sizeof(*st->image));
+   }
+   struct index_image *im = &st->image[st->count++];
+   memset(im,0,sizeof(*im));
+   im->name = strdup(name);
+   return im;
+}
+
+/*
+ * index_free_files()
+ */
+void index_free_files(struct index_image *im)
+{
+   for ( int i=0;i<im->nfiles;++i )
+   {
+      free(im->files[i].path);
+      free(im->files[i].tri);
+   }
+   free(im->files);
+   im->files = NULL;
+   im->nfiles = 0;
+   im->current = 0;
+}
+
+/*
+ * index_done()
+ *
+ * Parse the file list from index_found()
+ */
+void index_done(void *arg,int index,char *record)
+{
+   struct index_state *st = arg;
+   struct index_image *im = &st->image[st->pending[index]];
+   char *line = record;
+   int alloc = 0;
+
+   if ( !record )
+   {
+      fprintf(stderr,"Unable to examine %s\n",im->name);
+      return;
+   }
+   while ( *line )
+   {
+      char *eol = strchr(line,'\n');
+      char *hex;
+      long size;
+      int ntri,n;
+
+      if ( !eol || sscanf(line,"F %ld %d %n",&size,&ntri,&n) != 2 ) break;
+      *eol = 0;
+      hex = eol+1;
+      eol = strchr(hex,'\n');
+      if ( !eol || eol - hex != ntri * 6 ) break;
+      if ( im->nfiles == alloc )
+      {
+         alloc = alloc ? alloc * 2 : 16;
+         im->files = realloc(im->files,alloc * sizeof(*im->files));
+      }
+      struct index_file *f = &im->files[im->nfiles++];
+      f->path = strdup(line+n);
+      f->size = size;
+      f->ntri = ntri;
+      f->tri = malloc((ntri ? ntri : 1) * sizeof(*f->tri));
+      for ( int i=0;i<ntri;++i )
+      {
+         char t[7];
+         memcpy(t,hex+i*6,6);
+         t[6] = 0;
+         f->tri[i] = strtoul(t,NULL,16);
+      }
+      line = eol+1;
+   }
+   // Opening an image can fix up its header, so take the time stamp now
+   struct stat sb;
+   if ( stat(im->name,&sb) == 0 )
+   {
+      im->size = sb.st_size;
+      im->mtime = sb.st_mtim;
+   }
+   im->current = 1;
+   free(record);
+}
+
+/*
+ * index_open()
+ *
+ * Map an index file and find its tables; returns non-zero if it can't
+ * be read or is damaged
+ */
+int index_open(struct index_map *m,const char *filename)
+{
+   struct stat sb;
+   int fd = open(filename,O_RDONLY);
+   unsigned char *p,*end;
+
+   memset(m,0,sizeof(*m));
+   if ( fd < 0 ) return 1;
+   if ( fstat(fd,&sb) || sb.st_size < 24 )
+   {
+      close(fd);
+      return 1;
+   }
+   m->len = sb.st_size;
+   m->map = mmap(NULL,m->len,PROT_READ,MAP_PRIVATE,fd,0);
+   close(fd);
+   if ( m->map == MAP_FAILED )
+   {
+      m->map = NULL;
+      return 1;
+   }
+   end = m->map + m->len;
+   if ( memcmp(m->map,INDEX_MAGIC,8) != 0 ) goto damaged;
+   m->images = diff_get(m->map+8,4);
+   m->files = diff_get(m->map+12,4);
+   m->trigrams = diff_get(m->map+16,4);
+   m->postings = diff_get(m->map+20,4);
+   if ( m->images > m->len || m->files > m->len ) goto damaged;
+   m->image = malloc((m->images+1) * sizeof(*m->image));
+   m->file = malloc((m->files+1) * sizeof(*m->file));
+   p = m->map + 24;
+   for ( unsigned int i=0;i<m->images;++i )
+   {
+      if ( end - p < 18 || end - p < 18 + diff_get(p+16,2) ) goto damaged;
+      m->image[i] = p;
+      p += 18 + diff_get(p+16,2);
+   }
+   for ( unsigned int i=0;i<m->files;++i )
+   {
+      if ( end - p < 6 || end - p < 6 + diff_get(p+4,2) ) goto damaged;
+      m->file[i] = p;
+      p += 6 + diff_get(p+4,2);
+   }
+   if ( (size_t)(end - p) != (size_t)m->trigrams * 12 + (size_t)m->postings * 4 ) goto damaged;
+   m->dir = p;
+   m->post = p + (size_t)m->trigrams * 12;
+   // Searches depend on the trigram table being in order; postings are checked as they are used
+   for ( unsigned int i=0,next=0;i<m->trigrams;++i )
+   {
+      unsigned int first = diff_get(m->dir+i*12+4,4), count = diff_get(m->dir+i*12+8,4);
+      if ( first != next || count > m->postings - first || !count ) goto damaged;
+      if ( i && diff_get(m->dir+i*12,4) <= diff_get(m->dir+(i-1)*12,4) ) goto damaged;
+      next = first + count;
+      if ( i == m->trigrams-1 && next != m->postings ) goto damaged;
+   }
+   if ( !m->trigrams && m->postings ) goto damaged;
+   return 0;
+
+ damaged:
+   fprintf(stderr,"Index %s is damaged\n",filename);
+   index_close(m);
+   return 1;
+}
+
+/*
+ * index_close()
+ */
+void index_close(struct index_map *m)
+{
+   if ( m->map ) munmap(m->map,m->len);
+   free(m->image);
+   free(m->file);
+   memset(m,0,sizeof(*m));
+}
+
+/*
+ * index_load()
+ *
+ * Load the images from an existing index, turning the postings back
+ * into per-file trigram lists
+ */
+void index_load(struct index_state *st,const char *filename)
+{
+   struct index_map m;
+   struct index_file **byno;
+   unsigned int fileno = 0;
+
+   if ( index_open(&m,filename) ) return; // First run
+   byno = malloc((m.files+1) * sizeof(*byno));
+   for ( unsigned int i=0;i<m.images;++i )
+   {
+      const unsigned char *p = m.image[i];
+      char *name = strndup((const char *)p+18,diff_get(p+16,2));
+      struct index_image *im = index_image(st,name);
+      free(name);
+      if ( im->current ) // Listed twice; only in a damaged index
+      {
+         index_close(&m);
+         free(byno);
+         return;
+      }
+      im->size = diff_get(p,4);
+      im->mtime.tv_sec = diff_get(p+4,4);
+      im->mtime.tv_nsec = diff_get(p+8,4);
+      unsigned int nfiles = diff_get(p+12,4);
+      im->nfiles = ( nfiles > m.files - fileno ) ? m.files - fileno : nfiles;
+      im->files = calloc(im->nfiles+1,sizeof(*im->files));
+      for ( int j=0;j<im->nfiles;++j )
+      {
+         const unsigned char *f = m.file[fileno];
+         im->files[j].size = diff_get(f,4);
+         im->files[j].path = strndup((const char *)f+6,diff_get(f+4,2));
+         byno[fileno++] = &im->files[j];
+      }
+      im->current = 1;
+   }
+   for ( unsigned int i=0;i<m.postings;++i )
+   {
+      unsigned int f = diff_get(m.post+i*4,4);
+      if ( f < fileno ) ++byno[f]->ntri;
+   }
+   for ( unsigned int i=0;i<fileno;++i )
+   {
+      byno[i]->tri = malloc((byno[i]->ntri ? byno[i]->ntri : 1) * sizeof(*byno[i]->tri));
+      byno[i]->ntri = 0;
+   }
+   // The trigram table is in order, so each file's list comes out sorted
+   for ( unsigned int i=0;i<m.trigrams;++i )
+   {
+      unsigned int tri = diff_get(m.dir+i*12,4);
+      unsigned int first = diff_get(m.dir+i*12+4,4), count = diff_get(m.dir+i*12+8,4);
+      for ( unsigned int j=first;j<first+count;++j )
+      {
+         unsigned int f = diff_get(m.post+j*4,4);
+         if ( f < fileno ) byno[f]->tri[byno[f]->ntri++] = tri;
+      }
+   }
+   free(byno);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d images, %u files, %u trigrams in %s\n",__FUNCTION__,st->count,m.files,m.trigrams,filename);
+   index_close(&m);
+}
+
+/*
+ * index_write()
+ *
+ * Write the index for every image with current files
+ */
+int index_write(struct index_state *st,const char *filename)
+{
+   unsigned long long *pair;
+   size_t npairs = 0;
+   unsigned int nfiles = 0, nimages = 0, ntri = 0;
+   unsigned char b[24];
+   char *tmp = malloc(strlen(filename)+5);
+   FILE *f;
+   int r = 0;
+
+   for ( int i=0;i<st->count;++i )
+   {
+      if ( !st->image[i].current ) continue;
+      ++nimages;
+      for ( int j=0;j<st->image[i].nfiles;++j ) npairs += st->image[i].files[j].ntri;
+   }
+   pair = malloc((npairs+1) * sizeof(*pair));
+   npairs = 0;
+   for ( int i=0;i<st->count;++i )
+   {
+      if ( !st->image[i].current ) continue;
+      for ( int j=0;j<st->image[i].nfiles;++j,++nfiles )
+      {
+         struct index_file *fl = &st->image[i].files[j];
+         for ( int k=0;k<fl->ntri;++k ) pair[npairs++] = (unsigned long long)fl->tri[k] << 32 | nfiles;
+      }
+   }
+   qsort(pair,npairs,sizeof(*pair),index_cmp_pair);
+   for ( size_t i=0;i<npairs;++i )
+   {
+      if ( !i || pair[i] >> 32 != pair[i-1] >> 32 ) ++ntri;
+   }
+
+   sprintf(tmp,"%s.tmp",filename);
+   f = fopen(tmp,"w");
+   if ( !f )
+   {
+      fprintf(stderr,"Unable to write index %s\n",tmp);
+      free(tmp);
+      free(pair);
+      return 1;
+   }
+   memcpy(b,INDEX_MAGIC,8);
+   diff_put(b+8,nimages,4);
+   diff_put(b+12,nfiles,4);
+   diff_put(b+16,ntri,4);
+   diff_put(b+20,npairs,4);
+   r |= fwrite(b,24,1,f) != 1;
+   for ( int i=0;i<st->count;++i )
+   {
+      struct index_image *im = &st->image[i];
+      if ( !im->current ) continue;
+      diff_put(b,im->size,4);
+      diff_put(b+4,im->mtime.tv_sec,4);
+      diff_put(b+8,im->mtime.tv_nsec,4);
+      diff_put(b+12,im->nfiles,4);
+      diff_put(b+16,strlen(im->name),2);
+      r |= fwrite(b,18,1,f) != 1;
+      r |= fputs(im->name,f) < 0;
+   }
+   for ( int i=0;i<st->count;++i )
+   {
+      if ( !st->image[i].current ) continue;
+      for ( int j=0;j<st->image[i].nfiles;++j )
+      {
+         diff_put(b,st->image[i].files[j].size,4);
+         diff_put(b+4,strlen(st->image[i].files[j].path),2);
+         r |= fwrite(b,6,1,f) != 1;
+         r |= fputs(st->image[i].files[j].path,f) < 0;
+      }
+   }
+   for ( size_t i=0,j;i<npairs;i=j )
+   {
+      for ( j=i+1;j<npairs && pair[j] >> 32 == pair[i] >> 32;++j ) ;
+      diff_put(b,pair[i] >> 32,4);
+      diff_put(b+4,i,4);
+      diff_put(b+8,j-i,4);
+      r |= fwrite(b,12,1,f) != 1;
+   }
+   for ( size_t i=0;i<npairs;++i )
+   {
+      diff_put(b,(unsigned int)pair[i],4);
+      r |= fwrite(b,4,1,f) != 1;
+   }
+   r |= fclose(f) != 0;
+   if ( r )
+   {
+      fprintf(stderr,"Unable to write index %s\n",tmp);
+      unlink(tmp);
+   }
+   else rename(tmp,filename);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %u images, %u files, %u trigrams, %zu postings\n",__FUNCTION__,nimages,nfiles,ntri,npairs);
+   if ( !r ) printf("%u images, %u files indexed in %s\n",nimages,nfiles,filename);
+   free(tmp);
+   free(pair);
+   return r;
+}
+
+/*
+ * index_report()
+ *
+ * Entry point for --index without --search: add the named images or
+ * directories to the index, reading only images that are new or whose
+ * size or time stamp changed.  Images no longer on disk are dropped.
+ */
+int index_report(int count,char *names[])
+{
+   struct batch_list list = {0,0,NULL};
+   struct batch_list work = {0,0,NULL};
+   struct index_state st;
+   int r;
+
+   for ( int i=0;i<count;++i ) batch_expand(&list,names[i]);
+   memset(&st,0,sizeof(st));
+   index_load(&st,options.index);
+   if ( !list.count && !st.count )
+   {
+      fprintf(stderr,"No images specified for --index\n");
+      return 1;
+   }
+
+   // Queue images that aren't indexed or have changed
+   st.pending = calloc(list.count+1,sizeof(*st.pending));
+   for ( int i=0;i<list.count;++i )
+   {
+      struct stat sb;
+      struct index_image *im = index_image(&st,list.names[i]);
+      if ( im->used ) continue; // Named twice
+      im->used = 1;
+      if ( stat(list.names[i],&sb) ) memset(&sb,0,sizeof(sb));
+      if ( im->current && im->size == sb.st_size && im->mtime.tv_sec == sb.st_mtim.tv_sec && im->mtime.tv_nsec == sb.st_mtim.tv_nsec ) continue;
+      index_free_files(im);
+      im->size = sb.st_size;
+      im->mtime = sb.st_mtim;
+      st.pending[work.count] = im - st.image;
+      batch_add(&work,list.names[i]);
+   }
+   for ( int i=0;i<st.count;++i )
+   {
+      struct stat sb;
+      if ( !st.image[i].used && stat(st.image[i].name,&sb) ) index_free_files(&st.image[i]); // Gone
+   }
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d images, %d to examine\n",__FUNCTION__,list.count,work.count);
+   if ( work.count ) batch_run(&work,batch_jobs(work.count),index_examine,index_done,&st);
+   r = index_write(&st,options.index);
+
+   for ( int i=0;i<st.count;++i )
+   {
+      index_free_files(&st.image[i]);
+      free(st.image[i].name);
+   }
+   for ( int i=0;i<list.count;++i ) free(list.names[i]);
+   for ( int i=0;i<work.count;++i ) free(work.names[i]);
+   free(list.names);
+   free(work.names);
+   free(st.image);
+   free(st.pending);
+   return r;
+}
+
+/*
+ * index_query()
+ *
+ * Decode the --search string (with \xNN and \\ escapes) and make the
+ * forms it may take in memory: ATASCII and screen codes, each normal and
+ * inverse video.  Returns the number of distinct variants.
+ */
+int index_query(unsigned char variant[INDEX_VARIANTS][INDEX_QUERY_MAX],const char *form[INDEX_VARIANTS],int *len)
+{
+   static const char *forms[INDEX_VARIANTS] = {"ATASCII","screen codes","inverse ATASCII","inverse screen codes"};
+   const char *s = options.search;
+   int n = 0, count = 0;
+
+   while ( *s && n < INDEX_QUERY_MAX )
+   {
+      unsigned int c;
+      if ( s[0] == '\\' && s[1] == 'x' && sscanf(s+2,"%2x",&c) == 1 )
+      {
+         variant[0][n++] = c;
+         s += 2 + ( isxdigit((unsigned char)s[3]) ? 2 : 1 );
+         continue;
+      }
+      if ( s[0] == '\\' && s[1] == '\\' ) ++s;
+      variant[0][n++] = *s++;
+   }
+   *len = n;
+   for ( int v=0;v<INDEX_VARIANTS;++v )
+   {
+      for ( int i=0;i<n;++i )
+      {
+         unsigned char c = variant[0][i];
+         if ( v & 1 ) c = ATASCII_TO_SCREEN(c);
+         if ( v & 2 ) c |= 0x80;
+         variant[count][i] = c;
+      }
+      int dup = 0;
+      for ( int k=0;k<count && !dup;++k ) dup = ( memcmp(variant[k],variant[count],n) == 0 );
+      form[count] = forms[v];
+      if ( !dup ) ++count;
+   }
+   return count;
+}
+
+/*
+ * search_found()
+ *
+ * Worker: append the first offset of each form of the string in a file
+ */
+void search_found(struct dups_walk_state *w,const char *path,const char *data,off_t size)
+{
+   unsigned char variant[INDEX_VARIANTS][INDEX_QUERY_MAX];
+   const char *form[INDEX_VARIANTS];
+   int len;
+   int count = index_query(variant,form,&len);
+
+   for ( int v=0;v<count;++v )
+   {
+      const char *hit = memmem(data,size,variant[v],len);
+      if ( !hit ) continue;
+      batch_reserve(w,strlen(path) + 80);
+      w->len += sprintf(w->out+w->len,"%s: offset %ld ($%04lx) as %s\n",path,(long)(hit-data),(long)(hit-data),form[v]);
+   }
+}
+
+/*
+ * search_examine()
+ *
+ * Worker: search every file in one image
+ */
+char *search_examine(const char *name)
+{
+   struct dups_walk_state w;
+
+   memset(&w,0,sizeof(w));
+   w.alloc = 4096;
+   w.out = calloc(1,w.alloc);
+   w.found = search_found;
+   memset(&master_atrfs,0,sizeof(master_atrfs));
+   options.filename = name;
+   options.nodotfiles = 1;
+   if ( atr_preinit() ) return w.out;
+   tree_walk(&master_atrfs,dups_file,&w);
+   return w.out;
+}
+
+/*
+ * search_done()
+ *
+ * Print matches that are ready, in index order
+ */
+void search_done(void *arg,int index,char *record)
+{
+   struct search_state *st = arg;
+
+   if ( !record )
+   {
+      fprintf(stderr,"Unable to search %s\n",st->list->names[index]);
+      record = calloc(1,1);
+   }
+   st->reports[index] = record;
+   while ( st->printed < st->list->count && st->reports[st->printed] )
+   {
+      char *line = st->reports[st->printed];
+      while ( *line )
+      {
+         char *eol = strchr(line,'\n');
+         if ( !eol ) break;
+         printf("%s:%.*s\n",st->list->names[st->printed],(int)(eol-line),line);
+         ++st->matches;
+         line = eol+1;
+      }
+      free(st->reports[st->printed]);
+      ++st->printed;
+   }
+   fflush(stdout);
+}
+
+/*
+ * search_report()
+ *
+ * Entry point for --search: find the files containing a string
+ *
+ * The index narrows the search to files that have every trigram of one
+ * of the forms of the string; only the images holding those files are
+ * read to confirm the match and find the offset.  Exit status is
+ * non-zero if nothing matched, as with grep.
+ */
+int search_report(void)
+{
+   unsigned char variant[INDEX_VARIANTS][INDEX_QUERY_MAX];
+   const char *form[INDEX_VARIANTS];
+   struct index_map m;
+   struct batch_list list = {0,0,NULL};
+   struct search_state st;
+   unsigned char *hit;
+   int len,count,stale = 0;
+
+   if ( !options.index )
+   {
+      fprintf(stderr,"--search needs --index=<file> from an earlier --index run\n");
+      return 2;
+   }
+   count = index_query(variant,form,&len);
+   if ( !len )
+   {
+      fprintf(stderr,"Empty --search string\n");
+      return 2;
+   }
+   if ( index_open(&m,options.index) )
+   {
+      fprintf(stderr,"Unable to read index %s\n",options.index);
+      return 2;
+   }
+
+   // Files with every trigram of a variant; short strings have to check every file
+   hit = calloc(m.files+1,1);
+   for ( int v=0;v<count;++v )
+   {
+      unsigned int best_first = 0, best_count = m.files;
+      int ntri = len - 2, missing = 0;
+      unsigned int first[INDEX_QUERY_MAX],cnt[INDEX_QUERY_MAX];
+
+      if ( len < 3 )
+      {
+         for ( unsigned int f=0;f<m.files;++f ) if ( diff_get(m.file[f],4) >= (unsigned int)len ) hit[f] = 1;
+         break;
+      }
+      for ( int i=0;i<ntri && !missing;++i )
+      {
+         unsigned int tri = variant[v][i] << 16 | variant[v][i+1] << 8 | variant[v][i+2];
+         unsigned int lo = 0, hi = m.trigrams;
+         while ( lo < hi )
+         {
+            unsigned int mid = (lo + hi) / 2;
+            if ( diff_get(m.dir+mid*12,4) < tri ) lo = mid + 1;
+            else hi = mid;
+         }
+         if ( lo == m.trigrams || diff_get(m.dir+lo*12,4) != tri ) missing = 1;
+         else
+         {
+            first[i] = diff_get(m.dir+lo*12+4,4);
+            cnt[i] = diff_get(m.dir+lo*12+8,4);
+            if ( cnt[i] < best_count )
+            {
+               best_first = first[i];
+               best_count = cnt[i];
+            }
+         }
+      }
+      if ( missing ) continue;
+      for ( unsigned int p=best_first;p<best_first+best_count;++p )
+      {
+         unsigned int f = diff_get(m.post+p*4,4);
+         int all = ( f < m.files );
+         for ( int i=0;i<ntri && all;++i )
+         {
+            unsigned int lo = first[i], hi = first[i] + cnt[i];
+            while ( lo < hi )
+            {
+               unsigned int mid = (lo + hi) / 2;
+               if ( diff_get(m.post+mid*4,4) < f ) lo = mid + 1;
+               else hi = mid;
+            }
+            all = ( lo < first[i] + cnt[i] && diff_get(m.post+lo*4,4) == f );
+         }
+         if ( all ) hit[f] = 1;
+      }
+   }
+
+   // Images to read, and whether the index is out of date
+   for ( unsigned int i=0,fileno=0;i<m.images;++i )
+   {
+      const unsigned char *p = m.image[i];
+      unsigned int nfiles = diff_get(p+12,4);
+      int found = 0;
+      struct stat sb;
+
+      for ( unsigned int j=0;j<nfiles && fileno<m.files;++j,++fileno ) found |= hit[fileno];
+      char *name = strndup((const char *)p+18,diff_get(p+16,2));
+      if ( stat(name,&sb) || sb.st_size != (off_t)diff_get(p,4) || sb.st_mtim.tv_sec != (time_t)diff_get(p+4,4) || sb.st_mtim.tv_nsec != (long)diff_get(p+8,4) ) ++stale;
+      if ( found ) batch_add(&list,name);
+      free(name);
+   }
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d forms, %d of %u images to read\n",__FUNCTION__,count,list.count,m.images);
+   if ( stale ) fprintf(stderr,"%d image%s changed since %s was built; run --index again\n",stale,stale==1?" has":"s have",options.index);
+   free(hit);
+   index_close(&m);
+
+   memset(&st,0,sizeof(st));
+   st.list = &list;
+   st.reports = calloc(list.count+1,sizeof(*st.reports));
+   if ( list.count ) batch_run(&list,batch_jobs(list.count),search_examine,search_done,&st);
+
+   for ( int i=0;i<list.count;++i ) free(list.names[i]);
+   free(list.names);
+   free(st.reports);
+   return st.matches ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/*
+ * broker.c
+ *
+ * Sharing a mounted image with sio2linux, so a real Atari can use the
+ * image while files are edited through the mount.  Both programs map the
+ * image file, so they use the same pages and each sees the other's
+ * writes at once; the broker keeps them from seeing each other's changes
+ * half done, and tells atrfs when to drop its cached data.
+ *
+ *  - Locking: record locks on the image file.  sio2linux locks just the
+ *    sector it is reading or writing.  atrfs locks the whole image for
+ *    each operation, as one file write can touch the directory, the
+ *    bitmap, and any number of data sectors.
+ *
+ *  - Change notification: a small shared memory object for the image with
+ *    a generation number that is incremented after each change.  When
+ *    atrfs sees that it has changed, it expires its caches just as after
+ *    its own writes.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#include FUSE_INCLUDE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "atrfs.h"
+
+/*
+ * Macros and defines
+ */
+#define BROKER_MAGIC "ATRBRK01"
+
+/*
+ * Data types
+ */
+
+// The shared memory object, "/atrfs-<device>-<inode>" for the image file;
+// sio2linux has the same struct
+struct broker_shared {
+   char magic[8];
+   unsigned int generation; // Incremented after each change to the image
+   unsigned int unused;
+};
+
+struct broker {
+   struct broker_shared *shared;
+   unsigned int generation; // Last one seen
+   pthread_mutex_t mutex; // Record locks belong to the process, so FUSE threads take turns
+};
+
+/*
+ * Function prototypes
+ */
+int broker_setlock(struct atrfs *atrfs,int type);
+
+/*
+ * Functions
+ */
+
+/*
+ * broker_open()
+ *
+ * Called before mounting: share the image if it is mapped from the file.
+ * Images decoded into memory (compressed images, DCM archives, and pack
+ * members) can't be shared.  Returns non-zero on errors.
+ */
+int broker_open(struct atrfs *atrfs)
+{
+   char name[64];
+   struct broker *b;
+   int fd;
+   void *map;
+
+   if ( atrfs->zatr || atrfs->dcm || options.member || atrfs->fd < 0 ) return 0;
+   snprintf(name,sizeof(name),"/atrfs-%lx-%lx",(unsigned long)atrfs->atrstat.st_dev,(unsigned long)atrfs->atrstat.st_ino);
+   fd = shm_open(name,O_RDWR|O_CREAT,0644);
+   if ( fd < 0 || ftruncate(fd,sizeof(struct broker_shared)) )
+   {
+      if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s: %s; image not shared\n",__FUNCTION__,name,strerror(errno));
+      if ( fd >= 0 ) close(fd);
+      return 0;
+   }
+   map = mmap(NULL,sizeof(struct broker_shared),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+   close(fd);
+   if ( map == MAP_FAILED ) return 0;
+   b = calloc(1,sizeof(*b));
+   if ( !b )
+   {
+      munmap(map,sizeof(struct broker_shared));
+      return 1;
+   }
+   b->shared = map;
+   pthread_mutex_init(&b->mutex,NULL);
+   memcpy(b->shared->magic,BROKER_MAGIC,8); // New objects are zeros
+   b->generation = __atomic_load_n(&b->shared->generation,__ATOMIC_ACQUIRE);
+   atrfs->broker = b;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s at generation %u\n",__FUNCTION__,name,b->generation);
+   return 0;
+}
+
+/*
+ * broker_setlock()
+ *
+ * Lock or unlock the whole image, waiting for sio2linux if needed
+ */
+int broker_setlock(struct atrfs *atrfs,int type)
+{
+   struct flock fl;
+
+   memset(&fl,0,sizeof(fl));
+   fl.l_type = type;
+   fl.l_whence = SEEK_SET; // Start 0 and length 0 are the whole file
+   while ( fcntl(atrfs->fd,F_SETLKW,&fl) != 0 )
+   {
+      if ( errno == EINTR ) continue;
+      if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s\n",__FUNCTION__,strerror(errno));
+      return -errno;
+   }
+   return 0;
+}
+
+/*
+ * broker_lock()
+ *
+ * Before each file system operation: lock the image, and if sio2linux
+ * has changed it, expire cached data.
+ */
+void broker_lock(struct atrfs *atrfs,int write)
+{
+   struct broker *b = atrfs->broker;
+
+   if ( !b ) return;
+   pthread_mutex_lock(&b->mutex);
+   broker_setlock(atrfs,( write && !atrfs->readonly ) ? F_WRLCK : F_RDLCK);
+   unsigned int g = __atomic_load_n(&b->shared->generation,__ATOMIC_ACQUIRE);
+   if ( g != b->generation )
+   {
+      if ( options.debug ) fprintf(stderr,"DEBUG: %s: image changed by another program\n",__FUNCTION__);
+      b->generation = g;
+      ++atrfs->changes;
+      ++atrfs->rawchanges;
+   }
+}
+
+/*
+ * broker_unlock()
+ *
+ * After each file system operation: if it may have changed the image,
+ * note that for the other programs sharing it, and unlock the image.
+ */
+void broker_unlock(struct atrfs *atrfs,int write)
+{
+   struct broker *b = atrfs->broker;
+
+   if ( !b ) return;
+   if ( write && !atrfs->readonly ) b->generation = __atomic_add_fetch(&b->shared->generation,1,__ATOMIC_RELEASE);
+   broker_setlock(atrfs,F_UNLCK);
+   pthread_mutex_unlock(&b->mutex);
+}
@@ -9,12 +9,22 @@
  * Released under the GPL version 2.0
  */
 
+#define _GNU_SOURCE // fallocate()
 #include FUSE_INCLUDE
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
 #include "atrfs.h"
 
 /*
@@ -161,3 +171,873 @@ char *strcpy_case(char *dst,const char *src)
    if (options.upcase) return strcpy_upcase(dst,src);
    return strcpy(dst,src);
 }
+
+/*
+ * find_free_run()
+ *
+ * Search units 'first' through 'last' (sectors or clusters) for a run of
+ * 'count' free units as reported by 'is_free()'.  Return the start of the
+ * first run that is long enough, or the start of the longest run if none
+ * is.  Return -1 if nothing is free.
+ *
+ * Used to set atrfs->alloc_hint before preallocating space for a file.
+ */
+int find_free_run(struct atrfs *atrfs,int first,int last,int count,int (*is_free)(struct atrfs *,int))
+{
+   int best=-1,best_len=0;
+   int start=-1,len=0;
+
+   for ( int i=first;i<=last;++i )
+   {
+      if ( !is_free(atrfs,i) )
+      {
+         start = -1;
+         len = 0;
+         continue;
+      }
+      if ( start < 0 ) start = i;
+      ++len;
+      if ( len >= count ) return start;
+      if ( len > best_len )
+      {
+         best = start;
+         best_len = len;
+      }
+   }
+   return best;
+}
+
+/*
+ * punch_zero_blocks()
+ *
+ * Punch a hole in the image file for each host file system block in the
+ * byte range that is entirely zero.  Blocks that still hold data from
+ * neighboring sectors are left alone.
+ *
+ * Returns the number of blocks punched.
+ */
+int punch_zero_blocks(struct atrfs *atrfs,off_t offset,off_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+   if ( atrfs->zatr || atrfs->dcm ) return 0; // Not mapped from the file, and zeros take no space there
+   off_t bs = atrfs->atrstat.st_blksize ? atrfs->atrstat.st_blksize : 4096;
+   int punched = 0;
+
+   for ( off_t b = offset / bs * bs; b < offset + len && b + bs <= (off_t)atrfs->atrsize; b += bs )
+   {
+      const char *p = (const char *)atrfs->atrmem + b;
+      if ( p[0] || memcmp(p,p+1,bs-1) ) continue; // Not all zeros
+      if ( fallocate(atrfs->fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,b,bs) == 0 ) ++punched;
+      else if ( options.debug ) fprintf(stderr,"DEBUG: %s: punch at %lu failed\n",__FUNCTION__,b);
+   }
+   return punched;
+#else
+   (void)atrfs;
+   (void)offset;
+   (void)len;
+   return 0; // Not supported on this platform
+#endif
+}
+
+/*
+ * image_flush()
+ *
+ * Write back images that are decoded into memory instead of mapped from
+ * the file: compressed images and DCM archives.  Plain images are left
+ * to the mapping.
+ *
+ * Returns 0 or a negative errno.
+ */
+int image_flush(struct atrfs *atrfs)
+{
+   int r = zatr_flush(atrfs);
+   if ( !r ) r = dcm_flush(atrfs);
+   return r;
+}
+
+/*
+ * sparse_free()
+ *
+ * Called by the file systems when a sector (or cluster) is freed.  With
+ * --sparse, zero it and release the storage in the image file if possible.
+ * Reads from a hole return zeros, so nothing else needs to know.
+ *
+ * Not applicable to partitions in APT images, as those are working copies.
+ */
+void sparse_free(struct atrfs *atrfs,void *mem,size_t len)
+{
+   if ( !options.sparse || atrfs->readonly || atrfs->fd < 0 || !mem ) return;
+   memset(mem,0,len);
+   punch_zero_blocks(atrfs,(char *)mem - (char *)atrfs->atrmem,len);
+}
+
+/*
+ * sparsify_image()
+ *
+ * Offline pass for --sparsify: zero every sector that the file system
+ * says is unused, and then punch holes for all zero blocks in the image.
+ */
+int sparsify_image(struct atrfs *atrfs)
+{
+   int zeroed = 0;
+
+   if ( atrfs->readonly )
+   {
+      fprintf(stderr,"Image is read-only; unable to sparsify\n");
+      return 1;
+   }
+   if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_unused_sector )
+   {
+      for ( int sec=1;sec<=atrfs->sectors;++sec )
+      {
+         if ( !(fs_ops[atrfs->fstype]->fs_unused_sector)(atrfs,sec) ) continue;
+         unsigned char *s = SECTOR(sec);
+         int bytes = ( sec <= 3 && atrfs->shortsectors ) ? 128 : atrfs->sectorsize;
+         if ( s[0] || memcmp(s,s+1,bytes-1) )
+         {
+            memset(s,0,bytes);
+            ++zeroed;
+         }
+      }
+   }
+   int punched = punch_zero_blocks(atrfs,0,atrfs->atrsize);
+   printf("Zeroed %d unused sectors; %d zero blocks of %lu bytes released\n",zeroed,punched,(unsigned long)(atrfs->atrstat.st_blksize ? atrfs->atrstat.st_blksize : 4096));
+   return 0;
+}
+
+/*
+ * defrag_image()
+ *
+ * Offline pass for --defrag: have the file system move each fragmented
+ * file to a contiguous run of free sectors.  Moving one file can open up
+ * space for another, so repeat until a pass makes no progress.
+ *
+ * This checks the open mode rather than atrfs->readonly so that file
+ * systems without general write support can still be defragmented.
+ */
+int defrag_image(struct atrfs *atrfs)
+{
+   int moved = 0, fragmented = 0, r;
+
+   if ( atrfs->fd < 0 || (fcntl(atrfs->fd,F_GETFL) & O_ACCMODE) == O_RDONLY )
+   {
+      fprintf(stderr,"Image is read-only; unable to defragment\n");
+      return 1;
+   }
+   if ( !fs_ops[atrfs->fstype] || !fs_ops[atrfs->fstype]->fs_defrag )
+   {
+      fprintf(stderr,"Defragmenting is not supported for %s file systems\n",fs_ops[atrfs->fstype] ? fs_ops[atrfs->fstype]->name : "unknown");
+      return 1;
+   }
+   do
+   {
+      fragmented = 0;
+      r = (fs_ops[atrfs->fstype]->fs_defrag)(atrfs,&fragmented);
+      if ( r < 0 )
+      {
+         fprintf(stderr,"Defragmenting failed: %s\n",strerror(-r));
+         return 1;
+      }
+      moved += r;
+      if ( options.debug ) fprintf(stderr,"DEBUG: %s: pass moved %d files; %d still fragmented\n",__FUNCTION__,r,fragmented);
+   } while ( r && fragmented );
+   printf("Defragmented %d files; %d could not be moved (not enough contiguous free space)\n",moved,fragmented);
+   return 0;
+}
+
+/*
+ * detect_sanity()
+ *
+ * Run one fs_sanity function, recording the time for --info
+ */
+int detect_sanity(struct atrfs *atrfs,int type,int *order)
+{
+   struct timespec start,end;
+
+   clock_gettime(CLOCK_MONOTONIC,&start);
+   int r = (fs_ops[type]->fs_sanity)(atrfs);
+   clock_gettime(CLOCK_MONOTONIC,&end);
+   atrfs->detect.ns[type] += (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+   atrfs->detect.tried[type] = ++*order;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s score %d: %s\n",__FUNCTION__,fs_ops[type]->name,atrfs->detect.score[type],r ? "no" : "yes");
+   return r;
+}
+
+/*
+ * detect_fstype()
+ *
+ * Find the file system type among types first..last.  The answer is the
+ * same as calling each fs_sanity in order, but the cheap fs_score checks
+ * rule out most types first and the likely ones are tried first.  Types
+ * without fs_score are always tried.
+ *
+ * Return the type, or -1 if none match
+ */
+int detect_fstype(struct atrfs *atrfs,int first,int last)
+{
+   struct timespec start,end;
+   int order = 0;
+   int found = -1;
+
+   memset(&atrfs->detect,0,sizeof(atrfs->detect));
+   clock_gettime(CLOCK_MONOTONIC,&start);
+   for ( int i=first;i<=last;++i )
+   {
+      if ( !fs_ops[i] || !fs_ops[i]->fs_sanity ) continue;
+      atrfs->detect.score[i] = fs_ops[i]->fs_score ? (fs_ops[i]->fs_score)(atrfs) : 1;
+   }
+   clock_gettime(CLOCK_MONOTONIC,&end);
+   atrfs->detect.score_ns = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+
+   // Most likely first; ties in the usual order
+   while ( found < 0 )
+   {
+      int best = -1;
+      for ( int i=first;i<=last;++i )
+      {
+         if ( atrfs->detect.score[i] <= 0 || atrfs->detect.tried[i] ) continue;
+         if ( best < 0 || atrfs->detect.score[i] > atrfs->detect.score[best] ) best = i;
+      }
+      if ( best < 0 ) break;
+      if ( detect_sanity(atrfs,best,&order) == 0 ) found = best;
+   }
+
+   // Some types are subsets of others (DOS 2 is also valid MyDOS), so an
+   // earlier type in the list still wins if it also matches
+   for ( int i=first;found>=0 && i<found;++i )
+   {
+      if ( atrfs->detect.score[i] <= 0 || atrfs->detect.tried[i] ) continue;
+      if ( detect_sanity(atrfs,i,&order) == 0 ) found = i;
+   }
+
+   // Fall back on the full list in case a score was wrong
+   for ( int i=first;found<0 && i<=last;++i )
+   {
+      if ( !fs_ops[i] || !fs_ops[i]->fs_sanity || atrfs->detect.tried[i] ) continue;
+      if ( detect_sanity(atrfs,i,&order) == 0 )
+      {
+         fprintf(stderr,"Warning: %s detected, but its fs_score ruled it out\n",fs_ops[i]->name);
+         found = i;
+      }
+   }
+   return found;
+}
+
+/*
+ * detect_textdata()
+ *
+ * Report for --info on how the file system type was detected
+ */
+char *detect_textdata(struct atrfs *atrfs)
+{
+   char *buf = malloc(4*1024);
+   char *b = buf;
+   long total = atrfs->detect.score_ns;
+
+   if ( !buf ) return NULL;
+   b+=sprintf(b,"File system detection\n");
+   b+=sprintf(b,"  Scoring all types:  %8.1f us\n",atrfs->detect.score_ns/1000.0);
+   for ( int n=1;n<ATR_MAXFSTYPE;++n ) // In the order tried
+   {
+      for ( int i=0;i<ATR_MAXFSTYPE;++i )
+      {
+         if ( atrfs->detect.tried[i] != n ) continue;
+         b+=sprintf(b,"  %-18s  %8.1f us  score %d%s\n",fs_ops[i]->name,atrfs->detect.ns[i]/1000.0,atrfs->detect.score[i],i == (int)atrfs->fstype ? "  (detected)" : "");
+         total += atrfs->detect.ns[i];
+      }
+   }
+   b+=sprintf(b,"  Total:              %8.1f us\n",total/1000.0);
+   return buf;
+}
+
+/*
+ * Drive geometry for --skew
+ *
+ * Like sio2linux's 'struct trackformat', model where each sector sits on
+ * the track, measured in sector times from the start of the track.  Real
+ * drives format with a 2:1 interleave (1,3,5,...,2,4,6,...), so that is
+ * the layout assumed here.  Enhanced density (1040 single-density sectors)
+ * has 26 sectors per track; everything else has 18.
+ */
+#define SKEW_TRACK_SECTORS(atrfs) (((atrfs)->sectorsize == 128 && (atrfs)->sectors == 1040) ? 26 : 18)
+#define SKEW_TRACK(atrfs,sec)     (((sec)-1) / SKEW_TRACK_SECTORS(atrfs))
+#define SKEW_POSITION(atrfs,sec)  ((((sec)-1) % SKEW_TRACK_SECTORS(atrfs)) % 2 * (SKEW_TRACK_SECTORS(atrfs)/2) + (((sec)-1) % SKEW_TRACK_SECTORS(atrfs)) / 2)
+#define SKEW_STEP_TIME            2 // Sector times to step the head one track
+
+/*
+ * SIO timing for load_time(), from the SIO specification: each read is a
+ * 5-byte command frame, ACK and COMPLETE with the gaps around them, then
+ * the sector and a checksum byte.  Bytes are 10 bits with start and stop.
+ */
+#define LOAD_REV_US               (60*1000*1000/288) // Microseconds per revolution at 288 RPM
+#define LOAD_SIO_US               3000 // Command line, ACK, COMPLETE, and the gaps between them
+#define LOAD_ATARI_US             1000 // DOS taking the sector out of its buffer
+#define LOAD_BYTES_US(n,baud)     ((long)(n) * 10 * 1000 * 1000 / (baud))
+
+/*
+ * skew_delay()
+ *
+ * Return the sector times from the end of reading 'from' to the end of
+ * reading 'to', allowing options.skew sector times for the Atari to
+ * process each sector.
+ */
+int skew_delay(struct atrfs *atrfs,int from,int to)
+{
+   const int spt = SKEW_TRACK_SECTORS(atrfs);
+   int tracks = abs(SKEW_TRACK(atrfs,to) - SKEW_TRACK(atrfs,from));
+   int busy = options.skew + tracks * SKEW_STEP_TIME;
+   int ready = SKEW_POSITION(atrfs,from) + 1 + busy;
+   int wait = ((SKEW_POSITION(atrfs,to) - ready) % spt + spt) % spt;
+
+   return busy + wait + 1;
+}
+
+/*
+ * skew_next_sector()
+ *
+ * Find the free sector that can be read soonest after 'prev', looking on
+ * the same track and the next one.  Return -1 if none are free there.
+ */
+int skew_next_sector(struct atrfs *atrfs,int prev,int (*is_free)(struct atrfs *,int))
+{
+   const int spt = SKEW_TRACK_SECTORS(atrfs);
+   int first = SKEW_TRACK(atrfs,prev) * spt + 1;
+   int last = first + 2 * spt - 1;
+   int best = -1, best_delay = 0;
+
+   if ( last > atrfs->sectors ) last = atrfs->sectors;
+   for ( int sec=first;sec<=last;++sec )
+   {
+      if ( sec == prev || !is_free(atrfs,sec) ) continue;
+      int delay = skew_delay(atrfs,prev,sec);
+      if ( best < 0 || delay < best_delay )
+      {
+         best = sec;
+         best_delay = delay;
+      }
+   }
+   if ( options.debug > 1 ) fprintf(stderr,"DEBUG: %s: after %d use %d (%d sector times)\n",__FUNCTION__,prev,best,best_delay);
+   return best;
+}
+
+/*
+ * skew_chain_time()
+ *
+ * Estimated sector times to read a zero-terminated chain of sectors with
+ * the current --skew setting.
+ */
+int skew_chain_time(struct atrfs *atrfs,const int *sectors)
+{
+   int total = 0;
+
+   if ( !sectors || !sectors[0] ) return 0;
+   total = 1;
+   for ( int i=1;sectors[i];++i ) total += skew_delay(atrfs,sectors[i-1],sectors[i]);
+   return total;
+}
+
+/*
+ * load_time()
+ *
+ * Estimated microseconds for the Atari to read 'count' sectors in order
+ * through SIO at 'baud'.  This uses the drive geometry for --skew, but
+ * with the SIO transfer and track steps timed rather than set by --skew.
+ * The first sector waits half a revolution on average.
+ *
+ * If 'ideal' is given, it gets the time if each sector were on the next
+ * track position to come under the head once the drive is ready for it,
+ * so a layout can be compared with the best one possible.
+ */
+long load_time(struct atrfs *atrfs,const int *sectors,int count,int baud,long *ideal)
+{
+   const int spt = SKEW_TRACK_SECTORS(atrfs);
+   const long slot = LOAD_REV_US / spt;
+   const long rev = slot * spt;
+   const long command = LOAD_SIO_US + LOAD_BYTES_US(5,baud);
+   long total = 0, best = 0;
+
+   for ( int i=0;i<count;++i )
+   {
+      if ( i == 0 )
+      {
+         total += command + rev/2 + slot;
+         best += command + rev/2 + slot;
+         continue;
+      }
+      int prev = sectors[i-1], sec = sectors[i];
+      long data = LOAD_BYTES_US(( prev <= 3 ? 128 : atrfs->sectorsize ) + 1,baud);
+      long busy = data + LOAD_ATARI_US + command;
+      long steps = abs(SKEW_TRACK(atrfs,sec) - SKEW_TRACK(atrfs,prev)) * SKEW_STEP_TIME * slot;
+      long ready = ( (SKEW_POSITION(atrfs,prev) + 1) * slot + busy + steps ) % rev;
+      long wait = ( SKEW_POSITION(atrfs,sec) * slot - ready + rev ) % rev;
+      total += busy + steps + wait + slot;
+
+      // Best case: no wait beyond the next sector boundary, and a track
+      // step only after each full track
+      busy += ( i % spt == 0 ) ? SKEW_STEP_TIME * slot : 0;
+      best += ( busy + slot - 1 ) / slot * slot + slot;
+   }
+   if ( count )
+   {
+      long data = LOAD_BYTES_US(( sectors[count-1] <= 3 ? 128 : atrfs->sectorsize ) + 1,baud);
+      total += data;
+      best += data;
+   }
+   if ( ideal ) *ideal = best;
+   return total;
+}
+
+/*
+ * load_skew()
+ *
+ * The --skew setting that matches load_time() at 'baud': the sector
+ * times from the end of one read until the drive can read the next
+ */
+int load_skew(struct atrfs *atrfs,int baud)
+{
+   const long slot = LOAD_REV_US / SKEW_TRACK_SECTORS(atrfs);
+   long busy = LOAD_BYTES_US(atrfs->sectorsize + 1,baud) + LOAD_ATARI_US + LOAD_SIO_US + LOAD_BYTES_US(5,baud);
+
+   return ( busy + slot - 1 ) / slot;
+}
+
+/*
+ * xattr_value()
+ *
+ * Return an extended attribute value in the buffer from FUSE.
+ * A size of zero is a query for the length of the value.
+ */
+int xattr_value(char *value,size_t size,const void *data,size_t len)
+{
+   if ( !size ) return len;
+   if ( len > size ) return -ERANGE;
+   memcpy(value,data,len);
+   return len;
+}
+
+/*
+ * xattr_text()
+ *
+ * Short text attribute values; printf-style, no trailing newline or NULL
+ */
+int xattr_text(char *value,size_t size,const char *fmt,...)
+{
+   char buf[64];
+   va_list ap;
+
+   va_start(ap,fmt);
+   int len = vsnprintf(buf,sizeof(buf),fmt,ap);
+   va_end(ap);
+   if ( len < 0 ) return -EIO;
+   if ( len >= (int)sizeof(buf) ) len = sizeof(buf)-1;
+   return xattr_value(value,size,buf,len);
+}
+
+/*
+ * xattr_chain()
+ *
+ * Binary attribute value for a list of sector numbers: two bytes each,
+ * low byte first, as in the Atari file systems.
+ */
+int xattr_chain(char *value,size_t size,const int *sectors,int count)
+{
+   if ( !size ) return count*2;
+   if ( (size_t)count*2 > size ) return -ERANGE;
+   for ( int i=0;i<count;++i )
+   {
+      value[i*2] = sectors[i] & 0xff;
+      value[i*2+1] = sectors[i] >> 8;
+   }
+   return count*2;
+}
+
+/*
+ * xattr_names()
+ *
+ * Fill in the list of attribute names for listxattr from a NULL-terminated
+ * array of names.  XATTR_PREFIX is prepended to each.
+ */
+int xattr_names(char *list,size_t size,const char *const names[])
+{
+   size_t len = 0;
+
+   for ( int i=0;names[i];++i )
+   {
+      size_t n = sizeof(XATTR_PREFIX)-1 + strlen(names[i]) + 1;
+      if ( size )
+      {
+         if ( len + n > size ) return -ERANGE;
+         sprintf(list+len,"%s%s",XATTR_PREFIX,names[i]);
+      }
+      len += n;
+   }
+   return len;
+}
+
+/*
+ * sectormap_build()
+ *
+ * Have the file system claim every sector it uses, walking the directory
+ * tree once.  Returns NULL if the file system doesn't support this.
+ */
+struct sectormap *sectormap_build(struct atrfs *atrfs)
+{
+   if ( !fs_ops[atrfs->fstype] || !fs_ops[atrfs->fstype]->fs_sectormap ) return NULL;
+
+   struct sectormap *sm = calloc(1,sizeof(*sm));
+   if ( !sm ) return NULL;
+   sm->sectors = atrfs->sectors;
+   sm->map = calloc(atrfs->sectors+1,sizeof(sm->map[0]));
+   if ( !sm->map )
+   {
+      free(sm);
+      return NULL;
+   }
+   for ( int i=0;i<=atrfs->sectors;++i ) sm->map[i].owner = sm->map[i].other = -1;
+   int r = (fs_ops[atrfs->fstype]->fs_sectormap)(atrfs,sm);
+   if ( r<0 && options.debug ) fprintf(stderr,"DEBUG: %s: map incomplete: %d\n",__FUNCTION__,r);
+   return sm;
+}
+
+void sectormap_free(struct sectormap *sm)
+{
+   if ( !sm ) return;
+   for ( int i=0;i<sm->num_owners;++i ) free(sm->owners[i]);
+   free(sm->owners);
+   free(sm->map);
+   free(sm);
+}
+
+/*
+ * sectormap_owner()
+ *
+ * Add a name for a file, directory, or system area; return its index
+ */
+int sectormap_owner(struct sectormap *sm,const char *name)
+{
+   if ( (sm->num_owners & 0xff) == 0 )
+   {
+      char **o = realloc(sm->owners,sizeof(char *)*(sm->num_owners+256));
+      if ( !o ) return -1;
+      sm->owners = o;
+   }
+   sm->owners[sm->num_owners] = strdup(name);
+   return sm->num_owners++;
+}
+
+/*
+ * sectormap_claim()
+ *
+ * Record that a sector is used.  The first claim wins; later claims are
+ * counted so that cross-linked sectors can be reported.
+ */
+void sectormap_claim(struct sectormap *sm,int sector,int owner,int use,int position)
+{
+   if ( sector < 1 || sector > sm->sectors ) return;
+   struct sectormap_entry *e = &sm->map[sector];
+   if ( e->claims < 0xffff ) ++e->claims;
+   if ( e->claims == 1 )
+   {
+      e->owner = owner;
+      e->use = use;
+      e->position = position;
+   }
+   else if ( e->claims == 2 )
+   {
+      e->other = owner;
+   }
+}
+
+/*
+ * fscheck_add()
+ *
+ * Append a line to the --check report
+ */
+void fscheck_add(struct fscheck *ck,const char *fmt,va_list ap,const char *suffix)
+{
+   char line[512];
+
+   int len = vsnprintf(line,sizeof(line),fmt,ap);
+   if ( len < 0 ) return;
+   if ( len >= (int)sizeof(line) ) len = sizeof(line)-1;
+   size_t need = ck->len + len + strlen(suffix) + 2;
+   if ( need > ck->alloc )
+   {
+      size_t alloc = ck->alloc ? ck->alloc : 4096;
+      while ( alloc < need ) alloc *= 2;
+      char *b = realloc(ck->buf,alloc);
+      if ( !b ) return;
+      ck->buf = b;
+      ck->alloc = alloc;
+   }
+   ck->len += sprintf(ck->buf+ck->len,"%s%s\n",line,suffix);
+}
+
+/*
+ * fscheck_problem()
+ *
+ * Report an inconsistency; 'repaired' is non-zero if it has been fixed
+ */
+void fscheck_problem(struct fscheck *ck,int repaired,const char *fmt,...)
+{
+   va_list ap;
+
+   ++ck->problems;
+   if ( repaired ) ++ck->repaired;
+   va_start(ap,fmt);
+   fscheck_add(ck,fmt,ap,repaired ? " (repaired)" : "");
+   va_end(ap);
+}
+
+/*
+ * fscheck_note()
+ *
+ * Add a line to the report that isn't a problem with the image
+ */
+void fscheck_note(struct fscheck *ck,const char *fmt,...)
+{
+   va_list ap;
+
+   va_start(ap,fmt);
+   fscheck_add(ck,fmt,ap,"");
+   va_end(ap);
+}
+
+/*
+ * fscheck_unit()
+ *
+ * Compare one allocation unit of the sector map with the bitmap:
+ * 1 if marked in use but not claimed, 2 if claimed but marked free.
+ */
+int fscheck_unit(struct sectormap *sm,int u,int unit,int *owner)
+{
+   int mapped=0,claimed=0,marked_free=0;
+
+   *owner = -1;
+   for ( int i=u*unit;i<(u+1)*unit && i<=sm->sectors;++i )
+   {
+      const struct sectormap_entry *e = &sm->map[i];
+      if ( e->bitmap != SM_UNMAPPED ) ++mapped;
+      if ( e->bitmap == SM_FREE ) ++marked_free;
+      if ( e->claims )
+      {
+         ++claimed;
+         if ( e->bitmap == SM_FREE && *owner < 0 ) *owner = e->owner;
+      }
+   }
+   if ( !mapped ) return 0;
+   if ( !claimed && !marked_free ) return 1;
+   if ( *owner >= 0 ) return 2;
+   return 0;
+}
+
+/*
+ * fscheck_bitmap()
+ *
+ * Compare the sectors the file system claimed in ck->sm with its bitmap,
+ * and report cross-linked sectors.  The bitmap is in units of 'unit'
+ * sectors, starting with unit 0 at sector 0.  If 'set' is given and
+ * repairs are enabled, it is called with a unit number to mark it used
+ * or free.  Unclaimed units are left alone if a file is damaged, as they
+ * may still hold the rest of it.
+ */
+void fscheck_bitmap(struct fscheck *ck,struct atrfs *atrfs,int unit,int (*set)(struct atrfs *atrfs,int sector,int used))
+{
+   struct sectormap *sm = ck->sm;
+   char range[64];
+
+   (void)atrfs;
+   if ( !sm ) return;
+
+   // Cross-links, one report for each run with the same two owners
+   for ( int i=1,j;i<=sm->sectors;i=j )
+   {
+      const struct sectormap_entry *e = &sm->map[i];
+      for ( j=i+1;e->claims>1 && j<=sm->sectors && sm->map[j].claims>1 && sm->map[j].owner == e->owner && sm->map[j].other == e->other;++j ) ;
+      if ( e->claims < 2 ) continue;
+      if ( j-1 > i ) sprintf(range,"sectors %d-%d are",i,j-1);
+      else sprintf(range,"sector %d is",i);
+      fscheck_problem(ck,0,"%s cross-linked between %s and %s",range,sm->owners[e->owner],sm->owners[e->other]);
+   }
+
+   // If most of the disk is orphaned, the type was probably misdetected
+   int orphans = 0,who;
+   for ( int u=0;u<=sm->sectors/unit;++u ) orphans += fscheck_unit(sm,u,unit,&who) == 1;
+   int suspect = orphans*2 > sm->sectors/unit;
+
+   // Bitmap against claims, one report for each run
+   for ( int u=0,v;u<=sm->sectors/unit;u=v )
+   {
+      int owner,vowner;
+      int state = fscheck_unit(sm,u,unit,&owner);
+      for ( v=u+1;v<=sm->sectors/unit && fscheck_unit(sm,v,unit,&vowner) == state && vowner == owner;++v ) ;
+      if ( !state ) continue;
+      if ( unit == 1 && v-1 > u ) sprintf(range,"sectors %d-%d are",u,v-1);
+      else if ( unit == 1 ) sprintf(range,"sector %d is",u);
+      else if ( v-1 > u ) sprintf(range,"clusters %d-%d (sectors %d-%d) are",u,v-1,u*unit,v*unit-1);
+      else sprintf(range,"cluster %d (sectors %d-%d) is",u,u*unit,v*unit-1);
+      int fix = ck->repair && set;
+      if ( state == 1 )
+      {
+         if ( fix && ck->damaged )
+         {
+            fscheck_problem(ck,0,"%s marked in use but not part of any file (not freed: a damaged file may still use them)",range);
+            continue;
+         }
+         if ( fix && suspect )
+         {
+            fscheck_problem(ck,0,"%s marked in use but not part of any file (not freed: too much of the disk is orphaned to trust the detected type)",range);
+            continue;
+         }
+         for ( int w=u;fix && w<v;++w ) set(atrfs,w,0);
+         fscheck_problem(ck,fix,"%s marked in use but not part of any file",range);
+      }
+      else
+      {
+         for ( int w=u;fix && w<v;++w ) set(atrfs,w,1);
+         fscheck_problem(ck,fix,"%s used by %s but marked free",range,sm->owners[owner]);
+      }
+   }
+}
+
+/*
+ * check_image()
+ *
+ * Offline pass for --check: build the sector map and have the file
+ * system check itself against it, repairing if --repair was given.
+ * The report is malloc()ed.  Returns the number of problems not
+ * repaired, or -1 if the file system has no checks.
+ */
+int check_image(struct atrfs *atrfs,char **report,int *repaired)
+{
+   struct fscheck ck;
+
+   *report = NULL;
+   *repaired = 0;
+   if ( !fs_ops[atrfs->fstype] || !fs_ops[atrfs->fstype]->fs_check ) return -1;
+   memset(&ck,0,sizeof(ck));
+   ck.repair = options.repair;
+   if ( ck.repair && (atrfs->fd < 0 || (fcntl(atrfs->fd,F_GETFL) & O_ACCMODE) == O_RDONLY) )
+   {
+      fscheck_note(&ck,"image is read-only; nothing will be repaired");
+      ck.repair = 0;
+   }
+   ck.sm = sectormap_build(atrfs);
+   int r = (fs_ops[atrfs->fstype]->fs_check)(atrfs,&ck);
+   if ( r<0 ) fscheck_problem(&ck,0,"check stopped early: %s",strerror(-r));
+   if ( ck.repaired )
+   {
+      ++atrfs->changes;
+      msync(atrfs->atrmem,atrfs->atrsize,MS_SYNC);
+      image_flush(atrfs);
+   }
+   sectormap_free(ck.sm);
+   *report = ck.buf;
+   *repaired = ck.repaired;
+   return ck.problems - ck.repaired;
+}
+
+/*
+ * Tree walks
+ */
+#define TREE_MAX_DEPTH 32 // Directory loops in damaged images
+
+struct tree_names {
+   char **name;
+   int count;
+   int alloc;
+};
+
+/*
+ * tree_filler()
+ *
+ * Collect directory entries for tree_walk_dir(), skipping special files
+ */
+int tree_filler(void *buf,const char *name,const struct stat *stbuf,off_t off
+#if (FUSE_USE_VERSION >= 30)
+                ,enum fuse_fill_dir_flags flags
+#endif
+   )
+{
+   struct tree_names *n = buf;
+
+   (void)stbuf;
+   (void)off;
+#if (FUSE_USE_VERSION >= 30)
+   (void)flags;
+#endif
+   if ( name[0] == '.' ) return 0;
+   if ( n->count == n->alloc )
+   {
+      char **more = realloc(n->name,(n->alloc * 2 + 16) * sizeof(n->name[0]));
+      if ( !more ) return 1; // Stop listing
+      n->name = more;
+      n->alloc = n->alloc * 2 + 16;
+   }
+   n->name[n->count] = strdup(name);
+   if ( n->name[n->count] ) ++n->count;
+   return 0;
+}
+
+/*
+ * tree_walk_dir()
+ *
+ * Call found() for everything under 'path', each directory before its
+ * contents.  'dirs' holds the inodes of the directories above, so a
+ * damaged image that links a directory into itself ends the walk.
+ */
+int tree_walk_dir(struct atrfs *atrfs,const char *path,int (*found)(void *arg,const char *path,const struct stat *st),void *arg,int depth,ino_t *dirs)
+{
+   struct tree_names names = {NULL,0,0};
+   struct dirfill d;
+   char sub[PATH_MAX],fspath[PATH_MAX];
+   int r = 0;
+
+   memset(&d,0,sizeof(d));
+   d.buf = &names;
+   d.filler = tree_filler;
+   strcpy_upcase(fspath,path);
+   (fs_ops[atrfs->fstype]->fs_readdir)(atrfs,fspath,&d,atrfs_filler,0);
+
+   for ( int i=0;i<names.count;++i )
+   {
+      struct stat st;
+      int len = snprintf(sub,sizeof(sub),"%s%s%s",path,strcmp(path,"/")?"/":"",names.name[i]);
+
+      if ( r || len < 0 || len >= (int)sizeof(sub) ) goto next;
+      strcpy_upcase(fspath,sub);
+      atr_stat_defaults(&st);
+      if ( (fs_ops[atrfs->fstype]->fs_getattr)(atrfs,fspath,&st) ) goto next;
+      if ( S_ISDIR(st.st_mode) )
+      {
+         int loop = depth >= TREE_MAX_DEPTH;
+         for ( int k=0;k<depth && !loop;++k ) loop = ( dirs[k] == st.st_ino );
+         if ( loop ) goto next;
+         r = (found)(arg,sub,&st);
+         if ( r ) goto next;
+         dirs[depth] = st.st_ino;
+         r = tree_walk_dir(atrfs,sub,found,arg,depth+1,dirs);
+      }
+      else if ( S_ISREG(st.st_mode) ) r = (found)(arg,sub,&st);
+   next:
+      free(names.name[i]);
+   }
+   free(names.name);
+   return r;
+}
+
+/*
+ * tree_walk()
+ *
+ * Call found() with the path (as listed) and stat data of each file and
+ * directory in the image, each directory before its contents.  Special
+ * files are skipped.  A non-zero return from found() ends the walk.
+ *
+ * Returns 0 or found()'s return value
+ */
+int tree_walk(struct atrfs *atrfs,int (*found)(void *arg,const char *path,const struct stat *st),void *arg)
+{
+   ino_t dirs[TREE_MAX_DEPTH];
+
+   return tree_walk_dir(atrfs,"/",found,arg,0,dirs);
+}
@@ -0,0 +1,269 @@
+/*
+ * convert.c
+ *
+ * Convert an image to another file system in place, for --convert.  The
+ * files and directories are read into memory through the current file
+ * system's module, a new file system is created over the image, and
+ * everything is written back through the new module.  Directory entries
+ * are created first so each file's data is laid down in one contiguous
+ * run, and then the new module's defrag pass tidies anything left over.
+ *
+ * If anything fails (usually running out of space, as the new file system
+ * may need more sectors for its directories and maps, or a file system
+ * that doesn't fit the image's size), the original image is put back.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#include FUSE_INCLUDE
+#include <sys/stat.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include "atrfs.h"
+
+/*
+ * Data types
+ */
+struct convert_entry {
+   char *path; // Upper case, with the leading '/'
+   mode_t mode;
+   struct timespec mtime;
+   char *data; // NULL for directories
+   off_t size;
+};
+
+struct convert_list {
+   struct atrfs *atrfs;
+   struct convert_entry *entry;
+   int count;
+   int alloc;
+   int files;
+   int dirs;
+   int short_reads; // Files with broken chains; copied as far as they read
+};
+
+/*
+ * Function prototypes
+ */
+int convert_add(void *arg,const char *path,const struct stat *st);
+int convert_write(struct atrfs *atrfs,struct convert_list *list);
+void convert_free(struct convert_list *list);
+
+/*
+ * Functions
+ */
+
+/*
+ * convert_add()
+ *
+ * tree_walk() callback: read a file or directory into the list
+ *
+ * Returns 0 or -errno
+ */
+int convert_add(void *arg,const char *path,const struct stat *st)
+{
+   struct convert_list *list = arg;
+   struct atrfs *atrfs = list->atrfs;
+
+   if ( list->count == list->alloc )
+   {
+      struct convert_entry *more = realloc(list->entry,(list->alloc * 2 + 64) * sizeof(list->entry[0]));
+      if ( !more ) return -ENOMEM;
+      list->entry = more;
+      list->alloc = list->alloc * 2 + 64;
+   }
+   struct convert_entry *e = &list->entry[list->count++];
+   memset(e,0,sizeof(*e));
+   e->path = malloc(strlen(path) + 1);
+   if ( !e->path ) return -ENOMEM;
+   strcpy_upcase(e->path,path);
+   e->mode = st->st_mode;
+   e->mtime = st->st_mtim;
+   if ( S_ISDIR(st->st_mode) )
+   {
+      ++list->dirs;
+      return 0;
+   }
+   ++list->files;
+   e->data = malloc(st->st_size + 1);
+   if ( !e->data ) return -ENOMEM;
+   while ( e->size < st->st_size )
+   {
+      int got = (fs_ops[atrfs->fstype]->fs_read)(atrfs,e->path,e->data+e->size,st->st_size-e->size,e->size);
+      if ( got <= 0 ) break;
+      e->size += got;
+   }
+   if ( e->size < st->st_size )
+   {
+      fprintf(stderr,"%s: only %ld of %ld bytes could be read\n",e->path,(long)e->size,(long)st->st_size);
+      ++list->short_reads;
+   }
+   return 0;
+}
+
+/*
+ * convert_write()
+ *
+ * Create everything in the list in the new file system: first all the
+ * directories and empty files, so directories don't grow into the middle
+ * of the file data, then each file's data in one write, then the time
+ * stamps and locks, as writing updates the time stamps.
+ *
+ * Returns 0 or -errno
+ */
+int convert_write(struct atrfs *atrfs,struct convert_list *list)
+{
+   const struct fs_ops *ops = fs_ops[atrfs->fstype];
+   int r;
+
+   for ( int i=0;i<list->count;++i )
+   {
+      struct convert_entry *e = &list->entry[i];
+      if ( S_ISDIR(e->mode) ) r = ops->fs_mkdir ? (ops->fs_mkdir)(atrfs,e->path,0755) : -ENOTSUP;
+      else r = (ops->fs_create)(atrfs,e->path,0644);
+      if ( r < 0 )
+      {
+         fprintf(stderr,"%s: %s\n",e->path,strerror(-r));
+         return r;
+      }
+   }
+   for ( int i=0;i<list->count;++i )
+   {
+      struct convert_entry *e = &list->entry[i];
+      if ( !e->data || !e->size ) continue;
+      r = (ops->fs_write)(atrfs,e->path,e->data,e->size,0);
+      if ( r >= 0 && r != e->size ) r = -ENOSPC;
+      if ( r < 0 )
+      {
+         fprintf(stderr,"%s: %s\n",e->path,strerror(-r));
+         return r;
+      }
+   }
+   for ( int i=0;i<list->count;++i )
+   {
+      struct convert_entry *e = &list->entry[i];
+#if (FUSE_USE_VERSION >= 30)
+      struct timespec tv[2] = { e->mtime, e->mtime };
+      if ( ops->fs_utimens ) (ops->fs_utimens)(atrfs,e->path,tv);
+#else
+      struct utimbuf ut = { e->mtime.tv_sec, e->mtime.tv_sec };
+      if ( ops->fs_utime ) (ops->fs_utime)(atrfs,e->path,&ut);
+#endif
+      if ( !S_ISDIR(e->mode) && !(e->mode & 0200) && ops->fs_chmod ) (ops->fs_chmod)(atrfs,e->path,e->mode & 07777);
+   }
+   return 0;
+}
+
+/*
+ * convert_free()
+ */
+void convert_free(struct convert_list *list)
+{
+   for ( int i=0;i<list->count;++i )
+   {
+      free(list->entry[i].path);
+      free(list->entry[i].data);
+   }
+   free(list->entry);
+}
+
+/*
+ * convert_image()
+ *
+ * Offline pass for --convert=<type>: rebuild the image as a new file
+ * system with the same files.  Returns non-zero on errors.
+ */
+int convert_image(struct atrfs *atrfs)
+{
+   struct convert_list list;
+   int type = -1, from = atrfs->fstype, r;
+
+   for ( int i=0;i<ATR_MAXFSTYPE;++i )
+   {
+      if ( fs_ops[i] && fs_ops[i]->fstype && strcmp(options.convert,fs_ops[i]->fstype) == 0 ) type = i;
+   }
+   if ( type < 0 || !fs_ops[type]->fs_newfs || !fs_ops[type]->fs_create || !fs_ops[type]->fs_write )
+   {
+      fprintf(stderr,"Unable to convert to file system type: %s\n",options.convert);
+      return 1;
+   }
+   if ( atrfs->fd < 0 || (fcntl(atrfs->fd,F_GETFL) & O_ACCMODE) == O_RDONLY )
+   {
+      fprintf(stderr,"Image is read-only; unable to convert\n");
+      return 1;
+   }
+   if ( !fs_ops[from] || !fs_ops[from]->fs_readdir || !fs_ops[from]->fs_getattr || !fs_ops[from]->fs_read || from == ATR_APT || from == ATR_UNKNOWN )
+   {
+      fprintf(stderr,"No file system found to convert from\n");
+      return 1;
+   }
+   if ( from == type )
+   {
+      printf("Image is already %s\n",fs_ops[type]->name);
+      return 0;
+   }
+
+   memset(&list,0,sizeof(list));
+   list.atrfs = atrfs;
+   r = tree_walk(atrfs,convert_add,&list);
+   if ( r < 0 )
+   {
+      fprintf(stderr,"Reading files failed: %s\n",strerror(-r));
+      convert_free(&list);
+      return 1;
+   }
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d files and %d directories from %s\n",__FUNCTION__,list.files,list.dirs,fs_ops[from]->name);
+
+   // Keep the original to put back if the files don't fit
+   size_t bytes = atrfs->atrsize - ( (char *)atrfs->mem - (char *)atrfs->atrmem );
+   char *save = malloc(bytes);
+   if ( !save )
+   {
+      convert_free(&list);
+      return 1;
+   }
+   memcpy(save,atrfs->mem,bytes);
+
+   memset(atrfs->mem,0,bytes);
+   atrfs->fstype = type;
+   atrfs->readonly = 0;
+   ++atrfs->changes;
+   ++atrfs->rawchanges;
+   r = (fs_ops[type]->fs_newfs)(atrfs);
+   if ( r >= 0 ) r = convert_write(atrfs,&list);
+   if ( r >= 0 && fs_ops[type]->fs_sanity && (fs_ops[type]->fs_sanity)(atrfs) ) r = -EINVAL; // Such as DOS 2 on a large image
+   if ( r < 0 )
+   {
+      fprintf(stderr,"Converting to %s failed: %s; image left unchanged\n",fs_ops[type]->name,r == -EINVAL ? "not a valid layout for this image" : strerror(-r));
+      memcpy(atrfs->mem,save,bytes);
+      atrfs->fstype = from;
+      ++atrfs->changes;
+      ++atrfs->rawchanges;
+      free(save);
+      convert_free(&list);
+      return 1;
+   }
+   free(save);
+
+   // Tidy up whatever the allocator couldn't lay down contiguously
+   if ( fs_ops[type]->fs_defrag )
+   {
+      int fragmented;
+      do
+      {
+         fragmented = 0;
+         r = (fs_ops[type]->fs_defrag)(atrfs,&fragmented);
+      } while ( r > 0 && fragmented );
+   }
+
+   printf("Converted %d files and %d directories from %s to %s\n",list.files,list.dirs,fs_ops[from]->name,fs_ops[type]->name);
+   if ( list.short_reads ) printf("%d damaged files were copied as far as they could be read\n",list.short_reads);
+   convert_free(&list);
+   return 0;
+}
@@ -0,0 +1,449 @@
+/*
+ * dcm.c
+ *
+ * DCM (Disk Communicator) archives: the archive is decoded into memory
+ * when it is opened, so it can be mounted like any other image.  Changes
+ * are encoded back into the archive when files are closed and when the
+ * file system is unmounted.
+ *
+ * The decoder follows dcmtoatr.c, but works from a buffer with all of its
+ * state in one struct.  Most blocks are changes to the previous sector,
+ * so the whole archive is decoded in order.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#include FUSE_INCLUDE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+// MD5 library functions
+#if defined(__APPLE__)
+#  define COMMON_DIGEST_FOR_OPENSSL
+#  include <CommonCrypto/CommonDigest.h>
+#else
+#  include <openssl/md5.h>
+#endif
+#include "atrfs.h"
+
+/*
+ * Macros and defines
+ */
+#define DCM_ATR_HEADER 16
+#define DCM_PASS 0xfa // Start of a pass; 0xf9 in multi-file archives
+#define DCM_END 0x45 // End of a pass
+#define DCM_SEQUENTIAL 0x80 // Set in a block type if the next block is the next sector
+#define SECSIZE(atrfs,sec) ( ( (sec) <= 3 && (atrfs)->shortsectors ) ? 128 : (atrfs)->sectorsize )
+
+/*
+ * Archive format
+ *
+ * A pass starts with DCM_PASS, a flag byte (bit 7 for the last pass,
+ * bits 4-6 for the density), and the first sector number.  Each block
+ * is a block type, the data, and then the next sector number unless
+ * DCM_SEQUENTIAL is set.  A pass ends with DCM_END.  Block types:
+ *
+ *   0x41: Fill from an offset to the end, then bytes before it in reverse
+ *   0x43: Runs of bytes and repeated bytes
+ *   0x44: Bytes from an offset to the end; the rest is the previous sector
+ *   0x46: Same as the previous sector
+ *   0x47: Whole sector
+ *
+ * Offsets of 0 mean 256.  Sectors not in the archive are zero.
+ */
+
+/*
+ * Data types
+ */
+struct dcm {
+   char *path; // Full path of the archive, as FUSE changes directories
+   int density;
+   unsigned char md5[16]; // Of the image as last written
+};
+
+struct dcm_decoder {
+   const unsigned char *in;
+   size_t len;
+   size_t pos;
+   int bad; // Ran past the end of the archive
+   unsigned char *image; // ATR image being filled in
+   int secsize;
+   int sectors;
+   int cursec;
+   unsigned char buf[256]; // The previous sector, which blocks modify
+};
+
+/*
+ * Function prototypes
+ */
+int dcm_byte(struct dcm_decoder *d);
+int dcm_offset(struct dcm_decoder *d);
+int dcm_geometry(int density,int *secsize,int *sectors);
+int dcm_pass(struct dcm_decoder *d,int *last,int *density);
+int dcm_block(struct dcm_decoder *d,int blocktype);
+unsigned char *dcm_decode(const unsigned char *in,size_t len,size_t *size,int *density);
+size_t dcm_encode(struct atrfs *atrfs,int density,unsigned char *out);
+
+/*
+ * Functions
+ */
+
+/*
+ * dcm_byte()
+ */
+int dcm_byte(struct dcm_decoder *d)
+{
+   if ( d->pos >= d->len )
+   {
+      d->bad = 1;
+      return 0;
+   }
+   return d->in[d->pos++];
+}
+
+/*
+ * dcm_offset()
+ *
+ * An offset into a sector; 0 is 256
+ */
+int dcm_offset(struct dcm_decoder *d)
+{
+   int c = dcm_byte(d);
+   return c ? c : 256;
+}
+
+/*
+ * dcm_geometry()
+ *
+ * Returns non-zero for an unknown density
+ */
+int dcm_geometry(int density,int *secsize,int *sectors)
+{
+   switch ( density )
+   {
+      case 0: *secsize = 128; *sectors = 720; return 0;
+      case 2: *secsize = 256; *sectors = 720; return 0;
+      case 4: *secsize = 128; *sectors = 1040; return 0;
+   }
+   return 1;
+}
+
+/*
+ * dcm_pass()
+ *
+ * Start of a pass; the image is created with the first one
+ */
+int dcm_pass(struct dcm_decoder *d,int *last,int *density)
+{
+   int c = dcm_byte(d);
+   int secsize,sectors;
+
+   *last = c >> 7;
+   if ( dcm_geometry((c >> 4) & 7,&secsize,&sectors) ) return 1;
+   if ( !d->image )
+   {
+      size_t size = DCM_ATR_HEADER + 3*128 + (size_t)(sectors-3) * secsize;
+      unsigned int bytes16 = (size - DCM_ATR_HEADER) >> 4;
+
+      d->image = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+      if ( d->image == MAP_FAILED )
+      {
+         d->image = NULL;
+         return 1;
+      }
+      d->image[0] = 0x96;
+      d->image[1] = 0x02;
+      diff_put(d->image+2,bytes16 & 0xffff,2);
+      diff_put(d->image+4,secsize,2);
+      diff_put(d->image+6,bytes16 >> 16,2);
+      d->secsize = secsize;
+      d->sectors = sectors;
+      *density = (c >> 4) & 7;
+   }
+   else if ( secsize != d->secsize || sectors != d->sectors ) return 1;
+   d->cursec = dcm_byte(d);
+   d->cursec |= dcm_byte(d) << 8;
+   return d->bad;
+}
+
+/*
+ * dcm_block()
+ *
+ * Decode one block into the sector buffer and store it in the image, as
+ * decode_C1() through decode_C7() in dcmtoatr.c
+ */
+int dcm_block(struct dcm_decoder *d,int blocktype)
+{
+   int secoff,tmpoff,c;
+   int bytes = d->cursec < 4 ? 128 : d->secsize;
+
+   switch ( blocktype & ~DCM_SEQUENTIAL )
+   {
+      case 0x41:
+         tmpoff = dcm_offset(d);
+         c = dcm_byte(d);
+         if ( tmpoff > d->secsize ) return 1;
+         memset(d->buf,c,d->secsize);
+         for ( secoff=tmpoff-1;secoff>=0;--secoff ) d->buf[secoff] = dcm_byte(d);
+         break;
+      case 0x43:
+         secoff = 0;
+         do
+         {
+            tmpoff = secoff ? dcm_offset(d) : dcm_byte(d);
+            if ( tmpoff > d->secsize || d->bad ) return 1;
+            for ( ;secoff<tmpoff;++secoff ) d->buf[secoff] = dcm_byte(d);
+            if ( secoff == d->secsize ) break;
+            tmpoff = dcm_offset(d);
+            c = dcm_byte(d);
+            if ( tmpoff > d->secsize || d->bad ) return 1;
+            for ( ;secoff<tmpoff;++secoff ) d->buf[secoff] = c;
+         } while ( secoff < d->secsize );
+         break;
+      case 0x44:
+         tmpoff = dcm_offset(d);
+         for ( secoff=tmpoff;secoff<d->secsize;++secoff ) d->buf[secoff] = dcm_byte(d);
+         break;
+      case 0x46:
+         break;
+      case 0x47:
+         for ( secoff=0;secoff<bytes;++secoff ) d->buf[secoff] = dcm_byte(d);
+         break;
+      default:
+         return 1;
+   }
+   if ( d->bad || d->cursec < 1 || d->cursec > d->sectors ) return 1;
+   size_t off = d->cursec < 4 ? (size_t)(d->cursec-1) * 128 : 3*128 + (size_t)(d->cursec-4) * d->secsize;
+   memcpy(d->image + DCM_ATR_HEADER + off,d->buf,bytes);
+   if ( blocktype & DCM_SEQUENTIAL ) ++d->cursec;
+   else
+   {
+      d->cursec = dcm_byte(d);
+      d->cursec |= dcm_byte(d) << 8;
+   }
+   return d->bad;
+}
+
+/*
+ * dcm_decode()
+ *
+ * Decode a whole archive into a new anonymous mapping of an ATR image.
+ * Returns NULL if it is not a complete archive.
+ */
+unsigned char *dcm_decode(const unsigned char *in,size_t len,size_t *size,int *density)
+{
+   struct dcm_decoder d;
+   int working = 0, last = 0;
+
+   memset(&d,0,sizeof(d));
+   d.in = in;
+   d.len = len;
+   if ( len < 4 || (in[0] != DCM_PASS && in[0] != 0xf9) ) return NULL;
+   while ( 1 )
+   {
+      int blocktype = dcm_byte(&d);
+      int r;
+
+      if ( d.bad ) break;
+      if ( blocktype == DCM_PASS || blocktype == 0xf9 )
+      {
+         if ( working ) break;
+         r = dcm_pass(&d,&last,density);
+         working = 1;
+      }
+      else if ( blocktype == DCM_END )
+      {
+         if ( !working ) break;
+         working = 0;
+         if ( last )
+         {
+            *size = DCM_ATR_HEADER + 3*128 + (size_t)(d.sectors-3) * d.secsize;
+            return d.image;
+         }
+         continue;
+      }
+      else if ( !working ) break;
+      else r = dcm_block(&d,blocktype);
+      if ( r ) break;
+   }
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: Not a complete DCM archive; stopped at byte %lu of %lu\n",__FUNCTION__,(unsigned long)d.pos,(unsigned long)len);
+   if ( d.image ) munmap(d.image,DCM_ATR_HEADER + 3*128 + (size_t)(d.sectors-3) * d.secsize);
+   return NULL;
+}
+
+/*
+ * dcm_open()
+ *
+ * Called when opening an image: if it is a DCM archive, replace the
+ * mapping with the decoded image.  Anything that doesn't decode as a
+ * complete archive is left alone, as a raw image could start with the
+ * same byte.  Returns non-zero on errors.
+ */
+int dcm_open(struct atrfs *atrfs)
+{
+   unsigned char *image;
+   size_t size;
+   int density = 0;
+   char path[PATH_MAX];
+
+   if ( atrfs->atrsize < 4 || (((unsigned char *)atrfs->atrmem)[0] != DCM_PASS && ((unsigned char *)atrfs->atrmem)[0] != 0xf9) ) return 0;
+   image = dcm_decode(atrfs->atrmem,atrfs->atrsize,&size,&density);
+   if ( !image ) return 0;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s: DCM archive of %lu bytes\n",__FUNCTION__,options.filename,(unsigned long)size);
+
+   struct dcm *dcm = calloc(1,sizeof(*dcm));
+   if ( !dcm || !realpath(options.filename,path) || !(dcm->path = strdup(path)) )
+   {
+      free(dcm);
+      munmap(image,size);
+      return 1;
+   }
+   dcm->density = density;
+   MD5(image,size,dcm->md5);
+   munmap(atrfs->atrmem,atrfs->atrsize);
+   atrfs->atrmem = image;
+   atrfs->mem = (char *)image + DCM_ATR_HEADER;
+   atrfs->atrsize = size;
+   atrfs->atrstat.st_size = size;
+   atrfs->dcm = dcm;
+   return 0;
+}
+
+/*
+ * dcm_encode()
+ *
+ * Encode the image as a one-pass archive.  Zero sectors are left out, and
+ * each sector uses whichever block type is shortest.  'prev' follows the
+ * decoder's sector buffer, which blocks for boot sectors only partly
+ * replace.  'out' must have room for a whole block for every sector.
+ *
+ * Returns the archive size.
+ */
+size_t dcm_encode(struct atrfs *atrfs,int density,unsigned char *out)
+{
+   unsigned char prev[256];
+   unsigned char *o = out;
+   int sec,next;
+
+   memset(prev,0,sizeof(prev));
+   // Find the first sector to store
+   for ( next=1;next<=atrfs->sectors;++next )
+   {
+      unsigned char *s = SECTOR(next);
+      if ( s[0] || memcmp(s,s+1,SECSIZE(atrfs,next)-1) ) break;
+   }
+   *o++ = DCM_PASS;
+   *o++ = 0x80 | (density << 4); // Last pass
+   diff_put(o,next <= atrfs->sectors ? next : 1,2);
+   o += 2;
+   while ( next <= atrfs->sectors )
+   {
+      const unsigned char *data = SECTOR(next);
+      int bytes = SECSIZE(atrfs,next);
+      int fill,c1,c4;
+      unsigned char *type = o++;
+
+      sec = next;
+      // Cost of 0x41: offset, fill, and the bytes before the fill
+      for ( fill=bytes;fill>1 && data[fill-1] == data[bytes-1];--fill ) ;
+      c1 = 2 + fill;
+      // Cost of 0x44: offset and the bytes after the part matching 'prev'
+      // It always reads to the end of a full sector, so not for short boot sectors
+      for ( c4=0;c4<bytes && data[c4] == prev[c4];++c4 ) ;
+      if ( c4 == bytes ) *type = 0x46;
+      else if ( c4 > 0 && c4 < 256 && bytes == atrfs->sectorsize && 2 + bytes - c4 <= c1 && 2 + bytes - c4 < 1 + bytes )
+      {
+         *type = 0x44;
+         *o++ = c4;
+         memcpy(o,data+c4,bytes-c4);
+         o += bytes-c4;
+         memcpy(prev+c4,data+c4,bytes-c4);
+      }
+      else if ( c1 < 1 + bytes )
+      {
+         *type = 0x41;
+         *o++ = fill & 0xff;
+         *o++ = data[bytes-1];
+         for ( int i=fill-1;i>=0;--i ) *o++ = data[i];
+         memset(prev,data[bytes-1],atrfs->sectorsize);
+         memcpy(prev,data,fill);
+      }
+      else
+      {
+         *type = 0x47;
+         memcpy(o,data,bytes);
+         o += bytes;
+         memcpy(prev,data,bytes);
+      }
+
+      // The next sector to store, or none
+      for ( next=sec+1;next<=atrfs->sectors;++next )
+      {
+         unsigned char *s = SECTOR(next);
+         if ( s[0] || memcmp(s,s+1,SECSIZE(atrfs,next)-1) ) break;
+      }
+      if ( next == sec+1 || next > atrfs->sectors ) *type |= DCM_SEQUENTIAL;
+      else
+      {
+         diff_put(o,next,2);
+         o += 2;
+      }
+   }
+   *o++ = DCM_END;
+   return o - out;
+}
+
+/*
+ * dcm_flush()
+ *
+ * If the image has changed, encode it and replace the archive.  It is
+ * written to a temporary file and renamed so the old archive is intact
+ * if anything fails.
+ *
+ * Returns 0 or a negative errno.
+ */
+int dcm_flush(struct atrfs *atrfs)
+{
+   struct dcm *dcm = atrfs->dcm;
+   unsigned char md5[16];
+   unsigned char *out;
+   char *tmp;
+   FILE *f;
+   int r = 0;
+
+   if ( !dcm || atrfs->readonly ) return 0;
+   MD5(atrfs->atrmem,atrfs->atrsize,md5);
+   if ( memcmp(md5,dcm->md5,sizeof(md5)) == 0 ) return 0;
+   out = malloc(8 + (size_t)atrfs->sectors * (atrfs->sectorsize + 4));
+   tmp = malloc(strlen(dcm->path)+5);
+   if ( !out || !tmp )
+   {
+      free(out);
+      free(tmp);
+      return -ENOMEM;
+   }
+   size_t len = dcm_encode(atrfs,dcm->density,out);
+   sprintf(tmp,"%s.tmp",dcm->path);
+   f = fopen(tmp,"w");
+   if ( !f ) r = -errno;
+   else
+   {
+      if ( fwrite(out,len,1,f) != 1 ) r = -EIO;
+      if ( fclose(f) != 0 && !r ) r = -EIO;
+      if ( !r && rename(tmp,dcm->path) != 0 ) r = -errno;
+      if ( r ) unlink(tmp);
+   }
+   if ( !r ) memcpy(dcm->md5,md5,sizeof(md5));
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s: %lu bytes%s%s\n",__FUNCTION__,dcm->path,(unsigned long)len,r ? ": " : "",r ? strerror(-r) : "");
+   free(out);
+   free(tmp);
+   return r;
+}
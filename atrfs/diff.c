@@ -0,0 +1,440 @@
+/*
+ * diff.c
+ *
+ * Compare two images for --diff, reporting which files changed, or
+ * write the differing sectors as a patch that --apply can replay.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#include FUSE_INCLUDE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+// MD5 library functions
+#if defined(__APPLE__)
+#  define COMMON_DIGEST_FOR_OPENSSL
+#  include <CommonCrypto/CommonDigest.h>
+#else
+#  include <openssl/md5.h>
+#endif
+#include "atrfs.h"
+
+/*
+ * Macros and defines
+ */
+#define DIFF_BLOCK 64 // Sectors compared at once before looking at single sectors
+#define PATCH_MAGIC "ATRDIFF1"
+#define SECSIZE(atrfs,sec) ( ( (sec) <= 3 && (atrfs)->shortsectors ) ? 128 : (atrfs)->sectorsize )
+
+/*
+ * Patch file format (all numbers little-endian)
+ *
+ *   "ATRDIFF1"
+ *   MD5 of the original image file (16 bytes)
+ *   MD5 of the patched image file (16 bytes)
+ *   Sector count (4 bytes), sector size (2 bytes)
+ *   Runs: first sector (4 bytes), count (2 bytes), then the sector data
+ *   End: a run with first sector 0
+ */
+
+/*
+ * Function prototypes
+ */
+int diff_open(struct atrfs *atrfs,const char *filename);
+int diff_block_equal(struct atrfs *a,struct atrfs *b,int sec,int count);
+void diff_ranges(char *b,const int *list,int count);
+int diff_name_cmp(const void *a,const void *b);
+int diff_name_find(char **sorted,int count,const char *name);
+void diff_put(unsigned char *b,unsigned int value,int bytes);
+unsigned int diff_get(const unsigned char *b,int bytes);
+
+/*
+ * Functions
+ */
+
+/*
+ * diff_open()
+ *
+ * Open and detect an image into 'atrfs'
+ */
+int diff_open(struct atrfs *atrfs,const char *filename)
+{
+   memset(&master_atrfs,0,sizeof(master_atrfs));
+   options.filename = filename;
+   if ( atr_preinit() )
+   {
+      fprintf(stderr,"Unable to open image %s\n",filename);
+      return 1;
+   }
+   *atrfs = master_atrfs;
+   return 0;
+}
+
+/*
+ * diff_block_equal()
+ *
+ * True if 'count' sectors starting at 'sec' match in both images
+ *
+ * The sectors are contiguous in both images, so this is a single
+ * memcmp(), which the C library does with wide vector compares.
+ */
+int diff_block_equal(struct atrfs *a,struct atrfs *b,int sec,int count)
+{
+   struct atrfs *atrfs = a;
+   char *pa = SECTOR(sec);
+   char *last = (char *)SECTOR(sec+count-1) + SECSIZE(a,sec+count-1);
+   atrfs = b;
+   char *pb = SECTOR(sec);
+
+   return memcmp(pa,pb,last-pa) == 0;
+}
+
+/*
+ * diff_ranges()
+ *
+ * Format a sorted sector list as "4-6,9"
+ */
+void diff_ranges(char *b,const int *list,int count)
+{
+   char *start = b;
+
+   *b = 0;
+   for ( int i=0,j;i<count;i=j )
+   {
+      for ( j=i+1;j<count && list[j] == list[j-1]+1;++j ) ;
+      if ( i ) b+=sprintf(b,",");
+      if ( j-i == 1 ) b+=sprintf(b,"%d",list[i]);
+      else b+=sprintf(b,"%d-%d",list[i],list[j-1]);
+      if ( j < count && b - start > 80 )
+      {
+         sprintf(b,",...");
+         return;
+      }
+   }
+}
+
+int diff_name_cmp(const void *a,const void *b)
+{
+   return strcmp(*(char * const *)a,*(char * const *)b);
+}
+
+/*
+ * diff_name_find()
+ *
+ * True if 'name' is in the sorted owner list
+ */
+int diff_name_find(char **sorted,int count,const char *name)
+{
+   return bsearch(&name,sorted,count,sizeof(*sorted),diff_name_cmp) != NULL;
+}
+
+void diff_put(unsigned char *b,unsigned int value,int bytes)
+{
+   for ( int i=0;i<bytes;++i ) b[i] = value >> (8*i);
+}
+
+unsigned int diff_get(const unsigned char *b,int bytes)
+{
+   unsigned int value = 0;
+   for ( int i=bytes-1;i>=0;--i ) value = value << 8 | b[i];
+   return value;
+}
+
+/*
+ * diff_images()
+ *
+ * Entry point for --diff: compare two images
+ *
+ * Differing sectors are mapped back to the files that own them using each
+ * image's sector map, where the file system supports one.  A file that
+ * only exists in one image is reported as added or deleted even if none
+ * of its sectors changed.  With --patch=<file>, the differing sectors are
+ * written as a patch instead.
+ */
+int diff_images(int count,char *names[])
+{
+   struct atrfs old,new;
+   struct atrfs *atrfs;
+   int *diffs;
+   int ndiffs = 0;
+
+   if ( count != 2 )
+   {
+      fprintf(stderr,"--diff needs two images: <old> <new>\n");
+      return 1;
+   }
+   if ( diff_open(&old,names[0]) || diff_open(&new,names[1]) ) return 1;
+   if ( old.sectorsize != new.sectorsize || old.shortsectors != new.shortsectors || old.sectors != new.sectors )
+   {
+      fprintf(stderr,"Images have different geometry: %d sectors of %d bytes vs. %d sectors of %d bytes\n",old.sectors,old.sectorsize,new.sectors,new.sectorsize);
+      return 1;
+   }
+
+   // Find the differing sectors, skipping over identical blocks
+   diffs = malloc((new.sectors+1)*sizeof(*diffs));
+   for ( int sec=1;sec<=new.sectors;sec+=DIFF_BLOCK )
+   {
+      int n = new.sectors - sec + 1;
+      if ( n > DIFF_BLOCK ) n = DIFF_BLOCK;
+      if ( diff_block_equal(&old,&new,sec,n) ) continue;
+      for ( int i=sec;i<sec+n;++i )
+      {
+         if ( !diff_block_equal(&old,&new,i,1) ) diffs[ndiffs++] = i;
+      }
+   }
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d of %d sectors differ\n",__FUNCTION__,ndiffs,new.sectors);
+
+   if ( options.patch )
+   {
+      FILE *f = fopen(options.patch,"w");
+      unsigned char head[64];
+      int r = 0;
+
+      if ( !f )
+      {
+         fprintf(stderr,"Unable to create patch file %s\n",options.patch);
+         free(diffs);
+         return 1;
+      }
+      memcpy(head,PATCH_MAGIC,8);
+      MD5(old.atrmem,old.atrsize,head+8);
+      MD5(new.atrmem,new.atrsize,head+24);
+      diff_put(head+40,new.sectors,4);
+      diff_put(head+44,new.sectorsize,2);
+      r |= fwrite(head,46,1,f) != 1;
+      atrfs = &new;
+      for ( int i=0,j;i<ndiffs;i=j )
+      {
+         for ( j=i+1;j<ndiffs && diffs[j] == diffs[j-1]+1 && j-i < 0xffff;++j ) ;
+         diff_put(head,diffs[i],4);
+         diff_put(head+4,j-i,2);
+         r |= fwrite(head,6,1,f) != 1;
+         char *first = SECTOR(diffs[i]);
+         char *last = (char *)SECTOR(diffs[j-1]) + SECSIZE(atrfs,diffs[j-1]);
+         r |= fwrite(first,last-first,1,f) != 1;
+      }
+      memset(head,0,6);
+      r |= fwrite(head,6,1,f) != 1;
+      r |= fclose(f) != 0;
+      free(diffs);
+      if ( r )
+      {
+         fprintf(stderr,"Error writing patch file %s\n",options.patch);
+         return 1;
+      }
+      printf("Patch with %d sectors written to %s\n",ndiffs,options.patch);
+      return 0;
+   }
+
+   printf("%s: %s\n%s: %s\n",names[0],fs_ops[old.fstype]->name,names[1],fs_ops[new.fstype]->name);
+   if ( !ndiffs )
+   {
+      printf("Images are identical\n");
+      free(diffs);
+      return 0;
+   }
+
+   // Count differing sectors for each owner, preferring the new image's map
+   struct sectormap *smold = sectormap_build(&old);
+   struct sectormap *smnew = sectormap_build(&new);
+   int nold = smold ? smold->num_owners : 0;
+   int nnew = smnew ? smnew->num_owners : 0;
+   int **oldsecs = calloc(nold+1,sizeof(*oldsecs));
+   int **newsecs = calloc(nnew+1,sizeof(*newsecs));
+   int *oldcount = calloc(nold+1,sizeof(*oldcount));
+   int *newcount = calloc(nnew+1,sizeof(*newcount));
+   int *unowned = malloc(ndiffs*sizeof(*unowned));
+   int nunowned = 0;
+   char *ranges = malloc(128);
+
+   for ( int i=0;i<ndiffs;++i )
+   {
+      int s = diffs[i];
+      if ( smnew && smnew->map[s].owner >= 0 )
+      {
+         int o = smnew->map[s].owner;
+         if ( !newsecs[o] ) newsecs[o] = malloc(ndiffs*sizeof(int));
+         newsecs[o][newcount[o]++] = s;
+      }
+      else if ( smold && smold->map[s].owner >= 0 )
+      {
+         int o = smold->map[s].owner;
+         if ( !oldsecs[o] ) oldsecs[o] = malloc(ndiffs*sizeof(int));
+         oldsecs[o][oldcount[o]++] = s;
+      }
+      else unowned[nunowned++] = s;
+   }
+
+   // Sorted owner names to tell changed files from added and deleted ones
+   char **oldnames = malloc((nold+1)*sizeof(char *));
+   char **newnames = malloc((nnew+1)*sizeof(char *));
+   if ( nold ) memcpy(oldnames,smold->owners,nold*sizeof(char *));
+   if ( nnew ) memcpy(newnames,smnew->owners,nnew*sizeof(char *));
+   qsort(oldnames,nold,sizeof(char *),diff_name_cmp);
+   qsort(newnames,nnew,sizeof(char *),diff_name_cmp);
+
+   printf("%d of %d sectors differ\n\n",ndiffs,new.sectors);
+   for ( int o=0;o<nnew;++o )
+   {
+      int existed = !smold || diff_name_find(oldnames,nold,smnew->owners[o]);
+      if ( existed && !newcount[o] ) continue;
+      diff_ranges(ranges,newsecs[o],newcount[o]);
+      printf("%-8s %-24s %4d sectors %s\n",existed?"changed":"added",smnew->owners[o],newcount[o],ranges);
+   }
+   for ( int o=0;o<nold;++o )
+   {
+      int exists = smnew && diff_name_find(newnames,nnew,smold->owners[o]);
+      if ( smnew && exists ) continue; // Reported above
+      if ( !smnew && !oldcount[o] ) continue; // No way to tell if it was deleted
+      if ( !oldcount[o] )
+      {
+         printf("%-8s %s\n","deleted",smold->owners[o]);
+         continue;
+      }
+      diff_ranges(ranges,oldsecs[o],oldcount[o]);
+      printf("%-8s %-24s %4d sectors %s\n",smnew?"deleted":"changed",smold->owners[o],oldcount[o],ranges);
+   }
+   if ( nunowned )
+   {
+      diff_ranges(ranges,unowned,nunowned);
+      printf("%-8s %-24s %4d sectors %s\n","changed",smnew||smold?"[unused sectors]":"[no file map]",nunowned,ranges);
+   }
+
+   for ( int o=0;o<nold;++o ) free(oldsecs[o]);
+   for ( int o=0;o<nnew;++o ) free(newsecs[o]);
+   free(oldsecs);
+   free(newsecs);
+   free(oldcount);
+   free(newcount);
+   free(oldnames);
+   free(newnames);
+   free(unowned);
+   free(ranges);
+   free(diffs);
+   sectormap_free(smold);
+   sectormap_free(smnew);
+   return 0;
+}
+
+/*
+ * diff_apply()
+ *
+ * Entry point for --apply=<patch>: write a --diff patch into an image
+ *
+ * The image must match the one the patch was made from; the result is
+ * checked against the patched image's checksum.
+ */
+int diff_apply(int count,char *names[])
+{
+   struct atrfs image;
+   struct atrfs *atrfs = &image;
+   unsigned char head[46],digest[16];
+   FILE *f;
+   int applied = 0;
+
+   if ( count != 1 )
+   {
+      fprintf(stderr,"--apply needs one image to patch\n");
+      return 1;
+   }
+   f = fopen(options.apply,"r");
+   if ( !f )
+   {
+      fprintf(stderr,"Unable to open patch file %s\n",options.apply);
+      return 1;
+   }
+   if ( fread(head,sizeof(head),1,f) != 1 || memcmp(head,PATCH_MAGIC,8) != 0 )
+   {
+      fprintf(stderr,"%s is not an image patch\n",options.apply);
+      fclose(f);
+      return 1;
+   }
+   if ( diff_open(&image,names[0]) )
+   {
+      fclose(f);
+      return 1;
+   }
+   if ( image.readonly )
+   {
+      fprintf(stderr,"Image %s is read-only\n",names[0]);
+      fclose(f);
+      return 1;
+   }
+   MD5(image.atrmem,image.atrsize,digest);
+   if ( memcmp(digest,head+24,16) == 0 )
+   {
+      printf("Patch already applied to %s\n",names[0]);
+      fclose(f);
+      return 0;
+   }
+   if ( memcmp(digest,head+8,16) != 0 || (int)diff_get(head+40,4) != image.sectors || (int)diff_get(head+44,2) != image.sectorsize )
+   {
+      fprintf(stderr,"Image %s is not the one the patch was made from\n",names[0]);
+      fclose(f);
+      return 1;
+   }
+
+   // Read every run before writing any, so a damaged patch changes nothing
+   struct run { int sec; int n; size_t len; char *data; } *runs = NULL;
+   int nruns = 0, r = 0;
+   while ( !r )
+   {
+      unsigned char rh[6];
+      if ( fread(rh,6,1,f) != 1 ) r = 1;
+      else
+      {
+         int sec = diff_get(rh,4), n = diff_get(rh+4,2);
+         if ( sec == 0 ) break;
+         if ( n < 1 || sec+n-1 > image.sectors ) r = 1;
+         else
+         {
+            runs = realloc(runs,(nruns+1)*sizeof(*runs));
+            runs[nruns].sec = sec;
+            runs[nruns].n = n;
+            runs[nruns].len = ((char *)SECTOR(sec+n-1) + SECSIZE(atrfs,sec+n-1)) - (char *)SECTOR(sec);
+            runs[nruns].data = malloc(runs[nruns].len);
+            if ( fread(runs[nruns].data,runs[nruns].len,1,f) != 1 ) r = 1;
+            ++nruns;
+         }
+      }
+   }
+   fclose(f);
+   if ( !r )
+   {
+      for ( int i=0;i<nruns;++i )
+      {
+         char *dst = SECTOR(runs[i].sec);
+         memcpy(dst,runs[i].data,runs[i].len);
+         applied += runs[i].n;
+      }
+      MD5(image.atrmem,image.atrsize,digest);
+      msync(image.atrmem,image.atrsize,MS_SYNC);
+      if ( image_flush(&image) )
+      {
+         fprintf(stderr,"Unable to write image %s\n",names[0]);
+         applied = -1;
+      }
+   }
+   for ( int i=0;i<nruns;++i ) free(runs[i].data);
+   free(runs);
+   if ( r )
+   {
+      fprintf(stderr,"Patch file %s is damaged; image not changed\n",options.apply);
+      return 1;
+   }
+   if ( applied < 0 ) return 1;
+   if ( memcmp(digest,head+24,16) != 0 )
+   {
+      fprintf(stderr,"Patched image %s does not match the expected result\n",names[0]);
+      return 1;
+   }
+   printf("Applied %d sectors to %s\n",applied,names[0]);
+   return 0;
+}
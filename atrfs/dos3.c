@@ -82,6 +82,7 @@ enum dos3_vtoc_entry {
  * Function prototypes
  */
 int dos3_sanity(struct atrfs *atrfs);
+int dos3_score(struct atrfs *atrfs);
 int dos3_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf);
 int dos3_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
 int dos3_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, off_t offset);
@@ -94,6 +95,8 @@ int dos3_truncate(struct atrfs *atrfs,const char *path, off_t size);
 int dos3_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
 int dos3_newfs(struct atrfs *atrfs);
 char *dos3_fsinfo(struct atrfs *atrfs);
+int dos3_sectormap(struct atrfs *atrfs,struct sectormap *sm);
+int dos3_check(struct atrfs *atrfs,struct fscheck *ck);
 
 /*
  * Global variables
@@ -102,6 +105,7 @@ const struct fs_ops dos3_ops = {
    .name = "Atari DOS 3",
    .fstype = "dos3",
    .fs_sanity = dos3_sanity,
+   .fs_score = dos3_score,
    .fs_getattr = dos3_getattr,
    .fs_readdir = dos3_readdir,
    .fs_read = dos3_read,
@@ -117,6 +121,8 @@ const struct fs_ops dos3_ops = {
    .fs_statfs = dos3_statfs,
    .fs_newfs = dos3_newfs,
    .fs_fsinfo = dos3_fsinfo,
+   .fs_sectormap = dos3_sectormap,
+   .fs_check = dos3_check,
 };
 
 const unsigned char bootsectors[] = {
@@ -364,6 +370,19 @@ int dos3_sanity(struct atrfs *atrfs)
    return 0;
 }
 
+/*
+ * dos3_score()
+ *
+ * Quick check before dos3_sanity(); 0 if it would fail
+ */
+int dos3_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectorsize != 128 ) return 0;
+   struct sector1 *sec1 = SECTOR(1);
+   if ( sec1->boot_sectors != 9 ) return 0;
+   return 2; // Nothing else uses 9 boot sectors
+}
+
 /*
  * dos3_getattr()
  */
@@ -413,6 +432,34 @@ int dos3_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
    return 0; // Whatever, don't really care
 }
 
+/*
+ * dos3_dirent_name()
+ *
+ * Convert the 8+3 name to a string with a '.' if there is an extension
+ */
+void dos3_dirent_name(const struct dos3_dir_entry *dirent,char *name)
+{
+   char *n = name;
+   for (int j=0;j<8;++j)
+   {
+      if ( dirent->file_name[j] == ' ' ) break;
+      *n = dirent->file_name[j];
+      ++n;
+   }
+   if ( dirent->file_ext[0] != ' ' )
+   {
+      *n = '.';
+      ++n;
+      for (int j=0;j<3;++j)
+      {
+         if ( dirent->file_ext[j] == ' ' ) break;
+         *n=dirent->file_ext[j];
+         ++n;
+      }
+   }
+   *n=0;
+}
+
 /*
  * dos3_readdir()
  */
@@ -431,25 +478,7 @@ int dos3_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_
       if ( dirent[i].status == FLAGS_ACTIVE ) continue; // Not in use
       if ( (dirent[i].status & FLAGS_OPEN) ) continue; // Hidden; incomplete writes
       char name[8+1+3+1];
-      char *n = name;
-      for (int j=0;j<8;++j)
-      {
-         if ( dirent[i].file_name[j] == ' ' ) break;
-         *n = dirent[i].file_name[j];
-         ++n;
-      }
-      if ( dirent[i].file_ext[0] != ' ' )
-      {
-         *n = '.';
-         ++n;
-         for (int j=0;j<3;++j)
-         {
-            if ( dirent[i].file_ext[j] == ' ' ) break;
-            *n=dirent[i].file_ext[j];
-            ++n;
-         }
-      }
-      *n=0;
+      dos3_dirent_name(&dirent[i],name);
       filler(buf, name, FILLER_NULL);
    }
 #if 0 // Reserved, DIR, and VTOC sectors
@@ -657,6 +686,116 @@ int dos3_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf)
    return 0;
 }
 
+/*
+ * dos3_claim_cluster()
+ *
+ * Claim the eight sectors of a data block
+ */
+void dos3_claim_cluster(struct sectormap *sm,int cluster,int owner,int position)
+{
+   for ( int i=0;i<8;++i ) sectormap_claim(sm,CLUSTER_TO_SECTOR(cluster)+i,owner,SM_DATA,position*8+i);
+}
+
+/*
+ * dos3_sectormap()
+ *
+ * The VTOC has a byte for each data block: the next block in the file,
+ * free, or reserved.  Reserved blocks aren't counted as part of the map.
+ */
+int dos3_sectormap(struct atrfs *atrfs,struct sectormap *sm)
+{
+   unsigned char *vtoc = SECTOR(24);
+   struct sector1 *sec1 = SECTOR(1);
+   struct dos3_dir_entry *dirent = SECTOR(16);
+   int owner;
+
+   for ( int c=0;c<=MAX_CLUSTER && c<0x80;++c )
+   {
+      if ( vtoc[c] == VTOC_RESERVED ) continue;
+      for ( int i=0;i<8;++i ) sm->map[CLUSTER_TO_SECTOR(c)+i].bitmap = ( vtoc[c] == VTOC_FREE ) ? SM_FREE : SM_USED;
+   }
+   owner = sectormap_owner(sm,"[boot]");
+   for ( int i=1;i<=sec1->boot_sectors && i<16;++i ) sectormap_claim(sm,i,owner,SM_SYSTEM,i-1);
+   owner = sectormap_owner(sm,"/");
+   for ( int i=0;i<8;++i ) sectormap_claim(sm,16+i,owner,SM_DIR,i);
+   sectormap_claim(sm,24,sectormap_owner(sm,"[vtoc]"),SM_SYSTEM,0);
+
+   for ( int i=1;i<64;++i ) // Entry 0 is info about the file system
+   {
+      char name[1+8+1+3+1];
+
+      if ( !dirent[i].status ) break;
+      if ( !(dirent[i].status & FLAGS_IN_USE) ) continue;
+      name[0] = '/';
+      dos3_dirent_name(&dirent[i],name+1);
+      owner = sectormap_owner(sm,name);
+      int c = dirent[i].start;
+      for ( int n=0;c <= MAX_CLUSTER && n<0x80;++n )
+      {
+         int seen = sm->map[CLUSTER_TO_SECTOR(c)].claims; // Stop if the chain loops
+         dos3_claim_cluster(sm,c,owner,n);
+         if ( seen || vtoc[c] > 0x7f ) break;
+         c = vtoc[c];
+      }
+   }
+   return 0;
+}
+
+/*
+ * dos3_check()
+ *
+ * Check each file's chain of blocks against its directory entry, and the
+ * VTOC against the blocks in use.  There is no write support, so nothing
+ * is repaired.
+ */
+int dos3_check(struct atrfs *atrfs,struct fscheck *ck)
+{
+   unsigned char *vtoc = SECTOR(24);
+   struct dos3_dir_entry *dirent = SECTOR(16);
+
+   if ( ck->repair ) fscheck_note(ck,"repairs are not supported for %s",dos3_ops.name);
+   ck->repair = 0;
+   for ( int i=1;i<64;++i )
+   {
+      char name[8+1+3+1];
+      int c = dirent[i].start, n = 0, ok = 0;
+
+      if ( !dirent[i].status ) break;
+      if ( !(dirent[i].status & FLAGS_IN_USE) ) continue;
+      dos3_dirent_name(&dirent[i],name);
+      while ( 1 )
+      {
+         if ( c > MAX_CLUSTER )
+         {
+            fscheck_problem(ck,0,"/%s: chain of blocks runs off the disk after %d blocks",name,n);
+            break;
+         }
+         if ( ++n > TOTAL_CLUSTERS )
+         {
+            fscheck_problem(ck,0,"/%s: chain of blocks loops back on itself",name);
+            break;
+         }
+         if ( vtoc[c] == VTOC_EOF )
+         {
+            ok = 1;
+            break;
+         }
+         if ( vtoc[c] > 0x7f )
+         {
+            fscheck_problem(ck,0,"/%s: chain of blocks ends at block %d, which is marked %s instead of end-of-file",name,c,vtoc[c] == VTOC_FREE ? "free" : "reserved");
+            break;
+         }
+         c = vtoc[c];
+      }
+      if ( ok && dirent[i].blocks != n )
+      {
+         fscheck_problem(ck,0,"/%s: directory entry says %d blocks, but the chain has %d",name,dirent[i].blocks,n);
+      }
+   }
+   fscheck_bitmap(ck,atrfs,1,NULL);
+   return 0;
+}
+
 /*
  * dos3_fsinfo()
  */
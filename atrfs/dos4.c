@@ -183,6 +183,7 @@ struct dos4_vtoc {
  * Function prototypes
  */
 int dos4_sanity(struct atrfs *atrfs);
+int dos4_score(struct atrfs *atrfs);
 int dos4_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf);
 int dos4_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
 int dos4_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, off_t offset);
@@ -195,6 +196,8 @@ int dos4_truncate(struct atrfs *atrfs,const char *path, off_t size);
 int dos4_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
 int dos4_newfs(struct atrfs *atrfs);
 char *dos4_fsinfo(struct atrfs *atrfs);
+int dos4_sectormap(struct atrfs *atrfs,struct sectormap *sm);
+int dos4_check(struct atrfs *atrfs,struct fscheck *ck);
 
 /*
  * Global variables
@@ -203,6 +206,7 @@ const struct fs_ops dos4_ops = {
    .name = "Atari DOS 4",
    .fstype = "dos4",
    .fs_sanity = dos4_sanity,
+   .fs_score = dos4_score,
    .fs_getattr = dos4_getattr,
    .fs_readdir = dos4_readdir,
    .fs_read = dos4_read,
@@ -215,6 +219,8 @@ const struct fs_ops dos4_ops = {
    .fs_statfs = dos4_statfs,
    .fs_newfs = dos4_newfs,
    .fs_fsinfo = dos4_fsinfo,
+   .fs_sectormap = dos4_sectormap,
+   .fs_check = dos4_check,
 };
 
 static const unsigned char bootsectors[2][128*2] = {
@@ -567,6 +573,21 @@ int dos4_sanity(struct atrfs *atrfs)
    return 0;
 }
 
+/*
+ * dos4_score()
+ *
+ * Quick check before dos4_sanity(); 0 if it would fail
+ */
+int dos4_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectorsize != 128 &&  atrfs->sectorsize != 256 ) return 0;
+   if ( atrfs->sectors < (VTOC_CLUSTER+2)*CLUSTER_SIZE - 1 ) return 0;
+   if ( MAX_CLUSTER > 0xff ) return 0;
+   struct dos4_vtoc *vtoc = VTOC_START;
+   if ( vtoc->format != 'R' && vtoc->format != 'C' ) return 0;
+   return 1;
+}
+
 /*
  * dos4_getattr()
  */
@@ -613,6 +634,34 @@ int dos4_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
    return 0;
 }
 
+/*
+ * dos4_dirent_name()
+ *
+ * Convert the 8+3 name to a string with a '.' if there is an extension
+ */
+void dos4_dirent_name(const struct dos4_dir_entry *dirent,char *name)
+{
+   char *n = name;
+   for (int j=0;j<8;++j)
+   {
+      if ( dirent->file_name[j] == ' ' ) break;
+      *n = dirent->file_name[j];
+      ++n;
+   }
+   if ( dirent->file_ext[0] != ' ' )
+   {
+      *n = '.';
+      ++n;
+      for (int j=0;j<3;++j)
+      {
+         if ( dirent->file_ext[j] == ' ' ) break;
+         *n=dirent->file_ext[j];
+         ++n;
+      }
+   }
+   *n=0;
+}
+
 /*
  * dos4_readdir()
  */
@@ -631,25 +680,7 @@ int dos4_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_
       if ( (dirent[i].status & FLAGS_DELETED) ) continue;
       if ( (dirent[i].status & FLAGS_OPEN) ) continue; // Hidden; incomplete writes
       char name[8+1+3+1];
-      char *n = name;
-      for (int j=0;j<8;++j)
-      {
-         if ( dirent[i].file_name[j] == ' ' ) break;
-         *n = dirent[i].file_name[j];
-         ++n;
-      }
-      if ( dirent[i].file_ext[0] != ' ' )
-      {
-         *n = '.';
-         ++n;
-         for (int j=0;j<3;++j)
-         {
-            if ( dirent[i].file_ext[j] == ' ' ) break;
-            *n=dirent[i].file_ext[j];
-            ++n;
-         }
-      }
-      *n=0;
+      dos4_dirent_name(&dirent[i],name);
       filler(buf, name, FILLER_NULL);
    }
 
@@ -926,6 +957,138 @@ int dos4_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf)
    return 0;
 }
 
+/*
+ * dos4_valid_cluster()
+ *
+ * Non-zero if the cluster number can hold file data
+ */
+int dos4_valid_cluster(struct atrfs *atrfs,int cluster)
+{
+   if ( cluster < 8 || cluster > MAX_CLUSTER || cluster == 128 ) return 0;
+   if ( cluster == 8 && atrfs->sectorsize == 256 ) return 0; // Boot sectors on DD
+   return CLUSTER_TO_SEC(cluster)+CLUSTER_SIZE-1 <= atrfs->sectors;
+}
+
+/*
+ * dos4_sectormap()
+ *
+ * Free clusters are a linked list through the allocation table rather
+ * than a bitmap, so walk the list to find which clusters are free.
+ */
+int dos4_sectormap(struct atrfs *atrfs,struct sectormap *sm)
+{
+   struct dos4_vtoc *vtoc = VTOC_START;
+   unsigned char *map = VTOC_START;
+   struct dos4_dir_entry *dirent = DIR_START;
+   int owner;
+
+   for ( int c=8;c<=MAX_CLUSTER;++c )
+   {
+      if ( !dos4_valid_cluster(atrfs,c) ) continue;
+      for ( int i=0;i<CLUSTER_SIZE;++i ) sm->map[CLUSTER_TO_SEC(c)+i].bitmap = SM_USED;
+   }
+   for ( int c=vtoc->first_free,n=0;c && n<256;c=map[c],++n )
+   {
+      if ( !dos4_valid_cluster(atrfs,c) ) break;
+      for ( int i=0;i<CLUSTER_SIZE;++i ) sm->map[CLUSTER_TO_SEC(c)+i].bitmap = SM_FREE;
+   }
+
+   if ( atrfs->sectorsize == 256 )
+   {
+      owner = sectormap_owner(sm,"[boot]");
+      for ( int i=0;i<CLUSTER_SIZE;++i ) sectormap_claim(sm,1+i,owner,SM_SYSTEM,i);
+   }
+   owner = sectormap_owner(sm,"/");
+   int dir_sectors = 2*CLUSTER_SIZE - VTOC_SECTOR_COUNT;
+   for ( int i=0;i<dir_sectors;++i ) sectormap_claim(sm,CLUSTER_TO_SEC(VTOC_CLUSTER)+i,owner,SM_DIR,i);
+   owner = sectormap_owner(sm,"[vtoc]");
+   for ( int i=0;i<VTOC_SECTOR_COUNT;++i ) sectormap_claim(sm,CLUSTER_TO_SEC(VTOC_CLUSTER)+dir_sectors+i,owner,SM_SYSTEM,i);
+
+   for ( int i=0;i<DIR_ENTRIES;++i )
+   {
+      char name[1+8+1+3+1];
+
+      if ( !dirent[i].status ) break;
+      if ( (dirent[i].status & FLAGS_DELETED) ) continue;
+      name[0] = '/';
+      dos4_dirent_name(&dirent[i],name+1);
+      owner = sectormap_owner(sm,name);
+      for ( int c=dirent[i].start,n=0;dos4_valid_cluster(atrfs,c) && n<256;c=map[c],++n )
+      {
+         int seen = sm->map[CLUSTER_TO_SEC(c)].claims; // Stop if the chain loops
+         for ( int k=0;k<CLUSTER_SIZE;++k ) sectormap_claim(sm,CLUSTER_TO_SEC(c)+k,owner,SM_DATA,n*CLUSTER_SIZE+k);
+         if ( seen || map[c] < 8 ) break;
+      }
+   }
+   return 0;
+}
+
+/*
+ * dos4_check()
+ *
+ * Check each file's chain of clusters against its directory entry, the
+ * free list, and the free count.  There is no write support, so nothing
+ * is repaired.
+ */
+int dos4_check(struct atrfs *atrfs,struct fscheck *ck)
+{
+   struct dos4_vtoc *vtoc = VTOC_START;
+   unsigned char *map = VTOC_START;
+   struct dos4_dir_entry *dirent = DIR_START;
+   int n;
+
+   if ( ck->repair ) fscheck_note(ck,"repairs are not supported for %s",dos4_ops.name);
+   ck->repair = 0;
+   for ( int i=0;i<DIR_ENTRIES;++i )
+   {
+      char name[8+1+3+1];
+      int c = dirent[i].start, ok = 0;
+
+      if ( !dirent[i].status ) break;
+      if ( (dirent[i].status & FLAGS_DELETED) ) continue;
+      dos4_dirent_name(&dirent[i],name);
+      for ( n=1;;++n )
+      {
+         if ( !dos4_valid_cluster(atrfs,c) )
+         {
+            fscheck_problem(ck,0,"/%s: chain of clusters leads to cluster %d, which is not on the disk",name,c);
+            break;
+         }
+         if ( n > TOTAL_CLUSTERS )
+         {
+            fscheck_problem(ck,0,"/%s: chain of clusters loops back on itself",name);
+            break;
+         }
+         if ( map[c] < 8 )
+         {
+            ok = 1;
+            break;
+         }
+         c = map[c];
+      }
+      if ( ok && dirent[i].blocks != n )
+      {
+         fscheck_problem(ck,0,"/%s: directory entry says %d clusters, but the chain has %d",name,dirent[i].blocks,n);
+      }
+   }
+
+   // The free list must end, and only hold clusters in range
+   int c = vtoc->first_free;
+   for ( n=0;c && n<=TOTAL_CLUSTERS;c=map[c],++n )
+   {
+      if ( !dos4_valid_cluster(atrfs,c) )
+      {
+         fscheck_problem(ck,0,"free list leads to cluster %d, which is not on the disk",c);
+         break;
+      }
+   }
+   if ( c && n > TOTAL_CLUSTERS ) fscheck_problem(ck,0,"free list loops back on itself");
+   else if ( !c && n != vtoc->free ) fscheck_problem(ck,0,"VTOC says %d free clusters, but the free list has %d",vtoc->free,n);
+
+   fscheck_bitmap(ck,atrfs,1,NULL);
+   return 0;
+}
+
 /*
  * dos4_fsinfo()
  */
@@ -78,6 +78,7 @@
 #define MAX_PHYSICAL_CLUSTER (atrfs->sectorsize==128?(atrfs->sectors-1)/2:atrfs->sectors)
 #define MAX_CLUSTER (BYTES2(((struct dosxe_vtoc_cluster *)CLUSTER(4))->total_clusters)-1)
 #define VTOC_CLUSTER 4
+#define VALID_CLUSTER(n) ((n) >= 4 && (n) <= MAX_CLUSTER && (n) <= MAX_PHYSICAL_CLUSTER)
 #define VTOC_CLUSTERS        (((MAX_PHYSICAL_CLUSTER+7) / 8 + 10 + 255)/256)
 #define DATE_TO_YEAR(n)      (((n)[0])>>1)
 #define DATE_TO_4YEAR(n)     (DATE_TO_YEAR(n)+(DATE_TO_YEAR(n)<87?2000:1900))
@@ -205,6 +206,7 @@ enum drivetype {
  * Function prototypes
  */
 int dosxe_sanity(struct atrfs *atrfs);
+int dosxe_score(struct atrfs *atrfs);
 int dosxe_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf);
 int dosxe_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
 int dosxe_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, off_t offset);
@@ -220,6 +222,10 @@ int dosxe_utimens(struct atrfs *atrfs,const char *path, const struct timespec tv
 int dosxe_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
 int dosxe_newfs(struct atrfs *atrfs);
 char *dosxe_fsinfo(struct atrfs *atrfs);
+int dosxe_unused_sector(struct atrfs *atrfs,int sector);
+int dosxe_defrag(struct atrfs *atrfs,int *fragmented);
+int dosxe_sectormap(struct atrfs *atrfs,struct sectormap *sm);
+int dosxe_check(struct atrfs *atrfs,struct fscheck *ck);
 
 /*
  * Global variables
@@ -228,6 +234,7 @@ const struct fs_ops dosxe_ops = {
    .name = "Atari DOS XE",
    .fstype = "dosxe",
    .fs_sanity = dosxe_sanity,
+   .fs_score = dosxe_score,
    .fs_getattr = dosxe_getattr,
    .fs_readdir = dosxe_readdir,
    .fs_read = dosxe_read,
@@ -243,6 +250,10 @@ const struct fs_ops dosxe_ops = {
    .fs_statfs = dosxe_statfs,
    .fs_newfs = dosxe_newfs,
    .fs_fsinfo = dosxe_fsinfo,
+   .fs_unused_sector = dosxe_unused_sector,
+   .fs_defrag = dosxe_defrag,
+   .fs_sectormap = dosxe_sectormap,
+   .fs_check = dosxe_check,
 };
 
 /*
@@ -394,6 +405,16 @@ int dosxe_bitmap_status(struct atrfs *atrfs,int cluster)
    return (vtoc->bitmap[cluster/8] & mask) != 0; // 0 or 1
 }
 
+/*
+ * dosxe_unused_sector()
+ *
+ * Return non-zero if the physical sector is in a free cluster.
+ */
+int dosxe_unused_sector(struct atrfs *atrfs,int sector)
+{
+   return dosxe_bitmap_status(atrfs,atrfs->sectorsize==128?sector/2:sector);
+}
+
 /*
  * dosxe_free_cluster()
  */
@@ -401,6 +422,7 @@ int dosxe_free_cluster(struct atrfs *atrfs,int cluster)
 {
    if ( cluster < 4 ) return -EIO;
    if ( cluster > MAX_CLUSTER ) return -EIO;
+   sparse_free(atrfs,CLUSTER(cluster),256);
    cluster -= 1; // Make it 0-based
    struct dosxe_vtoc_cluster *vtoc = CLUSTER(VTOC_CLUSTER);
    unsigned char mask = 1<<(7-(cluster & 0x07));
@@ -414,6 +436,26 @@ int dosxe_free_cluster(struct atrfs *atrfs,int cluster)
    return 0;
 }
 
+/*
+ * dosxe_alloc_cluster()
+ */
+int dosxe_alloc_cluster(struct atrfs *atrfs,int cluster)
+{
+   if ( cluster < 4 ) return -EIO;
+   if ( cluster > MAX_CLUSTER ) return -EIO;
+   cluster -= 1; // Make it 0-based
+   struct dosxe_vtoc_cluster *vtoc = CLUSTER(VTOC_CLUSTER);
+   unsigned char mask = 1<<(7-(cluster & 0x07));
+   unsigned int byte = cluster / 8;
+   if ((vtoc->bitmap[byte] & mask) == 0) return 1; // Already in use
+   vtoc->bitmap[byte] &= ~mask;
+
+   int free_count = BYTES2(vtoc->free_clusters);
+   --free_count;
+   STOREBYTES2(vtoc->free_clusters,free_count);
+   return 0;
+}
+
 /*
  * dosxe_sanity(atrfs)
  *
@@ -456,6 +498,21 @@ int dosxe_sanity(struct atrfs *atrfs)
    return 0;
 }
 
+/*
+ * dosxe_score()
+ *
+ * Quick check before dosxe_sanity(); 0 if it would fail
+ */
+int dosxe_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectorsize != 128 && atrfs->sectorsize != 256 ) return 0;
+   struct sector1_dosxe *sec1 = SECTOR(1);
+   if ( sec1->pad_zero != 'X' ) return 0;
+   if ( sec1->boot_sectors != 3 ) return 0;
+   if ( BYTES2(sec1->exec_addr) != 0x0730 ) return 0;
+   return 3; // Flagged in sector 1
+}
+
 /*
  * dosxe_info()
  */
@@ -736,6 +793,55 @@ char *dosxe_fsinfo(struct atrfs *atrfs)
    return buf;
 }
 
+/*
+ * dosxe_dirent_stat()
+ *
+ * Fill in stat data from a directory entry
+ */
+void dosxe_dirent_stat(struct atrfs *atrfs,const struct dosxe_dir_entry *e,int isdir,struct stat *stbuf)
+{
+   struct tm tm;
+   struct timespec ts,cts;
+   memset(&tm,0,sizeof(tm));
+   tm.tm_sec=0;
+   tm.tm_min=0;
+   tm.tm_hour=12;
+   tm.tm_mday=DATE_TO_DAY(e->modification_date);
+   tm.tm_mon=DATE_TO_MONTH(e->modification_date)-1; // Want 0-11, not 1-12
+   tm.tm_year=DATE_TO_4YEAR(e->modification_date)-1900;
+   tm.tm_isdst = -1; // Have the system determine if DST is in effect
+   ts.tv_nsec = 0;
+   ts.tv_sec = mktime(&tm);
+   memset(&tm,0,sizeof(tm));
+   tm.tm_sec=0;
+   tm.tm_min=0;
+   tm.tm_hour=12;
+   tm.tm_mday=DATE_TO_DAY(e->creation_date);
+   tm.tm_mon=DATE_TO_MONTH(e->creation_date)-1; // Want 0-11, not 1-12
+   tm.tm_year=DATE_TO_4YEAR(e->creation_date)-1900;
+   tm.tm_isdst = -1; // Have the system determine if DST is in effect
+   cts.tv_nsec = 0;
+   cts.tv_sec = mktime(&tm);
+   if ( ts.tv_sec != -1 )
+   {
+      stbuf->st_mtim = ts;
+      stbuf->st_atim = ts;
+   }
+   if ( cts.tv_sec != -1 )
+   {
+      stbuf->st_ctim = cts;
+   }
+
+   if ( isdir )
+   {
+      ++stbuf->st_nlink;
+      stbuf->st_mode = MODE_DIR(atrfs->atrstat.st_mode & 0777);
+   }
+   if ( (e->status & FLAGS_LOCKED) ) stbuf->st_mode = MODE_RO(stbuf->st_mode);
+   stbuf->st_size = BYTES2(e->file_clusters) * 250 + e->bytes_in_last_cluster;
+   stbuf->st_ino = CLUSTER_TO_SEC(BYTES2(e->file_map_blocks[0])); // Unique, but not that useful
+}
+
 /*
  * dosxe_getattr()
  */
@@ -776,46 +882,7 @@ int dosxe_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
 
    if ( entry )
    {
-      struct tm tm;
-      struct timespec ts,cts;
-      memset(&tm,0,sizeof(tm));
-      tm.tm_sec=0;
-      tm.tm_min=0;
-      tm.tm_hour=12;
-      tm.tm_mday=DATE_TO_DAY(entry->modification_date);
-      tm.tm_mon=DATE_TO_MONTH(entry->modification_date)-1; // Want 0-11, not 1-12
-      tm.tm_year=DATE_TO_4YEAR(entry->modification_date)-1900;
-      tm.tm_isdst = -1; // Have the system determine if DST is in effect
-      ts.tv_nsec = 0;
-      ts.tv_sec = mktime(&tm);
-      memset(&tm,0,sizeof(tm));
-      tm.tm_sec=0;
-      tm.tm_min=0;
-      tm.tm_hour=12;
-      tm.tm_mday=DATE_TO_DAY(entry->creation_date);
-      tm.tm_mon=DATE_TO_MONTH(entry->creation_date)-1; // Want 0-11, not 1-12
-      tm.tm_year=DATE_TO_4YEAR(entry->creation_date)-1900;
-      tm.tm_isdst = -1; // Have the system determine if DST is in effect
-      cts.tv_nsec = 0;
-      cts.tv_sec = mktime(&tm);
-      if ( ts.tv_sec != -1 )
-      {
-         stbuf->st_mtim = ts;
-         stbuf->st_atim = ts;
-      }
-      if ( cts.tv_sec != -1 )
-      {
-         stbuf->st_ctim = cts;
-      }
-
-      if ( isdir && !isinfo )
-      {
-         ++stbuf->st_nlink;
-         stbuf->st_mode = MODE_DIR(atrfs->atrstat.st_mode & 0777);
-      }
-      if ( (entry->status & FLAGS_LOCKED) ) stbuf->st_mode = MODE_RO(stbuf->st_mode);
-      stbuf->st_size = BYTES2(entry->file_clusters) * 250 + entry->bytes_in_last_cluster;
-      stbuf->st_ino = CLUSTER_TO_SEC(BYTES2(entry->file_map_blocks[0])); // Unique, but not that useful
+      dosxe_dirent_stat(atrfs,entry,isdir && !isinfo,stbuf);
    }
    else
    {
@@ -838,12 +905,40 @@ int dosxe_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
    return 0; // Whatever, don't really care
 }
 
+/*
+ * dosxe_dirent_name()
+ *
+ * Convert the 8+3 name to a string with a '.' if there is an extension
+ */
+void dosxe_dirent_name(const struct dosxe_dir_entry *e,char *name)
+{
+   char *n = name;
+   for (int j=0;j<8;++j)
+   {
+      if ( e->file_name[j] == ' ' ) break;
+      *n = e->file_name[j];
+      ++n;
+   }
+   if ( e->file_ext[0] != ' ' )
+   {
+      *n = '.';
+      ++n;
+      for (int j=0;j<3;++j)
+      {
+         if ( e->file_ext[j] == ' ' ) break;
+         *n=e->file_ext[j];
+         ++n;
+      }
+   }
+   *n=0;
+}
+
 /*
  * dosxe_readdir()
  */
 int dosxe_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset)
 {
-   (void)offset;
+   (void)offset; // atrfs_filler() skips entries before the offset
 
    if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s\n",__FUNCTION__,path);
 
@@ -864,26 +959,15 @@ int dosxe_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir
          if ( e->status == 0 ) break;
          if ( e->status == FLAGS_DELETED ) continue;
          char name[8+1+3+1];
-         char *n = name;
-         for (int j=0;j<8;++j)
-         {
-            if ( e->file_name[j] == ' ' ) break;
-            *n = e->file_name[j];
-            ++n;
-         }
-         if ( e->file_ext[0] != ' ' )
+         dosxe_dirent_name(e,name);
+         struct stat st;
+         if ( dirfill_stat(buf,&st) )
          {
-            *n = '.';
-            ++n;
-            for (int j=0;j<3;++j)
-            {
-               if ( e->file_ext[j] == ' ' ) break;
-               *n=e->file_ext[j];
-               ++n;
-            }
+            dosxe_dirent_stat(atrfs,e,(e->status & FLAGS_DIR) != 0,&st);
+            r = filler(buf, name, FILLER_STAT(&st));
          }
-         *n=0;
-         filler(buf, name, FILLER_NULL);
+         else r = filler(buf, name, FILLER_NULL);
+         if ( r ) return 0;
       }
       if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s dir cluster %d -> %d\n",__FUNCTION__,path, dir_cluster_num, BYTES2(dir_cluster->next));
       dir_cluster_num = BYTES2(dir_cluster->next);
@@ -1004,6 +1088,337 @@ int dosxe_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, off
    if ( bytes_read ) return bytes_read;
    return -EOF;
 }
+
+/*
+ * dosxe_defrag_file()
+ *
+ * Move the data clusters of a file to a contiguous run of free clusters
+ * if they aren't already one, rewriting the entries in the file map
+ * clusters.  The map clusters themselves stay where they are.  Each data
+ * cluster carries its own label, so it moves intact.
+ *
+ * Return 1 if moved, 0 if left alone, -ENOSPC if no run is long enough.
+ */
+int dosxe_defrag_file(struct atrfs *atrfs,struct dosxe_dir_entry *entry)
+{
+   unsigned char **blocks = NULL;
+   int n=0,i;
+
+   // Collect the map entries for the data clusters
+   for ( int map=0;map<12;++map )
+   {
+      int map_cluster = BYTES2(entry->file_map_blocks[map]);
+      if ( !map_cluster ) break;
+      if ( map_cluster > MAX_CLUSTER )
+      {
+         free(blocks);
+         return 0; // Leave damaged files alone
+      }
+      struct dosxe_file_map_cluster *mapcluster = CLUSTER(map_cluster);
+      for ( int map_entry=0;map_entry<125;++map_entry )
+      {
+         int data_cluster_num = BYTES2(mapcluster->data_block[map_entry]);
+         if ( !data_cluster_num ) break; // EOF
+         if ( data_cluster_num > MAX_CLUSTER )
+         {
+            free(blocks);
+            return 0;
+         }
+         blocks = realloc(blocks,sizeof(*blocks)*(n+1));
+         if ( !blocks ) return -ENOMEM;
+         blocks[n++] = mapcluster->data_block[map_entry];
+      }
+   }
+   for ( i=1;i<n && BYTES2(blocks[i]) == BYTES2(blocks[0])+i;++i ) ;
+   if ( i >= n )
+   {
+      free(blocks);
+      return 0;
+   }
+
+   unsigned char *buf = malloc(n*256);
+   if ( !buf )
+   {
+      free(blocks);
+      return -ENOMEM;
+   }
+   for ( i=0;i<n;++i )
+   {
+      unsigned char *s = CLUSTER(BYTES2(blocks[i]));
+      memcpy(buf+i*256,s,256);
+      dosxe_free_cluster(atrfs,BYTES2(blocks[i]));
+   }
+
+   int start = find_free_run(atrfs,4,MAX_CLUSTER,n,dosxe_bitmap_status);
+   for ( i=0;start > 0 && i<n;++i )
+   {
+      if ( !dosxe_bitmap_status(atrfs,start+i) ) start = -1;
+   }
+   if ( start < 0 )
+   {
+      for ( i=0;i<n;++i )
+      {
+         unsigned char *s = CLUSTER(BYTES2(blocks[i]));
+         dosxe_alloc_cluster(atrfs,BYTES2(blocks[i]));
+         memcpy(s,buf+i*256,256);
+      }
+      free(buf);
+      free(blocks);
+      return -ENOSPC;
+   }
+
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d clusters from %d to %d\n",__FUNCTION__,n,BYTES2(blocks[0]),start);
+   for ( i=0;i<n;++i )
+   {
+      unsigned char *s = CLUSTER(start+i);
+      dosxe_alloc_cluster(atrfs,start+i);
+      memcpy(s,buf+i*256,256);
+      STOREBYTES2(blocks[i],start+i);
+   }
+   free(buf);
+   free(blocks);
+   return 1;
+}
+
+/*
+ * dosxe_defrag_dir()
+ *
+ * Directory clusters stay where they are; only the files in them move.
+ */
+int dosxe_defrag_dir(struct atrfs *atrfs,int dir_cluster_num,int *fragmented,int depth)
+{
+   int moved = 0;
+
+   if ( depth > 64 ) return 0; // Don't loop on a corrupted directory tree
+   while ( dir_cluster_num && dir_cluster_num < MAX_CLUSTER )
+   {
+      struct dosxe_dir_cluster *dir_cluster = CLUSTER(dir_cluster_num);
+      for (int i=0;i<5;++i)
+      {
+         struct dosxe_dir_entry *e = &dir_cluster->entries[i];
+         int r;
+
+         if ( e->status == 0 ) break;
+         if ( e->status == FLAGS_DELETED ) continue;
+         if ( e->status & FLAGS_DIR ) r = dosxe_defrag_dir(atrfs,BYTES2(e->file_map_blocks[0]),fragmented,depth+1);
+         else
+         {
+            r = dosxe_defrag_file(atrfs,e);
+            if ( r == -ENOSPC )
+            {
+               ++*fragmented;
+               r = 0;
+            }
+         }
+         if ( r<0 ) return r;
+         moved += r;
+      }
+      dir_cluster_num = BYTES2(dir_cluster->next);
+   }
+   return moved;
+}
+
+/*
+ * dosxe_defrag()
+ *
+ * There is no write support for DOS XE yet, but relocating clusters
+ * only needs the bitmap and the file maps.
+ */
+int dosxe_defrag(struct atrfs *atrfs,int *fragmented)
+{
+   return dosxe_defrag_dir(atrfs,ROOT_DIR_CLUSTER,fragmented,0);
+}
+
+/*
+ * dosxe_claim_cluster()
+ *
+ * Claim the physical sectors of a 256-byte cluster
+ */
+void dosxe_claim_cluster(struct atrfs *atrfs,struct sectormap *sm,int cluster,int owner,int use,int position)
+{
+   if ( atrfs->sectorsize == 128 )
+   {
+      sectormap_claim(sm,cluster*2,owner,use,position*2);
+      sectormap_claim(sm,cluster*2+1,owner,use,position*2+1);
+   }
+   else sectormap_claim(sm,cluster,owner,use,position);
+}
+
+/*
+ * dosxe_sectormap_dir()
+ *
+ * Claim a directory's clusters and everything in it, recursing into
+ * subdirectories.
+ */
+int dosxe_sectormap_dir(struct atrfs *atrfs,struct sectormap *sm,int dir_cluster_num,const char *dirpath,int dir_owner,int depth)
+{
+   char name[8+1+3+1];
+   char *path;
+
+   if ( depth > 32 ) return 0;
+   path = malloc(strlen(dirpath)+1+sizeof(name));
+   if ( !path ) return -ENOMEM;
+   for ( int pos=0;VALID_CLUSTER(dir_cluster_num);++pos )
+   {
+      struct dosxe_dir_cluster *dir_cluster = CLUSTER(dir_cluster_num);
+      int seen = sm->map[CLUSTER_TO_SEC(dir_cluster_num)].claims; // Stop if the chain loops
+      dosxe_claim_cluster(atrfs,sm,dir_cluster_num,dir_owner,SM_DIR,pos);
+      if ( seen ) break;
+      for (int i=0;i<5;++i)
+      {
+         struct dosxe_dir_entry *e = &dir_cluster->entries[i];
+
+         if ( e->status == 0 ) break;
+         if ( e->status == FLAGS_DELETED ) continue;
+         dosxe_dirent_name(e,name);
+         sprintf(path,"%s/%s",dirpath,name);
+         int owner = sectormap_owner(sm,path);
+         if ( e->status & FLAGS_DIR )
+         {
+            dosxe_sectormap_dir(atrfs,sm,BYTES2(e->file_map_blocks[0]),path,owner,depth+1);
+            continue;
+         }
+         for ( int map=0,seq=0;map<12;++map )
+         {
+            int map_cluster = BYTES2(e->file_map_blocks[map]);
+            if ( !VALID_CLUSTER(map_cluster) ) break;
+            dosxe_claim_cluster(atrfs,sm,map_cluster,owner,SM_MAP,map);
+            struct dosxe_file_map_cluster *mapcluster = CLUSTER(map_cluster);
+            for ( int map_entry=0;map_entry<125;++map_entry,++seq )
+            {
+               int data_cluster_num = BYTES2(mapcluster->data_block[map_entry]);
+               if ( !data_cluster_num ) break; // EOF
+               dosxe_claim_cluster(atrfs,sm,data_cluster_num,owner,SM_DATA,seq);
+            }
+         }
+      }
+      dir_cluster_num = BYTES2(dir_cluster->next);
+   }
+   free(path);
+   return 0;
+}
+
+/*
+ * dosxe_sectormap()
+ */
+int dosxe_sectormap(struct atrfs *atrfs,struct sectormap *sm)
+{
+   int owner;
+
+   for ( int i=1;i<=atrfs->sectors;++i )
+   {
+      int cluster = atrfs->sectorsize == 128 ? i/2 : i;
+      if ( cluster < 4 || cluster > MAX_CLUSTER ) continue;
+      sm->map[i].bitmap = dosxe_bitmap_status(atrfs,cluster) ? SM_FREE : SM_USED;
+   }
+   owner = sectormap_owner(sm,"[boot]");
+   for ( int i=1;i<=3;++i ) sectormap_claim(sm,i,owner,SM_SYSTEM,i-1);
+   owner = sectormap_owner(sm,"[vtoc]");
+   for ( int i=0;i<VTOC_CLUSTERS;++i ) dosxe_claim_cluster(atrfs,sm,VTOC_CLUSTER+i,owner,SM_SYSTEM,i);
+   return dosxe_sectormap_dir(atrfs,sm,ROOT_DIR_CLUSTER,"",sectormap_owner(sm,"/"),0);
+}
+
+/*
+ * dosxe_check_set()
+ *
+ * Mark a sector's cluster used or free for fscheck_bitmap()
+ */
+int dosxe_check_set(struct atrfs *atrfs,int sector,int used)
+{
+   int cluster = atrfs->sectorsize == 128 ? sector/2 : sector;
+   return used ? dosxe_alloc_cluster(atrfs,cluster) : dosxe_free_cluster(atrfs,cluster);
+}
+
+/*
+ * dosxe_check_dir()
+ *
+ * Check the file maps and cluster counts of everything in a directory,
+ * recursing into subdirectories.
+ */
+void dosxe_check_dir(struct atrfs *atrfs,struct fscheck *ck,int dir_cluster_num,const char *dirpath,int depth)
+{
+   char name[8+1+3+1];
+   char path[256];
+
+   for ( int pos=0;dir_cluster_num;++pos )
+   {
+      if ( !VALID_CLUSTER(dir_cluster_num) )
+      {
+         fscheck_problem(ck,0,"%s/: directory links to cluster %d, which is not on the disk",dirpath,dir_cluster_num);
+         ck->damaged = 1;
+         return;
+      }
+      // Cross-linked and looping directories are reported with the bitmap
+      if ( !ck->sm || ck->sm->map[CLUSTER_TO_SEC(dir_cluster_num)].claims != 1 || pos > MAX_CLUSTER ) return;
+      struct dosxe_dir_cluster *dir_cluster = CLUSTER(dir_cluster_num);
+      for (int i=0;i<5;++i)
+      {
+         struct dosxe_dir_entry *e = &dir_cluster->entries[i];
+         int n=0;
+
+         if ( e->status == 0 ) break;
+         if ( e->status == FLAGS_DELETED ) continue;
+         dosxe_dirent_name(e,name);
+         snprintf(path,sizeof(path),"%s/%s",dirpath,name);
+         if ( e->status & FLAGS_DIR )
+         {
+            if ( depth < 32 ) dosxe_check_dir(atrfs,ck,BYTES2(e->file_map_blocks[0]),path,depth+1);
+            continue;
+         }
+         for ( int map=0;map<12;++map )
+         {
+            int map_cluster = BYTES2(e->file_map_blocks[map]);
+            if ( !map_cluster ) break;
+            if ( !VALID_CLUSTER(map_cluster) )
+            {
+               fscheck_problem(ck,0,"%s: file map %d is cluster %d, which is not on the disk",path,map,map_cluster);
+               ck->damaged = 1;
+               break;
+            }
+            struct dosxe_file_map_cluster *mapcluster = CLUSTER(map_cluster);
+            for ( int map_entry=0;map_entry<125;++map_entry )
+            {
+               int data_cluster_num = BYTES2(mapcluster->data_block[map_entry]);
+               if ( !data_cluster_num ) break; // EOF
+               if ( !VALID_CLUSTER(data_cluster_num) )
+               {
+                  fscheck_problem(ck,0,"%s: cluster %d of the file is %d, which is not on the disk",path,n,data_cluster_num);
+                  ck->damaged = 1;
+               }
+               ++n;
+            }
+         }
+         // The count in the entry doesn't include the last cluster
+         if ( n != BYTES2(e->file_clusters) && n != BYTES2(e->file_clusters)+1 )
+         {
+            fscheck_problem(ck,0,"%s: directory entry says %d clusters, but the file maps have %d",path,BYTES2(e->file_clusters)+1,n);
+         }
+      }
+      dir_cluster_num = BYTES2(dir_cluster->next);
+   }
+}
+
+/*
+ * dosxe_check()
+ */
+int dosxe_check(struct atrfs *atrfs,struct fscheck *ck)
+{
+   struct dosxe_vtoc_cluster *vtoc = CLUSTER(VTOC_CLUSTER);
+   int free_count = 0;
+
+   dosxe_check_dir(atrfs,ck,ROOT_DIR_CLUSTER,"",0);
+   fscheck_bitmap(ck,atrfs,1,dosxe_check_set);
+
+   for ( int c=4;VALID_CLUSTER(c);++c ) free_count += dosxe_bitmap_status(atrfs,c);
+   if ( BYTES2(vtoc->free_clusters) != free_count )
+   {
+      int old = BYTES2(vtoc->free_clusters);
+      if ( ck->repair ) STOREBYTES2(vtoc->free_clusters,free_count);
+      fscheck_problem(ck,ck->repair,"VTOC says %d free clusters, but the bitmap has %d",old,free_count);
+   }
+   return 0;
+}
+
 // Implement these
 int dosxe_write(struct atrfs *atrfs,const char *path, const char *buf, size_t size, off_t offset);
 int dosxe_mkdir(struct atrfs *atrfs,const char *path,mode_t mode);
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <sys/mman.h>
 #include <sys/param.h>
 #include <unistd.h>
@@ -27,6 +28,13 @@
  * Macros and defines
  */
 #define GENERIC_DEBUG_THRESHOLD 4 // Only display messages from this layer if at least this debug level
+#define SECTOR_FILE(path) (strncasecmp(path,"/.sector",sizeof("/.sector")-1) == 0 && !isalpha((unsigned char)(path)[sizeof("/.sector")-1])) // Not .sectormap
+#define TEXT_SUFFIX ".txt" // With --textview, "<file>.txt" is an ASCII view of an ATASCII file
+#define ATASCII_EOL 0x9b
+#define ATASCII_TAB 0x7f
+#define BASIC_SUFFIX ".lst" // With --basicview, "<file>.lst" is the listing of a BASIC program
+#define VIEW_TEXT 1
+#define VIEW_BASIC 2
 
 /*
  * Data types
@@ -53,6 +61,12 @@ int generic_utimens(struct atrfs *atrfs,const char *path, const struct timespec
 int generic_utime(struct atrfs *atrfs,const char *path, struct utimbuf *utimbuf);
 #endif
 int generic_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
+int generic_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length);
+int generic_copy_file_range(struct atrfs *atrfs,const char *path_in, off_t offset_in, const char *path_out, off_t offset_out, size_t size);
+int generic_getxattr(struct atrfs *atrfs,const char *path, const char *name, char *value, size_t size);
+int generic_listxattr(struct atrfs *atrfs,const char *path, char *list, size_t size);
+int text_view(struct atrfs *atrfs,const char *path,char *base);
+void text_translate(char *buf,size_t size);
 
 /*
  * Global variables
@@ -81,12 +95,78 @@ const struct fs_ops generic_ops = {
    .fs_statfs = generic_statfs,
    //.fs_newfs = generic_newfs, // Only called from atrfs.c when creating new images; doesn't make sense here
    //.fs_fsinfo = generic_fsinfo, // Only called from special.c, bypassing this layer
+   .fs_fallocate = generic_fallocate,
+   .fs_copy_file_range = generic_copy_file_range,
+   .fs_getxattr = generic_getxattr,
+   .fs_listxattr = generic_listxattr,
 };
 
 /*
  * General functions
  */
 
+/*
+ * text_view()
+ *
+ * With --textview, "<file>.txt" shows a file with ATASCII end-of-line and
+ * tab characters as ASCII ones.  With --basicview, "<file>.lst" shows a
+ * tokenized BASIC program as a listing.  Neither applies if there is a
+ * real file by that name.  If 'path' is such a view, copy the path of the
+ * file to 'base' and return the view type (VIEW_TEXT or VIEW_BASIC).
+ */
+int text_view(struct atrfs *atrfs,const char *path,char *base)
+{
+   size_t suffix;
+   size_t len = strlen(path);
+   struct stat st;
+   int view;
+
+   if ( len >= PATH_MAX ) return 0;
+   if ( options.textview && len > sizeof(TEXT_SUFFIX) && strcasecmp(path+len-(sizeof(TEXT_SUFFIX)-1),TEXT_SUFFIX) == 0 )
+   {
+      view = VIEW_TEXT;
+      suffix = sizeof(TEXT_SUFFIX)-1;
+   }
+   else if ( options.basicview && len > sizeof(BASIC_SUFFIX) && strcasecmp(path+len-(sizeof(BASIC_SUFFIX)-1),BASIC_SUFFIX) == 0 )
+   {
+      view = VIEW_BASIC;
+      suffix = sizeof(BASIC_SUFFIX)-1;
+   }
+   else return 0;
+   if ( !fs_ops[atrfs->fstype] || !fs_ops[atrfs->fstype]->fs_getattr ) return 0;
+   atr_stat_defaults(&st);
+   if ( (fs_ops[atrfs->fstype]->fs_getattr)(atrfs,path,&st) == 0 ) return 0; // A real file
+   memcpy(base,path,len-suffix);
+   base[len-suffix] = 0;
+   atr_stat_defaults(&st);
+   if ( (fs_ops[atrfs->fstype]->fs_getattr)(atrfs,base,&st) != 0 ) return 0;
+   if ( !S_ISREG(st.st_mode) ) return 0;
+   return view;
+}
+
+/*
+ * text_translate()
+ *
+ * Swap the ATASCII and ASCII end-of-line and tab characters.  Each maps
+ * to one byte, so offsets in the view are offsets in the file, and
+ * reads and writes at any offset go straight to the file's sectors.  The
+ * swap is its own inverse, so any other byte that is an ASCII newline or
+ * tab survives a read and write back unchanged.
+ */
+void text_translate(char *buf,size_t size)
+{
+   for ( size_t i=0;i<size;++i )
+   {
+      switch ( (unsigned char)buf[i] )
+      {
+         case ATASCII_EOL: buf[i] = '\n'; break;
+         case '\n': buf[i] = (char)ATASCII_EOL; break;
+         case ATASCII_TAB: buf[i] = '\t'; break;
+         case '\t': buf[i] = (char)ATASCII_TAB; break;
+      }
+   }
+}
+
 /*
  * generic_getattr()
  *
@@ -97,7 +177,7 @@ int generic_getattr(struct atrfs *atrfs,const char *path,struct stat *stbuf)
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
 
    // Magic ".sector###" files
-   if ( strncasecmp(path,"/.sector",sizeof("/.sector")-1) == 0 )
+   if ( SECTOR_FILE(path) )
    {
       int sec = string_to_sector(path);
       if ( sec > 0 && sec <= master_atrfs.sectors )
@@ -116,7 +196,23 @@ int generic_getattr(struct atrfs *atrfs,const char *path,struct stat *stbuf)
    }
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_getattr )
    {
-      return (fs_ops[atrfs->fstype]->fs_getattr)(atrfs,path,stbuf);
+      char base[PATH_MAX];
+      int r = (fs_ops[atrfs->fstype]->fs_getattr)(atrfs,path,stbuf);
+      int view = r ? text_view(atrfs,path,base) : 0;
+      if ( view )
+      {
+         atr_stat_defaults(stbuf);
+         r = (fs_ops[atrfs->fstype]->fs_getattr)(atrfs,base,stbuf);
+         stbuf->st_ino |= 0x200000000; // Not the same file as the original
+      }
+      if ( view == VIEW_BASIC )
+      {
+         const char *listing = basic_view(atrfs,base);
+         if ( !listing ) return -ENOENT;
+         stbuf->st_size = strlen(listing);
+         stbuf->st_mode &= ~0222; // Read-only
+      }
+      return r;
    }
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s failure: EIO\n",__FUNCTION__,path);
    return -EIO;
@@ -151,7 +247,7 @@ int generic_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, o
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s %ld bytes at %lu\n",__FUNCTION__,path,size,offset);
 
    // Magic .sector### files: Read a raw sector
-   if ( strncasecmp(path,"/.sector",sizeof("/.sector")-1) == 0 )
+   if ( SECTOR_FILE(path) )
    {
       int sec = string_to_sector(path);
       if ( sec <= 0 || sec > atrfs->sectors ) return -ENOENT;
@@ -168,13 +264,38 @@ int generic_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, o
       return bytes;
    }
  
+   char base[PATH_MAX];
+   int view = text_view(atrfs,path,base);
+   if ( view == VIEW_BASIC )
+   {
+      const char *listing = basic_view(atrfs,base);
+      if ( !listing ) return -ENOENT;
+      size_t len = strlen(listing);
+      if ( (size_t)offset >= len ) return 0; // End of file
+      if ( size > len - offset ) size = len - offset;
+      memcpy(buf,listing+offset,size);
+      return size;
+   }
+   if ( view )
+   {
+      int r = generic_read(atrfs,base,buf,size,offset);
+      if ( r > 0 ) text_translate(buf,r);
+      return r;
+   }
+
    if ( fs_ops[ATR_SPECIAL] && fs_ops[ATR_SPECIAL]->fs_read )
    {
       int r;
       r = (fs_ops[ATR_SPECIAL]->fs_read)(atrfs,path,buf,size,offset);
       if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s special returned %d\n",__FUNCTION__,path,r);
       if ( r != 0 ) return r;
-      // If 'r' is zero, then it wasn't handled.
+      // If 'r' is zero, then it wasn't handled, unless it's the end of a special file
+      if ( fs_ops[ATR_SPECIAL]->fs_getattr )
+      {
+         struct stat st;
+         atr_stat_defaults(&st);
+         if ( (fs_ops[ATR_SPECIAL]->fs_getattr)(atrfs,path,&st) == 0 ) return 0;
+      }
    }
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_read )
    {
@@ -192,10 +313,12 @@ int generic_write(struct atrfs *atrfs,const char *path, const char *buf, size_t
 {
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s %ld bytes at %lu\n",__FUNCTION__,path,size,offset);
    if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes; // Expires cached data such as .sectormap
 
    // Magic .sector### files: Write a raw sector
-   if ( strncasecmp(path,"/.sector",sizeof("/.sector")-1) == 0 )
+   if ( SECTOR_FILE(path) )
    {
+      ++atrfs->rawchanges; // The file system module may have the sector indexed
       int sec = string_to_sector(path);
       if ( sec <= 0 || sec > atrfs->sectors ) return -ENOENT;
 
@@ -211,6 +334,20 @@ int generic_write(struct atrfs *atrfs,const char *path, const char *buf, size_t
       return bytes;
    }
 
+   char base[PATH_MAX];
+   int view = text_view(atrfs,path,base);
+   if ( view == VIEW_BASIC ) return -EACCES; // Listings are read-only
+   if ( view )
+   {
+      char *copy = malloc(size ? size : 1);
+      if ( !copy ) return -ENOMEM;
+      memcpy(copy,buf,size);
+      text_translate(copy,size);
+      int r = generic_write(atrfs,base,copy,size,offset);
+      free(copy);
+      return r;
+   }
+
    if ( fs_ops[ATR_SPECIAL] && fs_ops[ATR_SPECIAL]->fs_write )
    {
       int r;
@@ -230,6 +367,7 @@ int generic_mkdir(struct atrfs *atrfs,const char *path,mode_t mode)
 {
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_mkdir )
    {
       return (fs_ops[atrfs->fstype]->fs_mkdir)(atrfs,path,mode);
@@ -241,6 +379,7 @@ int generic_rmdir(struct atrfs *atrfs,const char *path)
 {
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_rmdir )
    {
       return (fs_ops[atrfs->fstype]->fs_rmdir)(atrfs,path);
@@ -252,6 +391,7 @@ int generic_unlink(struct atrfs *atrfs,const char *path)
 {
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_unlink )
    {
       return (fs_ops[atrfs->fstype]->fs_unlink)(atrfs,path);
@@ -268,6 +408,7 @@ int generic_rename(struct atrfs *atrfs,const char *path1, const char *path2,unsi
 {
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
 
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_rename )
    {
@@ -280,6 +421,7 @@ int generic_chmod(struct atrfs *atrfs,const char *path, mode_t mode)
 {
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_chmod )
    {
       return (fs_ops[atrfs->fstype]->fs_chmod)(atrfs,path,mode);
@@ -311,6 +453,7 @@ int generic_create(struct atrfs *atrfs,const char *path, mode_t mode)
 {
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_create )
    {
       return (fs_ops[atrfs->fstype]->fs_create)(atrfs,path,mode);
@@ -322,8 +465,13 @@ int generic_truncate(struct atrfs *atrfs,const char *path,off_t size)
 {
    if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s\n",__FUNCTION__);
    if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
    if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_truncate )
    {
+      char base[PATH_MAX];
+      int view = text_view(atrfs,path,base);
+      if ( view == VIEW_BASIC ) return -EACCES;
+      if ( view ) path = base;
       return (fs_ops[atrfs->fstype]->fs_truncate)(atrfs,path,size);
    }
    return -EIO; // Seems like the right error for not supported
@@ -352,3 +500,95 @@ int generic_utime(struct atrfs *atrfs,const char *path, struct utimbuf *utimbuf)
    return 0; // Fake success on file systems that don't have time stamps
 }
 #endif
+
+/*
+ * generic_fallocate()
+ *
+ * Preallocate space for a file.  This is only a hint to the file system
+ * to lay out the sectors contiguously, so file systems without support
+ * just report that it isn't supported.
+ */
+int generic_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length)
+{
+   if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s mode 0x%x %lu bytes at %lu\n",__FUNCTION__,path,mode,length,offset);
+   if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
+   if ( SECTOR_FILE(path) ) return -EOPNOTSUPP;
+   if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_fallocate )
+   {
+      return (fs_ops[atrfs->fstype]->fs_fallocate)(atrfs,path,mode,offset,length);
+   }
+   return -EOPNOTSUPP;
+}
+
+/*
+ * generic_copy_file_range()
+ *
+ * Copy data between two files in the image.
+ *
+ * File systems can provide a fast path that builds the new sector chain
+ * directly in the image; they return -EOPNOTSUPP for anything but the
+ * simple cases.  Otherwise, copy through the read and write functions
+ * here rather than making the kernel bounce the data through user space.
+ */
+int generic_copy_file_range(struct atrfs *atrfs,const char *path_in, off_t offset_in, const char *path_out, off_t offset_out, size_t size)
+{
+   if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s at %lu to %s at %lu, %lu bytes\n",__FUNCTION__,path_in,offset_in,path_out,offset_out,size);
+   if ( atrfs->readonly ) return -EROFS;
+   ++atrfs->changes;
+   if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_copy_file_range
+        && strncasecmp(path_in,"/.",2) != 0 && strncasecmp(path_out,"/.",2) != 0 )
+   {
+      int r = (fs_ops[atrfs->fstype]->fs_copy_file_range)(atrfs,path_in,offset_in,path_out,offset_out,size);
+      if ( r != -EOPNOTSUPP ) return r;
+   }
+
+   // Read only up to the end of the source file
+   struct stat stbuf;
+   memset(&stbuf,0,sizeof(stbuf));
+   int r = generic_getattr(atrfs,path_in,&stbuf);
+   if ( r<0 ) return r;
+   if ( offset_in >= stbuf.st_size ) return 0;
+   if ( (off_t)size > stbuf.st_size - offset_in ) size = stbuf.st_size - offset_in;
+
+   char *buf = malloc(size);
+   if ( !buf ) return -ENOMEM;
+   r = generic_read(atrfs,path_in,buf,size,offset_in);
+   if ( r > 0 ) r = generic_write(atrfs,path_out,buf,r,offset_out);
+   free(buf);
+   return r;
+}
+
+/*
+ * generic_getxattr()
+ *
+ * Extended attributes expose the directory entry and sector chain for
+ * tools that would otherwise have to parse the .info files.  Only the
+ * "user.atari." names are defined, and only for real files and
+ * directories, not the magic files.
+ */
+int generic_getxattr(struct atrfs *atrfs,const char *path, const char *name, char *value, size_t size)
+{
+   if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s %s\n",__FUNCTION__,path,name);
+   if ( strncmp(name,XATTR_PREFIX,sizeof(XATTR_PREFIX)-1) != 0 ) return -ENODATA;
+   if ( strncasecmp(path,"/.",2) == 0 ) return -ENODATA;
+   if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_getxattr )
+   {
+      return (fs_ops[atrfs->fstype]->fs_getxattr)(atrfs,path,name+sizeof(XATTR_PREFIX)-1,value,size);
+   }
+   return -ENODATA;
+}
+
+/*
+ * generic_listxattr()
+ */
+int generic_listxattr(struct atrfs *atrfs,const char *path, char *list, size_t size)
+{
+   if ( options.debug > GENERIC_DEBUG_THRESHOLD ) fprintf(stderr,"DEBUG: %s %s\n",__FUNCTION__,path);
+   if ( strncasecmp(path,"/.",2) == 0 ) return 0;
+   if ( fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_listxattr )
+   {
+      return (fs_ops[atrfs->fstype]->fs_listxattr)(atrfs,path,list,size);
+   }
+   return 0; // No attributes
+}
@@ -16,8 +16,20 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include "atrfs.h"
+#include "../basictokens.h"
 
+/*
+ * Macros and defines
+ */
+#define BASIC_HEADER_SIZE 14
+#define BASIC_VNT 0x100 // VNT address in a SAVE file; the rest follows in order
+#define BASIC_LISTING_CACHE 8 // Listings kept for .lst views
+
+/*
+ * Data types
+ */
 struct basic_header {
    unsigned char lomem[2]; // always 0000
    unsigned char vnt[2];
@@ -28,6 +40,26 @@ struct basic_header {
    unsigned char starp[2];
 };
 
+struct basic_out {
+   char *buf;
+   size_t len;
+   size_t alloc;
+   char **vname; // Variable names, or NULL
+   int vcount;
+};
+
+/*
+ * Function prototypes
+ */
+int basic_header_valid(const unsigned char *filebuf,int filesize);
+void basic_add(struct basic_out *o,const char *fmt,...);
+void basic_text(void *arg,const char *text);
+void basic_string(void *arg,const unsigned char *str,int count);
+void basic_float(void *arg,const unsigned char *f,int hex);
+void basic_variable(void *arg,int var);
+void basic_count(const unsigned char *filebuf,int start,int end,int *token_use_count,int *operand_use_count);
+char *basic_listing(const unsigned char *filebuf,int filesize);
+
 char *atr_info(const char *path,int filesize)
 {
    unsigned char *filebuf = malloc(filesize);
@@ -58,7 +90,6 @@ char *atr_info(const char *path,int filesize)
       return NULL;
    }
 
-   struct basic_header *basic=(void *)filebuf;
    // Binary load file
    if ( filesize > 6 && (
            ( filebuf[0] == 0xff && filebuf[1] == 0xff ) ||
@@ -107,13 +138,7 @@ char *atr_info(const char *path,int filesize)
       }
    }
    // BASIC save file format
-   else if ( BYTES2(basic->lomem) == 0 &&
-             BYTES2(basic->vnt) == 0x100 &&
-             BYTES2(basic->vnte) > BYTES2(basic->vnt) &&
-             BYTES2(basic->vvt) - 1 == BYTES2(basic->vnte) &&
-             BYTES2(basic->stmtab) > BYTES2(basic->vvt) &&
-             BYTES2(basic->stmcur) > BYTES2(basic->stmtab) &&
-             BYTES2(basic->starp) >= BYTES2(basic->stmcur) )
+   else if ( basic_header_valid(filebuf,filesize) )
    {
       b+=sprintf(b,"BASIC Save file\n");
    }
@@ -134,3 +159,237 @@ char *atr_info(const char *path,int filesize)
    buf = realloc(buf,strlen(buf)+1);
    return buf;
 }
+
+/*
+ * basic_header_valid()
+ *
+ * True if the file starts with an Atari BASIC SAVE header
+ */
+int basic_header_valid(const unsigned char *filebuf,int filesize)
+{
+   const struct basic_header *basic=(const void *)filebuf;
+
+   if ( filesize < BASIC_HEADER_SIZE ) return 0;
+   return ( BYTES2(basic->lomem) == 0 &&
+            BYTES2(basic->vnt) == BASIC_VNT &&
+            BYTES2(basic->vnte) > BYTES2(basic->vnt) &&
+            BYTES2(basic->vvt) - 1 == BYTES2(basic->vnte) &&
+            BYTES2(basic->stmtab) > BYTES2(basic->vvt) &&
+            BYTES2(basic->stmcur) > BYTES2(basic->stmtab) &&
+            BYTES2(basic->starp) >= BYTES2(basic->stmcur) );
+}
+
+/*
+ * basic_add()
+ */
+void basic_add(struct basic_out *o,const char *fmt,...)
+{
+   va_list ap;
+   int n;
+
+   va_start(ap,fmt);
+   n = vsnprintf(NULL,0,fmt,ap);
+   va_end(ap);
+   if ( o->len + n + 1 > o->alloc )
+   {
+      o->alloc = o->alloc * 2 + n + 1024;
+      o->buf = realloc(o->buf,o->alloc);
+   }
+   va_start(ap,fmt);
+   o->len += vsprintf(o->buf+o->len,fmt,ap);
+   va_end(ap);
+}
+
+/*
+ * basic_text()
+ */
+void basic_text(void *arg,const char *text)
+{
+   basic_add(arg,"%s",text);
+}
+
+/*
+ * basic_string()
+ *
+ * String constants, REM, and DATA text.  Inverse video shows as normal
+ * characters and anything else unprintable as '.', so the listing is
+ * plain ASCII for grep and diff.
+ */
+void basic_string(void *arg,const unsigned char *str,int count)
+{
+   for ( ;count>0;--count,++str )
+   {
+      unsigned char c = *str & 0x7f;
+      basic_add(arg,"%c",( c >= 0x20 && c < 0x7f ) ? c : '.');
+   }
+}
+
+/*
+ * basic_float()
+ */
+void basic_float(void *arg,const unsigned char *f,int hex)
+{
+   char text[BASIC_FLOAT_TEXT];
+
+   basic_float_text(text,f,hex);
+   basic_add(arg,"%s",text);
+}
+
+/*
+ * basic_variable()
+ */
+void basic_variable(void *arg,int var)
+{
+   struct basic_out *o = arg;
+
+   if ( var < o->vcount ) basic_add(o,"%s",o->vname[var]);
+   else basic_add(o,"_var_%d",var);
+}
+
+/*
+ * basic_count()
+ *
+ * Count the tokens and operands in the lines from 'start' to 'end' for
+ * basic_detect_mode()
+ */
+void basic_count(const unsigned char *filebuf,int start,int end,int *token_use_count,int *operand_use_count)
+{
+   for ( int line=start;line+3<=end; )
+   {
+      const unsigned char *l = filebuf + line;
+      int linelen = l[2];
+      if ( linelen < 4 || line + linelen > end ) break; // Damaged
+      for ( int stmt=3;stmt<linelen; )
+      {
+         int next = l[stmt];
+         if ( next <= stmt+1 || next > linelen ) break;
+         basic_count_statement(l+stmt+1,next-stmt-1,token_use_count,operand_use_count,NULL);
+         stmt = next;
+      }
+      line += linelen;
+   }
+}
+
+/*
+ * basic_listing()
+ *
+ * Detokenize a BASIC SAVE file the way LIST would show it, with newlines
+ * instead of ATASCII end-of-line characters.  The dialect is detected as
+ * basicanalyzer.c does; if no known BASIC has all the tokens used, only
+ * the Atari BASIC ones are decoded.  Returns NULL if it isn't a BASIC
+ * file.
+ */
+char *basic_listing(const unsigned char *filebuf,int filesize)
+{
+   const struct basic_header *basic=(const void *)filebuf;
+   struct basic_out o = {NULL,0,0,NULL,0};
+   struct basic_decode out = {&o,basic_text,basic_string,basic_float,basic_variable};
+   char *vname[128];
+   int token_use_count[256] = {0};
+   int operand_use_count[128] = {0};
+   int also_turbo;
+
+   if ( !basic_header_valid(filebuf,filesize) ) return NULL;
+   // Addresses in the header are relative to the VNT, which follows the header
+   const int base = BASIC_VNT - BASIC_HEADER_SIZE;
+   int vnt = BYTES2(basic->vnt) - base;
+   int vnte = BYTES2(basic->vnte) - base;
+   int stmtab = BYTES2(basic->stmtab) - base;
+   int stmcur = BYTES2(basic->stmcur) - base;
+   int starp = BYTES2(basic->starp) - base;
+   if ( stmcur > filesize ) return NULL;
+   if ( starp > filesize ) starp = filesize;
+
+   // Variable names: the last character of each has the high bit set
+   o.vname = vname;
+   for ( int i=vnt,start=vnt;i<vnte && o.vcount<128;++i )
+   {
+      if ( !(filebuf[i] & 0x80) ) continue;
+      vname[o.vcount] = malloc(i-start+2);
+      for ( int j=start;j<=i;++j ) vname[o.vcount][j-start] = filebuf[j] & 0x7f;
+      vname[o.vcount][i-start+1] = 0;
+      ++o.vcount;
+      start = i+1;
+   }
+
+   // Dialect: BASIC A+ has its own SAVE token, which shows in the immediate line
+   basic_count(filebuf,stmtab,stmcur,token_use_count,operand_use_count);
+   int save_19 = token_use_count[0x19];
+   int save_1d = token_use_count[0x1d];
+   basic_count(filebuf,stmcur,starp,token_use_count,operand_use_count);
+   int a_plus_save = ( save_19 == token_use_count[0x19] && save_1d != token_use_count[0x1d] );
+   enum basic_mode mode = basic_detect_mode(token_use_count,operand_use_count,a_plus_save,&also_turbo);
+
+   // Lines: number, length, then statements that each start with the offset of the next
+   basic_add(&o,"%s","");
+   for ( int line=stmtab;line+3<=stmcur; )
+   {
+      const unsigned char *l = filebuf + line;
+      int linelen = l[2];
+      if ( linelen < 4 || line + linelen > stmcur ) break; // Damaged
+      if ( BYTES2(l) >= 32768 ) break; // Immediate line
+      basic_add(&o,"%u ",BYTES2(l));
+      for ( int stmt=3;stmt<linelen; )
+      {
+         int next = l[stmt];
+         if ( next <= stmt+1 || next > linelen ) break;
+         basic_decode_statement(mode,l+stmt+1,next-stmt-1,&out);
+         stmt = next;
+      }
+      basic_add(&o,"\n");
+      line += linelen;
+   }
+   for ( int i=0;i<o.vcount;++i ) free(vname[i]);
+   return o.buf;
+}
+
+/*
+ * basic_view()
+ *
+ * The listing of a BASIC file for a ".lst" view, or NULL if it isn't
+ * one.  Listings are cached until the next write to the image, as a
+ * reader asks for the size and then reads in pieces.
+ */
+const char *basic_view(struct atrfs *atrfs,const char *path)
+{
+   static struct {
+      char *path;
+      unsigned int changes;
+      struct atrfs *atrfs;
+      char *listing;
+   } cache[BASIC_LISTING_CACHE];
+   static int next;
+   struct stat st;
+
+   for ( int i=0;i<BASIC_LISTING_CACHE;++i )
+   {
+      if ( cache[i].path && cache[i].atrfs == atrfs && cache[i].changes == atrfs->changes && strcmp(cache[i].path,path) == 0 ) return cache[i].listing;
+   }
+   if ( !fs_ops[atrfs->fstype]->fs_getattr || !fs_ops[atrfs->fstype]->fs_read ) return NULL;
+   atr_stat_defaults(&st);
+   if ( (fs_ops[atrfs->fstype]->fs_getattr)(atrfs,path,&st) != 0 ) return NULL;
+   if ( st.st_size < BASIC_HEADER_SIZE || st.st_size > 1024*1024 ) return NULL;
+
+   unsigned char *filebuf = malloc(st.st_size);
+   off_t got = 0;
+   if ( !filebuf ) return NULL;
+   while ( got < st.st_size )
+   {
+      int r = (fs_ops[atrfs->fstype]->fs_read)(atrfs,path,(char *)filebuf+got,st.st_size-got,got);
+      if ( r <= 0 ) break;
+      got += r;
+   }
+   char *listing = ( got == st.st_size ) ? basic_listing(filebuf,got) : NULL;
+   free(filebuf);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s: %s\n",__FUNCTION__,path,listing ? "listed" : "not a BASIC file");
+
+   // Replace the oldest entry, even with a NULL listing so non-BASIC files aren't read again
+   free(cache[next].path);
+   free(cache[next].listing);
+   cache[next].path = strdup(path);
+   cache[next].changes = atrfs->changes;
+   cache[next].atrfs = atrfs;
+   cache[next].listing = listing;
+   next = (next + 1) % BASIC_LISTING_CACHE;
+   return listing;
+}
@@ -39,8 +39,8 @@
 /*
  * Macros and defines
  */
-#define BITMAPBYTE(n)   (n/8)
-#define BITMAPMASK(n)   (1<<(7-(n%8)))
+#define BITMAPBYTE(n)   ((n)/8)
+#define BITMAPMASK(n)   (1<<(7-((n)%8)))
 #define CLUSTER_SIZE    ((((unsigned char *)SECTOR(360))[0]&0x3f)+1)
 #define CLUSTER_BYTES   (CLUSTER_SIZE * atrfs->sectorsize)
 #define VTOC_FIRST_SECTOR (CLUSTER_SIZE <= 4 ? 360 : CLUSTER_SIZE <= 16 ? 352 : CLUSTER_SIZE <= 32 ? 320 : 256) // Is there a formula?
@@ -88,6 +88,7 @@ enum dirent_flags {
  * Function prototypes
  */
 int litedos_sanity(struct atrfs *atrfs);
+int litedos_score(struct atrfs *atrfs);
 int litedos_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
 int litedos_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf);
 int litedos_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, off_t offset);
@@ -98,6 +99,11 @@ int litedos_chmod(struct atrfs *atrfs,const char *path, mode_t mode);
 int litedos_create(struct atrfs *atrfs,const char *path, mode_t mode);
 int litedos_truncate(struct atrfs *atrfs,const char *path, off_t size);
 int litedos_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
+int litedos_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length);
+int litedos_copy_file_range(struct atrfs *atrfs,const char *path_in, off_t offset_in, const char *path_out, off_t offset_out, size_t size);
+int litedos_defrag(struct atrfs *atrfs,int *fragmented);
+int litedos_sectormap(struct atrfs *atrfs,struct sectormap *sm);
+int litedos_check(struct atrfs *atrfs,struct fscheck *ck);
 int litedos_newfs(struct atrfs *atrfs);
 char *litedos_fsinfo(struct atrfs *atrfs);
 
@@ -108,6 +114,7 @@ const struct fs_ops litedos_ops = {
    .name = "LiteDOS",
    .fstype = "litedos",
    .fs_sanity = litedos_sanity,
+   .fs_score = litedos_score,
    .fs_getattr = litedos_getattr,
    .fs_readdir = litedos_readdir,
    .fs_read = litedos_read,
@@ -120,6 +127,11 @@ const struct fs_ops litedos_ops = {
    .fs_statfs = litedos_statfs,
    .fs_newfs = litedos_newfs,
    .fs_fsinfo = litedos_fsinfo,
+   .fs_fallocate = litedos_fallocate,
+   .fs_copy_file_range = litedos_copy_file_range,
+   .fs_defrag = litedos_defrag,
+   .fs_sectormap = litedos_sectormap,
+   .fs_check = litedos_check,
 };
 
 /*
@@ -189,6 +201,24 @@ int litedos_sanity(struct atrfs *atrfs)
    return 0;
 }
 
+/*
+ * litedos_score()
+ *
+ * Quick check before litedos_sanity(); 0 if it would fail
+ */
+int litedos_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectors < 361 ) return 0;
+   if ( atrfs->sectorsize > 256 ) return 0;
+   struct sector1 *sec1 = SECTOR(1);
+   if ( sec1->boot_sectors != 1 ) return 0;
+   if ( sec1->pad_zero == 'X' || sec1->pad_zero == 'S' ) return 0;
+   if ( sec1->boot_addr[1] != 1 ) return 0;
+   if ( sec1->jmp == 0x4c ) return 0;
+   if ( (((unsigned char *)SECTOR(360))[0]>>6) != 1 ) return 0;
+   return 2; // Boot sector loaded in the stack is distinctive
+}
+
 /*
  * litedos_trace_file()
  *
@@ -508,9 +538,26 @@ int litedos_alloc_cluster(struct atrfs *atrfs,int sector)
    return r;
 }
 
+/*
+ * litedos_alloc_any_cluster()
+ *
+ * Allocate the first free cluster, starting at atrfs->alloc_hint if set.
+ */
 int litedos_alloc_any_cluster(struct atrfs *atrfs)
 {
    int r;
+   if ( atrfs->alloc_hint > 1 )
+   {
+      for ( int i=atrfs->alloc_hint;i<=MAX_CLUSTER; ++i )
+      {
+         r=litedos_alloc_cluster(atrfs,i);
+         if ( r==0 )
+         {
+            atrfs->alloc_hint = i+1;
+            return i;
+         }
+      }
+   }
    for ( int i=2;i<=MAX_CLUSTER; ++i )
    {
       r=litedos_alloc_cluster(atrfs,i);
@@ -617,6 +664,33 @@ char *litedos_info(struct atrfs *atrfs,const char *path,struct litedos_dirent *d
    return buf;
 }
 
+/*
+ * litedos_dirent_name()
+ *
+ * Convert the 8+3 name to a string with a '.' if there is an extension
+ */
+void litedos_dirent_name(const struct litedos_dirent *dirent,char *name)
+{
+   memcpy(name,dirent->name,8);
+   int k;
+   for (k=0;k<8;++k)
+   {
+      if ( dirent->name[k] == ' ' ) break;
+   }
+   name[k]=0;
+   if ( dirent->ext[0] != ' ' )
+   {
+      name[k]='.';
+      ++k;
+      for (int l=0;l<3;++l)
+      {
+         if ( dirent->ext[l] == ' ' ) break;
+         name[k+l]=dirent->ext[l];
+         name[k+l+1]=0;
+      }
+   }
+}
+
 /*
  * litedos_readdir()
  *
@@ -645,25 +719,21 @@ int litedos_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_d
       if ( dirent->flags == 0 ) break;
       if ( dirent->flags & FLAGS_DELETED ) continue; // Deleted
 
-      memcpy(name,dirent->name,8);
-      int k;
-      for (k=0;k<8;++k)
-      {
-         if ( dirent->name[k] == ' ' ) break;
-      }
-      name[k]=0;
-      if ( dirent->ext[0] != ' ' )
+      litedos_dirent_name(dirent,name);
+      struct stat st;
+      if ( !dirfill_stat(buf,&st) )
       {
-         name[k]='.';
-         ++k;
-         for (int l=0;l<3;++l)
-         {
-            if ( dirent->ext[l] == ' ' ) break;
-            name[k+l]=dirent->ext[l];
-            name[k+l+1]=0;
-         }
+         if ( filler(buf, name, FILLER_NULL) ) break;
+         continue;
       }
-      filler(buf, name, FILLER_NULL);
+
+      // Same results as litedos_getattr(), but without looking up the path
+      int size,start = BYTES2(dirent->start);
+      if ( litedos_trace_file(atrfs,start,(dirent->flags & FLAGS_NOFILENO) ? -1 : i,&size,NULL) >= 0 ) st.st_size = size;
+      if ( dirent->flags & FLAGS_LOCKED ) st.st_mode = MODE_RO(st.st_mode);
+      st.st_ino = start;
+      st.st_blocks = BYTES2(dirent->sectors);
+      if ( filler(buf, name, FILLER_STAT(&st)) ) break;
    }
    return 0;
 }
@@ -860,7 +930,11 @@ int litedos_write(struct atrfs *atrfs,const char *path, const char *buf, size_t
       size-=bytes;
       r+=bytes;
    }
-   if ( !size ) return 0;
+   if ( !size )
+   {
+      free(sectors);
+      return r; // Overwrite only; no need to extend the file
+   }
 
    // Handle writing at end of file
    // 'offset' is offset from end of file (from above)
@@ -1183,7 +1257,7 @@ int litedos_create(struct atrfs *atrfs,const char *path, mode_t mode)
    memset(buf,0,CLUSTER_BYTES);
    if ( !(dirent->flags & FLAGS_NOFILENO) )
    {
-      buf[atrfs->sectorsize-2] = entry << 2;
+      buf[atrfs->sectorsize-3] = entry << 2;
    }
 #if 0 // FIXME: Make this work; but I think it's covered in write()
    if ( atrfs_strcmp(path,"/DOS.SYS")==0 )
@@ -1283,6 +1357,343 @@ int litedos_truncate(struct atrfs *atrfs,const char *path, off_t size)
    return 0;
 }
 
+/*
+ * litedos_fallocate()
+ *
+ * Reserve space for a file up front so that the clusters are contiguous.
+ *
+ * As with DOS 2, the sector chain defines the file size, so only growing
+ * the file is supported.  Find a run of free clusters, point the cluster
+ * allocator at it, and grow the file.
+ */
+int litedos_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length)
+{
+   int r,sector=0,count,locked,fileno,entry,filesize,*sectors;
+   int isdir,isinfo;
+
+   if ( mode ) return -EOPNOTSUPP;
+   r = litedos_path(atrfs,path,&sector,&count,&locked,&fileno,&entry,&isdir,&isinfo);
+   if ( isdir ) return -EISDIR;
+   if ( r<0 ) return r;
+   if ( r>0 ) return -ENOENT;
+   if ( isinfo ) return -ENOENT; // These aren't writable
+   if ( locked ) return -EACCES;
+
+   r = litedos_trace_file(atrfs,sector,fileno,&filesize,&sectors);
+   if ( r<0 ) return r;
+   free(sectors);
+   if ( r>0 ) return -EIO;
+   if ( offset + length <= filesize ) return 0; // Already allocated
+
+   // Fail up front rather than leave a partial allocation
+   int needed = (offset + length - filesize) / (atrfs->sectorsize-3) + 1;
+   if ( needed > BYTES2(LITEDOS_VTOC->free_sectors) ) return -ENOSPC;
+
+   int clusters = (needed + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+   atrfs->alloc_hint = find_free_run(atrfs,2,MAX_CLUSTER,clusters,litedos_bitmap_status);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s %d clusters starting at %d\n",__FUNCTION__,path,clusters,atrfs->alloc_hint);
+   r = litedos_truncate(atrfs,path,offset+length);
+   atrfs->alloc_hint = 0;
+   return r;
+}
+
+/*
+ * litedos_copy_file_range()
+ *
+ * Fast path for duplicating a whole file into a new, empty file.
+ *
+ * Same approach as MyDOS: allocate the new chain in one pass, copy each
+ * sector directly, and rewrite the link bytes.
+ */
+int litedos_copy_file_range(struct atrfs *atrfs,const char *path_in, off_t offset_in, const char *path_out, off_t offset_out, size_t size)
+{
+   int r,sector=0,count,locked,fileno,entry,filesize,*sectors;
+   int out_sector=0,out_count,out_locked,out_fileno,out_entry,out_filesize,*out_sectors;
+   int isdir,isinfo;
+
+   if ( offset_in || offset_out ) return -EOPNOTSUPP;
+   if ( atrfs_strcmp(path_out,"/DOS.SYS") == 0 ) return -EOPNOTSUPP; // Let litedos_write() handle it
+   r = litedos_path(atrfs,path_in,&sector,&count,&locked,&fileno,&entry,&isdir,&isinfo);
+   if ( r || isdir || isinfo ) return -EOPNOTSUPP;
+   r = litedos_path(atrfs,path_out,&out_sector,&out_count,&out_locked,&out_fileno,&out_entry,&isdir,&isinfo);
+   if ( r || isdir || isinfo ) return -EOPNOTSUPP;
+
+   struct litedos_dirent *out_dirent = DIRENT_ENTRY(out_entry);
+   if ( BYTES2(out_dirent->sectors) != 1 ) return -EOPNOTSUPP; // Not a new file
+   r = litedos_trace_file(atrfs,out_sector,out_fileno,&out_filesize,&out_sectors);
+   if ( r<0 ) return r;
+   free(out_sectors);
+   if ( r>0 || out_filesize ) return -EOPNOTSUPP;
+
+   r = litedos_trace_file(atrfs,sector,fileno,&filesize,&sectors);
+   if ( r<0 ) return r;
+   if ( r>0 || (size_t)filesize > size )
+   {
+      free(sectors);
+      return -EOPNOTSUPP;
+   }
+   count=0;
+   while ( sectors[count] ) ++count;
+
+   // Allocate the new chain up front; the first sector is already there
+   int clusters = (count - 1 + CLUSTER_SIZE - 1) / CLUSTER_SIZE; // Upper bound
+   if ( clusters * CLUSTER_SIZE > BYTES2(LITEDOS_VTOC->free_sectors) )
+   {
+      free(sectors);
+      return -ENOSPC;
+   }
+   out_sectors = malloc(sizeof(int)*(count+1));
+   if ( !out_sectors )
+   {
+      free(sectors);
+      return -ENOMEM;
+   }
+   litedos_remove_fileno(atrfs,out_dirent,out_fileno);
+   out_sectors[0] = out_sector;
+   out_sectors[count] = 0;
+   atrfs->alloc_hint = find_free_run(atrfs,2,MAX_CLUSTER,clusters,litedos_bitmap_status);
+   for ( int i=1;i<count;++i )
+   {
+      out_sectors[i] = litedos_alloc_sector(atrfs,out_sectors[i-1]);
+      if ( out_sectors[i] < 0 ) // Shouldn't happen after checking the free count
+      {
+         while ( --i > 0 ) litedos_free_sector(atrfs,out_sectors[i]);
+         atrfs->alloc_hint = 0;
+         free(out_sectors);
+         free(sectors);
+         litedos_add_fileno(atrfs,out_dirent,out_entry);
+         return -ENOSPC;
+      }
+   }
+   atrfs->alloc_hint = 0;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s to %s: %d sectors, %d bytes\n",__FUNCTION__,path_in,path_out,count,filesize);
+
+   for ( int i=0;i<count;++i )
+   {
+      unsigned char *src = SECTOR(sectors[i]);
+      unsigned char *dst = SECTOR(out_sectors[i]);
+      memcpy(dst,src,atrfs->sectorsize-3);
+      dst[atrfs->sectorsize-3] = out_sectors[i+1] >> 8;
+      dst[atrfs->sectorsize-2] = out_sectors[i+1] & 0xff;
+      dst[atrfs->sectorsize-1] = src[atrfs->sectorsize-1];
+   }
+   STOREBYTES2(out_dirent->sectors,count);
+   litedos_add_fileno(atrfs,out_dirent,out_entry);
+   free(out_sectors);
+   free(sectors);
+   return filesize;
+}
+/*
+ * litedos_defrag_file()
+ *
+ * Move a file to a contiguous run of free clusters if it isn't already
+ * one.  As with MyDOS, the data is buffered and the old clusters freed
+ * first so that the new run may overlap the old one.
+ *
+ * Return 1 if moved, 0 if left alone, -ENOSPC if no run is long enough.
+ */
+int litedos_defrag_file(struct atrfs *atrfs,struct litedos_dirent *dirent,int entry)
+{
+   int filesize,*sectors,n,i;
+   int fileno = (dirent->flags & FLAGS_NOFILENO) ? -1 : entry;
+   int old_start = BYTES2(dirent->start);
+   const int ss = atrfs->sectorsize;
+
+   int r = litedos_trace_file(atrfs,old_start,fileno,&filesize,&sectors);
+   if ( r || !sectors )
+   {
+      free(sectors);
+      return 0; // Leave damaged files alone
+   }
+   for ( n=0;sectors[n];++n ) ;
+   for ( i=1;i<n && sectors[i] == sectors[0]+i;++i ) ;
+   if ( i == n )
+   {
+      free(sectors);
+      return 0;
+   }
+
+   unsigned char *buf = malloc(n*ss);
+   if ( !buf )
+   {
+      free(sectors);
+      return -ENOMEM;
+   }
+   for ( i=0;i<n;++i )
+   {
+      unsigned char *s = SECTOR(sectors[i]);
+      memcpy(buf+i*ss,s,ss);
+      litedos_free_cluster(atrfs,sectors[i]/CLUSTER_SIZE);
+   }
+
+   // File numbers leave only 10 bits for the link
+   int last = atrfs->sectors;
+   if ( fileno >= 0 && last > 1023 ) last = 1023;
+   int clusters = (n + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+   int start = find_free_run(atrfs,2,MAX_CLUSTER,clusters,litedos_bitmap_status);
+   for ( i=0;start > 0 && i<clusters;++i )
+   {
+      if ( start+i > MAX_CLUSTER || !litedos_bitmap_status(atrfs,start+i) ) start = -1;
+   }
+   if ( start > 0 && start*CLUSTER_SIZE + n - 1 > last ) start = -1;
+   if ( start < 0 )
+   {
+      for ( i=0;i<n;++i )
+      {
+         unsigned char *s = SECTOR(sectors[i]);
+         litedos_alloc_cluster(atrfs,sectors[i]/CLUSTER_SIZE);
+         memcpy(s,buf+i*ss,ss);
+      }
+      free(buf);
+      free(sectors);
+      return -ENOSPC;
+   }
+
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d sectors from %d to cluster %d\n",__FUNCTION__,n,old_start,start);
+   for ( i=0;i<clusters;++i ) litedos_alloc_cluster(atrfs,start+i);
+   start *= CLUSTER_SIZE;
+   for ( i=0;i<n;++i )
+   {
+      unsigned char *s = SECTOR(start+i);
+      int next = ( i+1 < n ) ? start+i+1 : 0;
+
+      memcpy(s,buf+i*ss,ss);
+      if ( fileno >= 0 ) s[ss-3] = (s[ss-3] & 0xfc) | (next >> 8);
+      else s[ss-3] = next >> 8;
+      s[ss-2] = next & 0xff;
+   }
+   STOREBYTES2(dirent->start,start);
+
+   // Keep the boot sectors pointing at DOS.SYS
+   struct sector1 *sec1 = SECTOR(1);
+   if ( memcmp(dirent->name,"DOS     SYS",8+3) == 0 && BYTES2(sec1->dos_sector) == old_start )
+   {
+      STOREBYTES2(sec1->dos_sector,start);
+   }
+   free(buf);
+   free(sectors);
+   return 1;
+}
+
+/*
+ * litedos_defrag()
+ */
+int litedos_defrag(struct atrfs *atrfs,int *fragmented)
+{
+   int moved = 0;
+
+   for ( int i=0;i<DIRENT_COUNT;++i )
+   {
+      struct litedos_dirent *dirent = DIRENT_ENTRY(i);
+
+      if ( dirent->flags == 0 ) break;
+      if ( dirent->flags & FLAGS_DELETED ) continue;
+      int r = litedos_defrag_file(atrfs,dirent,i);
+      if ( r == -ENOSPC ) ++*fragmented;
+      else if ( r < 0 ) return r;
+      else moved += r;
+   }
+   return moved;
+}
+
+/*
+ * litedos_sectormap()
+ *
+ * The bitmap is in clusters, but files are chains of sectors, so the
+ * last cluster of a file may be partly unclaimed.  Clusters 0 and 1 are
+ * never allocated.
+ */
+int litedos_sectormap(struct atrfs *atrfs,struct sectormap *sm)
+{
+   int owner;
+
+   for ( int i=1;SECTOR_TO_CLUSTER_NUM(i)<MAX_CLUSTER && SECTOR_TO_CLUSTER_NUM(i)<1024 && i<=atrfs->sectors;++i )
+   {
+      sm->map[i].bitmap = MAP_VALUE(SECTOR_TO_CLUSTER_NUM(i)) ? SM_FREE : SM_USED;
+   }
+   owner = sectormap_owner(sm,"[boot]");
+   for ( int i=1;i<2*CLUSTER_SIZE;++i ) sectormap_claim(sm,i,owner,SM_SYSTEM,i-1);
+   sectormap_claim(sm,360,sectormap_owner(sm,"[vtoc]"),SM_SYSTEM,0);
+   owner = sectormap_owner(sm,"/");
+   for ( int i=VTOC_FIRST_SECTOR,n=0;i<=VTOC_LAST_SECTOR;++i )
+   {
+      if ( i != 360 ) sectormap_claim(sm,i,owner,SM_DIR,n++);
+   }
+
+   char name[1+8+1+3+1];
+   for ( int i=0;i<DIRENT_COUNT;++i )
+   {
+      struct litedos_dirent *dirent = DIRENT_ENTRY(i);
+      int size,*sectors;
+
+      if ( dirent->flags == 0 ) break;
+      if ( dirent->flags & FLAGS_DELETED ) continue;
+      name[0] = '/';
+      litedos_dirent_name(dirent,name+1);
+      owner = sectormap_owner(sm,name);
+      if ( BYTES2(dirent->start) < 1 ) continue;
+      if ( litedos_trace_file(atrfs,BYTES2(dirent->start),(dirent->flags & FLAGS_NOFILENO) ? -1 : i,&size,&sectors) < 0 ) continue;
+      for ( int k=0;sectors && sectors[k];++k ) sectormap_claim(sm,sectors[k],owner,SM_DATA,k);
+      free(sectors);
+   }
+   return 0;
+}
+
+/*
+ * litedos_check()
+ *
+ * Same checks as MyDOS, but the bitmap and free count are in clusters
+ */
+int litedos_check(struct atrfs *atrfs,struct fscheck *ck)
+{
+   char name[8+1+3+1];
+
+   for ( int i=0;i<DIRENT_COUNT;++i )
+   {
+      struct litedos_dirent *dirent = DIRENT_ENTRY(i);
+      int size,*sectors,n;
+
+      if ( dirent->flags == 0 ) break;
+      if ( dirent->flags & FLAGS_DELETED ) continue;
+      litedos_dirent_name(dirent,name);
+      int start = BYTES2(dirent->start);
+      if ( start < 1 || start > atrfs->sectors )
+      {
+         fscheck_problem(ck,0,"/%s: starts at sector %d, which is not on the disk",name,start);
+         ck->damaged = 1;
+         continue;
+      }
+      int r = litedos_trace_file(atrfs,start,(dirent->flags & FLAGS_NOFILENO) ? -1 : i,&size,&sectors);
+      for ( n=0;sectors && sectors[n];++n ) ;
+      free(sectors);
+      if ( r )
+      {
+         if ( r < 0 ) fscheck_problem(ck,0,"/%s: sector chain loops back on itself",name);
+         else if ( r == 164 ) fscheck_problem(ck,0,"/%s: sector chain leads into another file after %d sectors",name,n);
+         else fscheck_problem(ck,0,"/%s: sector chain runs off the disk after %d sectors",name,n);
+         ck->damaged = 1;
+         continue;
+      }
+      if ( BYTES2(dirent->sectors) != n )
+      {
+         int old = BYTES2(dirent->sectors);
+         if ( ck->repair ) STOREBYTES2(dirent->sectors,n);
+         fscheck_problem(ck,ck->repair,"/%s: directory entry says %d sectors, but the chain has %d",name,old,n);
+      }
+   }
+   fscheck_bitmap(ck,atrfs,CLUSTER_SIZE,litedos_bitmap);
+
+   int free_count = 0;
+   for ( int c=0;c<MAX_CLUSTER && c<1024;++c ) if ( MAP_VALUE(c) ) free_count += CLUSTER_SIZE;
+   if ( BYTES2(LITEDOS_VTOC->free_sectors) != free_count )
+   {
+      int old = BYTES2(LITEDOS_VTOC->free_sectors);
+      if ( ck->repair ) STOREBYTES2(LITEDOS_VTOC->free_sectors,free_count);
+      fscheck_problem(ck,ck->repair,"VTOC says %d free sectors, but the bitmap has %d",old,free_count);
+   }
+   return 0;
+}
+
 int litedos_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf)
 {
    (void)path; // meaningless
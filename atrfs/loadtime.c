@@ -0,0 +1,230 @@
+/*
+ * loadtime.c
+ *
+ * Estimated load times on a real drive for --loadtime.  Each file's
+ * sectors are taken from the sector map built for .sectormap, in the
+ * order DOS reads them (SpartaDOS reads each sector map sector before the
+ * data it lists), and timed with load_time() at the standard SIO speed
+ * and at high speed.
+ *
+ * The layout figure compares the time at the standard speed with the
+ * best that any layout could do, so badly placed files stand out
+ * regardless of their size.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#include FUSE_INCLUDE
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "atrfs.h"
+
+/*
+ * Macros and defines
+ */
+#define LOADTIME_BAUD      19200
+#define LOADTIME_FAST_BAUD 52640 // POKEY divisor 10, as with US Doubler and Happy drives
+#define LOADTIME_POOR      75 // Layouts under this percent of the best are flagged
+#define LOADTIME_WORST     5 // Listed at the end of the report
+
+/*
+ * Data types
+ */
+struct loadtime_read {
+   long order;
+   int sector;
+};
+
+struct loadtime_file {
+   const char *name;
+   struct loadtime_read *reads;
+   int count;
+   int data; // Data sectors (or boot sectors); 0 for directories and system areas
+   int filled;
+   long time; // Microseconds at LOADTIME_BAUD
+   long fast; // Microseconds at LOADTIME_FAST_BAUD
+   long ideal; // Best possible at LOADTIME_BAUD
+};
+
+/*
+ * Function prototypes
+ */
+int loadtime_cmp_read(const void *a,const void *b);
+int loadtime_cmp_layout(const void *a,const void *b);
+void loadtime_time(struct atrfs *atrfs,struct loadtime_file *f);
+int loadtime_layout(const struct loadtime_file *f);
+
+/*
+ * Functions
+ */
+
+/*
+ * loadtime_cmp_read()
+ */
+int loadtime_cmp_read(const void *a,const void *b)
+{
+   const struct loadtime_read *ra = a, *rb = b;
+   return ( ra->order > rb->order ) - ( ra->order < rb->order );
+}
+
+/*
+ * loadtime_layout()
+ *
+ * Percent of the best possible time achieved by the layout
+ */
+int loadtime_layout(const struct loadtime_file *f)
+{
+   if ( !f->time ) return 100;
+   return f->ideal * 100 / f->time;
+}
+
+/*
+ * loadtime_cmp_layout()
+ *
+ * Sort pointers to files by layout, worst first
+ */
+int loadtime_cmp_layout(const void *a,const void *b)
+{
+   int la = loadtime_layout(*(struct loadtime_file * const *)a);
+   int lb = loadtime_layout(*(struct loadtime_file * const *)b);
+   return la - lb;
+}
+
+/*
+ * loadtime_time()
+ *
+ * Sort one file's reads into order and time them
+ */
+void loadtime_time(struct atrfs *atrfs,struct loadtime_file *f)
+{
+   int *sectors = malloc(sizeof(int) * ( f->count + 1 ));
+
+   if ( !sectors ) return;
+   qsort(f->reads,f->count,sizeof(f->reads[0]),loadtime_cmp_read);
+   for ( int i=0;i<f->count;++i ) sectors[i] = f->reads[i].sector;
+   f->time = load_time(atrfs,sectors,f->count,LOADTIME_BAUD,&f->ideal);
+   f->fast = load_time(atrfs,sectors,f->count,LOADTIME_FAST_BAUD,NULL);
+   free(sectors);
+}
+
+/*
+ * loadtime_image()
+ *
+ * Offline pass for --loadtime: estimate the time to load each file and
+ * the boot sectors.  The report is malloc()ed; the first line is the
+ * summary.  Returns NULL if the file system can't map its sectors.
+ */
+char *loadtime_image(struct atrfs *atrfs)
+{
+   struct sectormap *sm = sectormap_build(atrfs);
+   if ( !sm ) return NULL;
+
+   struct loadtime_file *files = calloc(sm->num_owners+1,sizeof(*files));
+   struct loadtime_file **worst = calloc(sm->num_owners+1,sizeof(*worst));
+   const int per_map = atrfs->sectorsize/2 - 2; // SpartaDOS sector map entries
+   if ( !files || !worst )
+   {
+      free(files);
+      free(worst);
+      sectormap_free(sm);
+      return NULL;
+   }
+
+   // Each file's data and sector map sectors, and the boot sectors
+   for ( int pass=0;pass<2;++pass )
+   {
+      for ( int sec=1;sec<=sm->sectors;++sec )
+      {
+         struct sectormap_entry *e = &sm->map[sec];
+         if ( e->owner < 0 ) continue;
+         struct loadtime_file *f = &files[e->owner];
+         long order;
+         switch ( e->use )
+         {
+            case SM_DATA:
+               order = (long)e->position * 2 + 1;
+               break;
+            case SM_MAP:
+               order = (long)e->position * per_map * 2;
+               break;
+            case SM_SYSTEM:
+               if ( strcmp(sm->owners[e->owner],"[boot]") != 0 ) continue;
+               order = e->position;
+               break;
+            default:
+               continue;
+         }
+         if ( pass == 0 )
+         {
+            ++f->count;
+            if ( e->use != SM_MAP ) ++f->data;
+            continue;
+         }
+         if ( !f->reads ) f->reads = malloc(sizeof(f->reads[0]) * f->count);
+         if ( !f->reads ) continue;
+         f->reads[f->filled].order = order;
+         f->reads[f->filled].sector = sec;
+         ++f->filled;
+      }
+   }
+
+   size_t len = 512;
+   for ( int o=0;o<sm->num_owners;++o ) len += strlen(sm->owners[o]) * 2 + 128;
+   char *buf = malloc(len);
+   if ( !buf ) goto done;
+   char *b = buf;
+   struct loadtime_file all;
+   int nworst = 0;
+   memset(&all,0,sizeof(all));
+
+   b += sprintf(b,"Sectors  %5d  %5d  Layout  (seconds at each baud rate)\n",LOADTIME_BAUD,LOADTIME_FAST_BAUD);
+   for ( int o=0;o<sm->num_owners;++o )
+   {
+      struct loadtime_file *f = &files[o];
+      if ( !f->data || f->filled != f->count ) continue;
+      f->name = sm->owners[o];
+      loadtime_time(atrfs,f);
+      int layout = loadtime_layout(f);
+      int flag = ( layout < LOADTIME_POOR && f->count > 1 );
+      b += sprintf(b,"%7d  %5.1f  %5.1f  %5d%%  %s%s\n",f->count,f->time/1e6,f->fast/1e6,layout,f->name,flag ? "  [poor layout]" : "");
+      if ( f->name[0] != '/' ) continue; // Boot sectors aren't files
+      all.count += f->count;
+      all.time += f->time;
+      all.fast += f->fast;
+      all.ideal += f->ideal;
+      if ( flag ) worst[nworst++] = f;
+   }
+   b += sprintf(b,"%7d  %5.1f  %5.1f  %5d%%  All files\n",all.count,all.time/1e6,all.fast/1e6,loadtime_layout(&all));
+   if ( nworst )
+   {
+      qsort(worst,nworst,sizeof(worst[0]),loadtime_cmp_layout);
+      b += sprintf(b,"Worst layouts:\n");
+      for ( int i=0;i<nworst && i<LOADTIME_WORST;++i )
+      {
+         b += sprintf(b,"  %3d%%  %5.1f seconds lost  %s\n",loadtime_layout(worst[i]),(worst[i]->time - worst[i]->ideal)/1e6,worst[i]->name);
+      }
+   }
+   b += sprintf(b,"Files written with --skew=%d load best at %d baud, or --skew=%d at %d baud\n",
+                load_skew(atrfs,LOADTIME_BAUD),LOADTIME_BAUD,load_skew(atrfs,LOADTIME_FAST_BAUD),LOADTIME_FAST_BAUD);
+
+   // Summary on the first line
+   char summary[160];
+   snprintf(summary,sizeof(summary),"%s; %.1f seconds to load all files (%.1f at high speed)%s",
+            fs_ops[atrfs->fstype] ? fs_ops[atrfs->fstype]->name : "unknown",all.time/1e6,all.fast/1e6,nworst ? "; poor layouts flagged" : "");
+   char *out = malloc(strlen(summary) + strlen(buf) + 2);
+   if ( out ) sprintf(out,"%s\n%s",summary,buf);
+   free(buf);
+   buf = out;
+
+ done:
+   for ( int o=0;o<sm->num_owners;++o ) free(files[o].reads);
+   free(files);
+   free(worst);
+   sectormap_free(sm);
+   return buf;
+}
@@ -108,6 +108,10 @@ int mydos_sanity(struct atrfs *atrfs);
 int dos1_sanity(struct atrfs *atrfs);
 int dos2_sanity(struct atrfs *atrfs);
 int dos25_sanity(struct atrfs *atrfs);
+int mydos_score(struct atrfs *atrfs);
+int dos1_score(struct atrfs *atrfs);
+int dos2_score(struct atrfs *atrfs);
+int dos25_score(struct atrfs *atrfs);
 int mydos_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
 int mydos_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf);
 int mydos_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, off_t offset);
@@ -120,6 +124,14 @@ int mydos_chmod(struct atrfs *atrfs,const char *path, mode_t mode);
 int mydos_create(struct atrfs *atrfs,const char *path, mode_t mode);
 int mydos_truncate(struct atrfs *atrfs,const char *path, off_t size);
 int mydos_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
+int mydos_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length);
+int mydos_copy_file_range(struct atrfs *atrfs,const char *path_in, off_t offset_in, const char *path_out, off_t offset_out, size_t size);
+int mydos_unused_sector(struct atrfs *atrfs,int sector);
+int mydos_getxattr(struct atrfs *atrfs,const char *path, const char *name, char *value, size_t size);
+int mydos_listxattr(struct atrfs *atrfs,const char *path, char *list, size_t size);
+int mydos_sectormap(struct atrfs *atrfs,struct sectormap *sm);
+int mydos_check(struct atrfs *atrfs,struct fscheck *ck);
+int mydos_defrag(struct atrfs *atrfs,int *fragmented);
 int mydos_newfs(struct atrfs *atrfs);
 char *mydos_fsinfo(struct atrfs *atrfs);
 
@@ -130,6 +142,7 @@ const struct fs_ops dos1_ops = {
    .name = "Atari DOS 1",
    .fstype = "dos1",
    .fs_sanity = dos1_sanity,
+   .fs_score = dos1_score,
    .fs_getattr = mydos_getattr,
    .fs_readdir = mydos_readdir,
    .fs_read = mydos_read,
@@ -144,11 +157,20 @@ const struct fs_ops dos1_ops = {
    .fs_statfs = mydos_statfs,
    .fs_newfs = mydos_newfs,
    .fs_fsinfo = mydos_fsinfo,
+   .fs_fallocate = mydos_fallocate,
+   .fs_copy_file_range = mydos_copy_file_range,
+   .fs_unused_sector = mydos_unused_sector,
+   .fs_getxattr = mydos_getxattr,
+   .fs_listxattr = mydos_listxattr,
+   .fs_sectormap = mydos_sectormap,
+   .fs_check = mydos_check,
+   .fs_defrag = mydos_defrag,
 };
 const struct fs_ops dos2_ops = {
    .name = "Atari DOS 2.0s",
    .fstype = "dos2",
    .fs_sanity = dos2_sanity,
+   .fs_score = dos2_score,
    .fs_getattr = mydos_getattr,
    .fs_readdir = mydos_readdir,
    .fs_read = mydos_read,
@@ -163,6 +185,14 @@ const struct fs_ops dos2_ops = {
    .fs_statfs = mydos_statfs,
    .fs_newfs = mydos_newfs,
    .fs_fsinfo = mydos_fsinfo,
+   .fs_fallocate = mydos_fallocate,
+   .fs_copy_file_range = mydos_copy_file_range,
+   .fs_unused_sector = mydos_unused_sector,
+   .fs_getxattr = mydos_getxattr,
+   .fs_listxattr = mydos_listxattr,
+   .fs_sectormap = mydos_sectormap,
+   .fs_check = mydos_check,
+   .fs_defrag = mydos_defrag,
 };
 const struct fs_ops dos20d_ops = {
    .name = "Atari DOS 2.0d",
@@ -182,11 +212,20 @@ const struct fs_ops dos20d_ops = {
    .fs_statfs = mydos_statfs,
    .fs_newfs = mydos_newfs,
    .fs_fsinfo = mydos_fsinfo,
+   .fs_fallocate = mydos_fallocate,
+   .fs_copy_file_range = mydos_copy_file_range,
+   .fs_unused_sector = mydos_unused_sector,
+   .fs_getxattr = mydos_getxattr,
+   .fs_listxattr = mydos_listxattr,
+   .fs_sectormap = mydos_sectormap,
+   .fs_check = mydos_check,
+   .fs_defrag = mydos_defrag,
 };
 const struct fs_ops dos25_ops = {
    .name = "Atari DOS 2.5",
    .fstype = "dos25",
    .fs_sanity = dos25_sanity,
+   .fs_score = dos25_score,
    .fs_getattr = mydos_getattr,
    .fs_readdir = mydos_readdir,
    .fs_read = mydos_read,
@@ -201,11 +240,20 @@ const struct fs_ops dos25_ops = {
    .fs_statfs = mydos_statfs,
    .fs_newfs = mydos_newfs,
    .fs_fsinfo = mydos_fsinfo,
+   .fs_fallocate = mydos_fallocate,
+   .fs_copy_file_range = mydos_copy_file_range,
+   .fs_unused_sector = mydos_unused_sector,
+   .fs_getxattr = mydos_getxattr,
+   .fs_listxattr = mydos_listxattr,
+   .fs_sectormap = mydos_sectormap,
+   .fs_check = mydos_check,
+   .fs_defrag = mydos_defrag,
 };
 const struct fs_ops mydos_ops = {
    .name = "MyDOS 4.53 or compatible",
    .fstype = "mydos",
    .fs_sanity = mydos_sanity,
+   .fs_score = mydos_score,
    .fs_getattr = mydos_getattr,
    .fs_readdir = mydos_readdir,
    .fs_read = mydos_read,
@@ -220,6 +268,14 @@ const struct fs_ops mydos_ops = {
    .fs_statfs = mydos_statfs,
    .fs_newfs = mydos_newfs,
    .fs_fsinfo = mydos_fsinfo,
+   .fs_fallocate = mydos_fallocate,
+   .fs_copy_file_range = mydos_copy_file_range,
+   .fs_unused_sector = mydos_unused_sector,
+   .fs_getxattr = mydos_getxattr,
+   .fs_listxattr = mydos_listxattr,
+   .fs_sectormap = mydos_sectormap,
+   .fs_check = mydos_check,
+   .fs_defrag = mydos_defrag,
 };
 
 /*
@@ -562,6 +618,90 @@ int dos25_sanity(struct atrfs *atrfs)
    return 0;
 }
 
+/*
+ * dos_vtoc_score(atrfs)
+ *
+ * Checks on the VTOC and first directory entry shared by the DOS 1, DOS 2,
+ * DOS 2.5, and MyDOS scores.  Return 0 if the VTOC rules them all out.
+ */
+int dos_vtoc_score(struct atrfs *atrfs)
+{
+   struct mydos_vtoc *vtoc = SECTOR(360);
+   if ( !BYTES2(vtoc->total_sectors) ) return 0; // Must have some sectors
+   if ( BYTES2(vtoc->total_sectors) < BYTES2(vtoc->free_sectors) ) return 0; // free must not exceed total
+   struct dos2_dirent *dirent = SECTOR(361);
+   return 1 + ( dos_dirent_sanity(atrfs,dirent) == 0 ); // Bonus if there is a file
+}
+
+/*
+ * mydos_score(atrfs)
+ *
+ * Quick check before mydos_sanity(); 0 if it would fail
+ */
+int mydos_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectors < 368 ) return 0;
+   if ( atrfs->sectorsize > 256 ) return 0;
+   struct sector1 *sec1 = SECTOR(1);
+   if ( sec1->boot_sectors != 3 ) return 0;
+   if ( sec1->pad_zero == 'X' || sec1->pad_zero == 'S' ) return 0;
+   int score = dos_vtoc_score(atrfs);
+   if ( score && sec1->drive_bits == 0xff ) ++score; // All 8 drives: DOS 2 never does this
+   return score;
+}
+
+/*
+ * dos1_score(atrfs)
+ *
+ * Quick check before dos1_sanity(); 0 if it would fail
+ */
+int dos1_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectors < 368 || atrfs->sectors > 720 ) return 0;
+   if ( atrfs->sectorsize > 128 ) return 0;
+   struct sector1 *sec1 = SECTOR(1);
+   if ( sec1->boot_sectors != 1 ) return 0;
+   if ( sec1->drive_bits == 0xff ) return 0;
+   struct mydos_vtoc *vtoc = SECTOR(360);
+   if ( vtoc->vtoc_sectors != 1 ) return 0;
+   return dos_vtoc_score(atrfs);
+}
+
+/*
+ * dos2_score(atrfs)
+ *
+ * Quick check before dos2_sanity(); 0 if it would fail
+ */
+int dos2_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectors < 368 || atrfs->sectors > 720 ) return 0;
+   if ( atrfs->sectorsize > 128 ) return 0;
+   struct sector1 *sec1 = SECTOR(1);
+   if ( sec1->boot_sectors != 3 ) return 0;
+   if ( sec1->pad_zero == 'X' || sec1->pad_zero == 'S' ) return 0;
+   if ( sec1->drive_bits == 0xff ) return 0;
+   struct mydos_vtoc *vtoc = SECTOR(360);
+   if ( vtoc->vtoc_sectors != 2 ) return 0;
+   return dos_vtoc_score(atrfs);
+}
+
+/*
+ * dos25_score(atrfs)
+ *
+ * Quick check before dos25_sanity(); 0 if it would fail
+ */
+int dos25_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectors < 1024 || atrfs->sectors > 1040 ) return 0;
+   if ( atrfs->sectorsize > 128 ) return 0;
+   struct sector1 *sec1 = SECTOR(1);
+   if ( sec1->boot_sectors != 3 ) return 0;
+   if ( sec1->pad_zero == 'X' || sec1->pad_zero == 'S' ) return 0;
+   struct mydos_vtoc *vtoc = SECTOR(360);
+   if ( vtoc->vtoc_sectors != 2 ) return 0;
+   return dos_vtoc_score(atrfs);
+}
+
 /*
  * mydos_trace_file()
  *
@@ -890,13 +1030,15 @@ int mydos_bitmap_status(struct atrfs *atrfs,int sector)
          {
             vtoc=1024;
             bitmap_start = 48;
+            bitmap_offset = 0;
          }
          break;
       case ATR_MYDOS:
          if ( sector > 943 )
          {
+            // Same layout as mydos_bitmap()
             vtoc = 359 - ((sector-944)/8/atrfs->sectorsize);
-            bitmap_start = ((sector-944)/8/atrfs->sectorsize) * 8;
+            bitmap_start = 944 + ((sector-944)/8/atrfs->sectorsize) * 8*atrfs->sectorsize;
             bitmap_offset = 0;
          }
          break;
@@ -909,6 +1051,20 @@ int mydos_bitmap_status(struct atrfs *atrfs,int sector)
    return map[sec_bitmap/8] & mask;
 }
 
+/*
+ * mydos_unused_sector()
+ *
+ * Return non-zero if the sector is marked free.  Only trust the bitmap
+ * for the sectors that this variant can allocate.
+ */
+int mydos_unused_sector(struct atrfs *atrfs,int sector)
+{
+   if ( sector < 4 ) return 0; // Boot sectors
+   if ( (atrfs->fstype == ATR_DOS1 || atrfs->fstype == ATR_DOS2) && sector >= 720 ) return 0;
+   if ( atrfs->fstype == ATR_DOS25 && sector >= 1024 ) return 0;
+   return mydos_bitmap_status(atrfs,sector) != 0;
+}
+
 /*
  * mydos_bitmap()
  *
@@ -1008,6 +1164,7 @@ int mydos_free_sector(struct atrfs *atrfs,int sector)
    int offset = 3;
    if ( r == 0 )
    {
+      sparse_free(atrfs,SECTOR(sector),atrfs->sectorsize);
       if ( atrfs->fstype == ATR_DOS25 && sector >= 720 )
       {
          vtoc=1024;
@@ -1055,9 +1212,26 @@ int mydos_alloc_sector(struct atrfs *atrfs,int sector)
    return r;
 }
 
+/*
+ * mydos_alloc_any_sector()
+ *
+ * Allocate the first free sector, starting at atrfs->alloc_hint if set.
+ */
 int mydos_alloc_any_sector(struct atrfs *atrfs)
 {
    int r;
+   if ( atrfs->alloc_hint > 1 )
+   {
+      for ( int i=atrfs->alloc_hint;i<=atrfs->sectors; ++i )
+      {
+         r=mydos_alloc_sector(atrfs,i);
+         if ( r==0 )
+         {
+            atrfs->alloc_hint = i+1;
+            return i;
+         }
+      }
+   }
    for ( int i=2;i<=atrfs->sectors; ++i )
    {
       r=mydos_alloc_sector(atrfs,i);
@@ -1066,6 +1240,23 @@ int mydos_alloc_any_sector(struct atrfs *atrfs)
    return -1;
 }
 
+/*
+ * mydos_alloc_next_sector()
+ *
+ * Allocate a sector to follow 'prev' in a file.  With --skew, use the free
+ * sector that will be under the drive head soonest after 'prev' is read,
+ * unless a contiguous run was already requested through alloc_hint.
+ */
+int mydos_alloc_next_sector(struct atrfs *atrfs,int prev)
+{
+   if ( options.skew && prev > 0 && atrfs->alloc_hint <= 1 )
+   {
+      int sector = skew_next_sector(atrfs,prev,mydos_unused_sector);
+      if ( sector > 0 && mydos_alloc_sector(atrfs,sector) == 0 ) return sector;
+   }
+   return mydos_alloc_any_sector(atrfs);
+}
+
 /*
  * mydos_info()
  *
@@ -1080,7 +1271,6 @@ char *mydos_info(struct atrfs *atrfs,const char *path,struct dos2_dirent *dirent
 {
    char *buf,*b;
 
-   (void)atrfs;
    buf = malloc(64*1024);
    b = buf;
    *b = 0;
@@ -1131,7 +1321,9 @@ char *mydos_info(struct atrfs *atrfs,const char *path,struct dos2_dirent *dirent
       {
          b+=sprintf(b," -- %d",prev);
       }
-      b+=sprintf(b,"\n\n");
+      b+=sprintf(b,"\n");
+      if ( options.skew ) b+=sprintf(b,"Estimated read time with --skew=%d: %d sector times\n",options.skew,skew_chain_time(atrfs,sectors));
+      b+=sprintf(b,"\n");
    }
 
    // Generic info for the file type, but only if it's not a directory
@@ -1153,6 +1345,33 @@ char *mydos_info(struct atrfs *atrfs,const char *path,struct dos2_dirent *dirent
    return buf;
 }
 
+/*
+ * mydos_dirent_name()
+ *
+ * Convert the 8+3 name in a directory entry to a string
+ */
+void mydos_dirent_name(const struct dos2_dirent *dirent,char *name)
+{
+   int k;
+   for (k=0;k<8;++k)
+   {
+      if ( dirent->name[k] == ' ' ) break;
+      name[k]=dirent->name[k];
+   }
+   name[k]=0;
+   if ( dirent->ext[0] != ' ' )
+   {
+      name[k]='.';
+      ++k;
+      for (int l=0;l<3;++l)
+      {
+         if ( dirent->ext[l] == ' ' ) break;
+         name[k+l]=dirent->ext[l];
+         name[k+l+1]=0;
+      }
+   }
+}
+
 /*
  * mydos_readdir()
  *
@@ -1160,7 +1379,7 @@ char *mydos_info(struct atrfs *atrfs,const char *path,struct dos2_dirent *dirent
  */
 int mydos_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset)
 {
-   (void)offset; // FUSE will always read directories from the start in our use
+   (void)offset; // atrfs_filler() skips entries before the offset
    int r;
    int sector=0,parent_dir_sector,count,locked,fileno,entry,isdir,isinfo;
 
@@ -1178,25 +1397,31 @@ int mydos_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir
       if ( dirent[j].flags == 0 ) break;
       if ( dirent[j].flags & FLAGS_DELETED ) continue; // Deleted
 
-      memcpy(name,dirent[j].name,8);
-      int k;
-      for (k=0;k<8;++k)
+      mydos_dirent_name(&dirent[j],name);
+      struct stat st;
+      if ( !dirfill_stat(buf,&st) )
       {
-         if ( dirent[j].name[k] == ' ' ) break;
+         if ( filler(buf, name, FILLER_NULL) ) break;
+         continue;
       }
-      name[k]=0;
-      if ( dirent[j].ext[0] != ' ' )
+
+      // Same results as mydos_getattr(), but without looking up the path
+      int start = BYTES2(dirent[j].start);
+      if ( (dirent[j].flags & FLAGS_DIR) && atrfs->fstype != ATR_DOS25 )
       {
-         name[k]='.';
-         ++k;
-         for (int l=0;l<3;++l)
-         {
-            if ( dirent[j].ext[l] == ' ' ) break;
-            name[k+l]=dirent[j].ext[l];
-            name[k+l+1]=0;
-         }
+         ++st.st_nlink;
+         st.st_mode = MODE_DIR(atrfs->atrstat.st_mode & 0777);
+         st.st_size = 8*atrfs->sectorsize;
+      }
+      else
+      {
+         int size;
+         if ( mydos_trace_file(atrfs,start,(dirent[j].flags & FLAGS_NOFILENO) ? -1 : i,(dirent[j].flags & FLAGS_DOS2) == 0,&size,NULL) >= 0 ) st.st_size = size;
+         if ( dirent[j].flags & FLAGS_LOCKED ) st.st_mode = MODE_RO(st.st_mode);
       }
-      filler(buf, name, FILLER_NULL);
+      st.st_ino = start;
+      st.st_blocks = BYTES2(dirent[j].sectors);
+      if ( filler(buf, name, FILLER_STAT(&st)) ) break;
    }
    return 0;
 }
@@ -1460,13 +1685,19 @@ int mydos_write(struct atrfs *atrfs,const char *path, const char *buf, size_t si
       size-=bytes;
       r+=bytes;
    }
-   if ( !size ) return 0;
+   if ( !size )
+   {
+      free(sectors);
+      return r; // Overwrite only; no need to extend the file
+   }
 
    // Handle writing at end of file
    // 'offset' is offset from end of file (from above)
    if ( options.debug ) fprintf(stderr,"DEBUG: %s %s Remove file numbers from file for extension\n",__FUNCTION__,path);
    mydos_remove_fileno(atrfs,dirent,fileno);
    if ( options.debug ) fprintf(stderr,"DEBUG: %s %s extend file %lu bytes\n",__FUNCTION__,path,size+offset);
+   int prev_sector = 0; // Last sector of the file
+   for ( int i=0;sectors[i];++i ) prev_sector = sectors[i];
    while ( size+offset )
    {
       // Fill last sector
@@ -1506,7 +1737,7 @@ int mydos_write(struct atrfs *atrfs,const char *path, const char *buf, size_t si
       if ( size || ((dirent->flags & FLAGS_DOS2) && s[atrfs->sectorsize-1] == atrfs->sectorsize-3) )
       {
          // Allocate a new sector and set it to zero bytes
-         sector = mydos_alloc_any_sector(atrfs);
+         sector = mydos_alloc_next_sector(atrfs,prev_sector);
          if ( sector < 0 )
          {
             s[atrfs->sectorsize-2]=0; // next sector should already be zero
@@ -1525,6 +1756,7 @@ int mydos_write(struct atrfs *atrfs,const char *path, const char *buf, size_t si
             return -ENOSPC;
          }
          if ( options.debug ) fprintf(stderr,"DEBUG: %s %s add sector to file: %d\n",__FUNCTION__,path,sector);
+         prev_sector = sector;
          s[atrfs->sectorsize-2]=sector&0xff;
          s[atrfs->sectorsize-3]=sector>>8;
          int len = BYTES2(dirent->sectors);
@@ -2080,6 +2312,566 @@ int mydos_truncate(struct atrfs *atrfs,const char *path, off_t size)
    return 0;
 }
 
+/*
+ * mydos_fallocate()
+ *
+ * Reserve space for a file up front so that the sector chain is contiguous.
+ *
+ * The size of the file is defined by the sector chain, so there is no way
+ * to allocate sectors past the end of the file (FALLOC_FL_KEEP_SIZE).
+ * Instead, find a run of free sectors large enough for the new size, point
+ * the allocator at it, and grow the file there.  Later writes then only
+ * overwrite data.
+ */
+int mydos_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length)
+{
+   int r,sector=0,parent_dir_sector,count,locked,fileno,entry,filesize,*sectors;
+   int isdir,isinfo;
+   struct statvfs st;
+
+   if ( mode ) return -EOPNOTSUPP;
+   r = mydos_path(atrfs,path,&sector,&parent_dir_sector,&count,&locked,&fileno,&entry,&isdir,&isinfo);
+   if ( isdir ) return -EISDIR;
+   if ( r<0 ) return r;
+   if ( r>0 ) return -ENOENT;
+   if ( isinfo ) return -ENOENT; // These aren't writable
+   if ( locked ) return -EACCES;
+
+   struct dos2_dirent *dirent;
+   dirent = SECTOR(parent_dir_sector);
+   dirent += DIRENT_ENTRY(entry);
+   r = mydos_trace_file(atrfs,sector,fileno,(dirent->flags & FLAGS_DOS2) == 0,&filesize,&sectors);
+   if ( r<0 ) return r;
+   free(sectors);
+   if ( r>0 ) return -EIO;
+   if ( offset + length <= filesize ) return 0; // Already allocated
+
+   // Fail up front rather than leave a partial allocation
+   int needed = (offset + length - filesize) / (atrfs->sectorsize-3) + 1;
+   mydos_statfs(atrfs,path,&st);
+   if ( (unsigned int)needed > st.f_bfree ) return -ENOSPC;
+
+   atrfs->alloc_hint = find_free_run(atrfs,2,atrfs->sectors,needed,mydos_bitmap_status);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s %d sectors starting at %d\n",__FUNCTION__,path,needed,atrfs->alloc_hint);
+   r = mydos_truncate(atrfs,path,offset+length);
+   atrfs->alloc_hint = 0;
+   return r;
+}
+
+/*
+ * mydos_copy_file_range()
+ *
+ * Fast path for duplicating a whole file into a new, empty file.
+ *
+ * Allocate the destination chain in one pass (contiguous if possible),
+ * copy each sector directly, and rewrite the link bytes at the end of
+ * each sector.  Anything else returns -EOPNOTSUPP so that the generic
+ * layer falls back to reading and writing.
+ */
+int mydos_copy_file_range(struct atrfs *atrfs,const char *path_in, off_t offset_in, const char *path_out, off_t offset_out, size_t size)
+{
+   int r,sector=0,parent_dir_sector,count,locked,fileno,entry,filesize,*sectors;
+   int out_sector=0,out_parent_dir_sector,out_count,out_locked,out_fileno,out_entry,out_filesize,*out_sectors;
+   int isdir,isinfo;
+   struct statvfs st;
+
+   if ( offset_in || offset_out ) return -EOPNOTSUPP;
+   if ( atrfs_strcmp(path_out,"/DOS.SYS") == 0 ) return -EOPNOTSUPP; // Let mydos_write() fix the boot sectors
+   r = mydos_path(atrfs,path_in,&sector,&parent_dir_sector,&count,&locked,&fileno,&entry,&isdir,&isinfo);
+   if ( r || isdir || isinfo ) return -EOPNOTSUPP;
+   r = mydos_path(atrfs,path_out,&out_sector,&out_parent_dir_sector,&out_count,&out_locked,&out_fileno,&out_entry,&isdir,&isinfo);
+   if ( r || isdir || isinfo ) return -EOPNOTSUPP;
+   if ( out_locked ) return -EACCES; // As a write would
+
+   struct dos2_dirent *dirent,*out_dirent;
+   dirent = SECTOR(parent_dir_sector);
+   dirent += DIRENT_ENTRY(entry);
+   out_dirent = SECTOR(out_parent_dir_sector);
+   out_dirent += DIRENT_ENTRY(out_entry);
+   if ( (dirent->flags & FLAGS_DOS2) != (out_dirent->flags & FLAGS_DOS2) ) return -EOPNOTSUPP;
+   if ( BYTES2(out_dirent->sectors) != 1 ) return -EOPNOTSUPP; // Not a new file
+
+   r = mydos_trace_file(atrfs,out_sector,out_fileno,(out_dirent->flags & FLAGS_DOS2) == 0,&out_filesize,&out_sectors);
+   if ( r<0 ) return r;
+   free(out_sectors);
+   if ( r>0 || out_filesize ) return -EOPNOTSUPP;
+
+   r = mydos_trace_file(atrfs,sector,fileno,(dirent->flags & FLAGS_DOS2) == 0,&filesize,&sectors);
+   if ( r<0 ) return r;
+   if ( r>0 || (size_t)filesize > size )
+   {
+      free(sectors);
+      return -EOPNOTSUPP;
+   }
+   count=0;
+   while ( sectors[count] ) ++count;
+
+   // Allocate the new chain up front; the first sector is already there
+   mydos_statfs(atrfs,path_out,&st);
+   if ( (unsigned int)count-1 > st.f_bfree )
+   {
+      free(sectors);
+      return -ENOSPC;
+   }
+   out_sectors = malloc(sizeof(int)*(count+1));
+   if ( !out_sectors )
+   {
+      free(sectors);
+      return -ENOMEM;
+   }
+   mydos_remove_fileno(atrfs,out_dirent,out_fileno);
+   out_sectors[0] = out_sector;
+   out_sectors[count] = 0;
+   atrfs->alloc_hint = find_free_run(atrfs,2,atrfs->sectors,count-1,mydos_bitmap_status);
+   for ( int i=1;i<count;++i )
+   {
+      out_sectors[i] = mydos_alloc_any_sector(atrfs);
+      if ( out_sectors[i] < 0 ) // Shouldn't happen after checking the free count
+      {
+         while ( --i > 0 ) mydos_free_sector(atrfs,out_sectors[i]);
+         atrfs->alloc_hint = 0;
+         free(out_sectors);
+         free(sectors);
+         mydos_add_fileno(atrfs,out_dirent,out_entry);
+         return -ENOSPC;
+      }
+   }
+   atrfs->alloc_hint = 0;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s %s to %s: %d sectors, %d bytes\n",__FUNCTION__,path_in,path_out,count,filesize);
+
+   // Copy the data and the byte count (DOS 1: sequence number), then link the chain
+   for ( int i=0;i<count;++i )
+   {
+      unsigned char *src = SECTOR(sectors[i]);
+      unsigned char *dst = SECTOR(out_sectors[i]);
+      memcpy(dst,src,atrfs->sectorsize-3);
+      dst[atrfs->sectorsize-3] = out_sectors[i+1] >> 8;
+      dst[atrfs->sectorsize-2] = out_sectors[i+1] & 0xff;
+      dst[atrfs->sectorsize-1] = src[atrfs->sectorsize-1];
+   }
+   STOREBYTES2(out_dirent->sectors,count);
+   mydos_add_fileno(atrfs,out_dirent,out_entry);
+   free(out_sectors);
+   free(sectors);
+   return filesize;
+}
+
+/*
+ * mydos_getxattr()
+ *
+ * Attributes from the directory entry and sector chain (XATTR_PREFIX removed):
+ *   flags    Directory entry flags in hex
+ *   start    Starting sector
+ *   sectors  Sector count from the directory entry
+ *   locked   1 or 0
+ *   fileno   File number in the sector links; not for MyDOS-style files
+ *   format   dos1, dos2, or mydos (full sector numbers in the links)
+ *   chain    Sector chain, two bytes per sector, low byte first
+ */
+int mydos_getxattr(struct atrfs *atrfs,const char *path, const char *name, char *value, size_t size)
+{
+   int r,sector=0,parent_dir_sector,count,locked,fileno,entry,filesize,*sectors;
+   int isdir,isinfo;
+
+   r = mydos_path(atrfs,path,&sector,&parent_dir_sector,&count,&locked,&fileno,&entry,&isdir,&isinfo);
+   if ( r<0 ) return r;
+   if ( r>0 ) return -ENOENT;
+   if ( isinfo || entry < 0 ) return -ENODATA; // Root directory has no entry
+
+   struct dos2_dirent *dirent = SECTOR(parent_dir_sector);
+   dirent += DIRENT_ENTRY(entry);
+   if ( strcmp(name,"flags") == 0 ) return xattr_text(value,size,"%02x",dirent->flags);
+   if ( strcmp(name,"start") == 0 ) return xattr_text(value,size,"%d",BYTES2(dirent->start));
+   if ( strcmp(name,"sectors") == 0 ) return xattr_text(value,size,"%d",BYTES2(dirent->sectors));
+   if ( strcmp(name,"locked") == 0 ) return xattr_text(value,size,"%d",(dirent->flags & FLAGS_LOCKED) != 0);
+   if ( isdir ) return -ENODATA;
+   if ( strcmp(name,"fileno") == 0 )
+   {
+      if ( fileno < 0 ) return -ENODATA;
+      return xattr_text(value,size,"%d",fileno);
+   }
+   if ( strcmp(name,"format") == 0 )
+   {
+      if ( !(dirent->flags & FLAGS_DOS2) ) return xattr_text(value,size,"dos1");
+      return xattr_text(value,size,(fileno < 0) ? "mydos" : "dos2");
+   }
+   if ( strcmp(name,"chain") == 0 )
+   {
+      r = mydos_trace_file(atrfs,sector,fileno,(dirent->flags & FLAGS_DOS2) == 0,&filesize,&sectors);
+      if ( r<0 ) return r;
+      int n = 0;
+      while ( sectors && sectors[n] ) ++n;
+      r = xattr_chain(value,size,sectors,n);
+      free(sectors);
+      return r;
+   }
+   return -ENODATA;
+}
+
+/*
+ * mydos_listxattr()
+ */
+int mydos_listxattr(struct atrfs *atrfs,const char *path, char *list, size_t size)
+{
+   int r,sector=0,parent_dir_sector,count,locked,fileno,entry;
+   int isdir,isinfo;
+   static const char *const dir_names[] = { "flags","start","sectors","locked",NULL };
+   static const char *const file_names[] = { "flags","start","sectors","locked","format","chain",NULL };
+   static const char *const fileno_names[] = { "flags","start","sectors","locked","fileno","format","chain",NULL };
+
+   r = mydos_path(atrfs,path,&sector,&parent_dir_sector,&count,&locked,&fileno,&entry,&isdir,&isinfo);
+   if ( r<0 ) return r;
+   if ( r>0 ) return -ENOENT;
+   if ( isinfo || entry < 0 ) return 0;
+   if ( isdir ) return xattr_names(list,size,dir_names);
+   if ( fileno < 0 ) return xattr_names(list,size,file_names);
+   return xattr_names(list,size,fileno_names);
+}
+
+/*
+ * mydos_sectormap_dir()
+ *
+ * Claim the sectors of everything in a directory, recursing into
+ * subdirectories.
+ */
+int mydos_sectormap_dir(struct atrfs *atrfs,struct sectormap *sm,int dir_sector,const char *dirpath)
+{
+   struct dos2_dirent *dirent = SECTOR(dir_sector);
+   char name[8+1+3+1];
+   char *path;
+   int r=0;
+
+   if ( !dirent ) return -EIO;
+   path = malloc(strlen(dirpath)+1+sizeof(name));
+   if ( !path ) return -ENOMEM;
+   for ( int i=0;i<64;++i )
+   {
+      const int j=DIRENT_ENTRY(i);
+
+      if ( dirent[j].flags == 0 ) break;
+      if ( dirent[j].flags & FLAGS_DELETED ) continue;
+      mydos_dirent_name(&dirent[j],name);
+      sprintf(path,"%s/%s",dirpath,name);
+      int owner = sectormap_owner(sm,path);
+      int start = BYTES2(dirent[j].start);
+
+      if ( (dirent[j].flags & FLAGS_DIR) && atrfs->fstype != ATR_DOS25 )
+      {
+         if ( start < 1 || start+7 > atrfs->sectors ) continue;
+         int seen = sm->map[start].claims; // Don't loop on a corrupted directory tree
+         for ( int k=0;k<8;++k ) sectormap_claim(sm,start+k,owner,SM_DIR,k);
+         if ( !seen ) mydos_sectormap_dir(atrfs,sm,start,path);
+         continue;
+      }
+
+      if ( start < 1 ) continue;
+      int filesize,*sectors;
+      int fileno = (dirent[j].flags & FLAGS_NOFILENO) ? -1 : i;
+      r = mydos_trace_file(atrfs,start,fileno,(dirent[j].flags & FLAGS_DOS2) == 0,&filesize,&sectors);
+      if ( r<0 ) continue;
+      for ( int k=0;sectors && sectors[k];++k ) sectormap_claim(sm,sectors[k],owner,SM_DATA,k);
+      free(sectors);
+   }
+   free(path);
+   return 0;
+}
+
+/*
+ * mydos_sectormap()
+ */
+int mydos_sectormap(struct atrfs *atrfs,struct sectormap *sm)
+{
+   int owner;
+   struct sector1 *sec1 = SECTOR(1);
+   struct mydos_vtoc *vtoc = SECTOR(360);
+
+   // Sectors covered by the bitmap
+   int last = atrfs->sectors;
+   if ( (atrfs->fstype == ATR_DOS1 || atrfs->fstype == ATR_DOS2) && last > 719 ) last = 719;
+   if ( atrfs->fstype == ATR_DOS25 && last > 1023 ) last = 1023;
+   for ( int i=1;i<=last;++i )
+   {
+      sm->map[i].bitmap = mydos_bitmap_status(atrfs,i) ? SM_FREE : SM_USED;
+   }
+
+   owner = sectormap_owner(sm,"[boot]");
+   for ( int i=1;i<=sec1->boot_sectors && i<4;++i ) sectormap_claim(sm,i,owner,SM_SYSTEM,i-1);
+   owner = sectormap_owner(sm,"[vtoc]");
+   int vtoc_sectors = 1;
+   if ( atrfs->fstype == ATR_MYDOS && vtoc->vtoc_sectors > 2 )
+   {
+      vtoc_sectors = ( atrfs->sectorsize == 128 ) ? vtoc->vtoc_sectors*2-3 : vtoc->vtoc_sectors-1;
+   }
+   for ( int i=0;i<vtoc_sectors;++i ) sectormap_claim(sm,360-i,owner,SM_SYSTEM,i);
+   if ( atrfs->fstype == ATR_DOS25 ) sectormap_claim(sm,1024,owner,SM_SYSTEM,1);
+   if ( (atrfs->fstype == ATR_MYDOS || atrfs->fstype == ATR_DOS25) && atrfs->sectors >= 720 )
+   {
+      sectormap_claim(sm,720,sectormap_owner(sm,"[reserved]"),SM_SYSTEM,0); // Never allocated by MyDOS or DOS 2.5
+   }
+
+   owner = sectormap_owner(sm,"/");
+   for ( int i=0;i<8;++i ) sectormap_claim(sm,361+i,owner,SM_DIR,i);
+   return mydos_sectormap_dir(atrfs,sm,361,"");
+}
+
+/*
+ * mydos_check_dir()
+ *
+ * Check the sector chain and count of everything in a directory,
+ * recursing into subdirectories.
+ */
+int mydos_check_dir(struct atrfs *atrfs,struct fscheck *ck,int dir_sector,const char *dirpath,int depth)
+{
+   struct dos2_dirent *dirent = SECTOR(dir_sector);
+   char name[8+1+3+1];
+   char *path;
+
+   if ( !dirent ) return -EIO;
+   path = malloc(strlen(dirpath)+1+sizeof(name));
+   if ( !path ) return -ENOMEM;
+   for ( int i=0;i<64;++i )
+   {
+      const int j=DIRENT_ENTRY(i);
+
+      if ( dirent[j].flags == 0 ) break;
+      if ( dirent[j].flags & FLAGS_DELETED ) continue;
+      mydos_dirent_name(&dirent[j],name);
+      sprintf(path,"%s/%s",dirpath,name);
+      int start = BYTES2(dirent[j].start);
+
+      if ( (dirent[j].flags & FLAGS_DIR) && atrfs->fstype != ATR_DOS25 )
+      {
+         if ( start < 1 || start+7 > atrfs->sectors )
+         {
+            fscheck_problem(ck,0,"%s: directory starts at sector %d, which is not on the disk",path,start);
+            continue;
+         }
+         // Cross-linked directories are reported with the bitmap
+         if ( ck->sm && ck->sm->map[start].claims == 1 && depth < 32 ) mydos_check_dir(atrfs,ck,start,path,depth+1);
+         continue;
+      }
+
+      if ( start < 1 || start > atrfs->sectors )
+      {
+         fscheck_problem(ck,0,"%s: starts at sector %d, which is not on the disk",path,start);
+         ck->damaged = 1;
+         continue;
+      }
+      int filesize,*sectors,n;
+      int fileno = (dirent[j].flags & FLAGS_NOFILENO) ? -1 : i;
+      int r = mydos_trace_file(atrfs,start,fileno,(dirent[j].flags & FLAGS_DOS2) == 0,&filesize,&sectors);
+      for ( n=0;sectors && sectors[n];++n ) ;
+      free(sectors);
+      if ( r )
+      {
+         if ( r < 0 ) fscheck_problem(ck,0,"%s: sector chain loops back on itself",path);
+         else if ( r == 164 ) fscheck_problem(ck,0,"%s: sector chain leads into another file after %d sectors",path,n);
+         else fscheck_problem(ck,0,"%s: sector chain runs off the disk after %d sectors",path,n);
+         ck->damaged = 1;
+         continue;
+      }
+      if ( BYTES2(dirent[j].sectors) != n )
+      {
+         int old = BYTES2(dirent[j].sectors);
+         if ( ck->repair ) STOREBYTES2(dirent[j].sectors,n);
+         fscheck_problem(ck,ck->repair,"%s: directory entry says %d sectors, but the chain has %d",path,old,n);
+      }
+   }
+   free(path);
+   return 0;
+}
+
+/*
+ * mydos_check()
+ *
+ * Check directories and chains, then the bitmap and the free counts in
+ * the VTOC.  The counts are checked last so that they agree with any
+ * bitmap repairs.
+ */
+int mydos_check(struct atrfs *atrfs,struct fscheck *ck)
+{
+   int r = mydos_check_dir(atrfs,ck,361,"",0);
+   if ( r<0 ) return r;
+   fscheck_bitmap(ck,atrfs,1,mydos_bitmap);
+
+   int last = atrfs->sectors;
+   int free_low = 0, free_high = 0;
+   if ( (atrfs->fstype == ATR_DOS1 || atrfs->fstype == ATR_DOS2) && last > 719 ) last = 719;
+   if ( atrfs->fstype == ATR_DOS25 && last > 1023 ) last = 1023;
+   for ( int i=1;i<=last;++i )
+   {
+      if ( !mydos_bitmap_status(atrfs,i) ) continue;
+      if ( atrfs->fstype == ATR_DOS25 && i >= 720 ) ++free_high;
+      else ++free_low;
+   }
+   struct mydos_vtoc *vtoc = SECTOR(360);
+   if ( BYTES2(vtoc->free_sectors) != free_low )
+   {
+      int old = BYTES2(vtoc->free_sectors);
+      int total = BYTES2(vtoc->total_sectors);
+      if ( ck->repair ) STOREBYTES2(vtoc->free_sectors,free_low);
+      if ( free_low > total ) // Older images short the total by sectors never used
+      {
+         if ( ck->repair ) STOREBYTES2(vtoc->total_sectors,free_low);
+         fscheck_problem(ck,ck->repair,"VTOC says %d free of %d total sectors, but the bitmap has %d free",old,total,free_low);
+      }
+      else fscheck_problem(ck,ck->repair,"VTOC says %d free sectors, but the bitmap has %d",old,free_low);
+   }
+   if ( atrfs->fstype == ATR_DOS25 && atrfs->sectors >= 1024 )
+   {
+      struct dos25_vtoc2 *vtoc2 = SECTOR(1024);
+      if ( BYTES2(vtoc2->free_high_sectors) != free_high )
+      {
+         int old = BYTES2(vtoc2->free_high_sectors);
+         if ( ck->repair ) STOREBYTES2(vtoc2->free_high_sectors,free_high);
+         fscheck_problem(ck,ck->repair,"second VTOC says %d free sectors above 719, but the bitmap has %d",old,free_high);
+      }
+   }
+   return 0;
+}
+
+/*
+ * mydos_defrag_file()
+ *
+ * Move a file to a contiguous run of free sectors if it isn't already one.
+ * The data is buffered and the old sectors freed first so that the new
+ * run may overlap the old one.
+ *
+ * Return 1 if moved, 0 if left alone, -ENOSPC if no run is long enough.
+ */
+int mydos_defrag_file(struct atrfs *atrfs,struct dos2_dirent *dirent,int entry,int dir_sector)
+{
+   int filesize,*sectors,n,i;
+   int fileno = (dirent->flags & FLAGS_NOFILENO) ? -1 : entry;
+   int old_start = BYTES2(dirent->start);
+   const int ss = atrfs->sectorsize;
+
+   int r = mydos_trace_file(atrfs,old_start,fileno,(dirent->flags & FLAGS_DOS2) == 0,&filesize,&sectors);
+   if ( r || !sectors )
+   {
+      free(sectors);
+      return 0; // Leave damaged files alone
+   }
+   for ( n=0;sectors[n];++n ) ;
+   for ( i=1;i<n && sectors[i] == sectors[0]+i;++i ) ;
+   if ( i == n )
+   {
+      free(sectors);
+      return 0;
+   }
+
+   unsigned char *buf = malloc(n*ss);
+   if ( !buf )
+   {
+      free(sectors);
+      return -ENOMEM;
+   }
+   for ( i=0;i<n;++i )
+   {
+      unsigned char *s = SECTOR(sectors[i]);
+      memcpy(buf+i*ss,s,ss);
+      mydos_free_sector(atrfs,sectors[i]);
+   }
+
+   // File numbers leave only 10 bits for the link
+   int last = atrfs->sectors;
+   if ( fileno >= 0 && last > 1023 ) last = 1023;
+   int start = find_free_run(atrfs,4,last,n,mydos_unused_sector);
+   for ( i=0;start > 0 && i<n;++i )
+   {
+      if ( !mydos_unused_sector(atrfs,start+i) ) start = -1;
+   }
+   if ( start < 0 )
+   {
+      for ( i=0;i<n;++i )
+      {
+         unsigned char *s = SECTOR(sectors[i]);
+         mydos_alloc_sector(atrfs,sectors[i]);
+         memcpy(s,buf+i*ss,ss);
+      }
+      free(buf);
+      free(sectors);
+      return -ENOSPC;
+   }
+
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d sectors from %d to %d\n",__FUNCTION__,n,old_start,start);
+   for ( i=0;i<n;++i )
+   {
+      unsigned char *s = SECTOR(start+i);
+      int next = ( i+1 < n ) ? start+i+1 : 0;
+
+      mydos_alloc_sector(atrfs,start+i);
+      memcpy(s,buf+i*ss,ss);
+      if ( fileno >= 0 ) s[ss-3] = (s[ss-3] & 0xfc) | (next >> 8);
+      else s[ss-3] = next >> 8;
+      s[ss-2] = next & 0xff;
+   }
+   STOREBYTES2(dirent->start,start);
+
+   // Keep the boot sectors pointing at DOS.SYS
+   if ( dir_sector == 361 && memcmp(dirent->name,"DOS     SYS",8+3) == 0 )
+   {
+      struct sector1 *sec1 = SECTOR(1);
+      if ( atrfs->fstype == ATR_DOS1 )
+      {
+         if ( sec1->dos_sector[1] + sec1->displacement * 256 == old_start )
+         {
+            sec1->dos_sector[1] = start & 0xff;
+            sec1->displacement = start >> 8;
+         }
+      }
+      else if ( BYTES2(sec1->dos_sector) == old_start )
+      {
+         STOREBYTES2(sec1->dos_sector,start);
+      }
+   }
+   free(buf);
+   free(sectors);
+   return 1;
+}
+
+/*
+ * mydos_defrag_dir()
+ *
+ * Directories stay where they are; only the files in them move.
+ */
+int mydos_defrag_dir(struct atrfs *atrfs,int dir_sector,int *fragmented,int depth)
+{
+   struct dos2_dirent *dirent = SECTOR(dir_sector);
+   int moved = 0;
+
+   if ( depth > 64 ) return 0; // Don't loop on a corrupted directory tree
+   for ( int i=0;i<64;++i )
+   {
+      const int j=DIRENT_ENTRY(i);
+
+      if ( dirent[j].flags == 0 ) break;
+      if ( dirent[j].flags & FLAGS_DELETED ) continue;
+      if ( (dirent[j].flags & FLAGS_DIR) && atrfs->fstype != ATR_DOS25 )
+      {
+         int start = BYTES2(dirent[j].start);
+         if ( start < 1 || start+7 > atrfs->sectors ) continue;
+         int r = mydos_defrag_dir(atrfs,start,fragmented,depth+1);
+         if ( r < 0 ) return r;
+         moved += r;
+         continue;
+      }
+      int r = mydos_defrag_file(atrfs,&dirent[j],i,dir_sector);
+      if ( r == -ENOSPC ) ++*fragmented;
+      else if ( r < 0 ) return r;
+      else moved += r;
+   }
+   return moved;
+}
+
+/*
+ * mydos_defrag()
+ */
+int mydos_defrag(struct atrfs *atrfs,int *fragmented)
+{
+   return mydos_defrag_dir(atrfs,361,fragmented,0);
+}
+
 int mydos_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf)
 {
    (void)path; // meaningless
@@ -2167,7 +2959,7 @@ int mydos_newfs(struct atrfs *atrfs)
                //     1          2
                //     3          3
                //     5          4
-               first_vtoc = 361 - vtoc_count * 2;
+               first_vtoc = 361 - (vtoc_count * 2 - 1);
             }
             else
             {
@@ -2196,7 +2988,7 @@ int mydos_newfs(struct atrfs *atrfs)
    vtoc->total_sectors[0] = vtoc->free_sectors[0];
    vtoc->total_sectors[1] = vtoc->free_sectors[1];
 
-   return -EIO;
+   return 0;
 }
 
 char *mydos_fsinfo(struct atrfs *atrfs)
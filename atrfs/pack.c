@@ -0,0 +1,694 @@
+/*
+ * pack.c
+ *
+ * Packs of many images for --pack: each distinct 128-byte chunk of image
+ * data is stored once, and each member image is a list of chunks.  Boot
+ * sectors, DOS files, and empty sectors are shared by most images in a
+ * library, so a pack is much smaller than the images it holds.
+ *
+ * A member is mounted with --member=<name>.  Its image is copied out of
+ * the mapped pack into anonymous memory when it is opened, so everything
+ * else sees an ordinary image through SECTOR().  This is a read-only
+ * fallback: the copy isn't backed by the pack's chunks, so shared chunks
+ * aren't shared in memory between mounts.  That would need SECTOR() to
+ * look up chunks, as mmap() can't map 128-byte pieces of a file.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#include FUSE_INCLUDE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+// MD5 library functions
+#if defined(__APPLE__)
+#  define COMMON_DIGEST_FOR_OPENSSL
+#  include <CommonCrypto/CommonDigest.h>
+#else
+#  include <openssl/md5.h>
+#endif
+#include "atrfs.h"
+
+/*
+ * Macros and defines
+ */
+#define PACK_MAGIC "ATRPACK1"
+#define PACK_CHUNK 128 // Smallest sector size, so chunks line up with sectors
+#define PACK_START 128 // Offset of the first chunk
+#define PACK_ATR_HEADER 16
+#define PACK_MAX_IMAGE (64*1024*1024) // Larger files are not disk images
+
+/*
+ * Pack file format (all numbers little-endian)
+ *
+ *   "ATRPACK1"
+ *   Chunk count, member count, directory offset (4 bytes each)
+ *   Zeros to PACK_START
+ *   Chunks: PACK_CHUNK bytes each
+ *   Directory, for each member:
+ *      name length (2 bytes), name
+ *      image file size (4 bytes)
+ *      ATR header length (1 byte; 0 or 16), ATR header
+ *      chunk count (4 bytes), chunk numbers (4 bytes each)
+ *
+ * The image data after the ATR header is the listed chunks in order; the
+ * last chunk is padded with zeros.  Chunks start after the header so they
+ * line up with sectors.
+ */
+
+/*
+ * Data types
+ */
+struct pack_member {
+   char *name;
+   unsigned int size; // Image file size
+   int hdrlen;
+   unsigned char hdr[PACK_ATR_HEADER];
+   unsigned int nchunks;
+   const unsigned char *chunk; // Chunk numbers in the directory
+   unsigned int *newchunk; // Chunk numbers for a member added this run
+};
+
+struct pack {
+   unsigned char *map;
+   size_t len;
+   unsigned int chunks;
+   unsigned int members;
+   struct pack_member *member;
+};
+
+// Chunk checksums for finding duplicates while adding images
+struct pack_hash {
+   unsigned char md5[16];
+   unsigned int chunk;
+   int used;
+};
+
+struct pack_table {
+   struct pack_hash *slot;
+   unsigned int size; // Power of two
+   unsigned int count;
+};
+
+/*
+ * Function prototypes
+ */
+int pack_parse(struct pack *p,unsigned char *map,size_t len,const char *filename);
+int pack_open(struct pack *p,const char *filename);
+void pack_close(struct pack *p);
+struct pack_member *pack_find(struct pack *p,const char *name);
+void pack_image(struct pack *p,struct pack_member *m,unsigned char *buf);
+unsigned int pack_chunk_number(const struct pack_member *m,unsigned int i);
+int pack_table_find(struct pack_table *t,const unsigned char *md5,unsigned int *chunk);
+void pack_table_add(struct pack_table *t,const unsigned char *md5,unsigned int chunk);
+char *pack_name(const char *path);
+int pack_add(int count,char *names[]);
+int pack_list(void);
+int pack_unpack(void);
+
+/*
+ * Functions
+ */
+
+/*
+ * pack_parse()
+ *
+ * Find the members in a mapped pack; returns non-zero if it's damaged
+ */
+int pack_parse(struct pack *p,unsigned char *map,size_t len,const char *filename)
+{
+   memset(p,0,sizeof(*p));
+   p->map = map;
+   p->len = len;
+   if ( len < PACK_START || memcmp(map,PACK_MAGIC,8) != 0 ) goto damaged;
+   p->chunks = diff_get(map+8,4);
+   p->members = diff_get(map+12,4);
+   size_t dir = diff_get(map+16,4);
+   if ( dir != PACK_START + (size_t)p->chunks * PACK_CHUNK || dir > len ) goto damaged;
+   if ( p->members > len - dir ) goto damaged;
+   p->member = calloc(p->members+1,sizeof(*p->member));
+   const unsigned char *b = map + dir, *end = map + len;
+   for ( unsigned int i=0;i<p->members;++i )
+   {
+      struct pack_member *m = &p->member[i];
+      if ( end - b < 2 || end - b < 2 + diff_get(b,2) + 5 ) goto damaged;
+      m->name = strndup((const char *)b+2,diff_get(b,2));
+      b += 2 + diff_get(b,2);
+      m->size = diff_get(b,4);
+      m->hdrlen = b[4];
+      b += 5;
+      if ( ( m->hdrlen != 0 && m->hdrlen != PACK_ATR_HEADER ) || end - b < m->hdrlen + 4 ) goto damaged;
+      memcpy(m->hdr,b,m->hdrlen);
+      b += m->hdrlen;
+      m->nchunks = diff_get(b,4);
+      b += 4;
+      if ( m->nchunks > (size_t)(end - b) / 4 ) goto damaged;
+      if ( m->size < (unsigned int)m->hdrlen || (m->size - m->hdrlen + PACK_CHUNK - 1) / PACK_CHUNK != m->nchunks ) goto damaged;
+      m->chunk = b;
+      for ( unsigned int c=0;c<m->nchunks;++c )
+      {
+         if ( diff_get(b+c*4,4) >= p->chunks ) goto damaged;
+      }
+      b += m->nchunks * 4;
+   }
+   return 0;
+
+ damaged:
+   fprintf(stderr,"Pack %s is damaged\n",filename);
+   for ( unsigned int i=0;p->member && i<p->members;++i ) free(p->member[i].name);
+   free(p->member);
+   p->member = NULL;
+   p->members = 0;
+   return 1;
+}
+
+/*
+ * pack_open()
+ *
+ * Map and parse a pack file; returns non-zero on failure
+ */
+int pack_open(struct pack *p,const char *filename)
+{
+   struct stat sb;
+   int fd = open(filename,O_RDONLY);
+   unsigned char *map;
+
+   memset(p,0,sizeof(*p));
+   if ( fd < 0 ) return 1;
+   if ( fstat(fd,&sb) || sb.st_size < PACK_START )
+   {
+      close(fd);
+      return 1;
+   }
+   map = mmap(NULL,sb.st_size,PROT_READ,MAP_SHARED,fd,0);
+   close(fd);
+   if ( map == MAP_FAILED ) return 1;
+   if ( pack_parse(p,map,sb.st_size,filename) )
+   {
+      munmap(map,sb.st_size);
+      return 1;
+   }
+   return 0;
+}
+
+/*
+ * pack_close()
+ */
+void pack_close(struct pack *p)
+{
+   for ( unsigned int i=0;i<p->members;++i )
+   {
+      free(p->member[i].name);
+      free(p->member[i].newchunk);
+   }
+   free(p->member);
+   if ( p->map ) munmap(p->map,p->len);
+   memset(p,0,sizeof(*p));
+}
+
+/*
+ * pack_find()
+ *
+ * Find a member by its full name, or by the file name alone if that is
+ * unique in the pack
+ */
+struct pack_member *pack_find(struct pack *p,const char *name)
+{
+   struct pack_member *found = NULL;
+   int matches = 0;
+
+   for ( unsigned int i=0;i<p->members;++i )
+   {
+      if ( strcmp(p->member[i].name,name) == 0 ) return &p->member[i];
+   }
+   for ( unsigned int i=0;i<p->members;++i )
+   {
+      const char *base = strrchr(p->member[i].name,'/');
+      base = base ? base+1 : p->member[i].name;
+      if ( strcmp(base,name) == 0 )
+      {
+         found = &p->member[i];
+         ++matches;
+      }
+   }
+   return matches == 1 ? found : NULL;
+}
+
+/*
+ * pack_chunk_number()
+ */
+unsigned int pack_chunk_number(const struct pack_member *m,unsigned int i)
+{
+   if ( m->newchunk ) return m->newchunk[i];
+   return diff_get(m->chunk+i*4,4);
+}
+
+/*
+ * pack_image()
+ *
+ * Put a member's image file together in 'buf', which holds m->size bytes
+ */
+void pack_image(struct pack *p,struct pack_member *m,unsigned char *buf)
+{
+   memcpy(buf,m->hdr,m->hdrlen);
+   for ( unsigned int i=0;i<m->nchunks;++i )
+   {
+      size_t off = m->hdrlen + (size_t)i * PACK_CHUNK;
+      size_t n = m->size - off < PACK_CHUNK ? m->size - off : PACK_CHUNK;
+      memcpy(buf+off,p->map + PACK_START + (size_t)pack_chunk_number(m,i) * PACK_CHUNK,n);
+   }
+}
+
+/*
+ * pack_member()
+ *
+ * Called when opening an image: if it is a pack, replace the mapping with
+ * a private, read-only copy of the member named by --member.  Returns
+ * non-zero if it's a pack but the member can't be opened.
+ */
+int pack_member(struct atrfs *atrfs)
+{
+   struct pack p;
+   struct pack_member *m;
+   unsigned char *buf;
+
+   if ( atrfs->atrsize < PACK_START || memcmp(atrfs->atrmem,PACK_MAGIC,8) != 0 ) return 0;
+   if ( pack_parse(&p,atrfs->atrmem,atrfs->atrsize,options.filename) ) return 1;
+   if ( !options.member )
+   {
+      fprintf(stderr,"%s is a pack of %u images; use --member=<name> to open one\n",options.filename,p.members);
+      p.map = NULL; // Still mapped in atrfs
+      pack_close(&p);
+      return 1;
+   }
+   m = pack_find(&p,options.member);
+   if ( !m )
+   {
+      fprintf(stderr,"No member %s in pack %s\n",options.member,options.filename);
+      p.map = NULL;
+      pack_close(&p);
+      return 1;
+   }
+   buf = mmap(NULL,m->size ? m->size : 1,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+   if ( buf == MAP_FAILED )
+   {
+      p.map = NULL;
+      pack_close(&p);
+      return 1;
+   }
+   pack_image(&p,m,buf);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s: %u bytes in %u chunks\n",__FUNCTION__,m->name,m->size,m->nchunks);
+
+   munmap(atrfs->atrmem,atrfs->atrsize);
+   atrfs->atrmem = buf;
+   atrfs->mem = (char *)buf + PACK_ATR_HEADER;
+   atrfs->atrsize = m->size;
+   atrfs->atrstat.st_size = m->size;
+   if ( !atrfs->readonly ) fprintf(stderr,"NOTE: Pack member %s is read-only\n",m->name);
+   atrfs->readonly = 1;
+   p.map = NULL;
+   pack_close(&p);
+   return 0;
+}
+
+/*
+ * pack_table_find()
+ */
+int pack_table_find(struct pack_table *t,const unsigned char *md5,unsigned int *chunk)
+{
+   if ( !t->size ) return 0;
+   unsigned int i = diff_get(md5,4) & (t->size-1);
+   while ( t->slot[i].used )
+   {
+      if ( memcmp(t->slot[i].md5,md5,16) == 0 )
+      {
+         *chunk = t->slot[i].chunk;
+         return 1;
+      }
+      i = (i + 1) & (t->size-1);
+   }
+   return 0;
+}
+
+/*
+ * pack_table_add()
+ */
+void pack_table_add(struct pack_table *t,const unsigned char *md5,unsigned int chunk)
+{
+   if ( (t->count + 1) * 2 > t->size )
+   {
+      struct pack_table bigger;
+      bigger.size = t->size ? t->size * 2 : 4096;
+      bigger.count = 0;
+      bigger.slot = calloc(bigger.size,sizeof(*bigger.slot));
+      for ( unsigned int i=0;i<t->size;++i )
+      {
+         if ( t->slot[i].used ) pack_table_add(&bigger,t->slot[i].md5,t->slot[i].chunk);
+      }
+      free(t->slot);
+      *t = bigger;
+   }
+   unsigned int i = diff_get(md5,4) & (t->size-1);
+   while ( t->slot[i].used ) i = (i + 1) & (t->size-1);
+   memcpy(t->slot[i].md5,md5,16);
+   t->slot[i].chunk = chunk;
+   t->slot[i].used = 1;
+   ++t->count;
+}
+
+/*
+ * pack_name()
+ *
+ * Member name for an image path: leading "/" and "./" are dropped
+ */
+char *pack_name(const char *path)
+{
+   for (;;)
+   {
+      if ( path[0] == '/' ) ++path;
+      else if ( path[0] == '.' && path[1] == '/' ) path += 2;
+      else break;
+   }
+   return strdup(path);
+}
+
+/*
+ * pack_add()
+ *
+ * Add images to the pack, replacing members of the same name.  The pack
+ * is rewritten to a temporary file and renamed, so an interrupted run
+ * leaves the old pack intact.  Chunks no longer used by any member are
+ * kept; unpack and pack again to drop them.
+ */
+int pack_add(int count,char *names[])
+{
+   struct pack p;
+   struct pack_table t = {NULL,0,0};
+   char *tmp = malloc(strlen(options.pack)+5);
+   unsigned char b[PACK_START];
+   unsigned char *data = NULL;
+   unsigned int chunks,added = 0,reused = 0;
+   unsigned long long bytes = 0;
+   FILE *f;
+   int r = 0;
+
+   if ( pack_open(&p,options.pack) )
+   {
+      struct stat sb;
+      if ( stat(options.pack,&sb) == 0 )
+      {
+         fprintf(stderr,"%s exists and is not a pack\n",options.pack);
+         free(tmp);
+         return 1;
+      }
+      memset(&p,0,sizeof(p));
+   }
+   sprintf(tmp,"%s.tmp",options.pack);
+   f = fopen(tmp,"w");
+   if ( !f )
+   {
+      fprintf(stderr,"Unable to write pack %s\n",tmp);
+      pack_close(&p);
+      free(tmp);
+      return 1;
+   }
+
+   // Existing chunks
+   memset(b,0,sizeof(b));
+   r |= fwrite(b,PACK_START,1,f) != 1;
+   for ( unsigned int i=0;i<p.chunks;++i )
+   {
+      unsigned char md5[16];
+      const unsigned char *c = p.map + PACK_START + (size_t)i * PACK_CHUNK;
+      unsigned int dummy;
+      MD5(c,PACK_CHUNK,md5);
+      if ( !pack_table_find(&t,md5,&dummy) ) pack_table_add(&t,md5,i);
+   }
+   if ( p.chunks ) r |= fwrite(p.map + PACK_START,(size_t)p.chunks * PACK_CHUNK,1,f) != 1;
+   chunks = p.chunks;
+
+   // New images
+   for ( int n=0;n<count;++n )
+   {
+      struct stat sb;
+      int fd = open(names[n],O_RDONLY);
+      if ( fd < 0 || fstat(fd,&sb) || !S_ISREG(sb.st_mode) || sb.st_size > PACK_MAX_IMAGE )
+      {
+         fprintf(stderr,"Skipping %s: not a readable image file\n",names[n]);
+         if ( fd >= 0 ) close(fd);
+         continue;
+      }
+      data = realloc(data,sb.st_size + PACK_CHUNK);
+      ssize_t got = 0;
+      while ( got < sb.st_size )
+      {
+         ssize_t rd = read(fd,data+got,sb.st_size-got);
+         if ( rd <= 0 ) break;
+         got += rd;
+      }
+      close(fd);
+      if ( got != sb.st_size )
+      {
+         fprintf(stderr,"Skipping %s: read failed\n",names[n]);
+         continue;
+      }
+
+      char *name = pack_name(names[n]);
+      struct pack_member *m = NULL;
+      for ( unsigned int i=0;i<p.members;++i )
+      {
+         if ( strcmp(p.member[i].name,name) == 0 ) m = &p.member[i];
+      }
+      if ( m )
+      {
+         free(name);
+         free(m->newchunk);
+      }
+      else
+      {
+         p.member = realloc(p.member,(p.members+1) * sizeof(*p.member));
+         m = &p.member[p.members++];
+         memset(m,0,sizeof(*m));
+         m->name = name;
+      }
+      m->size = got;
+      m->hdrlen = ( got >= PACK_ATR_HEADER && data[0] == 0x96 && data[1] == 0x02 ) ? PACK_ATR_HEADER : 0;
+      memcpy(m->hdr,data,m->hdrlen);
+      m->nchunks = (got - m->hdrlen + PACK_CHUNK - 1) / PACK_CHUNK;
+      m->newchunk = malloc((m->nchunks+1) * sizeof(*m->newchunk));
+      memset(data+got,0,PACK_CHUNK); // Pad the last chunk
+      for ( unsigned int i=0;i<m->nchunks;++i )
+      {
+         unsigned char md5[16];
+         unsigned char *c = data + m->hdrlen + (size_t)i * PACK_CHUNK;
+         MD5(c,PACK_CHUNK,md5);
+         if ( pack_table_find(&t,md5,&m->newchunk[i]) )
+         {
+            ++reused;
+            continue;
+         }
+         if ( (unsigned long long)(chunks + 1) * PACK_CHUNK + PACK_START > 0xffffffffULL )
+         {
+            fprintf(stderr,"Pack %s is full (4GB)\n",options.pack);
+            r = 1;
+            break;
+         }
+         pack_table_add(&t,md5,chunks);
+         m->newchunk[i] = chunks++;
+         ++added;
+         r |= fwrite(c,PACK_CHUNK,1,f) != 1;
+      }
+      bytes += got;
+   }
+
+   // Directory and header
+   for ( unsigned int i=0;i<p.members;++i )
+   {
+      struct pack_member *m = &p.member[i];
+      diff_put(b,strlen(m->name),2);
+      r |= fwrite(b,2,1,f) != 1;
+      r |= fputs(m->name,f) < 0;
+      diff_put(b,m->size,4);
+      b[4] = m->hdrlen;
+      r |= fwrite(b,5,1,f) != 1;
+      if ( m->hdrlen ) r |= fwrite(m->hdr,m->hdrlen,1,f) != 1;
+      diff_put(b,m->nchunks,4);
+      r |= fwrite(b,4,1,f) != 1;
+      for ( unsigned int c=0;c<m->nchunks;++c )
+      {
+         diff_put(b,pack_chunk_number(m,c),4);
+         r |= fwrite(b,4,1,f) != 1;
+      }
+   }
+   memset(b,0,PACK_START);
+   memcpy(b,PACK_MAGIC,8);
+   diff_put(b+8,chunks,4);
+   diff_put(b+12,p.members,4);
+   diff_put(b+16,PACK_START + (size_t)chunks * PACK_CHUNK,4);
+   r |= fseek(f,0,SEEK_SET) != 0;
+   r |= fwrite(b,PACK_START,1,f) != 1;
+   r |= fclose(f) != 0;
+   if ( r )
+   {
+      fprintf(stderr,"Unable to write pack %s\n",tmp);
+      unlink(tmp);
+      r = 1;
+   }
+   else
+   {
+      rename(tmp,options.pack);
+      printf("%llu bytes added to %s: %u new chunks, %u shared; %u members, %u chunks (%llu bytes)\n",
+             bytes,options.pack,added,reused,p.members,chunks,(unsigned long long)chunks * PACK_CHUNK);
+   }
+   free(data);
+   free(t.slot);
+   free(tmp);
+   pack_close(&p);
+   return r;
+}
+
+/*
+ * pack_list()
+ *
+ * List the members of a pack and how much of each is shared
+ */
+int pack_list(void)
+{
+   struct pack p;
+   unsigned char *refs;
+   unsigned long long total = 0;
+
+   if ( pack_open(&p,options.pack) )
+   {
+      fprintf(stderr,"Unable to read pack %s\n",options.pack);
+      return 1;
+   }
+   refs = calloc(p.chunks+1,1);
+   for ( unsigned int i=0;i<p.members;++i )
+   {
+      for ( unsigned int c=0;c<p.member[i].nchunks;++c )
+      {
+         unsigned int n = pack_chunk_number(&p.member[i],c);
+         if ( refs[n] < 2 ) ++refs[n];
+      }
+   }
+   for ( unsigned int i=0;i<p.members;++i )
+   {
+      unsigned int shared = 0;
+      for ( unsigned int c=0;c<p.member[i].nchunks;++c ) shared += ( refs[pack_chunk_number(&p.member[i],c)] > 1 );
+      printf("%s: %u bytes, %u chunks, %u shared\n",p.member[i].name,p.member[i].size,p.member[i].nchunks,shared);
+      total += p.member[i].size;
+   }
+   printf("%u members, %llu bytes in %zu bytes of pack\n",p.members,total,p.len);
+   free(refs);
+   pack_close(&p);
+   return 0;
+}
+
+/*
+ * pack_unpack()
+ *
+ * Write members (all, or the one named by --member) under a directory
+ */
+int pack_unpack(void)
+{
+   struct pack p;
+   int r = 0, written = 0;
+
+   if ( pack_open(&p,options.pack) )
+   {
+      fprintf(stderr,"Unable to read pack %s\n",options.pack);
+      return 1;
+   }
+   struct pack_member *only = options.member ? pack_find(&p,options.member) : NULL;
+   if ( options.member && !only )
+   {
+      fprintf(stderr,"No member %s in pack %s\n",options.member,options.pack);
+      pack_close(&p);
+      return 1;
+   }
+   for ( unsigned int i=0;i<p.members;++i )
+   {
+      struct pack_member *m = &p.member[i];
+      if ( only && m != only ) continue;
+      if ( strcmp(m->name,"..") == 0 || strncmp(m->name,"../",3) == 0 || strstr(m->name,"/../") || !m->name[0] )
+      {
+         fprintf(stderr,"Skipping member with unsafe name: %s\n",m->name);
+         r = 1;
+         continue;
+      }
+      char *path = malloc(strlen(options.unpack)+strlen(m->name)+2);
+      sprintf(path,"%s/%s",options.unpack,m->name);
+      mkdir(options.unpack,0755);
+      for ( char *s=strchr(path+strlen(options.unpack)+1,'/');s;s=strchr(s+1,'/') )
+      {
+         *s = 0;
+         mkdir(path,0755); // Errors show up when creating the file
+         *s = '/';
+      }
+      int fd = open(path,O_WRONLY|O_CREAT|O_EXCL,0644);
+      unsigned char *buf = malloc(m->size ? m->size : 1);
+      if ( fd < 0 )
+      {
+         fprintf(stderr,"Unable to create %s: %s\n",path,strerror(errno));
+         r = 1;
+      }
+      else
+      {
+         pack_image(&p,m,buf);
+         if ( write(fd,buf,m->size) != (ssize_t)m->size )
+         {
+            fprintf(stderr,"Unable to write %s\n",path);
+            r = 1;
+         }
+         else ++written;
+         close(fd);
+      }
+      free(buf);
+      free(path);
+   }
+   printf("%d image%s written to %s\n",written,written==1?"":"s",options.unpack);
+   pack_close(&p);
+   return r;
+}
+
+/*
+ * pack_report()
+ *
+ * Entry point for --pack: add the named images or directories, or with
+ * none, list the members or write them out with --unpack
+ */
+int pack_report(int count,char *names[])
+{
+   if ( options.unpack ) return pack_unpack();
+   if ( !count ) return pack_list();
+
+   // Expand directories
+   char **list = NULL;
+   int n = 0, alloc = 0;
+   for ( int i=0;i<count;++i )
+   {
+      char **more = NULL;
+      int m = batch_files(names[i],&more);
+      if ( n + m > alloc )
+      {
+         alloc = (n + m) * 2;
+         list = realloc(list,alloc * sizeof(*list));
+      }
+      memcpy(list+n,more,m * sizeof(*list));
+      n += m;
+      free(more);
+   }
+   int r = pack_add(n,list);
+   for ( int i=0;i<n;++i ) free(list[i]);
+   free(list);
+   return r;
+}
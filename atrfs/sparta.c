@@ -44,6 +44,7 @@
 #define RENAME_EXCHANGE 0
 #endif
 #include <time.h>
+#include <ctype.h>
 #include "atrfs.h"
 
 /*
@@ -56,6 +57,7 @@
 #define SIZE_TO_MAP_SECTORS(n)      ((SIZE_TO_SECTORS(n)+ENTRIES_PER_MAP_SECTOR-1)/ENTRIES_PER_MAP_SECTOR)
 #define BITMAPBYTE(n)   (n/8)
 #define BITMAPMASK(n)   (1<<(7-(n%8)))
+#define DIRINDEX_BUCKETS 256 // Power of two
 
 /*
  * File System Structures
@@ -122,11 +124,28 @@ enum sparta_dir_status {
    FLAGS_DIR     = 0x20,
 };
 
+// In-memory index of one directory: names hashed to entry numbers
+struct sparta_dirindex {
+   struct sparta_dirindex *next; // Other indexed directories
+   struct atrfs *atrfs; // Partitions have their own directories
+   int dirinode;
+   unsigned int rawchanges; // atrfs->rawchanges when built
+   int entries; // Entries in the directory, including the header
+   int end; // First entry neither in use nor deleted; scans stop here
+   int lowfree; // No deleted entries before this one
+   unsigned char *status; // Status byte of each entry
+   unsigned char (*name)[8+3]; // Name of each entry
+   int *chain; // Next entry in the same bucket; 0 for none
+   int bucket[DIRINDEX_BUCKETS]; // First entry in each bucket; 0 for none
+};
+
 /*
  * Function prototypes
  */
 int sparta_alloc_any_sector(struct atrfs *atrfs);
+int sparta_alloc_next_sector(struct atrfs *atrfs,int prev);
 int sparta_sanity(struct atrfs *atrfs);
+int sparta_score(struct atrfs *atrfs);
 int sparta_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf);
 int sparta_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
 int sparta_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, off_t offset);
@@ -144,6 +163,14 @@ int sparta_utimens(struct atrfs *atrfs,const char *path, const struct timespec t
 int sparta_utime(struct atrfs *atrfs,const char *path,struct utimbuf *utimbif);
 #endif
 int sparta_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
+int sparta_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length);
+int sparta_copy_file_range(struct atrfs *atrfs,const char *path_in, off_t offset_in, const char *path_out, off_t offset_out, size_t size);
+int sparta_bitmap_status(struct atrfs *atrfs,int sector);
+int sparta_getxattr(struct atrfs *atrfs,const char *path, const char *name, char *value, size_t size);
+int sparta_listxattr(struct atrfs *atrfs,const char *path, char *list, size_t size);
+int sparta_sectormap(struct atrfs *atrfs,struct sectormap *sm);
+int sparta_check(struct atrfs *atrfs,struct fscheck *ck);
+int sparta_defrag(struct atrfs *atrfs,int *fragmented);
 int sparta_newfs(struct atrfs *atrfs);
 char *sparta_fsinfo(struct atrfs *atrfs);
 
@@ -154,6 +181,7 @@ const struct fs_ops sparta_ops = {
    .name = "SpartaDOS",
    .fstype = "sparta",
    .fs_sanity = sparta_sanity,
+   .fs_score = sparta_score,
    .fs_getattr = sparta_getattr,
    .fs_readdir = sparta_readdir,
    .fs_read = sparta_read,
@@ -173,7 +201,16 @@ const struct fs_ops sparta_ops = {
    .fs_statfs = sparta_statfs,
    .fs_newfs = sparta_newfs,
    .fs_fsinfo = sparta_fsinfo,
+   .fs_fallocate = sparta_fallocate,
+   .fs_copy_file_range = sparta_copy_file_range,
+   .fs_unused_sector = sparta_bitmap_status,
+   .fs_getxattr = sparta_getxattr,
+   .fs_listxattr = sparta_listxattr,
+   .fs_sectormap = sparta_sectormap,
+   .fs_check = sparta_check,
+   .fs_defrag = sparta_defrag,
 };
+static struct sparta_dirindex *dirindex_list;
 
 /*
  * Boot Sectors
@@ -260,7 +297,7 @@ int sparta_get_sector(struct atrfs *atrfs,int inode,int sequence,int allocate)
    if ( inode >= atrfs->sectors || inode <= 0 ) return -EIO; // Out of range
    unsigned char *s=SECTOR(inode);
 
-   while ( sequence > atrfs->sectorsize/2-2 )
+   while ( sequence >= atrfs->sectorsize/2-2 )
    {
       int next = BYTES2(s);
       if ( next > atrfs->sectors ) return -EIO; // Corrupt chain
@@ -278,7 +315,7 @@ int sparta_get_sector(struct atrfs *atrfs,int inode,int sequence,int allocate)
    if ( r==0 && allocate )
    {
       // Allocate a new sector, store it in the map and return it
-      r = sparta_alloc_any_sector(atrfs);
+      r = sparta_alloc_next_sector(atrfs,sequence ? BYTES2(s+4+(sequence-1)*2) : 0);
       if ( r<0 ) return r;
       s[4+sequence*2] = r & 0xff;
       s[4+sequence*2+1] = r >> 8;
@@ -335,6 +372,240 @@ int sparta_get_dirent(struct atrfs *atrfs,struct sparta_dir_entry *dirent,int di
    return 0;
 }
 
+/*
+ * sparta_dirindex_hash()
+ *
+ * Hash an 8+3 name; case-insensitive so that it works with --upcase
+ */
+int sparta_dirindex_hash(const unsigned char *name)
+{
+   unsigned int h = 0;
+   for ( int i=0;i<8+3;++i )
+   {
+      h = h*31 + toupper(name[i]);
+   }
+   return h & (DIRINDEX_BUCKETS-1);
+}
+
+/*
+ * sparta_dirindex_set()
+ *
+ * Record the current contents of one directory entry in the index.
+ */
+void sparta_dirindex_set(struct sparta_dirindex *index,int entry,const struct sparta_dir_entry *dirent)
+{
+   // Remove the old name from its bucket
+   if ( (index->status[entry] & FLAGS_IN_USE) && !(index->status[entry] & FLAGS_DELETED) )
+   {
+      int *p = &index->bucket[sparta_dirindex_hash(index->name[entry])];
+      while ( *p && *p != entry ) p = &index->chain[*p];
+      if ( *p ) *p = index->chain[entry];
+   }
+
+   index->status[entry] = dirent->status;
+   memcpy(index->name[entry],dirent->file_name,8+3);
+   index->chain[entry] = 0;
+   if ( dirent->status & FLAGS_DELETED )
+   {
+      if ( entry < index->lowfree ) index->lowfree = entry;
+   }
+   else if ( dirent->status & FLAGS_IN_USE )
+   {
+      int h = sparta_dirindex_hash(dirent->file_name);
+      index->chain[entry] = index->bucket[h];
+      index->bucket[h] = entry;
+   }
+
+   // Move the end of the directory if this entry changed it
+   if ( !(dirent->status & (FLAGS_IN_USE|FLAGS_DELETED)) )
+   {
+      if ( entry < index->end ) index->end = entry;
+      if ( entry < index->lowfree ) index->lowfree = entry;
+   }
+   else if ( entry == index->end )
+   {
+      while ( index->end < index->entries && (index->status[index->end] & (FLAGS_IN_USE|FLAGS_DELETED)) ) ++index->end;
+   }
+}
+
+/*
+ * sparta_dirindex_grow()
+ *
+ * Add entries to the index after the directory was extended.
+ *
+ * Returns zero on success, negative errno on error
+ */
+int sparta_dirindex_grow(struct atrfs *atrfs,struct sparta_dirindex *index,int entries)
+{
+   if ( entries <= index->entries ) return 0;
+   unsigned char *status = realloc(index->status,entries);
+   if ( !status ) return -ENOMEM;
+   index->status = status;
+   void *name = realloc(index->name,entries*sizeof(index->name[0]));
+   if ( !name ) return -ENOMEM;
+   index->name = name;
+   int *chain = realloc(index->chain,entries*sizeof(int));
+   if ( !chain ) return -ENOMEM;
+   index->chain = chain;
+
+   int first = index->entries;
+   index->entries = entries;
+   for ( int i=first;i<entries;++i )
+   {
+      struct sparta_dir_entry dirent;
+      int r = sparta_get_dirent(atrfs,&dirent,index->dirinode,i);
+      if ( r<0 ) return r;
+      index->status[i] = 0; // Nothing to remove from a bucket
+      sparta_dirindex_set(index,i,&dirent);
+   }
+   return 0;
+}
+
+/*
+ * sparta_dirindex_free()
+ *
+ * Forget the index of a directory, if there is one.
+ */
+void sparta_dirindex_free(struct atrfs *atrfs,int dirinode)
+{
+   for ( struct sparta_dirindex **p = &dirindex_list; *p; p = &(*p)->next )
+   {
+      struct sparta_dirindex *index = *p;
+      if ( index->atrfs != atrfs || index->dirinode != dirinode ) continue;
+      *p = index->next;
+      free(index->status);
+      free(index->name);
+      free(index->chain);
+      free(index);
+      return;
+   }
+}
+
+/*
+ * sparta_dirindex_expire()
+ *
+ * Forget every directory index for an image, as after raw sector writes
+ * or changes made by another program.
+ */
+void sparta_dirindex_expire(struct atrfs *atrfs)
+{
+   struct sparta_dirindex **p = &dirindex_list;
+   while ( *p )
+   {
+      struct sparta_dirindex *index = *p;
+      if ( index->atrfs != atrfs )
+      {
+         p = &index->next;
+         continue;
+      }
+      if ( options.debug ) fprintf(stderr,"DEBUG: %s: dropping index of dir %d\n",__FUNCTION__,index->dirinode);
+      *p = index->next;
+      free(index->status);
+      free(index->name);
+      free(index->chain);
+      free(index);
+   }
+}
+
+/*
+ * sparta_dirindex()
+ *
+ * Return the index for a directory, building it on first use.
+ *
+ * Returns NULL on error with the negative errno in *err
+ */
+struct sparta_dirindex *sparta_dirindex(struct atrfs *atrfs,int dirinode,int *err)
+{
+   struct sparta_dirindex *index;
+   for ( index = dirindex_list; index; index = index->next )
+   {
+      if ( index->atrfs != atrfs ) continue;
+      if ( index->rawchanges != atrfs->rawchanges )
+      {
+         // Sectors were written directly; no index for this image can be trusted
+         sparta_dirindex_expire(atrfs);
+         break;
+      }
+      if ( index->dirinode == dirinode ) return index;
+   }
+
+   struct sparta_dir_header dir_header;
+   *err = sparta_get_dirent(atrfs,(void *)&dir_header,dirinode,0);
+   if ( *err < 0 ) return NULL;
+
+   index = calloc(1,sizeof(*index));
+   if ( !index )
+   {
+      *err = -ENOMEM;
+      return NULL;
+   }
+   index->atrfs = atrfs;
+   index->dirinode = dirinode;
+   index->rawchanges = atrfs->rawchanges;
+   index->entries = 1; // The header is not a file
+   index->end = 1;
+   index->lowfree = 1;
+   index->next = dirindex_list;
+   dirindex_list = index;
+   *err = sparta_dirindex_grow(atrfs,index,BYTES3(dir_header.dir_length_bytes)/sizeof(dir_header));
+   if ( *err < 0 )
+   {
+      sparta_dirindex_free(atrfs,dirinode);
+      return NULL;
+   }
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: dir %d indexed %d entries\n",__FUNCTION__,dirinode,index->entries);
+   return index;
+}
+
+/*
+ * sparta_dirindex_lookup()
+ *
+ * Find an 8+3 name in a directory.  Set *firstfree to the entry a new file
+ * would use, or -1 if the directory must be extended.
+ *
+ * Returns the entry number, 0 if not found, or negative errno on error
+ */
+int sparta_dirindex_lookup(struct atrfs *atrfs,int dirinode,const unsigned char *name,int *firstfree)
+{
+   int r;
+   struct sparta_dirindex *index = sparta_dirindex(atrfs,dirinode,&r);
+   if ( !index ) return r;
+
+   while ( index->lowfree < index->end && !(index->status[index->lowfree] & FLAGS_DELETED) ) ++index->lowfree;
+   *firstfree = index->lowfree < index->entries ? index->lowfree : -1;
+
+   int found = 0;
+   for ( int i = index->bucket[sparta_dirindex_hash(name)]; i; i = index->chain[i] )
+   {
+      if ( i >= index->end ) continue; // Past the end of the directory
+      if ( atrfs_strncmp((char *)index->name[i],(char *)name,8+3) != 0 ) continue;
+      if ( !found || i < found ) found = i; // Duplicate names: same one a scan would find
+   }
+   return found;
+}
+
+/*
+ * sparta_dirindex_update()
+ *
+ * Called by sparta_put_dirent() to keep the directory index current.
+ */
+void sparta_dirindex_update(struct atrfs *atrfs,int dirinode,int entry,const struct sparta_dir_entry *dirent)
+{
+   for ( struct sparta_dirindex *index = dirindex_list; index; index = index->next )
+   {
+      if ( index->atrfs != atrfs || index->dirinode != dirinode ) continue;
+      if ( entry == 0 )
+      {
+         // Directory header: the length may have changed
+         int entries = BYTES3(((const struct sparta_dir_header *)dirent)->dir_length_bytes)/sizeof(*dirent);
+         if ( entries < index->entries ) sparta_dirindex_free(atrfs,dirinode);
+         else if ( entries > index->entries && sparta_dirindex_grow(atrfs,index,entries) < 0 ) sparta_dirindex_free(atrfs,dirinode);
+      }
+      else if ( entry < index->entries ) sparta_dirindex_set(index,entry,dirent);
+      return;
+   }
+}
+
 /*
  * sparta_put_dirent()
  *
@@ -364,18 +635,20 @@ int sparta_put_dirent(struct atrfs *atrfs,struct sparta_dir_entry *dirent,int di
       bytes = atrfs->sectorsize - secoff;
    }
    memcpy(s+secoff,dirent,bytes);
-   dirent = (void *)(((char *)dirent) + bytes);
-   bytes = sizeof(*dirent) - bytes;
-   if ( bytes == 0 ) return 0;
-   // Read remainder from next sector
-   sector = sparta_get_sector(atrfs,dirinode,OFFSET_TO_SECTOR(offset)+1,0);
-   if ( sector < 0 )
+   if ( bytes < (int)sizeof(*dirent) )
    {
-      if ( options.debug ) fprintf(stderr,"DEBUG: %s: Failed to get second sector %d in %d\n",__FUNCTION__,OFFSET_TO_SECTOR(offset)+1,dirinode);
-      return sector;
+      // Write remainder to next sector
+      sector = sparta_get_sector(atrfs,dirinode,OFFSET_TO_SECTOR(offset)+1,0);
+      if ( sector < 0 )
+      {
+         if ( options.debug ) fprintf(stderr,"DEBUG: %s: Failed to get second sector %d in %d\n",__FUNCTION__,OFFSET_TO_SECTOR(offset)+1,dirinode);
+         sparta_dirindex_free(atrfs,dirinode); // Partially written
+         return sector;
+      }
+      s = SECTOR(sector);
+      memcpy(s,((char *)dirent) + bytes,sizeof(*dirent) - bytes);
    }
-   s = SECTOR(sector);
-   memcpy(s,dirent,bytes);
+   sparta_dirindex_update(atrfs,dirinode,entry,dirent);
    return 0;
 }
 
@@ -457,6 +730,26 @@ int sparta_sanity(struct atrfs *atrfs)
    return 0;
 }
 
+/*
+ * sparta_score()
+ *
+ * Quick check before sparta_sanity(); 0 if it would fail
+ */
+int sparta_score(struct atrfs *atrfs)
+{
+   if ( atrfs->sectors < 6*1024/atrfs->sectorsize ) return 0;
+   struct sector1_sparta *sec1 = SECTOR(1);
+   if ( !( sec1->boot_sectors == 1 && atrfs->sectorsize == 512 ) &&
+        ( sec1->boot_sectors != 3 ) ) return 0;
+   if ( BYTES2(sec1->dir) > atrfs->sectors ) return 0;
+   if ( BYTES2(sec1->free) >= atrfs->sectors ) return 0;
+   if ( !sec1->bitmap_sectors ) return 0;
+   int score = 1;
+   if ( sec1->pad_zero == 'S' ) ++score;
+   if ( BYTES2(sec1->sectors) == atrfs->sectors ) ++score;
+   return score;
+}
+
 /*
  * sparta_path()
  *
@@ -556,29 +849,15 @@ int sparta_path(struct atrfs *atrfs,const char *path,int *inode,int *parent_dir_
       if ( *path == '/' ) ++path;
 
       if ( options.debug ) fprintf(stderr,"DEBUG: %s: Look for %11.11s in dir at sector %d\n",__FUNCTION__,name,*inode);
-      // Scan parent_dir_inode for file name
-      int firstfree = -1;
-      r = sparta_get_dirent(atrfs,(void *)&dir_header,*inode,0);
-      if ( r < 0 ) return r;
-      int dir_size = BYTES3(dir_header.dir_length_bytes);
-      for ( i=1;i<(int)(dir_size/sizeof(dir_header));++i )
+      // Look up file name in parent_dir_inode
+      int firstfree;
+      i = sparta_dirindex_lookup(atrfs,*inode,name,&firstfree);
+      if ( i < 0 ) return i;
+      if ( i > 0 )
       {
          struct sparta_dir_entry dir_entry;
          r = sparta_get_dirent(atrfs,&dir_entry,*inode,i);
          if ( r < 0 ) return r;
-
-         //if ( options.debug ) fprintf(stderr,"DEBUG: %s: entry %d:%d %11.11s flags %02x\n",__FUNCTION__,i,j,dirent[j].file_name,dirent[j].flags);
-         if ( dir_entry.status & FLAGS_DELETED )
-         {
-            if ( firstfree < 0 ) firstfree = i;
-            continue;
-         }
-         if ( !(dir_entry.status & FLAGS_IN_USE) )  // Directories should always end with a zero entry
-         {
-            if ( firstfree < 0 ) firstfree = i;
-            break; // Should hit the loop condition if continuing; break to be safe
-         }
-         if ( atrfs_strncmp((char *)dir_entry.file_name,(char *)name,8+3) != 0 ) continue;
          *entry = i;
          // subdirectories
          //if ( atrfs->fstype == ATR_SPARTA )
@@ -677,6 +956,7 @@ int sparta_free_sector(struct atrfs *atrfs,int sector)
    // Only update the free sector count if the bitmap was modified
    if ( r == 0 )
    {
+      sparse_free(atrfs,SECTOR(sector),atrfs->sectorsize);
       struct sector1_sparta *sec1 = SECTOR(1);
       if ( sec1->free[0] < 0xff ) ++sec1->free[0];
       else
@@ -714,10 +994,25 @@ int sparta_alloc_sector(struct atrfs *atrfs,int sector)
  * sparta_alloc_any_sector()
  *
  * Allocate the first free sector.  This is inefficient, but easy to code.
+ * If atrfs->alloc_hint is set, start there and advance it.
  */
 int sparta_alloc_any_sector(struct atrfs *atrfs)
 {
    int r;
+   if ( atrfs->alloc_hint > 1 )
+   {
+      for ( int i=atrfs->alloc_hint;i<=atrfs->sectors; ++i )
+      {
+         r=sparta_alloc_sector(atrfs,i);
+         if ( r==0 )
+         {
+            char *s = SECTOR(i);
+            memset(s,0,atrfs->sectorsize); // New sectors are zeroed out
+            atrfs->alloc_hint = i+1;
+            return i;
+         }
+      }
+   }
    for ( int i=2;i<=atrfs->sectors; ++i )
    {
       r=sparta_alloc_sector(atrfs,i);
@@ -731,6 +1026,28 @@ int sparta_alloc_any_sector(struct atrfs *atrfs)
    return -1;
 }
 
+/*
+ * sparta_alloc_next_sector()
+ *
+ * Allocate a data sector to follow 'prev' in a file.  With --skew, use the
+ * free sector that will be under the drive head soonest after 'prev' is
+ * read, unless a contiguous run was already requested through alloc_hint.
+ */
+int sparta_alloc_next_sector(struct atrfs *atrfs,int prev)
+{
+   if ( options.skew && prev > 0 && atrfs->alloc_hint <= 1 )
+   {
+      int sector = skew_next_sector(atrfs,prev,sparta_bitmap_status);
+      if ( sector > 0 && sparta_alloc_sector(atrfs,sector) == 0 )
+      {
+         char *s = SECTOR(sector);
+         memset(s,0,atrfs->sectorsize); // New sectors are zeroed out
+         return sector;
+      }
+   }
+   return sparta_alloc_any_sector(atrfs);
+}
+
 /*
  * sparta_add_map_sectors()
  *
@@ -931,6 +1248,11 @@ int sparta_touch_parent_dir(struct atrfs *atrfs,const char *path,int dir_inode)
       return -EIO; // Inode doesn't match what it must match
    }
 
+   if ( entry < 0 ) // Root directory: the time stamp is in its own header
+   {
+      parent_dir_inode = inode;
+      entry = 0;
+   }
    struct sparta_dir_entry dir_entry;
    r = sparta_get_dirent(atrfs,&dir_entry,parent_dir_inode,entry);
    if ( r<0 ) return r;
@@ -1029,32 +1351,21 @@ char *sparta_info(struct atrfs *atrfs,const char *path,int parent_dir_inode,int
 }
 
 /*
- * sparta_getattr()
+ * sparta_dirent_time()
+ *
+ * Set the stat time stamps from a directory entry
  */
-int sparta_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
+void sparta_dirent_time(const struct sparta_dir_entry *dir_entry,struct stat *stbuf)
 {
-   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s\n",__FUNCTION__,path);
-   int inode=0,parent_dir_inode,size,locked,entry,isdir,isinfo;
-   int r;
-   r = sparta_path(atrfs,path,&inode,&parent_dir_inode,&size,&locked,&entry,&isdir,&isinfo);
-   if ( r<0 ) return r;
-   if ( r>0 ) return -ENOENT;
-   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s parent: %d inode %d size %d entry %d\n",__FUNCTION__,path,parent_dir_inode,inode,size,entry);
-
-   // Get time stamp
-   struct sparta_dir_entry dir_entry;
-   r = sparta_get_dirent(atrfs,&dir_entry,parent_dir_inode,entry>0?entry:0); //isdir?0:entry);
-   if ( r<0 ) return r;
-   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s dir entry read\n",__FUNCTION__,path);
    struct tm tm;
    time_t secs;
    memset(&tm,0,sizeof(tm));
-   tm.tm_sec=dir_entry.file_time[2];
-   tm.tm_min=dir_entry.file_time[1];
-   tm.tm_hour=dir_entry.file_time[0];
-   tm.tm_mday=dir_entry.file_date[0];
-   tm.tm_mon=dir_entry.file_date[1]-1; // Want 0-11, not 1-12
-   tm.tm_year=dir_entry.file_date[2];
+   tm.tm_sec=dir_entry->file_time[2];
+   tm.tm_min=dir_entry->file_time[1];
+   tm.tm_hour=dir_entry->file_time[0];
+   tm.tm_mday=dir_entry->file_date[0];
+   tm.tm_mon=dir_entry->file_date[1]-1; // Want 0-11, not 1-12
+   tm.tm_year=dir_entry->file_date[2];
    if ( tm.tm_year < 78 ) tm.tm_year += 100;
    // tm.tm_year += 1900; // Spec: Year - 1900, so don't add 1900
    tm.tm_isdst = -1; // Have the system determine if DST is in effect
@@ -1069,6 +1380,27 @@ int sparta_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
       stbuf->st_ctim = ts;
       stbuf->st_atim = ts;
    }
+}
+
+/*
+ * sparta_getattr()
+ */
+int sparta_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
+{
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s\n",__FUNCTION__,path);
+   int inode=0,parent_dir_inode,size,locked,entry,isdir,isinfo;
+   int r;
+   r = sparta_path(atrfs,path,&inode,&parent_dir_inode,&size,&locked,&entry,&isdir,&isinfo);
+   if ( r<0 ) return r;
+   if ( r>0 ) return -ENOENT;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s parent: %d inode %d size %d entry %d\n",__FUNCTION__,path,parent_dir_inode,inode,size,entry);
+
+   // Get time stamp
+   struct sparta_dir_entry dir_entry;
+   r = sparta_get_dirent(atrfs,&dir_entry,parent_dir_inode,entry>0?entry:0); //isdir?0:entry);
+   if ( r<0 ) return r;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s dir entry read\n",__FUNCTION__,path);
+   sparta_dirent_time(&dir_entry,stbuf);
 
    if ( isinfo )
    {
@@ -1094,12 +1426,39 @@ int sparta_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
    return 0;
 }
 
+/*
+ * sparta_dirent_name()
+ *
+ * Convert the 8+3 name in a directory entry to a string
+ */
+void sparta_dirent_name(const struct sparta_dir_entry *dir_entry,char *name)
+{
+   int k;
+   for (k=0;k<8;++k)
+   {
+      if ( dir_entry->file_name[k] == ' ' ) break;
+      name[k]=dir_entry->file_name[k];
+   }
+   name[k]=0;
+   if ( dir_entry->file_ext[0] != ' ' )
+   {
+      name[k]='.';
+      ++k;
+      for (int l=0;l<3;++l)
+      {
+         if ( dir_entry->file_ext[l] == ' ' ) break;
+         name[k+l]=dir_entry->file_ext[l];
+         name[k+l+1]=0;
+      }
+   }
+}
+
 /*
  * sparta_readdir()
  */
 int sparta_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset)
 {
-   (void)offset; // FUSE will always read directories from the start in our use
+   (void)offset; // atrfs_filler() skips entries before the offset
 
    if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s\n",__FUNCTION__,path);
    int sector=0,parent_dir_inode,dir_size,locked,entry,isdir,isinfo;
@@ -1117,26 +1476,33 @@ int sparta_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_di
       if ( r < 0 ) return r;
       if ( dir_entry.status & FLAGS_DELETED ) continue;
       if ( !(dir_entry.status & FLAGS_IN_USE) ) continue;
-      memcpy(name,dir_entry.file_name,8);
-      int k;
-      for (k=0;k<8;++k)
+      sparta_dirent_name(&dir_entry,name);
+      if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s %s\n",__FUNCTION__,path,name);
+      struct stat st;
+      if ( !dirfill_stat(buf,&st) )
       {
-         if ( dir_entry.file_name[k] == ' ' ) break;
+         if ( filler(buf, name, FILLER_NULL) ) break;
+         continue;
       }
-      name[k]=0;
-      if ( dir_entry.file_ext[0] != ' ' )
+
+      // Same results as sparta_getattr(), but without looking up the path
+      int inode = BYTES2(dir_entry.sector_map);
+      int size = BYTES3(dir_entry.file_size_bytes);
+      sparta_dirent_time(&dir_entry,&st);
+      if ( dir_entry.status & FLAGS_DIR )
       {
-         name[k]='.';
-         ++k;
-         for (int l=0;l<3;++l)
-         {
-            if ( dir_entry.file_ext[l] == ' ' ) break;
-            name[k+l]=dir_entry.file_ext[l];
-            name[k+l+1]=0;
-         }
+         ++st.st_nlink;
+         st.st_mode = MODE_DIR(atrfs->atrstat.st_mode & 0777);
+         // Directory size is in the directory header, not the entry
+         unsigned char *s = SECTOR(inode);
+         struct sparta_dir_header *head = s ? SECTOR(BYTES2(s+4)) : NULL;
+         if ( head ) size = BYTES3(head->dir_length_bytes);
       }
-      if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s %s\n",__FUNCTION__,path,name);
-      filler(buf, name, FILLER_NULL);
+      if ( dir_entry.status & FLAGS_LOCKED ) st.st_mode = MODE_RO(st.st_mode);
+      st.st_size = size;
+      st.st_ino = inode;
+      st.st_blocks = (size + atrfs->sectorsize -1) / atrfs->sectorsize + 1; // Approx; accuracy isn't important
+      if ( filler(buf, name, FILLER_STAT(&st)) ) break;
    }
    return 0;
 }
@@ -1384,13 +1750,14 @@ int sparta_freemap(struct atrfs *atrfs,int inode)
          }
       }
 
+      int next = BYTES2(s); // Next map sector; read before freeing, as --sparse zeros it
       r = sparta_free_sector(atrfs,inode);
       if ( r )
       {
          if ( options.debug ) fprintf(stderr,"DEBUG: %s: Freeing free map sector %d\n",__FUNCTION__,inode);
       }
 
-      inode = BYTES2(s); // Next map sector
+      inode = next;
    }
    return 0;
 }
@@ -1450,6 +1817,7 @@ int sparta_rmdir(struct atrfs *atrfs,const char *path)
 
    // Free the sectors
    sparta_freemap(atrfs,inode);
+   sparta_dirindex_free(atrfs,inode); // The map sector may be reused
 
    // Update time stamp on parent directory
    r = sparta_touch_parent_dir(atrfs,path,parent_dir_inode);
@@ -1852,7 +2220,7 @@ int sparta_truncate(struct atrfs *atrfs,const char *path, off_t size)
       // Zero blank space at the end, if any
       int last;
       last = sparta_get_sector(atrfs,inode,OFFSET_TO_SECTOR(filesize),0);
-      if ( last > 0 )
+      if ( last > 1 ) // -EOF (1) if past the end of the sector map
       {
          int offset = OFFSET_TO_SECTOR_OFFSET(filesize);
          int bytes = atrfs->sectorsize - offset;
@@ -1861,8 +2229,18 @@ int sparta_truncate(struct atrfs *atrfs,const char *path, off_t size)
             memset(SECTOR(last)+offset,0,bytes);
          }
       }
-      r = sparta_add_map_sectors(atrfs,inode,SIZE_TO_MAP_SECTORS(size)-SIZE_TO_MAP_SECTORS(filesize));
-      if ( r<0 ) return r;
+      // Only add map sectors not already there (fallocate may have added them)
+      int maps = 1;
+      for ( int next=BYTES2((unsigned char *)SECTOR(inode)); next; next=BYTES2((unsigned char *)SECTOR(next)) )
+      {
+         if ( next > atrfs->sectors ) return -EIO; // Corrupt chain
+         ++maps;
+      }
+      if ( SIZE_TO_MAP_SECTORS(size) > maps )
+      {
+         r = sparta_add_map_sectors(atrfs,inode,SIZE_TO_MAP_SECTORS(size)-maps);
+         if ( r<0 ) return r;
+      }
    }
    else
    {
@@ -1918,6 +2296,11 @@ int sparta_utimens(struct atrfs *atrfs,const char *path, const struct timespec t
    if ( r<0 ) return r;
    if ( r>0 ) return -ENOENT;
    if ( isinfo ) return -EACCES;
+   if ( entry < 0 ) // Root directory: the time stamp is in its own header
+   {
+      parent_dir_inode = inode;
+      entry = 0;
+   }
 
    struct sparta_dir_entry dir_entry;
    r = sparta_get_dirent(atrfs,&dir_entry,parent_dir_inode,entry);
@@ -1977,6 +2360,555 @@ int sparta_utime(struct atrfs *atrfs,const char *path, struct utimbuf *utimbuf)
 }
 #endif
 
+/*
+ * sparta_fallocate()
+ *
+ * Allocate the data sectors (and any needed map sectors) for the range
+ * up front, using a contiguous run of free sectors if there is one.
+ * SpartaDOS files are sector maps, so sectors may be allocated past the
+ * end of the file with FALLOC_FL_KEEP_SIZE.
+ */
+int sparta_fallocate(struct atrfs *atrfs,const char *path, int mode, off_t offset, off_t length)
+{
+   int inode=0,parent_dir_inode,filesize,locked,entry,isdir,isinfo;
+   int r;
+
+   if ( mode & ~FALLOC_FL_KEEP_SIZE ) return -EOPNOTSUPP;
+   r = sparta_path(atrfs,path,&inode,&parent_dir_inode,&filesize,&locked,&entry,&isdir,&isinfo);
+   if ( r<0 ) return r;
+   if ( r>0 ) return -ENOENT;
+   if ( isinfo ) return -EACCES;
+   if ( isdir ) return -EISDIR;
+   if ( locked ) return -EACCES;
+   if ( length <= 0 ) return -EINVAL;
+   if ( offset + length > 0xffffff ) return -EFBIG; // 24-bit file size
+
+   // Count the sectors that need to be allocated
+   int first = OFFSET_TO_SECTOR(offset);
+   int last = OFFSET_TO_SECTOR(offset+length-1);
+   int needed = 0;
+   for ( int seq=first;seq<=last;++seq )
+   {
+      int sector = sparta_get_sector(atrfs,inode,seq,0);
+      if ( sector < 0 ) return sector;
+      if ( sector < 2 ) ++needed; // Sparse or past the end of the map (-EOF)
+   }
+   if ( needed )
+   {
+      needed += needed/ENTRIES_PER_MAP_SECTOR + 1; // Map sectors
+      struct sector1_sparta *sec1 = SECTOR(1);
+      if ( needed > BYTES2(sec1->free) ) return -ENOSPC;
+
+      atrfs->alloc_hint = find_free_run(atrfs,2,atrfs->sectors,needed,sparta_bitmap_status);
+      if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s %d sectors starting at %d\n",__FUNCTION__,path,needed,atrfs->alloc_hint);
+      for ( int seq=first;seq<=last;++seq )
+      {
+         r = sparta_alloc_sector_in_map(atrfs,inode,seq);
+         if ( r<0 ) break;
+      }
+      atrfs->alloc_hint = 0;
+      if ( r<0 ) return r;
+   }
+
+   if ( !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > filesize )
+   {
+      return sparta_truncate(atrfs,path,offset+length);
+   }
+   return 0;
+}
+
+/*
+ * sparta_copy_file_range()
+ *
+ * Fast path for duplicating a whole file into a new, empty file.
+ *
+ * Size the destination map first, then allocate a sector for each
+ * allocated sector in the source (holes stay holes) and copy the data
+ * directly.  Anything else returns -EOPNOTSUPP so that the generic layer
+ * falls back to reading and writing.
+ */
+int sparta_copy_file_range(struct atrfs *atrfs,const char *path_in, off_t offset_in, const char *path_out, off_t offset_out, size_t size)
+{
+   int inode=0,parent_dir_inode,filesize,locked,entry,isdir,isinfo;
+   int out_inode=0,out_parent_dir_inode,out_filesize,out_locked,out_entry;
+   int r;
+
+   if ( offset_in || offset_out ) return -EOPNOTSUPP;
+   r = sparta_path(atrfs,path_in,&inode,&parent_dir_inode,&filesize,&locked,&entry,&isdir,&isinfo);
+   if ( r || isdir || isinfo ) return -EOPNOTSUPP;
+   r = sparta_path(atrfs,path_out,&out_inode,&out_parent_dir_inode,&out_filesize,&out_locked,&out_entry,&isdir,&isinfo);
+   if ( r || isdir || isinfo ) return -EOPNOTSUPP;
+   if ( out_locked ) return -EACCES; // As a write would
+   if ( out_filesize || (size_t)filesize > size ) return -EOPNOTSUPP;
+   if ( inode == out_inode ) return -EINVAL;
+
+   // Count the sectors needed, including the map sectors
+   int sectors = SIZE_TO_SECTORS(filesize);
+   int needed = SIZE_TO_MAP_SECTORS(filesize);
+   for ( int seq=0;seq<sectors;++seq )
+   {
+      int sector = sparta_get_sector(atrfs,inode,seq,0);
+      if ( sector < 0 ) return sector;
+      if ( sector >= 2 ) ++needed; // Skip holes
+   }
+   struct sector1_sparta *sec1 = SECTOR(1);
+   if ( needed > BYTES2(sec1->free) ) return -ENOSPC;
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s to %s: %d sectors, %d bytes\n",__FUNCTION__,path_in,path_out,needed,filesize);
+
+   atrfs->alloc_hint = find_free_run(atrfs,2,atrfs->sectors,needed,sparta_bitmap_status);
+   r = sparta_truncate(atrfs,path_out,filesize); // Just the map; no data sectors yet
+   for ( int seq=0;r>=0 && seq<sectors;++seq )
+   {
+      int src = sparta_get_sector(atrfs,inode,seq,0);
+      if ( src < 0 )
+      {
+         r = src;
+         break;
+      }
+      if ( src < 2 ) continue; // Hole
+      r = sparta_alloc_sector_in_map(atrfs,out_inode,seq);
+      if ( r<0 ) break;
+      int dst = sparta_get_sector(atrfs,out_inode,seq,0);
+      unsigned char *d = SECTOR(dst);
+      unsigned char *s = SECTOR(src);
+      if ( dst < 2 || !d || !s )
+      {
+         r = -EIO;
+         break;
+      }
+      memcpy(d,s,atrfs->sectorsize);
+   }
+   atrfs->alloc_hint = 0;
+   if ( r<0 ) return r;
+   return filesize;
+}
+
+/*
+ * sparta_getxattr()
+ *
+ * Attributes from the directory entry and sector map (XATTR_PREFIX removed):
+ *   status   Directory entry status in hex
+ *   map      First sector of the sector map
+ *   sectors  Number of data sectors allocated
+ *   locked   1 or 0
+ *   mtime    Time stamp as stored: YYYY-MM-DD HH:MM:SS
+ *   chain    Data sectors, two bytes each, low byte first; zero for holes
+ */
+int sparta_getxattr(struct atrfs *atrfs,const char *path, const char *name, char *value, size_t size)
+{
+   int inode=0,parent_dir_inode,filesize,locked,entry,isdir,isinfo;
+   int r;
+
+   r = sparta_path(atrfs,path,&inode,&parent_dir_inode,&filesize,&locked,&entry,&isdir,&isinfo);
+   if ( r<0 ) return r;
+   if ( r>0 ) return -ENOENT;
+   if ( isinfo ) return -ENODATA;
+
+   // The root directory only has the directory header
+   struct sparta_dir_entry dir_entry;
+   r = sparta_get_dirent(atrfs,&dir_entry,parent_dir_inode,entry>0?entry:0);
+   if ( r<0 ) return r;
+
+   if ( strcmp(name,"map") == 0 ) return xattr_text(value,size,"%d",inode);
+   if ( strcmp(name,"mtime") == 0 )
+   {
+      int year = dir_entry.file_date[2] + (dir_entry.file_date[2] < 78 ? 2000 : 1900);
+      return xattr_text(value,size,"%04d-%02d-%02d %02d:%02d:%02d",year,dir_entry.file_date[1],dir_entry.file_date[0],
+                        dir_entry.file_time[0],dir_entry.file_time[1],dir_entry.file_time[2]);
+   }
+   if ( strcmp(name,"sectors") == 0 || strcmp(name,"chain") == 0 )
+   {
+      int n = (filesize + atrfs->sectorsize - 1) / atrfs->sectorsize;
+      int count = 0;
+      int *sectors = malloc(sizeof(int)*(n+1));
+      if ( !sectors ) return -ENOMEM;
+      for ( int i=0;i<n;++i )
+      {
+         sectors[i] = sparta_get_sector(atrfs,inode,i,0);
+         if ( sectors[i] < 2 ) sectors[i] = 0; // Hole, or -EOF (1) past the end of the map
+         else ++count;
+      }
+      if ( strcmp(name,"chain") == 0 ) r = xattr_chain(value,size,sectors,n);
+      else r = xattr_text(value,size,"%d",count);
+      free(sectors);
+      return r;
+   }
+   if ( entry <= 0 ) return -ENODATA;
+   if ( strcmp(name,"status") == 0 ) return xattr_text(value,size,"%02x",dir_entry.status);
+   if ( strcmp(name,"locked") == 0 ) return xattr_text(value,size,"%d",locked);
+   return -ENODATA;
+}
+
+/*
+ * sparta_listxattr()
+ */
+int sparta_listxattr(struct atrfs *atrfs,const char *path, char *list, size_t size)
+{
+   int inode=0,parent_dir_inode,filesize,locked,entry,isdir,isinfo;
+   int r;
+   static const char *const root_names[] = { "map","sectors","mtime","chain",NULL };
+   static const char *const names[] = { "status","map","sectors","locked","mtime","chain",NULL };
+
+   r = sparta_path(atrfs,path,&inode,&parent_dir_inode,&filesize,&locked,&entry,&isdir,&isinfo);
+   if ( r<0 ) return r;
+   if ( r>0 ) return -ENOENT;
+   if ( isinfo ) return 0;
+   if ( entry <= 0 ) return xattr_names(list,size,root_names);
+   return xattr_names(list,size,names);
+}
+
+/*
+ * sparta_sectormap_file()
+ *
+ * Claim the sector map and data sectors for one file or directory.
+ */
+int sparta_sectormap_file(struct atrfs *atrfs,struct sectormap *sm,int inode,int owner,int use)
+{
+   int seq=0;
+
+   for ( int mapno=0;inode;++mapno )
+   {
+      unsigned char *s = SECTOR(inode);
+      if ( !s ) return -EIO;
+      int seen = sm->map[inode].claims; // Stop if the chain loops
+      sectormap_claim(sm,inode,owner,SM_MAP,mapno);
+      if ( seen ) return -EIO;
+      for ( int i=4;i<atrfs->sectorsize;i+=2,++seq )
+      {
+         if ( BYTES2(s+i) ) sectormap_claim(sm,BYTES2(s+i),owner,use,seq);
+      }
+      inode = BYTES2(s);
+   }
+   return 0;
+}
+
+/*
+ * sparta_sectormap_dir()
+ *
+ * Claim the sectors of everything in a directory, recursing into
+ * subdirectories.
+ */
+int sparta_sectormap_dir(struct atrfs *atrfs,struct sectormap *sm,int dirinode,const char *dirpath)
+{
+   struct sparta_dir_header dir_header;
+   struct sparta_dir_entry dir_entry;
+   char name[8+1+3+1];
+   char *path;
+   int r;
+
+   r = sparta_get_dirent(atrfs,(void *)&dir_header,dirinode,0);
+   if ( r<0 ) return r;
+   int dir_size = BYTES3(dir_header.dir_length_bytes);
+   path = malloc(strlen(dirpath)+1+sizeof(name));
+   if ( !path ) return -ENOMEM;
+   for ( int i=1;i<(int)(dir_size/sizeof(dir_entry));++i )
+   {
+      r = sparta_get_dirent(atrfs,&dir_entry,dirinode,i);
+      if ( r<0 ) break;
+      if ( dir_entry.status & FLAGS_DELETED ) continue;
+      if ( !(dir_entry.status & FLAGS_IN_USE) ) continue;
+      sparta_dirent_name(&dir_entry,name);
+      sprintf(path,"%s/%s",dirpath,name);
+      int owner = sectormap_owner(sm,path);
+      int inode = BYTES2(dir_entry.sector_map);
+      if ( inode < 1 || inode > atrfs->sectors ) continue;
+      int seen = sm->map[inode].claims;
+      if ( sparta_sectormap_file(atrfs,sm,inode,owner,(dir_entry.status & FLAGS_DIR) ? SM_DIR : SM_DATA) < 0 ) continue;
+      if ( !seen && (dir_entry.status & FLAGS_DIR) ) sparta_sectormap_dir(atrfs,sm,inode,path);
+   }
+   free(path);
+   return r<0 ? r : 0;
+}
+
+/*
+ * sparta_sectormap()
+ */
+int sparta_sectormap(struct atrfs *atrfs,struct sectormap *sm)
+{
+   struct sector1_sparta *sec1 = SECTOR(1);
+   int owner;
+
+   for ( int i=1;i<=atrfs->sectors;++i )
+   {
+      sm->map[i].bitmap = sparta_bitmap_status(atrfs,i) ? SM_FREE : SM_USED;
+   }
+   owner = sectormap_owner(sm,"[boot]");
+   for ( int i=1;i<=sec1->boot_sectors;++i ) sectormap_claim(sm,i,owner,SM_SYSTEM,i-1);
+   owner = sectormap_owner(sm,"[bitmap]");
+   for ( int i=0;i<sec1->bitmap_sectors;++i ) sectormap_claim(sm,BYTES2(sec1->first_bitmap)+i,owner,SM_SYSTEM,i);
+
+   owner = sectormap_owner(sm,"/");
+   sparta_sectormap_file(atrfs,sm,BYTES2(sec1->dir),owner,SM_DIR);
+   return sparta_sectormap_dir(atrfs,sm,BYTES2(sec1->dir),"");
+}
+
+/*
+ * sparta_check_map()
+ *
+ * Follow the sector map chain for a file or directory, and check that
+ * it covers 'size' bytes (-1 to skip that check).
+ */
+void sparta_check_map(struct atrfs *atrfs,struct fscheck *ck,int inode,int size,const char *path)
+{
+   int seq=0,last=0,maps=0;
+
+   while ( inode )
+   {
+      unsigned char *s = SECTOR(inode);
+      if ( inode > atrfs->sectors || !s )
+      {
+         fscheck_problem(ck,0,"%s: sector map %d links to sector %d, which is not on the disk",path,maps,inode);
+         ck->damaged = 1;
+         return;
+      }
+      if ( ++maps > atrfs->sectors )
+      {
+         fscheck_problem(ck,0,"%s: sector map chain loops back on itself",path);
+         ck->damaged = 1;
+         return;
+      }
+      for ( int i=4;i<atrfs->sectorsize;i+=2,++seq )
+      {
+         int sector = BYTES2(s+i);
+         if ( !sector ) continue;
+         if ( sector > atrfs->sectors )
+         {
+            fscheck_problem(ck,0,"%s: sector %d of the file is %d, which is not on the disk",path,seq,sector);
+            ck->damaged = 1;
+            continue;
+         }
+         last = seq+1;
+      }
+      inode = BYTES2(s);
+   }
+   if ( size >= 0 && last < (size+atrfs->sectorsize-1)/atrfs->sectorsize )
+   {
+      fscheck_problem(ck,0,"%s: file is %d bytes, but its sector map only covers %d sectors",path,size,last);
+   }
+}
+
+/*
+ * sparta_check_dir()
+ *
+ * Check everything in a directory, recursing into subdirectories
+ */
+int sparta_check_dir(struct atrfs *atrfs,struct fscheck *ck,int dirinode,const char *dirpath,int depth)
+{
+   struct sparta_dir_header dir_header;
+   struct sparta_dir_entry dir_entry;
+   char name[8+1+3+1];
+   char *path;
+   int r;
+
+   r = sparta_get_dirent(atrfs,(void *)&dir_header,dirinode,0);
+   if ( r<0 )
+   {
+      fscheck_problem(ck,0,"%s/: directory header can't be read",dirpath);
+      return 0;
+   }
+   int dir_size = BYTES3(dir_header.dir_length_bytes);
+   path = malloc(strlen(dirpath)+1+sizeof(name));
+   if ( !path ) return -ENOMEM;
+   for ( int i=1;i<(int)(dir_size/sizeof(dir_entry));++i )
+   {
+      r = sparta_get_dirent(atrfs,&dir_entry,dirinode,i);
+      if ( r<0 )
+      {
+         fscheck_problem(ck,0,"%s/: directory is %d bytes, but its sector map ends at entry %d",dirpath,dir_size,i);
+         break;
+      }
+      if ( dir_entry.status & FLAGS_DELETED ) continue;
+      if ( !(dir_entry.status & FLAGS_IN_USE) ) continue;
+      sparta_dirent_name(&dir_entry,name);
+      sprintf(path,"%s/%s",dirpath,name);
+      int inode = BYTES2(dir_entry.sector_map);
+      if ( inode < 1 || inode > atrfs->sectors )
+      {
+         fscheck_problem(ck,0,"%s: sector map is sector %d, which is not on the disk",path,inode);
+         ck->damaged = 1;
+         continue;
+      }
+      int isdir = (dir_entry.status & FLAGS_DIR) != 0;
+      sparta_check_map(atrfs,ck,inode,isdir ? -1 : (int)BYTES3(dir_entry.file_size_bytes),path);
+      // Cross-linked directories are reported with the bitmap
+      if ( isdir && ck->sm && ck->sm->map[inode].claims == 1 && depth < 32 ) sparta_check_dir(atrfs,ck,inode,path,depth+1);
+   }
+   free(path);
+   return 0;
+}
+
+/*
+ * sparta_check()
+ */
+int sparta_check(struct atrfs *atrfs,struct fscheck *ck)
+{
+   struct sector1_sparta *sec1 = SECTOR(1);
+   int free_count = 0;
+
+   sparta_check_map(atrfs,ck,BYTES2(sec1->dir),-1,"/");
+   int r = sparta_check_dir(atrfs,ck,BYTES2(sec1->dir),"",0);
+   if ( r<0 ) return r;
+   fscheck_bitmap(ck,atrfs,1,sparta_bitmap);
+
+   for ( int i=1;i<=atrfs->sectors;++i ) free_count += sparta_bitmap_status(atrfs,i);
+   if ( BYTES2(sec1->free) != free_count )
+   {
+      int old = BYTES2(sec1->free);
+      if ( ck->repair ) STOREBYTES2(sec1->free,free_count);
+      fscheck_problem(ck,ck->repair,"boot sector says %d free sectors, but the bitmap has %d",old,free_count);
+   }
+   return 0;
+}
+
+/*
+ * sparta_defrag_file()
+ *
+ * Move the data sectors of a file or directory to a contiguous run of
+ * free sectors if they aren't already one, rewriting the entries in the
+ * sector map.  The sector map itself stays where it is.
+ *
+ * Return 1 if moved, 0 if left alone, -ENOSPC if no run is long enough.
+ */
+int sparta_defrag_file(struct atrfs *atrfs,int inode)
+{
+   struct sector1_sparta *sec1 = SECTOR(1);
+   unsigned char **entries = NULL;
+   int n=0,i,mapno;
+   const int ss = atrfs->sectorsize;
+
+   // Collect the map entries for the data sectors
+   for ( mapno=0;inode && mapno<=atrfs->sectors;++mapno )
+   {
+      unsigned char *s = SECTOR(inode);
+      if ( !s ) break;
+      for ( i=4;i<ss;i+=2 )
+      {
+         if ( !BYTES2(s+i) ) continue; // Hole in a sparse file
+         if ( BYTES2(s+i) > atrfs->sectors )
+         {
+            free(entries);
+            return 0; // Leave damaged files alone
+         }
+         entries = realloc(entries,sizeof(*entries)*(n+1));
+         if ( !entries ) return -ENOMEM;
+         entries[n++] = s+i;
+      }
+      inode = BYTES2(s);
+   }
+   if ( inode )
+   {
+      free(entries);
+      return 0; // Leave damaged files alone
+   }
+   for ( i=1;i<n && BYTES2(entries[i]) == BYTES2(entries[0])+i;++i ) ;
+   if ( i >= n )
+   {
+      free(entries);
+      return 0;
+   }
+
+   unsigned char *buf = malloc(n*ss);
+   if ( !buf )
+   {
+      free(entries);
+      return -ENOMEM;
+   }
+   for ( i=0;i<n;++i )
+   {
+      unsigned char *s = SECTOR(BYTES2(entries[i]));
+      memcpy(buf+i*ss,s,ss);
+      sparta_free_sector(atrfs,BYTES2(entries[i]));
+   }
+
+   int start = find_free_run(atrfs,sec1->boot_sectors+1,atrfs->sectors,n,sparta_bitmap_status);
+   for ( i=0;start > 0 && i<n;++i )
+   {
+      if ( start+i > atrfs->sectors || !sparta_bitmap_status(atrfs,start+i) ) start = -1;
+   }
+   if ( start < 0 )
+   {
+      for ( i=0;i<n;++i )
+      {
+         unsigned char *s = SECTOR(BYTES2(entries[i]));
+         sparta_alloc_sector(atrfs,BYTES2(entries[i]));
+         memcpy(s,buf+i*ss,ss);
+      }
+      free(buf);
+      free(entries);
+      return -ENOSPC;
+   }
+
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d sectors from %d to %d\n",__FUNCTION__,n,BYTES2(entries[0]),start);
+   for ( i=0;i<n;++i )
+   {
+      unsigned char *s = SECTOR(start+i);
+      sparta_alloc_sector(atrfs,start+i);
+      memcpy(s,buf+i*ss,ss);
+      STOREBYTES2(entries[i],start+i);
+   }
+   free(buf);
+   free(entries);
+   return 1;
+}
+
+/*
+ * sparta_defrag_dir()
+ *
+ * Defragment everything in a directory, then the directory itself.
+ * Directory entries only reference sector maps, so they don't change.
+ */
+int sparta_defrag_dir(struct atrfs *atrfs,int dirinode,int *fragmented,int depth)
+{
+   struct sparta_dir_header dir_header;
+   struct sparta_dir_entry dir_entry;
+   int moved=0;
+   int r;
+
+   if ( depth > 64 ) return 0; // Don't loop on a corrupted directory tree
+   r = sparta_get_dirent(atrfs,(void *)&dir_header,dirinode,0);
+   if ( r<0 ) return r;
+   int dir_size = BYTES3(dir_header.dir_length_bytes);
+   for ( int i=1;i<(int)(dir_size/sizeof(dir_entry));++i )
+   {
+      r = sparta_get_dirent(atrfs,&dir_entry,dirinode,i);
+      if ( r<0 ) return r;
+      if ( dir_entry.status & FLAGS_DELETED ) continue;
+      if ( !(dir_entry.status & FLAGS_IN_USE) ) continue;
+      int inode = BYTES2(dir_entry.sector_map);
+      if ( inode < 1 || inode > atrfs->sectors ) continue;
+      if ( dir_entry.status & FLAGS_DIR ) r = sparta_defrag_dir(atrfs,inode,fragmented,depth+1);
+      else
+      {
+         r = sparta_defrag_file(atrfs,inode);
+         if ( r == -ENOSPC )
+         {
+            ++*fragmented;
+            r = 0;
+         }
+      }
+      if ( r<0 ) return r;
+      moved += r;
+   }
+   r = sparta_defrag_file(atrfs,dirinode);
+   if ( r == -ENOSPC )
+   {
+      ++*fragmented;
+      r = 0;
+   }
+   if ( r<0 ) return r;
+   return moved + r;
+}
+
+/*
+ * sparta_defrag()
+ */
+int sparta_defrag(struct atrfs *atrfs,int *fragmented)
+{
+   struct sector1_sparta *sec1 = SECTOR(1);
+
+   return sparta_defrag_dir(atrfs,BYTES2(sec1->dir),fragmented,0);
+}
+
 /*
  * sparta_statfs()
  */
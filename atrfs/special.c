@@ -42,6 +42,7 @@ int special_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, o
 int special_write(struct atrfs *atrfs,const char *path, const char *buf, size_t size, off_t offset);
 char *fsinfo_textdata(struct atrfs *atrfs);
 char *bootinfo_textdata(struct atrfs *atrfs);
+char *sectormap_textdata(struct atrfs *atrfs);
 
 /*
  * Global variables
@@ -63,6 +64,12 @@ const struct special_files files[] = {
    {
       .name = ".fsinfo"
    },
+   {
+      .name = ".sectormap"
+   },
+   {
+      .name = ".contents.tar"
+   },
 };
 
 /*
@@ -76,6 +83,8 @@ int special_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
       {
          if ( atrfs_strcmp(files[i].name,path+1)==0 )
          {
+            if ( i == 3 && !sectormap_textdata(atrfs) ) return -ENOENT; // Not supported on this file system
+            if ( i == 4 && tar_size(atrfs) < 0 ) return -ENOENT;
             if ( i!=1 ) // not .bootsectors
             {
                stbuf->st_mode = MODE_RO(stbuf->st_mode); // Not writable
@@ -103,6 +112,14 @@ int special_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
             {
                stbuf->st_size = strlen(fsinfo_textdata(atrfs));
             }
+            else if ( i == 3 )
+            {
+               stbuf->st_size = strlen(sectormap_textdata(atrfs));
+            }
+            else if ( i == 4 )
+            {
+               stbuf->st_size = tar_size(atrfs);
+            }
             return 0;
          }
       }
@@ -118,6 +135,8 @@ int special_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_d
    {
       for (int i=0;(long unsigned)i<sizeof(files)/sizeof(files[0]);++i)
       {
+         if ( i == 3 && !(fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_sectormap) ) continue;
+         if ( i == 4 && !(fs_ops[atrfs->fstype] && fs_ops[atrfs->fstype]->fs_readdir && fs_ops[atrfs->fstype]->fs_read) ) continue;
          filler(buf, files[i].name, FILLER_NULL);
       }
    }
@@ -146,12 +165,19 @@ int special_read(struct atrfs *atrfs,const char *path, char *buf, size_t size, o
                memcpy(buf,s,bytes);
                return bytes;
             }
-            if ( i==2 || i==0 )
+            if ( i==4 )
+            {
+               if ( options.debug ) fprintf(stderr,"DEBUG: %s %s Special file %d\n",__FUNCTION__,path,i);
+               return tar_read(atrfs,buf,size,offset);
+            }
+            if ( i==2 || i==0 || i==3 )
             {
                if ( options.debug ) fprintf(stderr,"DEBUG: %s %s Special file %d\n",__FUNCTION__,path,i);
                char *b;
                if ( i==2 ) b = fsinfo_textdata(atrfs);
+               else if ( i==3 ) b = sectormap_textdata(atrfs);
                else b = bootinfo_textdata(atrfs);
+               if ( !b ) return -EIO;
                int bytes = strlen(b);
                if (offset >= bytes) return -EOF;
                b += offset;
@@ -314,3 +340,78 @@ char *bootinfo_textdata(struct atrfs *atrfs)
    buf=realloc(buf,strlen(buf)+1);
    return buf;
 }
+
+/*
+ * sectormap_textdata()
+ *
+ * One line for each sector with the bitmap status, what it's used for,
+ * the owner, and the position in the owner's chain.  Allocated sectors
+ * with no owner, cross-linked sectors, and sectors in use but marked
+ * free are flagged, with totals at the end.
+ *
+ * Regenerated only after something has been written, or for another
+ * image (each APT partition has its own).
+ */
+char *sectormap_textdata(struct atrfs *atrfs)
+{
+   static char *buf;
+   static unsigned int changes;
+   static struct atrfs *built;
+   static const char *use_names[] = { "-","system","dir","data","map" };
+   static const char *bitmap_names[] = { "-","free","used" };
+
+   if ( buf && built == atrfs && changes == atrfs->changes ) return buf;
+   free(buf);
+   buf = NULL;
+   struct sectormap *sm = sectormap_build(atrfs);
+   if ( !sm ) return NULL;
+   changes = atrfs->changes;
+   built = atrfs;
+
+   size_t size = 64*1024,len = 0;
+   int orphans=0,crosslinks=0,unallocated=0;
+   buf = malloc(size);
+   len += sprintf(buf+len,"Sector ownership map\n\nSector Bitmap Use    Owner [position]\n");
+   for ( int i=1;i<=sm->sectors;++i )
+   {
+      const struct sectormap_entry *e = &sm->map[i];
+      const char *owner = ( e->owner >= 0 ) ? sm->owners[e->owner] : "";
+      const char *other = ( e->other >= 0 ) ? sm->owners[e->other] : "";
+      if ( len + 128 + strlen(owner) + strlen(other) > size )
+      {
+         size *= 2;
+         buf = realloc(buf,size);
+      }
+      len += sprintf(buf+len,"%6d %-6s %s",i,bitmap_names[e->bitmap],use_names[e->use]);
+      if ( e->claims )
+      {
+         len += sprintf(buf+len,"%*s %s",6-(int)strlen(use_names[e->use]),"",owner);
+         if ( e->use != SM_SYSTEM ) len += sprintf(buf+len," %d",e->position);
+      }
+      if ( e->claims > 1 )
+      {
+         len += sprintf(buf+len," CROSSLINKED(%d) %s",e->claims,other);
+         ++crosslinks;
+      }
+      if ( !e->claims && e->bitmap == SM_USED )
+      {
+         len += sprintf(buf+len," ORPHAN");
+         ++orphans;
+      }
+      if ( e->claims && e->bitmap == SM_FREE )
+      {
+         len += sprintf(buf+len," MARKED-FREE");
+         ++unallocated;
+      }
+      len += sprintf(buf+len,"\n");
+   }
+   buf = realloc(buf,len+256);
+   sprintf(buf+len,
+           "\nOrphaned sectors (allocated with no owner): %d\n"
+           "Cross-linked sectors: %d\n"
+           "Sectors in use but marked free: %d\n",
+           orphans,crosslinks,unallocated);
+   sectormap_free(sm);
+   buf = realloc(buf,strlen(buf)+1);
+   return buf;
+}
@@ -0,0 +1,284 @@
+/*
+ * tar.c
+ *
+ * The /.contents.tar special file: every file and directory in the image
+ * as a ustar archive, so one sequential read can replace a tree walk.
+ *
+ * Only an index is built up front: the path, size, and archive offset of
+ * each entry.  That gives the archive size for getattr, and lets a read
+ * at any offset find its entry with a binary search.  Headers and file
+ * data are generated as they are read.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#include FUSE_INCLUDE
+#include <sys/stat.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "atrfs.h"
+
+/*
+ * Macros and defines
+ */
+#define TAR_BLOCK 512
+#define TAR_ROUND(n) ( ((n) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK )
+
+/*
+ * Data types
+ */
+struct tar_entry {
+   char *path; // With the leading '/'; directories end with '/'
+   off_t offset; // Of the header in the archive
+   off_t size; // File data; 0 for directories
+   mode_t mode;
+   time_t mtime;
+   uid_t uid;
+   gid_t gid;
+};
+
+struct tar_index {
+   struct atrfs *atrfs;
+   unsigned int changes; // atrfs->changes when built
+   struct tar_entry *entry;
+   int count;
+   int alloc;
+   off_t size; // Whole archive, including the two zero blocks at the end
+};
+
+// Header layout from POSIX ustar
+struct tar_header {
+   char name[100];
+   char mode[8];
+   char uid[8];
+   char gid[8];
+   char size[12];
+   char mtime[12];
+   char chksum[8];
+   char typeflag;
+   char linkname[100];
+   char magic[6];
+   char version[2];
+   char uname[32];
+   char gname[32];
+   char devmajor[8];
+   char devminor[8];
+   char prefix[155];
+   char pad[12];
+};
+
+/*
+ * Function prototypes
+ */
+int tar_add(void *arg,const char *path,const struct stat *st);
+struct tar_index *tar_index(struct atrfs *atrfs);
+int tar_header(const struct tar_entry *e,struct tar_header *h);
+int tar_entry_read(struct atrfs *atrfs,const struct tar_entry *e,char *buf,size_t size,off_t offset);
+
+/*
+ * Functions
+ */
+
+/*
+ * tar_add()
+ *
+ * tree_walk() callback: append an entry to the index after the previous
+ * one's data
+ */
+int tar_add(void *arg,const char *path,const struct stat *st)
+{
+   struct tar_index *idx = arg;
+   char *name = malloc(strlen(path) + 2);
+
+   if ( !name ) return -ENOMEM;
+   strcpy(name,path);
+   if ( S_ISDIR(st->st_mode) ) strcat(name,"/");
+   if ( idx->count == idx->alloc )
+   {
+      struct tar_entry *more = realloc(idx->entry,(idx->alloc * 2 + 64) * sizeof(idx->entry[0]));
+      if ( !more )
+      {
+         free(name);
+         return -ENOMEM;
+      }
+      idx->entry = more;
+      idx->alloc = idx->alloc * 2 + 64;
+   }
+   struct tar_entry *e = &idx->entry[idx->count++];
+   e->path = name;
+   e->offset = idx->size;
+   e->size = S_ISDIR(st->st_mode) ? 0 : st->st_size;
+   e->mode = st->st_mode;
+   e->mtime = st->st_mtim.tv_sec;
+   e->uid = st->st_uid;
+   e->gid = st->st_gid;
+   idx->size += TAR_BLOCK + TAR_ROUND(e->size);
+   return 0;
+}
+
+/*
+ * tar_index()
+ *
+ * Return the index for the archive, rebuilding it only after something
+ * has been written.  NULL if the file system can't list its files.
+ */
+struct tar_index *tar_index(struct atrfs *atrfs)
+{
+   static struct tar_index idx;
+
+   const struct fs_ops *ops = fs_ops[atrfs->fstype];
+   if ( !ops || !ops->fs_readdir || !ops->fs_getattr || !ops->fs_read ) return NULL;
+   if ( idx.entry && idx.atrfs == atrfs && idx.changes == atrfs->changes ) return &idx;
+   for ( int i=0;i<idx.count;++i ) free(idx.entry[i].path);
+   free(idx.entry);
+   memset(&idx,0,sizeof(idx));
+   idx.atrfs = atrfs;
+   idx.changes = atrfs->changes;
+   tree_walk(atrfs,tar_add,&idx);
+   idx.size += 2 * TAR_BLOCK;
+   if ( !idx.entry ) idx.entry = malloc(sizeof(idx.entry[0])); // Empty but valid
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d entries, %ld bytes\n",__FUNCTION__,idx.count,(long)idx.size);
+   return &idx;
+}
+
+/*
+ * tar_size()
+ *
+ * Size of /.contents.tar, or -ENOENT if it isn't supported here
+ */
+off_t tar_size(struct atrfs *atrfs)
+{
+   struct tar_index *idx = tar_index(atrfs);
+   if ( !idx ) return -ENOENT;
+   return idx->size;
+}
+
+/*
+ * tar_header()
+ *
+ * Fill in the ustar header for one entry.  Names too long for the header
+ * are split at a '/' into the prefix field.  Returns non-zero if the name
+ * doesn't fit, in which case the header still holds a valid truncated one.
+ */
+int tar_header(const struct tar_entry *e,struct tar_header *h)
+{
+   const char *name = e->path + 1; // Relative to the archive
+   size_t len = strlen(name);
+   int r = 0;
+
+   memset(h,0,sizeof(*h));
+   if ( len <= sizeof(h->name) ) memcpy(h->name,name,len);
+   else
+   {
+      const char *split = NULL;
+      for ( const char *s=name+len-1-sizeof(h->name);s<name+len-1;++s )
+      {
+         if ( *s == '/' && s-name <= (int)sizeof(h->prefix) ) { split = s; break; }
+      }
+      if ( split )
+      {
+         memcpy(h->prefix,name,split-name);
+         memcpy(h->name,split+1,len-(split-name)-1);
+      }
+      else
+      {
+         memcpy(h->name,name,sizeof(h->name));
+         r = 1;
+      }
+   }
+   sprintf(h->mode,"%07o",(unsigned int)(e->mode & 07777));
+   sprintf(h->uid,"%07o",(unsigned int)e->uid & 07777777);
+   sprintf(h->gid,"%07o",(unsigned int)e->gid & 07777777);
+   sprintf(h->size,"%011lo",(unsigned long)e->size & 077777777777UL); // Atari files are far smaller
+   sprintf(h->mtime,"%011lo",(unsigned long)(e->mtime < 0 ? 0 : e->mtime) & 077777777777UL);
+   h->typeflag = S_ISDIR(e->mode) ? '5' : '0';
+   memcpy(h->magic,"ustar",6);
+   memcpy(h->version,"00",2);
+   memset(h->chksum,' ',sizeof(h->chksum));
+   unsigned int sum = 0;
+   for ( size_t i=0;i<sizeof(*h);++i ) sum += ((unsigned char *)h)[i];
+   sprintf(h->chksum,"%06o",sum); // Followed by NUL and the space already there
+   return r;
+}
+
+/*
+ * tar_entry_read()
+ *
+ * Read from one entry's header, data, or padding; 'offset' is from the
+ * start of the header.  A file that reads short (a broken chain) is
+ * padded with zeros so that the archive keeps the size given by getattr.
+ */
+int tar_entry_read(struct atrfs *atrfs,const struct tar_entry *e,char *buf,size_t size,off_t offset)
+{
+   if ( offset < TAR_BLOCK )
+   {
+      struct tar_header h;
+      if ( tar_header(e,&h) && options.debug ) fprintf(stderr,"DEBUG: %s: name too long for tar: %s\n",__FUNCTION__,e->path);
+      if ( size > (size_t)(TAR_BLOCK - offset) ) size = TAR_BLOCK - offset;
+      memcpy(buf,(char *)&h + offset,size);
+      return size;
+   }
+   offset -= TAR_BLOCK;
+   off_t end = TAR_ROUND(e->size);
+   if ( size > (size_t)(end - offset) ) size = end - offset;
+   size_t got = 0;
+   if ( offset < e->size )
+   {
+      char fspath[PATH_MAX];
+      size_t want = size;
+      if ( want > (size_t)(e->size - offset) ) want = e->size - offset;
+      strcpy_upcase(fspath,e->path);
+      while ( got < want )
+      {
+         int r = (fs_ops[atrfs->fstype]->fs_read)(atrfs,fspath,buf+got,want-got,offset+got);
+         if ( r <= 0 ) break;
+         got += r;
+      }
+   }
+   memset(buf+got,0,size-got);
+   return size;
+}
+
+/*
+ * tar_read()
+ *
+ * Read from /.contents.tar
+ */
+int tar_read(struct atrfs *atrfs,char *buf,size_t size,off_t offset)
+{
+   struct tar_index *idx = tar_index(atrfs);
+   size_t done = 0;
+
+   if ( !idx ) return -EIO;
+   if ( offset >= idx->size ) return 0; // End of file
+   if ( size > (size_t)(idx->size - offset) ) size = idx->size - offset;
+   while ( done < size )
+   {
+      off_t at = offset + done;
+      // Last entry starting at or before 'at'
+      int lo = 0, hi = idx->count - 1, i = -1;
+      while ( lo <= hi )
+      {
+         int mid = (lo + hi) / 2;
+         if ( idx->entry[mid].offset <= at ) { i = mid; lo = mid + 1; }
+         else hi = mid - 1;
+      }
+      off_t end = ( i+1 < idx->count ) ? idx->entry[i+1].offset : idx->size - 2 * TAR_BLOCK;
+      if ( i < 0 || at >= end ) // Zero blocks at the end
+      {
+         memset(buf+done,0,size-done);
+         break;
+      }
+      size_t n = size - done;
+      if ( n > (size_t)(end - at) ) n = end - at;
+      done += tar_entry_read(atrfs,&idx->entry[i],buf+done,n,at - idx->entry[i].offset);
+   }
+   return size;
+}
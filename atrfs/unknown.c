@@ -41,6 +41,31 @@ struct disk_checksums {
    char *name;
 };
 
+/*
+ * Known-disk index
+ *
+ * Signatures are grouped by sector range so each range is hashed once per
+ * image.  Each range has an open-addressed hash table keyed on the MD5.
+ */
+struct known_disk {
+   unsigned char digest[16];
+   char *name;
+};
+
+struct known_range {
+   int start_sector;
+   int sector_count;
+   int size; // Slots in the table; a power of two
+   int used;
+   struct known_disk *slot; // name is NULL for an empty slot
+};
+
+struct known_index {
+   int count;
+   struct known_range *range;
+   int loaded;
+};
+
 /*
  * Function prototypes
  */
@@ -49,6 +74,11 @@ int unknown_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf);
 int unknown_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
 int unknown_statfs(struct atrfs *atrfs,const char *path, struct statvfs *stfsbuf);
 int unknown_newfs(struct atrfs *atrfs);
+const char *known_disk_name(struct atrfs *atrfs);
+struct known_range *known_range(int start,int count);
+int known_add(int start,int count,const char *hex,const char *name);
+void known_load(const char *filename);
+void known_index_build(void);
 
 /*
  * Global variables
@@ -93,53 +123,197 @@ const struct disk_checksums disk_checksums[] = {
    {18,3,"08eac44021fddad107db650fa6a1ea52","Alternate Reality The City (disk 4)"},
 };
 
-int matching_checksum;
 int match_found;
 const char *match_disk_name;
+struct known_index known_index;
+
+/*
+ * known_range()
+ *
+ * Find or add the table for a sector range
+ */
+struct known_range *known_range(int start,int count)
+{
+   for ( int i=0;i<known_index.count;++i )
+   {
+      if ( known_index.range[i].start_sector == start && known_index.range[i].sector_count == count ) return &known_index.range[i];
+   }
+   struct known_range *r = realloc(known_index.range,(known_index.count+1)*sizeof(*r));
+   if ( !r ) return NULL;
+   known_index.range = r;
+   r = &known_index.range[known_index.count++];
+   memset(r,0,sizeof(*r));
+   r->start_sector = start;
+   r->sector_count = count;
+   return r;
+}
+
+/*
+ * known_add()
+ *
+ * Add one signature; the first one added for a checksum wins
+ * Returns 0 on success, 1 if the hex string is invalid, -ENOMEM
+ */
+int known_add(int start,int count,const char *hex,const char *name)
+{
+   unsigned char digest[16];
+
+   if ( strlen(hex) != 32 ) return 1;
+   for (int j=0;j<16;++j)
+   {
+      char h[3] = {hex[j*2],hex[j*2+1],0};
+      char *end;
+      digest[j] = strtol(h,&end,16);
+      if ( *end ) return 1;
+   }
+
+   struct known_range *r = known_range(start,count);
+   if ( !r ) return -ENOMEM;
+
+   // Keep the table at most half full
+   if ( (r->used+1)*2 > r->size )
+   {
+      int size = r->size ? r->size*2 : 16;
+      struct known_disk *slot = calloc(size,sizeof(*slot));
+      if ( !slot ) return -ENOMEM;
+      for ( int i=0;i<r->size;++i )
+      {
+         if ( !r->slot[i].name ) continue;
+         unsigned int h = BYTES3(r->slot[i].digest) & (size-1);
+         while ( slot[h].name ) h = (h+1) & (size-1);
+         slot[h] = r->slot[i];
+      }
+      free(r->slot);
+      r->slot = slot;
+      r->size = size;
+   }
+
+   unsigned int h = BYTES3(digest) & (r->size-1);
+   while ( r->slot[h].name )
+   {
+      if ( memcmp(r->slot[h].digest,digest,16) == 0 ) return 0; // Duplicate
+      h = (h+1) & (r->size-1);
+   }
+   memcpy(r->slot[h].digest,digest,16);
+   r->slot[h].name = strdup(name);
+   if ( !r->slot[h].name ) return -ENOMEM;
+   for ( char *c=r->slot[h].name;*c;++c ) if ( *c == '/' ) *c = '-'; // Shown as a file name
+   ++r->used;
+   return 0;
+}
+
+/*
+ * known_load()
+ *
+ * Read signatures from a file, one per line:
+ *    <start sector> <sector count> <md5 hex> <disk name>
+ * Blank lines and lines starting with '#' are ignored.
+ */
+void known_load(const char *filename)
+{
+   FILE *f = fopen(filename,"r");
+   char line[1024];
+   int lineno = 0;
+   int added = 0;
+
+   if ( !f )
+   {
+      fprintf(stderr,"Unable to open known disk file %s\n",filename);
+      return;
+   }
+   while ( fgets(line,sizeof(line),f) )
+   {
+      int start,count;
+      char hex[64],name[sizeof(line)];
+      ++lineno;
+      line[strcspn(line,"\r\n")] = 0;
+      if ( line[strspn(line," \t")] == 0 || line[strspn(line," \t")] == '#' ) continue;
+      if ( sscanf(line,"%d %d %63s %[^\n]",&start,&count,hex,name) != 4 ||
+           start < 1 || count < 1 || known_add(start,count,hex,name) )
+      {
+         fprintf(stderr,"%s:%d: Invalid known disk entry\n",filename,lineno);
+         continue;
+      }
+      ++added;
+   }
+   fclose(f);
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %d signatures from %s\n",__FUNCTION__,added,filename);
+}
+
+/*
+ * known_index_build()
+ *
+ * Load the signatures once: the --knowndisks file first so it can rename
+ * a built-in entry, then the built-in table.
+ */
+void known_index_build(void)
+{
+   if ( known_index.loaded ) return;
+   known_index.loaded = 1;
+   if ( options.knowndisks ) known_load(options.knowndisks);
+   for (unsigned int i=0;i<sizeof(disk_checksums)/sizeof(disk_checksums[0]);++i)
+   {
+      known_add(disk_checksums[i].start_sector,disk_checksums[i].sector_count,disk_checksums[i].md5sum_hexstring,disk_checksums[i].name);
+   }
+}
 
 /*
  * find_checksum_match()
  *
  * Check to see if the disk image matches any of the known checksums
- * Note: This may not work correctly on images that are not single density
+ *
+ * Boot sectors (1-3) are 128 bytes on the drive, so only the first 128
+ * bytes of each are hashed even if the image pads them to the sector size.
+ * That way a double-density image matches the same signature whether or
+ * not it stores short boot sectors.
  */
 void find_checksum_match(struct atrfs *atrfs)
 {
    match_found = 0;
-   unsigned char digest[16];
-   for (unsigned int i=0;i<sizeof(disk_checksums)/sizeof(disk_checksums[0]);++i)
+   match_disk_name = "UNKNOWN_DISK_FORMAT";
+   known_index_build();
+   for ( int i=0;i<known_index.count;++i )
    {
-      // Convert the hex string into a 16-byte binary blob
-      unsigned char match_digest[16];
-      for (int j=0;j<16;++j)
-      {
-         char hex[3];
-         hex[0] = disk_checksums[i].md5sum_hexstring[j*2];
-         hex[1] = disk_checksums[i].md5sum_hexstring[j*2+1];
-         hex[2] = 0;
-         match_digest[j] = strtol(hex,NULL,16);
-      }
+      struct known_range *r = &known_index.range[i];
+      unsigned char digest[16];
+
+      // Skip checksums that run past the end of a short image
+      if ( r->start_sector + r->sector_count - 1 > atrfs->sectors ) continue;
 
-      // Compute MD5 checksum on the specified sector range in the image
+      // Compute MD5 checksum on the sector range in the image
+      MD5_CTX md5;
+      MD5_Init(&md5);
+      for ( int sec=r->start_sector;sec<r->start_sector+r->sector_count;++sec )
       {
-         MD5_CTX md5;
-         MD5_Init(&md5);
-         // FIXME: Make this a loop for boot sectors in case it's DD
-         // FIXME: Use the sector size instead of 128 to support DD disks
-         MD5_Update(&md5,SECTOR(disk_checksums[i].start_sector),disk_checksums[i].sector_count*128);
-         MD5_Final(digest,&md5);
+         MD5_Update(&md5,SECTOR(sec),sec <= 3 ? 128 : atrfs->sectorsize);
       }
+      MD5_Final(digest,&md5);
 
-      // Do they match?
-      if (0==memcmp(digest,match_digest,16))
+      // Look it up
+      unsigned int h = BYTES3(digest) & (r->size-1);
+      while ( r->slot[h].name )
       {
-         matching_checksum = i;
-         match_found = 1;
-         match_disk_name = disk_checksums[i].name;
-         return;
+         if ( memcmp(r->slot[h].digest,digest,16) == 0 )
+         {
+            match_found = 1;
+            match_disk_name = r->slot[h].name;
+            return;
+         }
+         h = (h+1) & (r->size-1);
       }
    }
-   match_disk_name = "UNKNOWN_DISK_FORMAT";
+}
+
+/*
+ * known_disk_name()
+ *
+ * Name of the known disk this image matches, or NULL if none
+ */
+const char *known_disk_name(struct atrfs *atrfs)
+{
+   find_checksum_match(atrfs);
+   if ( match_found ) return match_disk_name;
+   return NULL;
 }
 
 /*
@@ -177,7 +351,7 @@ int unknown_getattr(struct atrfs *atrfs,const char *path, struct stat *stbuf)
 int unknown_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_dir_t filler, off_t offset)
 {
    (void)path; // Always "/"
-   (void)offset;
+   (void)offset; // atrfs_filler() skips entries before the offset
 
    if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s\n",__FUNCTION__,path);
    filler(buf, match_disk_name, FILLER_NULL);
@@ -195,7 +369,17 @@ int unknown_readdir(struct atrfs *atrfs,const char *path, void *buf, fuse_fill_d
       unsigned char *s = SECTOR(sec);
       if ( memcmp(s,zero,atrfs->sectorsize) == 0 ) continue; // Skip empty sectors
       sprintf(name,".sector%0*d",digits,sec);
-      filler(buf,name,FILLER_NULL);
+      struct stat st;
+      int full;
+      if ( dirfill_stat(buf,&st) )
+      {
+         // Same results as getattr on the magic sector file
+         st.st_size = (atrfs->ssbytes && sec <= 3) ? 128 : atrfs->sectorsize;
+         st.st_ino = sec;
+         full = filler(buf,name,FILLER_STAT(&st));
+      }
+      else full = filler(buf,name,FILLER_NULL);
+      if ( full ) break; // FUSE will call again with an offset
    }
    free(zero);
 #endif
@@ -0,0 +1,453 @@
+/*
+ * zatr.c
+ *
+ * Compressed images: the image data is split into groups of sectors, and
+ * each group is compressed on its own with zlib, so one sector can be
+ * read without decompressing the whole image.  sio2linux reads and
+ * writes these containers a group at a time.
+ *
+ * atrfs decompresses every group when the image is opened, as the file
+ * systems expect the whole image in memory through SECTOR().  Groups
+ * that have changed are compressed again when files are closed and when
+ * the file system is unmounted.
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#include FUSE_INCLUDE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "atrfs.h"
+
+/*
+ * Macros and defines
+ */
+#define ZATR_MAGIC "ATRZIP01"
+#define ZATR_ATR_HEADER 16
+#define ZATR_INDEX 48 // Offset of the group index
+#define ZATR_GROUP 4096 // Image bytes in each group; 32 SD or 16 DD sectors
+#define ZATR_MAX_GROUP (1024*1024)
+
+/*
+ * Compressed image format (all numbers little-endian)
+ *
+ *   "ATRZIP01"
+ *   Image file size, group size, group count (4 bytes each)
+ *   ATR header length (1 byte; 0 or 16), zeros to 32
+ *   ATR header (16 bytes, zeros if none)
+ *   Group index, for each group:
+ *      offset, compressed length (4 bytes each); length 0 is all zeros
+ *   Compressed groups
+ *
+ * Groups start after the ATR header so they line up with sectors; the
+ * last group is short.  A group that is written again is appended to the
+ * end and then the index is updated, so the old data is still there if
+ * the update is interrupted.  Compress the image again to drop old data.
+ */
+
+/*
+ * Data types
+ */
+struct zatr {
+   unsigned int size; // Image file size
+   unsigned int groupsize;
+   unsigned int groups;
+   int hdrlen;
+   unsigned char hdr[ZATR_ATR_HEADER];
+   unsigned long *crc; // Checksum of each group as stored
+};
+
+/*
+ * Function prototypes
+ */
+int zatr_parse(struct zatr *z,const unsigned char *map,size_t len);
+unsigned char *zatr_decode(struct zatr *z,const unsigned char *map,size_t len,const char *filename);
+unsigned int zatr_group_bytes(const struct zatr *z,unsigned int g);
+int zatr_write(const char *filename,const unsigned char *image,size_t size);
+int zatr_convert(int count,char *names[]);
+
+/*
+ * Functions
+ */
+
+/*
+ * zatr_parse()
+ *
+ * Read the header of a mapped compressed image; returns non-zero if it
+ * isn't one or the header is damaged
+ */
+int zatr_parse(struct zatr *z,const unsigned char *map,size_t len)
+{
+   memset(z,0,sizeof(*z));
+   if ( len < ZATR_INDEX || memcmp(map,ZATR_MAGIC,8) != 0 ) return 1;
+   z->size = diff_get(map+8,4);
+   z->groupsize = diff_get(map+12,4);
+   z->groups = diff_get(map+16,4);
+   z->hdrlen = map[20];
+   memcpy(z->hdr,map+32,ZATR_ATR_HEADER);
+   if ( z->hdrlen != 0 && z->hdrlen != ZATR_ATR_HEADER ) return 1;
+   if ( z->groupsize < 128 || z->groupsize > ZATR_MAX_GROUP || z->size < (unsigned int)z->hdrlen ) return 1;
+   if ( z->groups != (z->size - z->hdrlen + z->groupsize - 1) / z->groupsize ) return 1;
+   if ( ZATR_INDEX + (size_t)z->groups * 8 > len ) return 1;
+   return 0;
+}
+
+/*
+ * zatr_group_bytes()
+ *
+ * Image bytes in group 'g'; only the last one is short
+ */
+unsigned int zatr_group_bytes(const struct zatr *z,unsigned int g)
+{
+   unsigned int start = g * z->groupsize;
+   unsigned int data = z->size - z->hdrlen;
+
+   return data - start < z->groupsize ? data - start : z->groupsize;
+}
+
+/*
+ * zatr_decode()
+ *
+ * Decompress all groups into a new anonymous mapping of the image, and
+ * note the checksum of each for zatr_flush().  Returns NULL if it is
+ * damaged.
+ */
+unsigned char *zatr_decode(struct zatr *z,const unsigned char *map,size_t len,const char *filename)
+{
+   unsigned char *buf;
+
+   buf = mmap(NULL,z->size ? z->size : 1,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+   if ( buf == MAP_FAILED ) return NULL;
+   z->crc = calloc(z->groups ? z->groups : 1,sizeof(*z->crc));
+   if ( !z->crc )
+   {
+      munmap(buf,z->size ? z->size : 1);
+      return NULL;
+   }
+   memcpy(buf,z->hdr,z->hdrlen);
+   for ( unsigned int g=0;g<z->groups;++g )
+   {
+      const unsigned char *entry = map + ZATR_INDEX + (size_t)g * 8;
+      unsigned int off = diff_get(entry,4);
+      unsigned int clen = diff_get(entry+4,4);
+      unsigned char *data = buf + z->hdrlen + (size_t)g * z->groupsize;
+      uLongf n = zatr_group_bytes(z,g);
+
+      if ( clen ) // Otherwise all zeros, as the mapping already is
+      {
+         if ( (size_t)off + clen > len || uncompress(data,&n,map+off,clen) != Z_OK || n != zatr_group_bytes(z,g) )
+         {
+            fprintf(stderr,"Compressed image %s is damaged in group %u\n",filename,g);
+            munmap(buf,z->size ? z->size : 1);
+            free(z->crc);
+            z->crc = NULL;
+            return NULL;
+         }
+      }
+      z->crc[g] = crc32(0,data,zatr_group_bytes(z,g));
+   }
+   return buf;
+}
+
+/*
+ * zatr_open()
+ *
+ * Called when opening an image: if it is compressed, replace the mapping
+ * with the decompressed image.  The file descriptor stays open on the
+ * compressed file for zatr_flush().  Returns non-zero if it's compressed
+ * but damaged.
+ */
+int zatr_open(struct atrfs *atrfs)
+{
+   struct zatr *z;
+   unsigned char *buf;
+
+   if ( atrfs->atrsize < ZATR_INDEX || memcmp(atrfs->atrmem,ZATR_MAGIC,8) != 0 ) return 0;
+   z = malloc(sizeof(*z));
+   if ( !z ) return 1;
+   if ( zatr_parse(z,atrfs->atrmem,atrfs->atrsize) )
+   {
+      fprintf(stderr,"Compressed image %s is damaged\n",options.filename);
+      free(z);
+      return 1;
+   }
+   buf = zatr_decode(z,atrfs->atrmem,atrfs->atrsize,options.filename);
+   if ( !buf )
+   {
+      free(z);
+      return 1;
+   }
+   if ( options.debug ) fprintf(stderr,"DEBUG: %s: %s: %u bytes in %u groups\n",__FUNCTION__,options.filename,z->size,z->groups);
+
+   munmap(atrfs->atrmem,atrfs->atrsize);
+   atrfs->atrmem = buf;
+   atrfs->mem = (char *)buf + ZATR_ATR_HEADER;
+   atrfs->atrsize = z->size;
+   atrfs->atrstat.st_size = z->size;
+   atrfs->zatr = z;
+   return 0;
+}
+
+/*
+ * zatr_flush()
+ *
+ * Compress each group that has changed and append it to the file.  The
+ * index is only updated after the new groups are on disk.
+ *
+ * Returns 0 or a negative errno.
+ */
+int zatr_flush(struct atrfs *atrfs)
+{
+   struct zatr *z = atrfs->zatr;
+   struct {
+      unsigned int group;
+      unsigned int off;
+      unsigned int len;
+      unsigned long crc;
+   } *pending;
+   unsigned int count = 0;
+   unsigned char *out;
+   unsigned char entry[8];
+   off_t end;
+   int r = 0;
+
+   if ( !z || atrfs->readonly ) return 0;
+   int hdrchanged = memcmp(atrfs->atrmem,z->hdr,z->hdrlen) != 0;
+   uLong bound = compressBound(z->groupsize);
+   out = malloc(bound);
+   pending = malloc((z->groups ? z->groups : 1) * sizeof(*pending));
+   end = lseek(atrfs->fd,0,SEEK_END);
+   if ( !out || !pending || end < 0 )
+   {
+      r = end < 0 ? -errno : -ENOMEM;
+      free(out);
+      free(pending);
+      return r;
+   }
+   for ( unsigned int g=0;g<z->groups;++g )
+   {
+      const unsigned char *data = (unsigned char *)atrfs->atrmem + z->hdrlen + (size_t)g * z->groupsize;
+      unsigned int n = zatr_group_bytes(z,g);
+      unsigned long crc = crc32(0,data,n);
+      uLongf clen = 0;
+
+      if ( crc == z->crc[g] ) continue;
+      if ( data[0] || memcmp(data,data+1,n-1) )
+      {
+         clen = bound;
+         if ( compress2(out,&clen,data,n,Z_BEST_COMPRESSION) != Z_OK ) { r = -EIO; break; }
+         if ( end + clen > 0xffffffffLL ) { r = -EFBIG; break; }
+         if ( pwrite(atrfs->fd,out,clen,end) != (ssize_t)clen ) { r = -EIO; break; }
+      }
+      pending[count].group = g;
+      pending[count].off = clen ? end : 0;
+      pending[count].len = clen;
+      pending[count].crc = crc;
+      ++count;
+      end += clen;
+   }
+
+   // New data first, then the index entries that point to it
+   if ( !r && (count || hdrchanged) && fdatasync(atrfs->fd) ) r = -errno;
+   for ( unsigned int i=0;i<count && !r;++i )
+   {
+      diff_put(entry,pending[i].off,4);
+      diff_put(entry+4,pending[i].len,4);
+      if ( pwrite(atrfs->fd,entry,8,ZATR_INDEX + (off_t)pending[i].group * 8) != 8 ) r = -EIO;
+      else z->crc[pending[i].group] = pending[i].crc;
+   }
+   if ( !r && hdrchanged )
+   {
+      if ( pwrite(atrfs->fd,atrfs->atrmem,z->hdrlen,32) != z->hdrlen ) r = -EIO;
+      else memcpy(z->hdr,atrfs->atrmem,z->hdrlen);
+   }
+   if ( !r && (count || hdrchanged) && fdatasync(atrfs->fd) ) r = -errno;
+   if ( options.debug && count ) fprintf(stderr,"DEBUG: %s: %u groups compressed again%s%s\n",__FUNCTION__,count,r ? ": " : "",r ? strerror(-r) : "");
+   free(pending);
+   free(out);
+   return r;
+}
+
+/*
+ * zatr_write()
+ *
+ * Write an image out as a new compressed image file.  It is written to a
+ * temporary file and renamed, so the image can be compressed in place to
+ * drop old groups.
+ */
+int zatr_write(const char *filename,const unsigned char *image,size_t size)
+{
+   struct zatr z;
+   unsigned char b[ZATR_INDEX];
+   unsigned char *index,*out;
+   char *tmp;
+   FILE *f;
+   int r = 0;
+
+   if ( size > 0xffffffffUL - ZATR_INDEX )
+   {
+      fprintf(stderr,"Image is too large to compress\n");
+      return 1;
+   }
+   memset(&z,0,sizeof(z));
+   z.size = size;
+   z.groupsize = ZATR_GROUP;
+   if ( size >= ZATR_ATR_HEADER && image[0] == 0x96 && image[1] == 0x02 ) z.hdrlen = ZATR_ATR_HEADER;
+   z.groups = (z.size - z.hdrlen + z.groupsize - 1) / z.groupsize;
+   memset(b,0,sizeof(b));
+   memcpy(b,ZATR_MAGIC,8);
+   diff_put(b+8,z.size,4);
+   diff_put(b+12,z.groupsize,4);
+   diff_put(b+16,z.groups,4);
+   b[20] = z.hdrlen;
+   memcpy(b+32,image,z.hdrlen);
+
+   uLong bound = compressBound(z.groupsize);
+   index = calloc(z.groups ? z.groups : 1,8);
+   out = malloc(bound);
+   tmp = malloc(strlen(filename)+5);
+   if ( !index || !out || !tmp )
+   {
+      free(index);
+      free(out);
+      free(tmp);
+      return 1;
+   }
+   sprintf(tmp,"%s.tmp",filename);
+   f = fopen(tmp,"w");
+   if ( !f )
+   {
+      fprintf(stderr,"Unable to write %s\n",tmp);
+      free(index);
+      free(out);
+      free(tmp);
+      return 1;
+   }
+   size_t off = ZATR_INDEX + (size_t)z.groups * 8;
+   r |= fwrite(b,ZATR_INDEX,1,f) != 1;
+   r |= z.groups && fwrite(index,(size_t)z.groups * 8,1,f) != 1; // Filled in below
+   for ( unsigned int g=0;g<z.groups && !r;++g )
+   {
+      const unsigned char *data = image + z.hdrlen + (size_t)g * z.groupsize;
+      unsigned int n = zatr_group_bytes(&z,g);
+      uLongf clen = bound;
+
+      if ( !data[0] && memcmp(data,data+1,n-1) == 0 ) continue; // All zeros
+      if ( compress2(out,&clen,data,n,Z_BEST_COMPRESSION) != Z_OK ) r = 1;
+      else if ( off + clen > 0xffffffffUL ) r = 1;
+      else r |= fwrite(out,clen,1,f) != 1;
+      diff_put(index + (size_t)g * 8,off,4);
+      diff_put(index + (size_t)g * 8 + 4,clen,4);
+      off += clen;
+   }
+   if ( !r && z.groups )
+   {
+      r |= fseek(f,ZATR_INDEX,SEEK_SET) != 0;
+      r |= fwrite(index,(size_t)z.groups * 8,1,f) != 1;
+   }
+   r |= fclose(f) != 0;
+   if ( r )
+   {
+      fprintf(stderr,"Unable to write %s\n",tmp);
+      unlink(tmp);
+   }
+   else
+   {
+      rename(tmp,filename);
+      printf("%lu bytes compressed to %lu bytes in %s\n",(unsigned long)size,(unsigned long)off,filename);
+   }
+   free(index);
+   free(out);
+   free(tmp);
+   return r;
+}
+
+/*
+ * zatr_convert()
+ *
+ * Entry point for --compress and --decompress: write the image given as
+ * a compressed or plain image file.  Either kind of image can be given.
+ */
+int zatr_convert(int count,char *names[])
+{
+   const char *outname = options.compress ? options.compress : options.decompress;
+   struct zatr z;
+   struct stat sb;
+   unsigned char *map,*image;
+   size_t size;
+   int fd,r;
+
+   if ( count != 1 )
+   {
+      fprintf(stderr,"Give exactly one image with --%s\n",options.compress ? "compress" : "decompress");
+      return 1;
+   }
+   fd = open(names[0],O_RDONLY);
+   if ( fd < 0 || fstat(fd,&sb) || !S_ISREG(sb.st_mode) || sb.st_size < 1 )
+   {
+      fprintf(stderr,"Unable to read image %s\n",names[0]);
+      if ( fd >= 0 ) close(fd);
+      return 1;
+   }
+   map = mmap(NULL,sb.st_size,PROT_READ,MAP_SHARED,fd,0);
+   close(fd);
+   if ( map == MAP_FAILED )
+   {
+      fprintf(stderr,"Unable to read image %s\n",names[0]);
+      return 1;
+   }
+   image = map;
+   size = sb.st_size;
+   if ( zatr_parse(&z,map,sb.st_size) == 0 )
+   {
+      image = zatr_decode(&z,map,sb.st_size,names[0]);
+      if ( !image )
+      {
+         munmap(map,sb.st_size);
+         return 1;
+      }
+      size = z.size;
+      free(z.crc);
+   }
+   else if ( sb.st_size >= 8 && memcmp(map,ZATR_MAGIC,8) == 0 )
+   {
+      fprintf(stderr,"Compressed image %s is damaged\n",names[0]);
+      munmap(map,sb.st_size);
+      return 1;
+   }
+
+   if ( options.compress ) r = zatr_write(outname,image,size);
+   else
+   {
+      char *tmp = malloc(strlen(outname)+5);
+      FILE *f;
+      sprintf(tmp,"%s.tmp",outname);
+      f = fopen(tmp,"w");
+      r = !f;
+      if ( f )
+      {
+         r |= size && fwrite(image,size,1,f) != 1;
+         r |= fclose(f) != 0;
+      }
+      if ( r )
+      {
+         fprintf(stderr,"Unable to write %s\n",tmp);
+         unlink(tmp);
+      }
+      else rename(tmp,outname);
+      free(tmp);
+   }
+   if ( image != map ) munmap(image,size ? size : 1);
+   munmap(map,sb.st_size);
+   return r;
+}
@@ -80,6 +80,7 @@ cat ${X/1/2}a ${X/1/2}c > ${X/1/2}
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include "basictokens.h"
 
 /*
  * Data types
@@ -159,17 +160,6 @@ struct token_table {
    struct codeline *lines;
 };
 
-enum basic_mode {
-   auto_detect,
-   atari_basic,
-   turbo_basic_xl,
-   altirra_basic,
-   basic_xl,
-   basic_xe,
-   basic_ap, // BASIC A+ (opcodes/operands in different order)
-   unknown, // opcodes or operands outside of any known implementation
-};
-
 struct basic_program {
    char *filename;
    int fd;
@@ -189,8 +179,6 @@ struct basic_program {
    enum basic_mode compatibility;
    int turbo_basic_compatibility; // True if 'compatibility' could also be Turbo
    int hex_constant_out_of_range;
-   int highest_token;
-   int highest_operand;
    int basic_a_plus_save;
    int normal_save;
 };
@@ -687,51 +675,23 @@ int parse_line(struct basic_program *prog,struct token_table *table,int immediat
 int scan_and_validate_token(struct basic_program *prog,struct token *token)
 {
    // Scan the command to look for non-standard opcodes, operands, and count variable references
-   ++prog->token_use_count[token->token];
+   basic_count_statement(token->raw+1,token->tokenlen-1,prog->token_use_count,prog->operand_use_count,prog->var_use_count);
    if ( token->token == 0x00 || token->token == 0x01 || token->token == 0x37 ) // rem, data, error
    {
-      // 0x37 is wrong for BASIC A+ where it's the 'CP' opcode and 0x53 is 'ERROR-  '
       return 0;
    }
-   if ( token->token > 0x37 ) // nonstandard command
-   {
-      ; // All other BASICs seem to use the same parsing for these
-   }
 
    unsigned char *next=token->operands;
    int len=token->tokenlen-2;
    int minus=0;
 
-   while ( len )
+   while ( len > 0 )
    {
-      if ( *next & 0x80 )
-      {
-         ++prog->var_use_count[*next & 0x7f];
-         ++next;
-         --len;
-         minus=0;
-         continue;
-      }
-      ++prog->operand_use_count[*next];
-      if ( *next == 0x0e && len >= 7 ) // scalar
-      {
-         if ( minus ) ++prog->merge_minus_count;
-         next += 7;
-         len -= 7;
-         minus=0;
-         continue;
-      }
-      if ( *next == 0x0f && len >= 2 && len >= 2 + next[1] ) // string
-      {
-         len -= 2+next[1];
-         next+= 2+next[1];
-         minus=0;
-         continue;
-      }
-      minus=0;
-      if ( *next == 0x36 ) minus=1; // unary minus, 39 in BASIC A+, but 36 there is a string comparison, so we're safe
-      ++next;
-      --len;
+      int n = basic_operand_length(next,len);
+      if ( *next == 0x0e && n == 7 && minus ) ++prog->merge_minus_count; // scalar
+      minus = ( *next == 0x36 ); // unary minus, 39 in BASIC A+, but 36 there is a string comparison, so we're safe
+      next += n;
+      len -= n;
    }
    return 0;
 }
@@ -802,90 +762,7 @@ int parse_immediate(struct basic_program *prog)
 
 void detect_compatibility(struct basic_program *prog)
 {
-   int also_turbo = 1; // Clear if something found not compatible (also implied by 'unknown')
-   prog->compatibility = atari_basic; // This is the starting point
-   prog->highest_token=0;
-   prog->highest_operand=0;
-   for ( int i=0x0;i<256;++i) if ( prog->token_use_count[i] ) prog->highest_token = i;
-   for ( int i=0x0;i<128;++i) if ( prog->operand_use_count[i] ) prog->highest_operand = i;
-
-   for ( int i=0;i<0x11;++i)
-   {
-      if ( !prog->operand_use_count[i] ) continue;
-      if ( i==0xd || i==0xe || i==0xf ) continue; // legal
-      prog->compatibility = unknown; // Illegal operand
-      prog->turbo_basic_compatibility = 0;
-      return;
-   }
-   if ( prog->basic_a_plus_save && prog->highest_token <= 53 && prog->highest_operand <= 61 && !prog->operand_use_count[0x0d] )
-   {
-      prog->compatibility = basic_ap;
-      prog->turbo_basic_compatibility = 0;
-      return;
-   }
-
-   for ( int i=0x38;i<256;++i)
-   {
-      if ( prog->token_use_count[i] )
-      {
-         if ( i >= 0x66 )
-         {
-            prog->compatibility = unknown;  // No known BASIC uses opcodes 0x66 and above
-         }
-         else if ( i >= 0x64 ) { also_turbo = 0; prog->compatibility = basic_xe; } // 'END' token in BASIC XE
-         else if ( i >= 0x59 ) { prog->compatibility = basic_xe; } // both XE and turbo
-         else if ( i >= 0x52 || i == 0x45 || i == 0x42 || i == 0x41 || i == 0x40 || i <= 0x3b )
-         {
-            prog->compatibility = basic_xl;
-         }
-         else
-         {
-            prog->compatibility = altirra_basic;
-         }
-      }
-   }
-   for ( int i=0x55;i<127;++i)
-   {
-      if ( prog->operand_use_count[i] )
-      {
-         if ( i >= 0x6E )
-         {
-            prog->compatibility = unknown;  // No known BASIC uses operands 0x6E and above
-         }
-         else if ( i >= 0x69 ) prog->compatibility = turbo_basic_xl; // Only Turbo BASIC XL uses these
-         else switch (i) {
-               case 0x55:
-               case 0x56:
-               case 0x59:
-               case 0x5B:
-               case 0x5D:
-               case 0x5F:
-               case 0x64:
-               case 0x65:
-               case 0x66:
-               case 0x67:
-               case 0x68: // These are not in Altirra
-                  if ( prog->compatibility == atari_basic || prog->compatibility == altirra_basic )
-                  {
-                     prog->compatibility = basic_xl;
-                  }
-                  break;
-               default: // These are in all extended BASICS
-                  if ( prog->compatibility == atari_basic )
-                  {
-                     prog->compatibility = altirra_basic;
-                  }
-                  break;
-            }
-      }
-   }
-   if ( prog->operand_use_count[0x0d] ) // hex constant
-   {
-      also_turbo = 0;
-      if ( prog->compatibility == atari_basic ) prog->compatibility = altirra_basic;
-   }
-   if ( prog->compatibility == unknown || prog->compatibility == atari_basic ) also_turbo = 0;
-   prog->turbo_basic_compatibility = also_turbo;
+   prog->compatibility = basic_detect_mode(prog->token_use_count,prog->operand_use_count,prog->basic_a_plus_save,&prog->turbo_basic_compatibility);
 }
 
 /*
@@ -910,104 +787,37 @@ void print_atari_string(unsigned char *str,int count)
 
 char *print_atari_float(struct basic_program *prog,struct bcd_float *f,int hex)
 {
-   static char buf[32];
-   char *b = buf;
-   int exp;
-   unsigned long man;
-
-   memset(buf,0,sizeof(buf));
-   //b+=sprintf(buf,"%02x%02x%02x%02x%02x%02x:",f->atarifloat[0],f->atarifloat[1],f->atarifloat[2],f->atarifloat[3],f->atarifloat[4],f->atarifloat[5]); // debug
+   static char buf[BASIC_FLOAT_TEXT];
 
-   if ( f->atarifloat[0]&0x80 )
-   {
-      *b='-';
-      ++b;
-   }
-
-   exp = (f->atarifloat[0]&0x7f);
-   exp -= 64; // exponent in excess 64 notation
-   man = 0;
-   for ( int i=1;i<6;++i )
-   {
-      man *= 100;
-      man += (f->atarifloat[i] / 16) * 10 + (f->atarifloat[i] & 0xf);
-   }
-   if ( !man )
-   {
-      *b='0';
-      return buf;
-   }
-
-   exp -= 4; // 100^4 is implied to put the decimal point after the first byte; normalize man.
-   exp *= 2; // powers of 10 now, not 100
-   while ( man%10 == 0 )
-   {
-      man /= 10;
-      ++exp;
-   }
-
-   /*
-    * Number is now 'man' * 10^'exp'
-    */
-   // Conver to integer if appropriate
-   if ( hex && exp < 4 && !(f->atarifloat[0]&0x80) )
-   {
-      unsigned long m=man; // Don't modify 'man' in case we don't print
-      for (int i=0;i<exp;++i) m *=10;
-      if ( m <= 0xffff )
-      {
-         b+=sprintf(b,"$%04lX",m);
-         return buf;
-      }
-   }
-
-   if ( hex ) ++prog->hex_constant_out_of_range; // Hex constant isn't $0000 through $ffff
+   if ( basic_float_text(buf,f->atarifloat,hex) ) ++prog->hex_constant_out_of_range; // Hex constant isn't $0000 through $ffff
+   return buf;
+}
 
-   // Add a small number (possibly zero) of zeros
-   if ( exp >= 0 && exp < 7 )
-   {
-      b+=sprintf(b,"%lu",man);
-      b+=sprintf(b,"000000"+(6-exp));
-      return buf;
-   }
-   int digits=sprintf(b,"%lu",man); // Just to count the digits; don't adjust 'b'
-   // Print as a regular decimal value
-   if ( exp < 0 && digits+exp > -4 )
-   {
-      if ( digits+exp > 0 ) // digits before the decimal point
-      {
-         // characters are already printed, just move past them
-         b+=digits+exp;
-         *b='.';
-         ++b;
-         // Now remove the leading digits from m
-         int mod=1;
-         for (int i=0;i<-exp;++i ) mod*=10;
-         man=man%mod;
-         b+=sprintf(b,"%lu",man);
-         return buf;
-      }
-      b+=sprintf(b,"0.");
-      b+=sprintf(b,"000000"+(6+(digits+exp)));
-      b+=sprintf(b,"%lu",man);
-      return buf;
-   }
+/*
+ * Output functions for basic_decode_statement()
+ */
+void print_decode_text(void *arg,const char *text)
+{
+   (void)arg;
+   printf("%s",text);
+}
+void print_decode_string(void *arg,const unsigned char *str,int count)
+{
+   (void)arg;
+   print_atari_string((unsigned char *)str,count);
+}
+void print_decode_number(void *arg,const unsigned char *bcd,int hex)
+{
+   printf("%s",print_atari_float(arg,(void *)bcd,hex));
+}
+void print_decode_variable(void *arg,int var)
+{
+   struct basic_program *prog = arg;
 
-   // Print it as x.xxxE+xx
-   ++b;
-   if ( digits > 1 )
-   {
-      sprintf(b,"%lu",man);
-      *b='.'; // clobber duplicated first digit
-      b+=digits;
-   }
-   *b='E';
-   ++b;
-   exp+=digits-1;
-   b+=sprintf(b,exp>0?"+":"-");
-   b+=sprintf(b,"%02d",abs(exp));
-   return buf;
+   if ( var < prog->vnt.vnt_entry_count ) printf("%s",prog->vnt.vname[var]);
+   else printf("_var_%d",var);
 }
+
 void print_token(struct basic_program *prog,struct token *token)
 {
    enum basic_mode mode = display_mode;
@@ -1016,512 +826,9 @@ void print_token(struct basic_program *prog,struct token *token)
       mode = prog->compatibility;
       if ( mode == unknown ) mode = basic_xe; // Seems like the best guess
    }
+   const struct basic_decode out = { prog,print_decode_text,print_decode_string,print_decode_number,print_decode_variable };
 
-   char *command_name[] = {
-      "REM",
-      "DATA",
-      "INPUT",
-      "COLOR",
-      "LIST",
-      "ENTER",
-      "LET",
-      "IF",
-      "FOR",
-      "NEXT",
-      "GOTO",
-      "GO TO",
-      "GOSUB",
-      "TRAP",
-      "BYE",
-      "CONT",
-      "COM",
-      "CLOSE",
-      "CLR",
-      "DEG",
-      "DIM",
-      "END",
-      "NEW",
-      "OPEN",
-      "LOAD",
-      "SAVE",
-      "STATUS",
-      "NOTE",
-      "POINT",
-      "XIO",
-      "ON",
-      "POKE",
-      "PRINT",
-      "RAD",
-      "READ",
-      "RESTORE",
-      "RETURN",
-      "RUN",
-      "STOP",
-      "POP",
-      "?",
-      "GET",
-      "PUT",
-      "GRAPHICS",
-      "PLOT",
-      "POSITION",
-      "DOS",
-      "DRAWTO",
-      "SETCOLOR",
-      "LOCATE",
-      "SOUND",
-      "LPRINT",
-      "CSAVE",
-      "CLOAD",
-      "", // implied LET
-      "ERROR-  ", // 37
-   };
-   char *command_name_turbo_basic_xl[] = {
-      // https://github.com/rossumur/esp_8_bit/blob/master/atr_image_explorer.htm
-      // Verified with direct testing
-      "DPOKE", // 38
-      "MOVE","-MOVE","*F",
-      "REPEAT", // 3C
-      "UNTIL","WHILE","WEND",
-      "ELSE","ENDIF","BPUT","BGET","FILLTO","DO","LOOP","EXIT",
-      "DIR","LOCK","UNLOCK","RENAME","DELETE","PAUSE","TIME$=","PROC",
-      "  EXEC", // 50 (yes, it has two leading spaces)
-      "ENDPROC","FCOLOR",
-      "*L", // 53
-      "------------------------------", // 54 (30 dashes, ignores operands; enter two or more dashes and this is produced)
-      "RENUM","DEL","DUMP",
-      "TRACE","TEXT","BLOAD","BRUN","GO#","#", "*B","PAINT",
-      "CLS","DSOUND","CIRCLE",
-      "%PUT", // 63
-      // 64 on up are garbage
-   };
-   // BASIC XL 1.03 is mostly a subset of BASIC XE except for NUM and END
-   char *command_name_basic_xe[] = {
-      // https://www.virtualdub.org/downloads/Altirra%20BASIC%20Reference%20Manual.pdf
-      // I created a file a sequence of extended opcodes, then did a list to see what they were for BASIC XE and BASIC XL 1.03
-      "WHILE",    // 38, not in Altirra (with two spaces at the start in XL but not XE)
-      "ENDWHILE", // 39, not in Altirra (with two spaces at the start in XL but not XE)
-      "TRACEOFF", // 3A, not in Altirra
-      "TRACE", // 3B, not in Altirra
-      "ELSE", // 3C
-      "ENDIF",
-      "DPOKE",
-      "LOMEM", // 3F
-      "DEL",  // 40, not in Altirra
-      "RPUT", // 41, not in Altirra
-      "RGET", // 42, not in Altirra
-      "BPUT",
-      "BGET",
-      "TAB",  // 45, not in Altirra
-      "CP",
-      "ERASE",
-      "PROTECT",
-      "UNPROTECT",
-      "DIR",
-      "RENAME",
-      "MOVE",
-      "MISSILE",
-      "PMCLR",
-      "PMCOLOR",
-      "PMGRAPHICS",
-      "PMMOVE", // 51, last command also in Altirra
-      "PMWIDTH",
-      "SET",
-      "LVAR",
-      "RENUM", // 55
-      "FAST",  // 56 last one that is the same on BASIC XL (1.03)
-      "LOCAL", // 57 BASIC XL has this as "NUM"
-      "EXTEND", // 58 BASIC XL has this as "END"
-      "PROCEDURE", // 59 BASIC XL displays garbage ("-?")
-      " ", // 5A Listing displays as two spaces (intentional indentation?) // BASIC XL generates error 100 when listing
-      "", // 5B Listing displays as one space
-      "", // 5C Listing displays as one space
-      "", // 5D Listing displays as one space
-      "EXIT",
-      "NUM",
-      "HITCLR",
-      "INVERSE",
-      "NORMAL",
-      "BLOAD",
-      "END", // Are these real?  Two new contexts for END?
-      "END", // yes, same as previous, not sure if this is real
-      // 0x66 displays garbage
-      // 0x67 generates error 100 when listing
-
-   };
-   char *command_name_basic_a_plus[] = {
-      "REM",
-      "DATA",
-      "INPUT",
-      "LIST",
-      "ENTER",
-      "LET",
-      "IF",
-      "FOR",
-      "  NEXT",
-      "GOTO",
-      "RENUM",
-      "GOSUB",
-      "TRAP",
-      "BYE",
-      "CONT",
-      "CLOSE",
-      "CLR", // 10
-      "DEG",
-      "DIM",
-      "WHILE",
-      "  ENDWHILE",
-      "TRACEOFF",
-      "TRACE",
-      "ELSE",
-      "ENDIF",
-      "END", // 19
-      "NEW",
-      "OPEN",
-      "LOAD",
-      "SAVE", // 1D
-      "STATUS",
-      "NOTE",
-      "POINT", //20
-      "XIO",
-      "ON",
-      "POKE",
-      "DPOKE",
-      "PRINT",
-      "RAD",
-      "READ",
-      "RESTORE",
-      "RETURN",
-      "RUN",
-      "STOP",
-      "POP",
-      "?",
-      "GET",
-      "PUT",
-      "LOMEM", // 30
-      "DEL",
-      "RPUT", // 32
-      "RGET",
-      "BPUT",
-      "BGET",
-      "TAB",
-      "CP", // 37
-      "DOS",
-      "ERASE",
-      "PROTECT",
-      "UNPROTECT",
-      "DIR",
-      "RENAME",
-      "MOVE",
-      "COLOR",
-      "GRAPHICS",
-      "PLOT",
-      "POSITION",
-      "DRAWTO",
-      "SETCOLOR",
-      "LOCATE",
-      "SOUND",
-      "LPRINT",
-      "CSAVE", // 48
-      "CLOAD",
-      "MISSILE",
-      "PMCLR",
-      "PMCOLOR",
-      "PMGRAPHICS",
-      "PMMOVE",
-      "PMWIDTH", // 4F
-      "SET",
-      "LVAR",
-      "", // 52 (implied let?)
-      "ERROR-  ", // 53 last opcode
-   };
-
-   char *operand_name[] = {
-      ",", // starting at 0x12
-      "$",
-      ":", // statement end
-      ";",
-      "", // line end
-      " GOTO ",
-      " GOSUB ",
-      " TO ",
-      " STEP ",
-      " THEN ",
-      "#",
-      "<=",
-      "<>",
-      ">=",
-      "<",
-      ">",
-      "=",
-      " ", // What is this?
-      "*",
-      "+",
-      "-",
-      "/",
-      " NOT ",
-      " OR ",
-      " AND ",
-      "(",
-      ")",
-      "=", // numeric assign
-      "=", // string assign
-      "<=", // string
-      "<>",
-      ">=",
-      "<",
-      ">",
-      "=",
-      "+", // unary
-      "-", // 36
-      "(", // string
-      "(", // array
-      "(", // dim array
-      "(", // function
-      "(", // dim string
-      ",", // array
-      "STR$",
-      "CHR$",
-      "USR",
-      "ASC",
-      "VAL",
-      "LEN",
-      "ADR",
-      "ATN",
-      "COS",
-      "PEEK",
-      "SIN",
-      "RND",
-      "FRE",
-      "EXP",
-      "LOG",
-      "CLOG",
-      "SQR",
-      "SGN",
-      "ABS",
-      "INT",
-      "PADDLE",
-      "STICK",
-      "PTRIG",
-      "STRIG", // 54
-   };
-   char *operand_name_turbo_basic_xl[] = {
-      // https://github.com/rossumur/esp_8_bit/blob/master/atr_image_explorer.htm
-      // verified and corrected spaces with manual testing
-      "DPEEK", // 55
-      "&","!","INSTR","INKEY$"," EXOR ","HEX$","DEC",
-      " DIV ","FRAC","TIME$","TIME"," MOD "," EXEC ","RND","RAND",
-      "TRUNC","%0","%1","%2","%3"," GO# ","UINSTR","ERR",
-      "ERL", // 6D
-   };
-   char *operand_name_basic_xe[] = { // A subset of BASIC XL/XE
-      // https://www.virtualdub.org/downloads/Altirra%20BASIC%20Reference%20Manual.pdf
-      // manual testing in BASIC XL/XE; both are the same for opcodes
-      " USING", // 55, not in Altirra
-      "%", // 56
-      "!",
-      "&",
-      ";", // 59, not in Altirra
-      "BUMP(",
-      "FIND(", // 5B, not in Altirra
-      "HEX$",
-      "RANDOM(", // 5D, not in Altirra
-      "DPEEK",
-      "SYS", // 5F, not in Altirra
-      "VSTICK",
-      "HSTICK",
-      "PMADR",
-      "ERR", // 63, last one in Altirra
-      "TAB", // 64
-      "PEN",
-      "LEFT$(",
-      "RIGHT$(",
-      "MID$(", // 68
-      // opcode 69 causes BASIC XE to hang when listing
-   };
-   char *operand_name_basic_a_plus[] = {
-      ",", // starting at 0x12
-      "$",
-      ":", // statement end
-      ";",
-      "", // line end
-      " GOTO ",
-      " GOSUB ",
-      " TO ",
-      " STEP ",
-      " THEN ",
-      " USING ", // 1C
-      "#",
-      "<=",
-      "<>",
-      ">=",
-      "<",
-      ">",
-      "=",
-      "^", // 24
-      "*",
-      "+",
-      "-",
-      "/",
-      " NOT ",
-      " OR ",
-      " AND ",
-      "!", // 2C
-      "&", // 2D
-      "(",
-      ")",
-      "=", // numeric assign
-      "=", // string assign
-      "<=", // string
-      "<>", // 33
-      ">=",
-      "<",
-      ">",
-      "=",
-      "+", // unary
-      "-", // 39
-      "(", // string
-      "", // array
-      "", // dim array
-      "(", // function
-      "(", // dim string
-      ",", // array
-      "STR$",
-      "CHR$",
-      "USR",
-      "ASC",
-      "VAL",
-      "LEN",
-      "ADR",
-      "BUMP", // 47
-      "FIND",
-      "DPEEK", //49
-      "ATN",
-      "COS",
-      "PEEK",
-      "SIN",
-      "RND",
-      "FRE",
-      "EXP(", // 50
-      "LOG(",
-      "CLOG(",
-      "SQR(",
-      "SGN(",
-      "ABS(",
-      "INT(",
-      "SYS(",
-      "PADDLE(",
-      "STICK(",
-      "PTRIG(",
-      "STRIG(",
-      "VSTICK(",
-      "HSTICK(",
-      "PMADR(",
-      "ERR(", // 5F
-      "TAB(", // 60
-      "PEN(", // 61 last opcode
-   };
-
-   if ( mode == basic_ap && token->token < sizeof(command_name_basic_a_plus)/sizeof(command_name_basic_a_plus[0])  )
-   {
-      printf("%s",command_name_basic_a_plus[token->token]);
-      if ( *command_name_basic_a_plus[token->token] ) printf(" "); // no space after implied let
-   }
-   else if ( token->token < sizeof(command_name)/sizeof(command_name[0]) )
-   {
-      printf("%s",command_name[token->token]);
-      if ( *command_name[token->token] ) printf(" "); // no space after implied let
-   }
-   else if ( mode == basic_xl && token->token == 0x57 )
-   {
-      printf("NUM"); // "LOCAL" in BASIC XE
-   }
-   else if ( mode == basic_xl && token->token == 0x58 )
-   {
-      printf("END"); // "EXTEND" in BASIC XE
-   }
-   else if ( ( mode == altirra_basic || mode == basic_xl || mode == basic_xe ) && token->token - sizeof(command_name)/sizeof(command_name[0]) < sizeof(command_name_basic_xe)/sizeof(command_name_basic_xe[0]) )
-   {
-      printf("%s",command_name_basic_xe[token->token - sizeof(command_name)/sizeof(command_name[0])]);
-   }
-   else if ( ( mode == turbo_basic_xl ) && token->token - sizeof(command_name)/sizeof(command_name[0]) < sizeof(command_name_turbo_basic_xl)/sizeof(command_name_turbo_basic_xl[0]) )
-   {
-      printf("%s",command_name_turbo_basic_xl[token->token - sizeof(command_name)/sizeof(command_name[0])]);
-   }
-   else
-   {
-      printf("(command %02x) ",token->token);
-   }
-
-   // Print operands
-   // REM, DATA, and ERROR are special
-   if ( token->token == 0x00 || token->token == 0x01 || (token->token == 0x37 && mode != basic_ap) || (token->token == 0x53 && mode == basic_ap) ) // rem, data, error
-   {
-      print_atari_string(token->operands,token->tokenlen-3);
-      return;
-   }
-
-   unsigned char *next=token->operands;
-   int len=token->tokenlen-2;
-
-   while ( len )
-   {
-      if ( *next & 0x80 )
-      {
-         if ( (*next & 0x7f) < prog->vnt.vnt_entry_count )
-         {
-            printf("%s",prog->vnt.vname[*next & 0x7f]);
-         }
-         else
-         {
-            printf("_var_%d",*next & 0x7f);
-         }
-         ++next;
-         --len;
-      }
-      else if ( (*next == 0x0e || *next == 0x0d) && len >= 7 ) // 0D is a float displayed as hex in Altirra, XL, and XE BASICS
-      {
-         printf("%s",print_atari_float(prog,(void *)next+1,(*next == 0x0d)) );
-         next += 7;
-         len -= 7;
-      }
-      else if ( *next == 0x0f && len >= 2 && len >= 2 + next[1] )
-      {
-         printf("%c",'"');
-         print_atari_string(&next[2],next[1]);
-         printf("%c",'"');
-         len -= 2+next[1];
-         next+= 2+next[1];
-      }
-      else if ( mode == basic_ap &&  *next - (unsigned)0x12 < sizeof(operand_name_basic_a_plus)/sizeof(operand_name_basic_a_plus[0]) )
-      {
-         printf("%s",operand_name_basic_a_plus[*next-0x12]);
-         ++next;
-         --len;
-      }
-      else if ( *next - (unsigned)0x12 < sizeof(operand_name)/sizeof(operand_name[0]) )
-      {
-         printf("%s",operand_name[*next-0x12]);
-         ++next;
-         --len;
-      }
-      else if ( ( mode == altirra_basic || mode == basic_xl || mode == basic_xe ) && *next - sizeof(operand_name)/sizeof(operand_name[0]) < sizeof(operand_name_basic_xe)/sizeof(operand_name_basic_xe[0]) )
-      {
-         printf("%s",operand_name_basic_xe[*next - 0x12 - sizeof(operand_name)/sizeof(operand_name[0])]);
-         ++next;
-         --len;
-      }
-      else if ( ( mode == turbo_basic_xl ) && *next - sizeof(operand_name)/sizeof(operand_name[0]) < sizeof(operand_name_turbo_basic_xl)/sizeof(operand_name_turbo_basic_xl[0]) )
-      {
-         printf("%s",operand_name_turbo_basic_xl[*next - 0x12 - sizeof(operand_name)/sizeof(operand_name[0])]);
-         ++next;
-         --len;
-      }
-      else
-      {
-         printf("(operand %02x)",*next);
-         break;
-      }
-   }
+   basic_decode_statement(mode,token->raw+1,token->tokenlen-1,&out);
 }
 
 void print_line(struct basic_program *prog,struct codeline *line)
@@ -0,0 +1,769 @@
+/*
+ * basictokens.h
+ *
+ * Token names and statement decoding for Atari BASIC and the extended
+ * BASICs, shared by basicanalyzer.c and atrfs (for .lst views).  The
+ * caller supplies the output functions, so each program can show strings
+ * and numbers its own way.
+ *
+ * Usage: count the tokens in the whole program with basic_count_statement(),
+ * pick the dialect with basic_detect_mode(), and then list each statement
+ * with basic_decode_statement().
+ *
+ * Copyright 2023
+ * Preston Crow
+ *
+ * Released under the GPL version 2.0
+ */
+
+#ifndef BASICTOKENS_H
+#define BASICTOKENS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Macros and defines
+ */
+#define BASIC_COUNT(_a) ((int)(sizeof(_a)/sizeof((_a)[0])))
+#define BASIC_FLOAT_TEXT 48 // Buffer size for basic_float_text()
+
+/*
+ * Data types
+ */
+enum basic_mode {
+   auto_detect,
+   atari_basic,
+   turbo_basic_xl,
+   altirra_basic,
+   basic_xl,
+   basic_xe,
+   basic_ap, // BASIC A+ (opcodes/operands in different order)
+   unknown, // opcodes or operands outside of any known implementation
+};
+
+// Output for basic_decode_statement()
+struct basic_decode {
+   void *arg; // Passed to each function
+   void (*text)(void *arg,const char *text); // Token names and punctuation
+   void (*string)(void *arg,const unsigned char *str,int count); // REM, DATA, and string constants (quotes are sent as text)
+   void (*number)(void *arg,const unsigned char *bcd,int hex); // Six-byte constant; 'hex' for operand 0x0d
+   void (*variable)(void *arg,int var); // Index into the variable name table
+};
+
+/*
+ * Token names
+ */
+static const char *const basic_command_names[] = {
+   "REM",
+   "DATA",
+   "INPUT",
+   "COLOR",
+   "LIST",
+   "ENTER",
+   "LET",
+   "IF",
+   "FOR",
+   "NEXT",
+   "GOTO",
+   "GO TO",
+   "GOSUB",
+   "TRAP",
+   "BYE",
+   "CONT",
+   "COM",
+   "CLOSE",
+   "CLR",
+   "DEG",
+   "DIM",
+   "END",
+   "NEW",
+   "OPEN",
+   "LOAD",
+   "SAVE",
+   "STATUS",
+   "NOTE",
+   "POINT",
+   "XIO",
+   "ON",
+   "POKE",
+   "PRINT",
+   "RAD",
+   "READ",
+   "RESTORE",
+   "RETURN",
+   "RUN",
+   "STOP",
+   "POP",
+   "?",
+   "GET",
+   "PUT",
+   "GRAPHICS",
+   "PLOT",
+   "POSITION",
+   "DOS",
+   "DRAWTO",
+   "SETCOLOR",
+   "LOCATE",
+   "SOUND",
+   "LPRINT",
+   "CSAVE",
+   "CLOAD",
+   "", // implied LET
+   "ERROR-  ", // 37
+};
+static const char *const basic_command_names_turbo_basic_xl[] = {
+   // https://github.com/rossumur/esp_8_bit/blob/master/atr_image_explorer.htm
+   // Verified with direct testing
+   "DPOKE", // 38
+   "MOVE","-MOVE","*F",
+   "REPEAT", // 3C
+   "UNTIL","WHILE","WEND",
+   "ELSE","ENDIF","BPUT","BGET","FILLTO","DO","LOOP","EXIT",
+   "DIR","LOCK","UNLOCK","RENAME","DELETE","PAUSE","TIME$=","PROC",
+   "  EXEC", // 50 (yes, it has two leading spaces)
+   "ENDPROC","FCOLOR",
+   "*L", // 53
+   "------------------------------", // 54 (30 dashes, ignores operands; enter two or more dashes and this is produced)
+   "RENUM","DEL","DUMP",
+   "TRACE","TEXT","BLOAD","BRUN","GO#","#", "*B","PAINT",
+   "CLS","DSOUND","CIRCLE",
+   "%PUT", // 63
+   // 64 on up are garbage
+};
+// BASIC XL 1.03 is mostly a subset of BASIC XE except for NUM and END
+static const char *const basic_command_names_basic_xe[] = {
+   // https://www.virtualdub.org/downloads/Altirra%20BASIC%20Reference%20Manual.pdf
+   // I created a file a sequence of extended opcodes, then did a list to see what they were for BASIC XE and BASIC XL 1.03
+   "WHILE",    // 38, not in Altirra (with two spaces at the start in XL but not XE)
+   "ENDWHILE", // 39, not in Altirra (with two spaces at the start in XL but not XE)
+   "TRACEOFF", // 3A, not in Altirra
+   "TRACE", // 3B, not in Altirra
+   "ELSE", // 3C
+   "ENDIF",
+   "DPOKE",
+   "LOMEM", // 3F
+   "DEL",  // 40, not in Altirra
+   "RPUT", // 41, not in Altirra
+   "RGET", // 42, not in Altirra
+   "BPUT",
+   "BGET",
+   "TAB",  // 45, not in Altirra
+   "CP",
+   "ERASE",
+   "PROTECT",
+   "UNPROTECT",
+   "DIR",
+   "RENAME",
+   "MOVE",
+   "MISSILE",
+   "PMCLR",
+   "PMCOLOR",
+   "PMGRAPHICS",
+   "PMMOVE", // 51, last command also in Altirra
+   "PMWIDTH",
+   "SET",
+   "LVAR",
+   "RENUM", // 55
+   "FAST",  // 56 last one that is the same on BASIC XL (1.03)
+   "LOCAL", // 57 BASIC XL has this as "NUM"
+   "EXTEND", // 58 BASIC XL has this as "END"
+   "PROCEDURE", // 59 BASIC XL displays garbage ("-?")
+   " ", // 5A Listing displays as two spaces (intentional indentation?) // BASIC XL generates error 100 when listing
+   "", // 5B Listing displays as one space
+   "", // 5C Listing displays as one space
+   "", // 5D Listing displays as one space
+   "EXIT",
+   "NUM",
+   "HITCLR",
+   "INVERSE",
+   "NORMAL",
+   "BLOAD",
+   "END", // Are these real?  Two new contexts for END?
+   "END", // yes, same as previous, not sure if this is real
+   // 0x66 displays garbage
+   // 0x67 generates error 100 when listing
+};
+static const char *const basic_command_names_basic_a_plus[] = {
+   "REM",
+   "DATA",
+   "INPUT",
+   "LIST",
+   "ENTER",
+   "LET",
+   "IF",
+   "FOR",
+   "  NEXT",
+   "GOTO",
+   "RENUM",
+   "GOSUB",
+   "TRAP",
+   "BYE",
+   "CONT",
+   "CLOSE",
+   "CLR", // 10
+   "DEG",
+   "DIM",
+   "WHILE",
+   "  ENDWHILE",
+   "TRACEOFF",
+   "TRACE",
+   "ELSE",
+   "ENDIF",
+   "END", // 19
+   "NEW",
+   "OPEN",
+   "LOAD",
+   "SAVE", // 1D
+   "STATUS",
+   "NOTE",
+   "POINT", //20
+   "XIO",
+   "ON",
+   "POKE",
+   "DPOKE",
+   "PRINT",
+   "RAD",
+   "READ",
+   "RESTORE",
+   "RETURN",
+   "RUN",
+   "STOP",
+   "POP",
+   "?",
+   "GET",
+   "PUT",
+   "LOMEM", // 30
+   "DEL",
+   "RPUT", // 32
+   "RGET",
+   "BPUT",
+   "BGET",
+   "TAB",
+   "CP", // 37
+   "DOS",
+   "ERASE",
+   "PROTECT",
+   "UNPROTECT",
+   "DIR",
+   "RENAME",
+   "MOVE",
+   "COLOR",
+   "GRAPHICS",
+   "PLOT",
+   "POSITION",
+   "DRAWTO",
+   "SETCOLOR",
+   "LOCATE",
+   "SOUND",
+   "LPRINT",
+   "CSAVE", // 48
+   "CLOAD",
+   "MISSILE",
+   "PMCLR",
+   "PMCOLOR",
+   "PMGRAPHICS",
+   "PMMOVE",
+   "PMWIDTH", // 4F
+   "SET",
+   "LVAR",
+   "", // 52 (implied let?)
+   "ERROR-  ", // 53 last opcode
+};
+
+static const char *const basic_operand_names[] = {
+   ",", // starting at 0x12
+   "$",
+   ":", // statement end
+   ";",
+   "", // line end
+   " GOTO ",
+   " GOSUB ",
+   " TO ",
+   " STEP ",
+   " THEN ",
+   "#",
+   "<=",
+   "<>",
+   ">=",
+   "<",
+   ">",
+   "=",
+   " ", // What is this?
+   "*",
+   "+",
+   "-",
+   "/",
+   " NOT ",
+   " OR ",
+   " AND ",
+   "(",
+   ")",
+   "=", // numeric assign
+   "=", // string assign
+   "<=", // string
+   "<>",
+   ">=",
+   "<",
+   ">",
+   "=",
+   "+", // unary
+   "-", // 36
+   "(", // string
+   "(", // array
+   "(", // dim array
+   "(", // function
+   "(", // dim string
+   ",", // array
+   "STR$",
+   "CHR$",
+   "USR",
+   "ASC",
+   "VAL",
+   "LEN",
+   "ADR",
+   "ATN",
+   "COS",
+   "PEEK",
+   "SIN",
+   "RND",
+   "FRE",
+   "EXP",
+   "LOG",
+   "CLOG",
+   "SQR",
+   "SGN",
+   "ABS",
+   "INT",
+   "PADDLE",
+   "STICK",
+   "PTRIG",
+   "STRIG", // 54
+};
+static const char *const basic_operand_names_turbo_basic_xl[] = {
+   // https://github.com/rossumur/esp_8_bit/blob/master/atr_image_explorer.htm
+   // verified and corrected spaces with manual testing
+   "DPEEK", // 55
+   "&","!","INSTR","INKEY$"," EXOR ","HEX$","DEC",
+   " DIV ","FRAC","TIME$","TIME"," MOD "," EXEC ","RND","RAND",
+   "TRUNC","%0","%1","%2","%3"," GO# ","UINSTR","ERR",
+   "ERL", // 6D
+};
+static const char *const basic_operand_names_basic_xe[] = { // A subset of BASIC XL/XE
+   // https://www.virtualdub.org/downloads/Altirra%20BASIC%20Reference%20Manual.pdf
+   // manual testing in BASIC XL/XE; both are the same for opcodes
+   " USING", // 55, not in Altirra
+   "%", // 56
+   "!",
+   "&",
+   ";", // 59, not in Altirra
+   "BUMP(",
+   "FIND(", // 5B, not in Altirra
+   "HEX$",
+   "RANDOM(", // 5D, not in Altirra
+   "DPEEK",
+   "SYS", // 5F, not in Altirra
+   "VSTICK",
+   "HSTICK",
+   "PMADR",
+   "ERR", // 63, last one in Altirra
+   "TAB", // 64
+   "PEN",
+   "LEFT$(",
+   "RIGHT$(",
+   "MID$(", // 68
+   // opcode 69 causes BASIC XE to hang when listing
+};
+static const char *const basic_operand_names_basic_a_plus[] = {
+   ",", // starting at 0x12
+   "$",
+   ":", // statement end
+   ";",
+   "", // line end
+   " GOTO ",
+   " GOSUB ",
+   " TO ",
+   " STEP ",
+   " THEN ",
+   " USING ", // 1C
+   "#",
+   "<=",
+   "<>",
+   ">=",
+   "<",
+   ">",
+   "=",
+   "^", // 24
+   "*",
+   "+",
+   "-",
+   "/",
+   " NOT ",
+   " OR ",
+   " AND ",
+   "!", // 2C
+   "&", // 2D
+   "(",
+   ")",
+   "=", // numeric assign
+   "=", // string assign
+   "<=", // string
+   "<>", // 33
+   ">=",
+   "<",
+   ">",
+   "=",
+   "+", // unary
+   "-", // 39
+   "(", // string
+   "", // array
+   "", // dim array
+   "(", // function
+   "(", // dim string
+   ",", // array
+   "STR$",
+   "CHR$",
+   "USR",
+   "ASC",
+   "VAL",
+   "LEN",
+   "ADR",
+   "BUMP", // 47
+   "FIND",
+   "DPEEK", //49
+   "ATN",
+   "COS",
+   "PEEK",
+   "SIN",
+   "RND",
+   "FRE",
+   "EXP(", // 50
+   "LOG(",
+   "CLOG(",
+   "SQR(",
+   "SGN(",
+   "ABS(",
+   "INT(",
+   "SYS(",
+   "PADDLE(",
+   "STICK(",
+   "PTRIG(",
+   "STRIG(",
+   "VSTICK(",
+   "HSTICK(",
+   "PMADR(",
+   "ERR(", // 5F
+   "TAB(", // 60
+   "PEN(", // 61 last opcode
+};
+
+/*
+ * Functions
+ */
+
+/*
+ * basic_command_name()
+ *
+ * Name of a statement token in the given dialect, or NULL if unknown
+ */
+static const char *basic_command_name(enum basic_mode mode,int token)
+{
+   const int extended = token - BASIC_COUNT(basic_command_names);
+
+   if ( mode == basic_ap )
+   {
+      if ( token < BASIC_COUNT(basic_command_names_basic_a_plus) ) return basic_command_names_basic_a_plus[token];
+      return NULL;
+   }
+   if ( extended < 0 ) return basic_command_names[token];
+   if ( mode == basic_xl && token == 0x57 ) return "NUM"; // "LOCAL" in BASIC XE
+   if ( mode == basic_xl && token == 0x58 ) return "END"; // "EXTEND" in BASIC XE
+   if ( ( mode == altirra_basic || mode == basic_xl || mode == basic_xe ) && extended < BASIC_COUNT(basic_command_names_basic_xe) )
+   {
+      return basic_command_names_basic_xe[extended];
+   }
+   if ( mode == turbo_basic_xl && extended < BASIC_COUNT(basic_command_names_turbo_basic_xl) )
+   {
+      return basic_command_names_turbo_basic_xl[extended];
+   }
+   return NULL;
+}
+
+/*
+ * basic_operand_name()
+ *
+ * Name of an operator or function token in the given dialect, or NULL if
+ * unknown
+ */
+static const char *basic_operand_name(enum basic_mode mode,int operand)
+{
+   const int index = operand - 0x12;
+   const int extended = index - BASIC_COUNT(basic_operand_names);
+
+   if ( index < 0 ) return NULL; // Constants, or not valid
+   if ( mode == basic_ap )
+   {
+      if ( index < BASIC_COUNT(basic_operand_names_basic_a_plus) ) return basic_operand_names_basic_a_plus[index];
+      return NULL;
+   }
+   if ( extended < 0 ) return basic_operand_names[index];
+   if ( ( mode == altirra_basic || mode == basic_xl || mode == basic_xe ) && extended < BASIC_COUNT(basic_operand_names_basic_xe) )
+   {
+      return basic_operand_names_basic_xe[extended];
+   }
+   if ( mode == turbo_basic_xl && extended < BASIC_COUNT(basic_operand_names_turbo_basic_xl) )
+   {
+      return basic_operand_names_turbo_basic_xl[extended];
+   }
+   return NULL;
+}
+
+/*
+ * basic_text_command()
+ *
+ * True for REM, DATA, and ERROR, which hold text up to the end of line
+ */
+static int basic_text_command(enum basic_mode mode,int token)
+{
+   // 0x37 is the 'CP' opcode in BASIC A+, where 0x53 is 'ERROR-  '
+   return ( token == 0x00 || token == 0x01 || (token == 0x37 && mode != basic_ap) || (token == 0x53 && mode == basic_ap) );
+}
+
+/*
+ * basic_operand_length()
+ *
+ * Bytes in the operand at 'next' with 'len' bytes left in the statement:
+ * a variable, a six-byte constant (0x0e, or 0x0d for hex), a string
+ * constant, or an operator or function.
+ */
+static int basic_operand_length(const unsigned char *next,int len)
+{
+   if ( *next & 0x80 ) return 1; // variable
+   if ( (*next == 0x0e || *next == 0x0d) && len >= 7 ) return 7; // 0D is a float displayed as hex in Turbo, Altirra, XL, and XE BASICS
+   if ( *next == 0x0f && len >= 2 && len >= 2 + next[1] ) return 2 + next[1];
+   return 1;
+}
+
+/*
+ * basic_count_statement()
+ *
+ * Count the tokens in one statement (the token byte followed by its
+ * operands) for basic_detect_mode().  'var_use_count' may be NULL.
+ */
+static void basic_count_statement(const unsigned char *stmt,int len,int *token_use_count,int *operand_use_count,int *var_use_count)
+{
+   ++token_use_count[stmt[0]];
+   // rem, data, error; 0x37 is wrong for BASIC A+, but the dialect isn't known yet
+   if ( stmt[0] == 0x00 || stmt[0] == 0x01 || stmt[0] == 0x37 ) return;
+   for ( ++stmt,--len;len>0; )
+   {
+      int n = basic_operand_length(stmt,len);
+      if ( *stmt & 0x80 )
+      {
+         if ( var_use_count ) ++var_use_count[*stmt & 0x7f];
+      }
+      else ++operand_use_count[*stmt];
+      stmt += n;
+      len -= n;
+   }
+}
+
+/*
+ * basic_detect_mode()
+ *
+ * Work out which BASIC a program was written for from its token counts.
+ * '*also_turbo' is set if Turbo BASIC XL would also list it.
+ * 'basic_a_plus_save' is set if the immediate line saved with the BASIC
+ * A+ SAVE token.
+ */
+static enum basic_mode basic_detect_mode(const int *token_use_count,const int *operand_use_count,int basic_a_plus_save,int *also_turbo)
+{
+   enum basic_mode compatibility = atari_basic; // This is the starting point
+   int highest_token=0;
+   int highest_operand=0;
+
+   *also_turbo = 1; // Clear if something found not compatible (also implied by 'unknown')
+   for ( int i=0x0;i<256;++i) if ( token_use_count[i] ) highest_token = i;
+   for ( int i=0x0;i<128;++i) if ( operand_use_count[i] ) highest_operand = i;
+
+   for ( int i=0;i<0x11;++i)
+   {
+      if ( !operand_use_count[i] ) continue;
+      if ( i==0xd || i==0xe || i==0xf ) continue; // legal
+      *also_turbo = 0;
+      return unknown; // Illegal operand
+   }
+   if ( basic_a_plus_save && highest_token <= 53 && highest_operand <= 61 && !operand_use_count[0x0d] )
+   {
+      *also_turbo = 0;
+      return basic_ap;
+   }
+
+   for ( int i=0x38;i<256;++i)
+   {
+      if ( token_use_count[i] )
+      {
+         if ( i >= 0x66 )
+         {
+            compatibility = unknown;  // No known BASIC uses opcodes 0x66 and above
+         }
+         else if ( i >= 0x64 ) { *also_turbo = 0; compatibility = basic_xe; } // 'END' token in BASIC XE
+         else if ( i >= 0x59 ) { compatibility = basic_xe; } // both XE and turbo
+         else if ( i >= 0x52 || i == 0x45 || i == 0x42 || i == 0x41 || i == 0x40 || i <= 0x3b )
+         {
+            compatibility = basic_xl;
+         }
+         else
+         {
+            compatibility = altirra_basic;
+         }
+      }
+   }
+   for ( int i=0x55;i<127;++i)
+   {
+      if ( operand_use_count[i] )
+      {
+         if ( i >= 0x6E )
+         {
+            compatibility = unknown;  // No known BASIC uses operands 0x6E and above
+         }
+         else if ( i >= 0x69 ) compatibility = turbo_basic_xl; // Only Turbo BASIC XL uses these
+         else switch (i) {
+               case 0x55:
+               case 0x56:
+               case 0x59:
+               case 0x5B:
+               case 0x5D:
+               case 0x5F:
+               case 0x64:
+               case 0x65:
+               case 0x66:
+               case 0x67:
+               case 0x68: // These are not in Altirra
+                  if ( compatibility == atari_basic || compatibility == altirra_basic )
+                  {
+                     compatibility = basic_xl;
+                  }
+                  break;
+               default: // These are in all extended BASICS
+                  if ( compatibility == atari_basic )
+                  {
+                     compatibility = altirra_basic;
+                  }
+                  break;
+            }
+      }
+   }
+   if ( operand_use_count[0x0d] ) // hex constant
+   {
+      if ( compatibility == atari_basic ) compatibility = altirra_basic;
+   }
+   if ( compatibility == unknown || compatibility == atari_basic ) *also_turbo = 0;
+   return compatibility;
+}
+
+/*
+ * basic_float_text()
+ *
+ * Six-byte BCD constant as BASIC would list it, in a buffer of
+ * BASIC_FLOAT_TEXT bytes.  Hex constants show as $XXXX; returns non-zero
+ * if 'hex' was set but the value isn't $0000 through $FFFF.
+ */
+static int basic_float_text(char *buf,const unsigned char *f,int hex)
+{
+   unsigned long man = 0;
+   int exp = (f[0] & 0x7f) - 64; // Excess 64, in powers of 100
+   char digits[24];
+
+   for ( int i=1;i<6;++i ) man = man * 100 + (f[i] >> 4) * 10 + (f[i] & 0xf);
+   if ( !man )
+   {
+      strcpy(buf,"0");
+      return 0;
+   }
+   exp = (exp - 4) * 2; // Now 'man' * 10^'exp'
+   while ( man % 10 == 0 )
+   {
+      man /= 10;
+      ++exp;
+   }
+   if ( hex && exp < 4 && !(f[0] & 0x80) )
+   {
+      unsigned long m = man;
+      for ( int i=0;i<exp;++i ) m *= 10;
+      if ( m <= 0xffff )
+      {
+         sprintf(buf,"$%04lX",m);
+         return 0;
+      }
+   }
+
+   const char *sign = ( f[0] & 0x80 ) ? "-" : "";
+   int n = sprintf(digits,"%lu",man);
+   if ( exp >= 0 && exp < 7 ) sprintf(buf,"%s%s%.*s",sign,digits,exp,"000000");
+   else if ( exp < 0 && n+exp > 0 ) sprintf(buf,"%s%.*s.%s",sign,n+exp,digits,digits+n+exp);
+   else if ( exp < 0 && n+exp > -4 ) sprintf(buf,"%s0.%.*s%s",sign,-(n+exp),"000000",digits);
+   else
+   {
+      exp += n-1;
+      if ( n > 1 ) sprintf(buf,"%s%c.%sE%c%02d",sign,digits[0],digits+1,exp>0?'+':'-',abs(exp));
+      else sprintf(buf,"%s%sE%c%02d",sign,digits,exp>0?'+':'-',abs(exp));
+   }
+   return hex;
+}
+
+/*
+ * basic_decode_statement()
+ *
+ * List one statement (the token byte followed by its operands) through
+ * the output functions.  Unknown tokens are shown in hex, and listing
+ * stops at an unknown operand, as its length isn't known.
+ */
+static void basic_decode_statement(enum basic_mode mode,const unsigned char *stmt,int len,const struct basic_decode *out)
+{
+   const char *name = basic_command_name(mode,stmt[0]);
+   char unknown_token[24];
+
+   if ( name )
+   {
+      out->text(out->arg,name);
+      if ( *name ) out->text(out->arg," "); // no space after implied let
+   }
+   else
+   {
+      sprintf(unknown_token,"(command %02x) ",stmt[0]);
+      out->text(out->arg,unknown_token);
+   }
+   if ( basic_text_command(mode,stmt[0]) )
+   {
+      --len;
+      if ( len > 0 && stmt[len] == 0x9b ) --len; // End of line
+      out->string(out->arg,stmt+1,len);
+      return;
+   }
+   for ( ++stmt,--len;len>0; )
+   {
+      int n = basic_operand_length(stmt,len);
+
+      if ( *stmt & 0x80 ) out->variable(out->arg,*stmt & 0x7f);
+      else if ( (*stmt == 0x0e || *stmt == 0x0d) && n == 7 ) out->number(out->arg,stmt+1,*stmt == 0x0d);
+      else if ( *stmt == 0x0f && n > 1 )
+      {
+         out->text(out->arg,"\"");
+         out->string(out->arg,stmt+2,stmt[1]);
+         out->text(out->arg,"\"");
+      }
+      else if ( (name = basic_operand_name(mode,*stmt)) ) out->text(out->arg,name);
+      else
+      {
+         sprintf(unknown_token,"(operand %02x)",*stmt);
+         out->text(out->arg,unknown_token);
+         break;
+      }
+      stmt += n;
+      len -= n;
+   }
+}
+
+#endif
@@ -7,7 +7,11 @@
  *
  *
  * Compilation:
- *	gcc -W -Wall -o sio2linux sio2linux.c
+ *	gcc -W -Wall -o sio2linux sio2linux.c -lz
+ *
+ * Images can be mounted with atrfs at the same time.  Both map the image
+ * file, and they coordinate through record locks and a shared generation
+ * number (see atrfs/broker.c).
  *
  * Currently, this does not support the 'format' or 'verify' SIO
  * commands.
@@ -174,6 +178,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <zlib.h>
 
 #ifndef MAXPATHLEN
 #define MAXPATHLEN 1024
@@ -226,6 +232,41 @@ struct trackformat {
 	int bad[18];		/* Only set with special SIO2Linux command */
 };
 
+/*
+ * Compressed image, as written by 'atrfs --compress'
+ *
+ * The image after the ATR header is in groups of sectors, each compressed
+ * on its own, with an index of where each group is in the file.  See
+ * atrfs/zatr.c for the format.
+ */
+struct zimage {
+	unsigned int size;	/* image file size */
+	unsigned int groupsize;	/* image bytes in each group */
+	unsigned int groups;
+	int hdrlen;		/* 0 or 16 */
+	unsigned char hdr[16];	/* ATR header */
+	unsigned char *index;	/* offset and length of each group, as in the file */
+};
+
+/*
+ * Recently used groups, decompressed
+ */
+struct zcache {
+	struct zimage *z;
+	unsigned int group;
+	unsigned char *data;
+	unsigned long used;	/* for replacing the least recently used */
+};
+
+/*
+ * Shared with atrfs for each image: "/atrfs-<device>-<inode>"
+ */
+struct broker_shared {
+	char magic[8];		/* "ATRBRK01" */
+	unsigned int generation;/* incremented after each change to the image */
+	unsigned int unused;
+};
+
 struct image {
 	int secsize;		/* 128 or 256 */
 	int seccount;		/* 720, 1040, or whatever */
@@ -235,6 +276,10 @@ struct image {
 	int active;		/* non-zero if Linux is responding for this disk */
 	int fakewrite;		/* non-zero if writes are accepted but dropped */
 	int blank;		/* non-zero if disk can grow as needed */
+	struct zimage *z;	/* NULL unless a compressed image */
+	unsigned char *map;	/* image file mapped, shared with atrfs */
+	size_t mapsize;
+	struct broker_shared *broker; /* NULL if not shared */
 	/*
 	 * Stuff for directories as virtual disk images
 	 */
@@ -316,6 +361,12 @@ int afnamecpy(char *an,const char *n);
 void init_mydos_drive(int disk,char *hostdir,int write);
 void read_mydos_sector(struct host_mydos *mydos,int sec);
 void write_mydos_sector(struct host_mydos *mydos,int sec,unsigned char *buf);
+static int zload(int disk);
+static unsigned char *zgroup(struct zimage *z,int fd,unsigned int g);
+static int zread(int disk,off_t to,unsigned char *buf,int size);
+static int zwrite(int disk,off_t to,const unsigned char *buf,int size);
+static void share(int disk);
+static void lock_sector(int disk,off_t to,int size,int type);
 
 /*
  * Macros
@@ -326,6 +377,10 @@ void write_mydos_sector(struct host_mydos *mydos,int sec,unsigned char *buf);
 #define SEEK2(n,i)	(ATRHEAD + ((n-1)*disks[i].secsize))
 #define ATRHEAD		16
 #define MAXDISKS	15 // Hard to access beyond 9
+#define ZMAGIC		"ATRZIP01" /* Compressed image */
+#define ZINDEX		48 /* Offset of the group index */
+#define ZCACHE		4 /* Groups kept decompressed */
+#define ZGET4(p)	((p)[0]|((p)[1]<<8)|((p)[2]<<16)|((unsigned int)(p)[3]<<24))
 #define TRACK18(n)	(((n)-1)/18) /* track of sector 'n' if 18 sectors per track (0-39) */
 #define OFF18(n)	(((n)-1)%18) /* offset of sector 'n' in track (0-17) */
 #define TRACKSTART(n)	((((n)-1)/18)*18+1)
@@ -360,6 +415,8 @@ int noring; /* If true, the serial port ring detect doesn't work */
 char *serial;
 char sbuf[64];
 int uspr=208333; /* microseconds per revolution, default for 288 RPM */
+struct zcache zcache[ZCACHE];
+unsigned long zclock; /* counts group lookups for the cache */
 int speed=19200; /* Baud rate */
 
 /*
@@ -475,6 +532,7 @@ int main(int argc,char *argv[])
 	"  -x     skip next drive image\n" \
 	"  -n     no ring detect on serial port (some USB converters)\n" \
 	"  <file> disk image to mount as next disk (D1 through D15 in order)\n" \
+	"         (ATR, XFD, or compressed with 'atrfs --compress')\n" \
         "  <dir>  directory to mount as next disk\n"
 
 	if (argc==1) {
@@ -813,6 +871,18 @@ static void senddata(int disk,int sec)
 	if ( sec > disks[disk].seccount ) {
 		memset(buf,0,size);
 	}
+	else if ( disks[disk].z ) {
+		if ( zread(disk,SEEK(sec,disk),buf,size) != size ) {
+			fprintf(stderr,"Incomplete read\n");
+			exit(1);
+		}
+	}
+	else if ( disks[disk].map && (size_t)(SEEK(sec,disk))+size <= disks[disk].mapsize ) {
+		to=SEEK(sec,disk);
+		lock_sector(disk,to,size,F_RDLCK);
+		memcpy(buf,disks[disk].map+to,size);
+		lock_sector(disk,to,size,F_UNLCK);
+	}
 	else {
 		to=SEEK(sec,disk);
 		check=lseek(disks[disk].diskfd,to,SEEK_SET);
@@ -822,7 +892,9 @@ static void senddata(int disk,int sec)
 			exit(1);
 		}
 		/* printf("-%d-",check); */
+		lock_sector(disk,to,size,F_RDLCK);
 		i=read(disks[disk].diskfd,buf,size);
+		lock_sector(disk,to,size,F_UNLCK);
 		if (i!=size) {
 			if (i<0) perror("read");
 			fprintf(stderr,"Incomplete read\n");
@@ -906,9 +978,26 @@ static void recvdata(int disk,int sec)
 	else if (disks[disk].fakewrite) {
 		if ( !quiet) printf("[write discarded]");
 	}
+	else if ( disks[disk].z ) {
+		i=zwrite(disk,SEEK(sec,disk),mybuf,size);
+		if (i!=size) if ( !quiet) printf("[write failed: %d]",i);
+	}
+	else if ( disks[disk].map && !disks[disk].ro && (size_t)(SEEK(sec,disk))+size <= disks[disk].mapsize ) {
+		off_t to=SEEK(sec,disk);
+
+		lock_sector(disk,to,size,F_WRLCK);
+		memcpy(disks[disk].map+to,mybuf,size);
+		if ( disks[disk].broker ) __atomic_add_fetch(&disks[disk].broker->generation,1,__ATOMIC_RELEASE);
+		lock_sector(disk,to,size,F_UNLCK);
+	}
 	else {
-		lseek(disks[disk].diskfd,SEEK(sec,disk),SEEK_SET);
+		off_t to=SEEK(sec,disk);
+
+		lock_sector(disk,to,size,F_WRLCK);
+		lseek(disks[disk].diskfd,to,SEEK_SET);
 		i=write(disks[disk].diskfd,mybuf,size);
+		if ( disks[disk].broker ) __atomic_add_fetch(&disks[disk].broker->generation,1,__ATOMIC_RELEASE);
+		lock_sector(disk,to,size,F_UNLCK);
 		if (i!=size) if ( !quiet) printf("[write failed: %d]",i);
 		if ( disks[disk].blank && sec>disks[disk].seccount ) {
 			disks[disk].seccount=sec;
@@ -1134,6 +1223,13 @@ static void loaddisk(char *path,int disk)
 		fprintf(stderr,"Unable to open disk image %s; drive %d disabled\n",path,disk);
 		return;
 	}
+	if ( disks[disk].diskfd>=0 && zload(disk) ) {
+		fprintf(stderr,"Compressed image %s is damaged; drive %d disabled\n",path,disk);
+		close(disks[disk].diskfd);
+		disks[disk].diskfd= -1;
+		return;
+	}
+	if ( disks[disk].z ) disks[disk].blank=0; /* Can't grow */
 	disks[disk].active=1;
 	if ( !disks[disk].blank || exists ) {
 
@@ -1145,6 +1241,7 @@ static void loaddisk(char *path,int disk)
 		struct stat buf;
 
 		fstat(disks[disk].diskfd,&buf);
+		if ( disks[disk].z ) buf.st_size=disks[disk].z->size;
 		disks[disk].seekcode=atrdd3;
 		if (((buf.st_size-ATRHEAD)%256)==128) disks[disk].seekcode=atr;
 		if (((buf.st_size)%128)==0) disks[disk].seekcode=xfd;
@@ -1158,7 +1255,8 @@ static void loaddisk(char *path,int disk)
 		struct atr_head atr;
 		long paragraphs;
 
-		read(disks[disk].diskfd,&atr,sizeof(atr));
+		if ( disks[disk].z ) memcpy(&atr,disks[disk].z->hdr,sizeof(atr));
+		else read(disks[disk].diskfd,&atr,sizeof(atr));
 		disks[disk].secsize=atr.secsizelo+256*atr.secsizehi;
 		paragraphs=atr.seccountlo+atr.seccounthi*256+
 			atr.hiseccountlo*256*256+atr.hiseccounthi*256*256*256;
@@ -1175,7 +1273,237 @@ static void loaddisk(char *path,int disk)
 	else {
 		write_atr_head(disk);
 	}
-	printf( "D%d: %s opened%s (%d %d-byte sectors)\n",disk+1,path,disks[disk].ro?" read-only":"",disks[disk].seccount,disks[disk].secsize);
+	if ( !disks[disk].z ) share(disk);
+	printf( "D%d: %s opened%s%s (%d %d-byte sectors)\n",disk+1,path,disks[disk].z?" compressed":"",disks[disk].ro?" read-only":"",disks[disk].seccount,disks[disk].secsize);
+}
+
+/*
+ * share()
+ *
+ * Map the image file, so atrfs and sio2linux use the same pages, and
+ * open the generation number shared with atrfs.  Images that grow are
+ * not mapped, but they are still locked and shared.
+ */
+static void share(int disk)
+{
+	struct stat buf;
+	char name[64];
+	int fd;
+
+	if ( disks[disk].diskfd<0 || fstat(disks[disk].diskfd,&buf) ) return;
+	if ( !disks[disk].blank && buf.st_size>0 ) {
+		disks[disk].map=mmap(NULL,buf.st_size,PROT_READ|(disks[disk].ro?0:PROT_WRITE),MAP_SHARED,disks[disk].diskfd,0);
+		if ( disks[disk].map==MAP_FAILED ) disks[disk].map=NULL;
+		else disks[disk].mapsize=buf.st_size;
+	}
+	sprintf(name,"/atrfs-%lx-%lx",(unsigned long)buf.st_dev,(unsigned long)buf.st_ino);
+	fd=shm_open(name,O_RDWR|O_CREAT,0644);
+	if ( fd<0 ) return;
+	if ( ftruncate(fd,sizeof(struct broker_shared))==0 ) {
+		void *map=mmap(NULL,sizeof(struct broker_shared),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+
+		if ( map!=MAP_FAILED ) {
+			disks[disk].broker=map;
+			memcpy(disks[disk].broker->magic,"ATRBRK01",8);
+		}
+	}
+	close(fd);
+}
+
+/*
+ * lock_sector()
+ *
+ * Lock or unlock the bytes of one sector in the image file.  atrfs locks
+ * the whole image while it works on it, so this waits for it to finish.
+ */
+static void lock_sector(int disk,off_t to,int size,int type)
+{
+	struct flock fl;
+
+	if ( !disks[disk].broker ) return;
+	memset(&fl,0,sizeof(fl));
+	fl.l_type=type;
+	fl.l_whence=SEEK_SET;
+	fl.l_start=to;
+	fl.l_len=size;
+	if ( type==F_WRLCK && disks[disk].ro ) fl.l_type=F_RDLCK;
+	while ( fcntl(disks[disk].diskfd,F_SETLKW,&fl)!=0 && errno==EINTR ) ;
+}
+
+/*
+ * zload()
+ *
+ * If the disk image is compressed, read its header and group index.
+ * Returns non-zero if it is compressed but damaged.
+ */
+static int zload(int disk)
+{
+	unsigned char head[ZINDEX];
+	struct zimage *z;
+	struct stat buf;
+	size_t len;
+
+	if ( pread(disks[disk].diskfd,head,ZINDEX,0)!=ZINDEX || memcmp(head,ZMAGIC,8)!=0 ) return(0);
+	fstat(disks[disk].diskfd,&buf);
+	z=calloc(1,sizeof(*z));
+	if ( !z ) return(1);
+	z->size=ZGET4(head+8);
+	z->groupsize=ZGET4(head+12);
+	z->groups=ZGET4(head+16);
+	z->hdrlen=head[20];
+	memcpy(z->hdr,head+32,16);
+	len=(size_t)z->groups*8;
+	if ( (z->hdrlen!=0 && z->hdrlen!=16) || z->groupsize<128 || z->groupsize>1024*1024 ||
+	     z->size<(unsigned int)z->hdrlen ||
+	     z->groups!=(z->size-z->hdrlen+z->groupsize-1)/z->groupsize ||
+	     ZINDEX+len>(size_t)buf.st_size ) {
+		free(z);
+		return(1);
+	}
+	z->index=malloc(len?len:1);
+	if ( !z->index || pread(disks[disk].diskfd,z->index,len,ZINDEX)!=(ssize_t)len ) {
+		free(z->index);
+		free(z);
+		return(1);
+	}
+	disks[disk].z=z;
+	return(0);
+}
+
+/*
+ * zgroup()
+ *
+ * Return group 'g' decompressed, from the cache if it's there.  The
+ * least recently used group is replaced.  Returns NULL if it can't be
+ * read.
+ */
+static unsigned char *zgroup(struct zimage *z,int fd,unsigned int g)
+{
+	struct zcache *c=&zcache[0];
+	unsigned char *in;
+	unsigned int off,clen;
+	uLongf n;
+	int i;
+
+	++zclock;
+	for(i=0;i<ZCACHE;++i) {
+		if ( zcache[i].z==z && zcache[i].group==g && zcache[i].data ) {
+			zcache[i].used=zclock;
+			return(zcache[i].data);
+		}
+		if ( zcache[i].used<c->used ) c=&zcache[i];
+	}
+	c->z=NULL;
+	free(c->data);
+	c->data=malloc(z->groupsize);
+	if ( !c->data ) return(NULL);
+	n=z->groupsize;
+	if ( (g+1)*z->groupsize > z->size-z->hdrlen ) n=z->size-z->hdrlen-g*z->groupsize;
+	off=ZGET4(z->index+g*8);
+	clen=ZGET4(z->index+g*8+4);
+	if ( !clen ) memset(c->data,0,n); /* All zeros */
+	else {
+		uLongf want=n;
+
+		in=malloc(clen);
+		if ( !in ) return(NULL);
+		if ( pread(fd,in,clen,off)!=(ssize_t)clen || uncompress(c->data,&n,in,clen)!=Z_OK || n!=want ) {
+			free(in);
+			return(NULL);
+		}
+		free(in);
+	}
+	c->z=z;
+	c->group=g;
+	c->used=zclock;
+	return(c->data);
+}
+
+/*
+ * zread()
+ *
+ * Read from a compressed image as if it were the plain image file.
+ * Sectors can cross from one group into the next.
+ */
+static int zread(int disk,off_t to,unsigned char *buf,int size)
+{
+	struct zimage *z=disks[disk].z;
+	int done=0;
+
+	if ( to<z->hdrlen || to+size>z->size ) return(-1);
+	to-=z->hdrlen;
+	while ( done<size ) {
+		unsigned int g=(to+done)/z->groupsize;
+		unsigned int o=(to+done)%z->groupsize;
+		int n=z->groupsize-o;
+		unsigned char *data=zgroup(z,disks[disk].diskfd,g);
+
+		if ( !data ) return(done);
+		if ( n>size-done ) n=size-done;
+		memcpy(buf+done,data+o,n);
+		done+=n;
+	}
+	return(size);
+}
+
+/*
+ * zwrite()
+ *
+ * Write to a compressed image as if it were the plain image file.  Each
+ * group written to is compressed again and appended to the file, and
+ * then its index entry is updated to point to it.  The old copy is left
+ * in the file; 'atrfs --compress' can rewrite the image without them.
+ */
+static int zwrite(int disk,off_t to,const unsigned char *buf,int size)
+{
+	struct zimage *z=disks[disk].z;
+	uLong bound=compressBound(z->groupsize);
+	unsigned char *out=malloc(bound);
+	int done=0;
+	int i;
+
+	if ( to<z->hdrlen || to+size>z->size ) return(-1);
+	to-=z->hdrlen;
+	while ( done<size ) {
+		unsigned int g=(to+done)/z->groupsize;
+		unsigned int o=(to+done)%z->groupsize;
+		uLongf n=z->groupsize;
+		uLongf clen=bound;
+		unsigned char entry[8];
+		unsigned char *data=out?zgroup(z,disks[disk].diskfd,g):NULL;
+		off_t end;
+		int len=z->groupsize-o;
+
+		if ( !data ) break;
+		if ( len>size-done ) len=size-done;
+		memcpy(data+o,buf+done,len);
+		if ( (g+1)*z->groupsize > z->size-z->hdrlen ) n=z->size-z->hdrlen-g*z->groupsize;
+		for(i=0;i<(int)n && !data[i];++i) ;
+		if ( i==(int)n ) { /* All zeros */
+			clen=0;
+			end=0;
+		}
+		else {
+			if ( compress2(out,&clen,data,n,Z_BEST_COMPRESSION)!=Z_OK ) goto failed;
+			end=lseek(disks[disk].diskfd,0,SEEK_END);
+			if ( end<0 || end+clen>0xffffffffLL ) goto failed;
+			if ( pwrite(disks[disk].diskfd,out,clen,end)!=(ssize_t)clen ) goto failed;
+		}
+		for(i=0;i<4;++i) {
+			entry[i]=(end>>(i*8))&0xff;
+			entry[4+i]=(clen>>(i*8))&0xff;
+		}
+		if ( pwrite(disks[disk].diskfd,entry,8,ZINDEX+(off_t)g*8)!=8 ) goto failed;
+		memcpy(z->index+g*8,entry,8);
+		done+=len;
+		continue;
+	    failed:
+		/* The cached group no longer matches the file */
+		for(i=0;i<ZCACHE;++i) if ( zcache[i].z==z && zcache[i].group==g ) zcache[i].z=NULL;
+		break;
+	}
+	free(out);
+	return(done);
 }
 
 /*